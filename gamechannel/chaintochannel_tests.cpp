@@ -78,6 +78,7 @@ public:
   {
     EXPECT_CALL (*this, stop ()).Times (0);
     EXPECT_CALL (*this, getcurrentstate ()).Times (0);
+    EXPECT_CALL (*this, getchannels (testing::_)).Times (0);
   }
 
   /**
@@ -186,6 +187,8 @@ public:
   MOCK_METHOD0 (getnullstate, Json::Value ());
   MOCK_METHOD0 (getpendingstate, Json::Value ());
   MOCK_METHOD1 (waitforpendingchange, Json::Value (int));
+  MOCK_METHOD1 (waitforpendingdelta, Json::Value (int));
+  MOCK_METHOD1 (getchannels, Json::Value (const Json::Value&));
 
 };
 
@@ -96,4 +96,26 @@ AllChannelsGameStateJson (ChannelsTable& tbl, const BoardRules& r)
   return res;
 }
 
+void
+WriteAllChannelsGameStateJson (ChannelsTable& tbl, const BoardRules& r,
+                               JsonStreamWriter& out)
+{
+  /* QueryAll returns the channels ordered by ID, which matches the
+     order of keys in the equivalent Json::Value object.  */
+  out.BeginObject ();
+  auto* stmt = tbl.QueryAll ();
+  while (true)
+    {
+      const int rc = sqlite3_step (stmt);
+      if (rc == SQLITE_DONE)
+        break;
+      CHECK_EQ (rc, SQLITE_ROW);
+
+      auto h = tbl.GetFromResult (stmt);
+      out.Key (h->GetId ().ToHex ());
+      out.Value (ChannelToGameStateJson (*h, r));
+    }
+  out.EndObject ();
+}
+
 } // namespace xaya
@@ -9,6 +9,7 @@
 #include "database.hpp"
 #include "proto/metadata.pb.h"
 
+#include <xayagame/jsonwriter.hpp>
 #include <xayautil/uint256.hpp>
 
 #include <json/json.h>
@@ -40,6 +41,14 @@ Json::Value ChannelToGameStateJson (const ChannelData& ch, const BoardRules& r);
 Json::Value AllChannelsGameStateJson (ChannelsTable& tbl,
                                       const BoardRules& r);
 
+/**
+ * Writes the same data as AllChannelsGameStateJson to a streaming writer,
+ * one channel at a time.  This avoids building up the JSON for all
+ * channels in memory.
+ */
+void WriteAllChannelsGameStateJson (ChannelsTable& tbl, const BoardRules& r,
+                                    JsonStreamWriter& out);
+
 } // namespace xaya
 
 #endif // GAMECHANNEL_GAMESTATEJSON_HPP
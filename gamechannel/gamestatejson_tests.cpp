@@ -209,5 +209,16 @@ TEST_F (GameStateJsonTests, AllChannels)
   EXPECT_EQ (AllChannelsGameStateJson (tbl, game.rules), expected);
 }
 
+TEST_F (GameStateJsonTests, AllChannelsStreamed)
+{
+  std::ostringstream out;
+  JsonStreamWriter w(out);
+  WriteAllChannelsGameStateJson (tbl, game.rules, w);
+  ASSERT_TRUE (w.IsComplete ());
+
+  EXPECT_EQ (out.str (),
+             CompactJson (AllChannelsGameStateJson (tbl, game.rules)));
+}
+
 } // anonymous namespace
 } // namespace xaya
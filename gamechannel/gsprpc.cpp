@@ -7,8 +7,6 @@
 #include "database.hpp"
 #include "gamestatejson.hpp"
 
-#include <xayagame/gamerpcserver.hpp>
-
 #include <glog/logging.h>
 
 #include <jsonrpccpp/common/errors.h>
@@ -16,9 +14,48 @@
 
 #include <sqlite3.h>
 
+#include <set>
+#include <vector>
+
 namespace xaya
 {
 
+namespace
+{
+
+/**
+ * Parses a channel ID from a JSON value, throwing an RPC error if it is not
+ * a valid hex string.
+ */
+uint256
+ParseChannelId (const Json::Value& val)
+{
+  uint256 id;
+  if (!val.isString () || !id.FromHex (val.asString ()))
+    throw jsonrpc::JsonRpcException (jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+                                     "channel ID is not a valid uint256");
+  return id;
+}
+
+/**
+ * Parses an array of channel IDs, throwing an RPC error if it is invalid.
+ */
+std::vector<uint256>
+ParseChannelIds (const Json::Value& val)
+{
+  if (!val.isArray ())
+    throw jsonrpc::JsonRpcException (jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+                                     "channel IDs must be an array");
+
+  std::vector<uint256> res;
+  for (const auto& entry : val)
+    res.push_back (ParseChannelId (entry));
+
+  return res;
+}
+
+} // anonymous namespace
+
 void
 ChannelGspRpcServer::stop ()
 {
@@ -54,6 +91,13 @@ ChannelGspRpcServer::getchannel (const std::string& channelId)
   return DefaultGetChannel (game, chGame, channelId);
 }
 
+Json::Value
+ChannelGspRpcServer::getchannels (const Json::Value& channelIds)
+{
+  LOG (INFO) << "RPC method called: getchannels " << channelIds;
+  return DefaultGetChannels (game, chGame, channelIds);
+}
+
 std::string
 ChannelGspRpcServer::waitforchange (const std::string& knownBlock)
 {
@@ -68,6 +112,13 @@ ChannelGspRpcServer::waitforpendingchange (const int oldVersion)
   return game.WaitForPendingChange (oldVersion);
 }
 
+Json::Value
+ChannelGspRpcServer::waitforpendingdelta (const int oldVersion)
+{
+  LOG (INFO) << "RPC method called: waitforpendingdelta " << oldVersion;
+  return game.WaitForPendingDelta (oldVersion);
+}
+
 Json::Value
 ChannelGspRpcServer::DefaultGetChannel (const Game& g, ChannelGame& chg,
                                         const std::string& channelId)
@@ -93,6 +144,148 @@ ChannelGspRpcServer::DefaultGetChannel (const Game& g, ChannelGame& chg,
       });
 }
 
+Json::Value
+ChannelGspRpcServer::ExtractChannels (const Game& g, ChannelGame& chg,
+                                      const std::set<uint256>& ids)
+{
+  return chg.GetCustomStateData (g, "channels",
+    [&chg, &ids] (const SQLiteDatabase& db)
+      {
+        ChannelsTable tbl(const_cast<SQLiteDatabase&> (db));
+
+        Json::Value res(Json::objectValue);
+        for (const auto& id : ids)
+          {
+            auto h = tbl.GetById (id);
+            if (h == nullptr)
+              res[id.ToHex ()] = Json::Value ();
+            else
+              res[id.ToHex ()] = ChannelToGameStateJson (*h,
+                                                         chg.GetBoardRules ());
+          }
+
+        return res;
+      });
+}
+
+Json::Value
+ChannelGspRpcServer::DefaultGetChannels (const Game& g, ChannelGame& chg,
+                                         const Json::Value& channelIds)
+{
+  const auto ids = ParseChannelIds (channelIds);
+  return ExtractChannels (g, chg, std::set<uint256> (ids.begin (), ids.end ()));
+}
+
+bool
+ChannelGspRpcServer::ProcessBatch (const Json::Value& batch,
+                                   Json::Value& responses)
+{
+  if (GameRpcServer::ProcessStateBatch (game, batch, responses))
+    return true;
+
+  /* Parsed data about one call in the batch.  */
+  struct Call
+  {
+    Json::Value id;
+    bool notification = false;
+    bool single = false;
+    std::vector<uint256> channels;
+    bool valid = true;
+    int errorCode = 0;
+    std::string errorMessage;
+  };
+
+  /* We only handle batches where all calls are well-formed getchannel or
+     getchannels requests.  Everything else is processed call-by-call by
+     the normal server, which also takes care of error reporting for
+     malformed requests.  */
+  std::vector<Call> calls;
+  std::set<uint256> allChannels;
+  for (const auto& req : batch)
+    {
+      if (!req.isObject () || req["jsonrpc"] != "2.0"
+            || !req["method"].isString ())
+        return false;
+
+      const auto& params = req["params"];
+      if (!params.isArray () || params.size () != 1)
+        return false;
+
+      Call c;
+      c.notification = !req.isMember ("id");
+      c.id = req["id"];
+
+      const std::string method = req["method"].asString ();
+      if (method == "getchannel" && params[0].isString ())
+        c.single = true;
+      else if (method == "getchannels" && params[0].isArray ())
+        c.single = false;
+      else
+        return false;
+
+      try
+        {
+          if (c.single)
+            c.channels.push_back (ParseChannelId (params[0]));
+          else
+            c.channels = ParseChannelIds (params[0]);
+          allChannels.insert (c.channels.begin (), c.channels.end ());
+        }
+      catch (const jsonrpc::JsonRpcException& exc)
+        {
+          c.valid = false;
+          c.errorCode = exc.GetCode ();
+          c.errorMessage = exc.GetMessage ();
+        }
+
+      calls.push_back (std::move (c));
+    }
+
+  LOG (INFO)
+      << "RPC batch with " << calls.size () << " calls for "
+      << allChannels.size () << " channels";
+  /* Split the channel data off once, so that each response just starts
+     from a copy of the remaining custom state.  */
+  Json::Value base = ExtractChannels (game, chGame, allChannels);
+  Json::Value channelData;
+  const bool hasChannels = base.removeMember ("channels", &channelData);
+  const Json::Value& channels = channelData;
+
+  for (const auto& c : calls)
+    {
+      if (c.notification)
+        continue;
+
+      if (!c.valid)
+        {
+          responses.append (RpcBatchHandler::ErrorResponse (
+              c.id, c.errorCode, c.errorMessage));
+          continue;
+        }
+
+      Json::Value result = base;
+      if (hasChannels)
+        {
+          if (c.single)
+            result["channel"] = channels[c.channels.front ().ToHex ()];
+          else
+            {
+              Json::Value subset(Json::objectValue);
+              for (const auto& id : c.channels)
+                {
+                  const std::string hex = id.ToHex ();
+                  subset[hex] = channels[hex];
+                }
+              result["channels"] = subset;
+            }
+        }
+
+      responses.append (RpcBatchHandler::ResultResponse (c.id, result));
+    }
+
+  return true;
+}
+
 std::unique_ptr<RpcServerInterface>
 ChannelGspInstanceFactory::BuildRpcServer (
     Game& game, jsonrpc::AbstractServerConnector& conn)
@@ -11,10 +11,17 @@
 
 #include <xayagame/defaultmain.hpp>
 #include <xayagame/game.hpp>
+#include <xayagame/gamerpcserver.hpp>
+#include <xayagame/rpcbatch.hpp>
+#include <xayagame/rpcencoding.hpp>
+#include <xayagame/rpcrawresult.hpp>
+#include <xayautil/uint256.hpp>
 
 #include <json/json.h>
 #include <jsonrpccpp/server.h>
 
+#include <set>
+
 namespace xaya
 {
 
@@ -22,7 +29,15 @@ namespace xaya
  * Implementation of a simple RPC server for game channel GSPs.  This extends
  * the GameRpcServer for general GSPs by the "getchannel" method, which extracts
  * data about a single channel by ID.  This method is used by the channel
- * daemon to query states.
+ * daemon to query states.  "getchannels" returns data for multiple channels
+ * at once from the same state.
+ *
+ * JSON-RPC batches consisting only of getchannel and getchannels calls are
+ * answered from a single database snapshot, so that all results are
+ * consistent with each other and refer to the same block.  Batches of
+ * the general state methods are handled as for GameRpcServer.
+ *
+ * Clients can request CBOR-encoded responses, see RpcEncodingHandler.
  */
 class ChannelGspRpcServer : public ChannelGspRpcServerStub
 {
@@ -35,20 +50,60 @@ private:
   /** The ChannelGame that manages the database.  */
   ChannelGame& chGame;
 
+  /** Handler answering the state methods with cached strings.  */
+  RpcRawResultHandler rawHandler;
+
+  /** Handler for processing batches of channel queries as a whole.  */
+  RpcBatchHandler batchHandler;
+
+  /**
+   * Handler for clients that opt into a binary response encoding.  The
+   * base64-encoded protos and states of channels are sent as raw bytes
+   * with it.
+   */
+  RpcEncodingHandler encodingHandler;
+
+  /**
+   * Queries the data for all given channels from a single snapshot.  The
+   * result is the custom-state JSON with a "channels" field, which is an
+   * object mapping the hex IDs to the channel data (or null).
+   */
+  static Json::Value ExtractChannels (const Game& g, ChannelGame& chg,
+                                      const std::set<uint256>& ids);
+
+  /**
+   * Tries to process a JSON-RPC batch of getchannel and getchannels calls
+   * (or of the general state methods, see GameRpcServer::ProcessStateBatch).
+   * This is the callback for batchHandler.
+   */
+  bool ProcessBatch (const Json::Value& batch, Json::Value& responses);
+
 public:
 
   explicit ChannelGspRpcServer (Game& g, ChannelGame& chg,
                                 jsonrpc::AbstractServerConnector& conn)
-    : ChannelGspRpcServerStub(conn), game(g), chGame(chg)
-  {}
+    : ChannelGspRpcServerStub(conn), game(g), chGame(chg),
+      rawHandler(conn),
+      batchHandler(conn, [this] (const Json::Value& batch,
+                                 Json::Value& responses)
+        {
+          return ProcessBatch (batch, responses);
+        }),
+      encodingHandler(conn, {"base64", "proof", "proto", "reinit"})
+  {
+    GameRpcServer::AddRawStateMethods (game, rawHandler);
+    GameRpcServer::AddAsyncWaitMethods (game, conn);
+  }
 
   virtual void stop () override;
   virtual Json::Value getcurrentstate () override;
   virtual Json::Value getnullstate () override;
   virtual Json::Value getpendingstate () override;
   virtual Json::Value getchannel (const std::string& channelId) override;
+  virtual Json::Value getchannels (const Json::Value& channelIds) override;
   virtual std::string waitforchange (const std::string& knownBlock) override;
   virtual Json::Value waitforpendingchange (int oldVersion) override;
+  virtual Json::Value waitforpendingdelta (int oldVersion) override;
 
   /**
    * Implements the standard getchannel method.  This can be used by
@@ -58,6 +113,14 @@ public:
   static Json::Value DefaultGetChannel (const Game& g, ChannelGame& chg,
                                         const std::string& channelId);
 
+  /**
+   * Implements the standard getchannels method, which returns the data
+   * for each of the given channels (as array of hex strings) in a JSON
+   * object keyed by the channel IDs.  Unknown channels map to null.
+   */
+  static Json::Value DefaultGetChannels (const Game& g, ChannelGame& chg,
+                                         const Json::Value& channelIds);
+
 };
 
 /**
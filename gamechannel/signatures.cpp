@@ -1,4 +1,4 @@
-// Copyright (C) 2019 The Xaya developers
+// Copyright (C) 2019-2020 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
@@ -13,6 +13,7 @@
 #include <glog/logging.h>
 
 #include <string>
+#include <vector>
 
 namespace xaya
 {
@@ -43,20 +44,42 @@ VerifyParticipantSignatures (XayaRpcClient& rpc,
                              const std::string& topic,
                              const proto::SignedData& data)
 {
-  const std::string msg = GetChannelSignatureMessage (channelId, meta, topic,
-                                                      data.data ());
+  return VerifyParticipantSignatures (rpc, channelId, meta, topic,
+                                      {&data}).front ();
+}
 
-  std::set<std::string> addresses;
-  for (const auto& sgn : data.signatures ())
+std::vector<std::set<int>>
+VerifyParticipantSignatures (XayaRpcClient& rpc,
+                             const uint256& channelId,
+                             const proto::ChannelMetadata& meta,
+                             const std::string& topic,
+                             const std::vector<const proto::SignedData*>& data)
+{
+  std::vector<SignedMessage> msgs;
+  for (const auto* d : data)
     {
-      const std::string& sgnStr = EncodeBase64 (sgn);
-      addresses.emplace (VerifyMessage (rpc, msg, sgnStr));
+      const std::string msg = GetChannelSignatureMessage (channelId, meta,
+                                                          topic, d->data ());
+      for (const auto& sgn : d->signatures ())
+        msgs.push_back ({msg, EncodeBase64 (sgn)});
     }
 
-  std::set<int> res;
-  for (int i = 0; i < meta.participants_size (); ++i)
-    if (addresses.count (meta.participants (i).address ()) > 0)
-      res.emplace (i);
+  const auto addresses = VerifyMessages (rpc, msgs);
+  auto addrIt = addresses.begin ();
+
+  std::vector<std::set<int>> res;
+  for (const auto* d : data)
+    {
+      const std::set<std::string> signers(addrIt,
+                                          addrIt + d->signatures_size ());
+      addrIt += d->signatures_size ();
+
+      res.emplace_back ();
+      for (int i = 0; i < meta.participants_size (); ++i)
+        if (signers.count (meta.participants (i).address ()) > 0)
+          res.back ().emplace (i);
+    }
+  CHECK (addrIt == addresses.end ());
 
   return res;
 }
@@ -1,4 +1,4 @@
-// Copyright (C) 2019 The Xaya developers
+// Copyright (C) 2019-2020 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
@@ -14,6 +14,7 @@
 
 #include <set>
 #include <string>
+#include <vector>
 
 namespace xaya
 {
@@ -51,6 +52,17 @@ std::set<int> VerifyParticipantSignatures (XayaRpcClient& rpc,
                                            const std::string& topic,
                                            const proto::SignedData& data);
 
+/**
+ * Verifies the signatures on multiple SignedData instances at once (all with
+ * the same topic).  The result is the same as calling
+ * VerifyParticipantSignatures on each of them, but all signatures are
+ * verified concurrently (see VerifyMessages).
+ */
+std::vector<std::set<int>> VerifyParticipantSignatures (
+    XayaRpcClient& rpc, const uint256& channelId,
+    const proto::ChannelMetadata& meta, const std::string& topic,
+    const std::vector<const proto::SignedData*>& data);
+
 /**
  * Tries to sign the given data for the given participant index, using
  * the provided Xaya wallet.  Returns true if a signature could be made.
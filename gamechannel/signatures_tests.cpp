@@ -1,4 +1,4 @@
-// Copyright (C) 2019 The Xaya developers
+// Copyright (C) 2019-2020 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
@@ -104,6 +104,30 @@ TEST_F (SignaturesTests, VerifyParticipantSignatures)
              std::set<int> ({1}));
 }
 
+TEST_F (SignaturesTests, VerifyParticipantSignaturesBatch)
+{
+  std::vector<proto::SignedData> data(4);
+  data[0].set_data ("no signatures");
+  data[1].set_data ("first");
+  data[1].add_signatures ("sgn 0");
+  data[2].set_data ("both");
+  data[2].add_signatures ("sgn 1");
+  data[2].add_signatures ("sgn 0");
+  data[3].set_data ("invalid");
+  data[3].add_signatures ("invalid");
+  data[3].add_signatures ("sgn 1");
+
+  EXPECT_CALL (*mockXayaServer,
+               verifymessage ("", _, EncodeBase64 ("invalid")))
+      .WillOnce (Return (ParseJson (R"({"valid": false})")));
+
+  EXPECT_EQ (VerifyParticipantSignatures (mockXayaServer.GetClient (),
+                                          channelId, meta, "topic",
+                                          {&data[0], &data[1],
+                                           &data[2], &data[3]}),
+             std::vector<std::set<int>> ({{}, {0}, {0, 1}, {1}}));
+}
+
 TEST_F (SignaturesTests, SignDataForParticipantError)
 {
   EXPECT_CALL (*mockXayaWallet, signmessage ("address 1", _))
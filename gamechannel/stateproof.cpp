@@ -1,4 +1,4 @@
-// Copyright (C) 2019 The Xaya developers
+// Copyright (C) 2019-2020 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
@@ -6,10 +6,18 @@
 
 #include "signatures.hpp"
 
+#include <xayagame/signatures.hpp>
+
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
 #include <iterator>
+#include <mutex>
 #include <set>
+#include <vector>
 
 namespace xaya
 {
@@ -18,21 +26,208 @@ namespace
 {
 
 /**
- * Internal version of VerifyStateTransition, which also returns all valid
- * signatures made on the new state.  This is useful when validating a state
- * proof, so that we do not need to duplicate that check.
+ * Number of states in a state proof whose signatures are verified together
+ * as one task on the verification pool (see ProofSignatures).  Proofs with
+ * at most that many states are verified up front instead.
  */
-bool
-ExtraVerifyStateTransition (XayaRpcClient& rpc, const BoardRules& rules,
-                            const uint256& channelId,
-                            const proto::ChannelMetadata& meta,
-                            const ParsedBoardState& oldState,
-                            const proto::StateTransition& transition,
-                            std::set<int>& signatures,
-                            std::unique_ptr<ParsedBoardState>& parsedNew)
+constexpr size_t STATES_PER_CHUNK = 8;
+
+/**
+ * Verifies the signatures on all states of a state proof, while the caller
+ * applies the moves.  If signatures are verified locally and the proof
+ * is long enough, the states are split into chunks which are submitted
+ * as tasks to the signature verification pool (see SubmitVerificationTask),
+ * so that the results become available progressively.  Otherwise all
+ * signatures are verified right away in the constructor.  This is the case
+ * in particular when Xaya Core has to be called, since the RPC client
+ * (which is also passed to the board rules) need not be thread-safe.
+ */
+class ProofSignatures
 {
 
-  const int turn = oldState.WhoseTurn ();
+private:
+
+  XayaRpcClient& rpc;
+  const uint256& channelId;
+  const proto::ChannelMetadata& meta;
+
+  /** The signed states to verify.  */
+  const std::vector<const proto::SignedData*>& states;
+
+  /** Lock for the results.  */
+  std::mutex mut;
+
+  /**
+   * Notified when new results are available and when a submitted task
+   * has finished.
+   */
+  std::condition_variable cvVerified;
+
+  /** The signers of each state (valid once its chunk is done).  */
+  std::vector<std::set<int>> verified;
+
+  /** For each chunk, whether its signatures have been verified.  */
+  std::vector<bool> chunkDone;
+
+  /** Number of submitted tasks that have not yet finished.  */
+  size_t running = 0;
+
+  /** Set if one of the tasks threw.  */
+  std::exception_ptr error;
+
+  /** Set to skip the remaining tasks early.  */
+  std::atomic<bool> cancelled;
+
+  /**
+   * Verifies the signatures of the states in the given chunk.
+   */
+  void
+  VerifyChunk (const size_t chunk)
+  {
+    if (!cancelled)
+      {
+        const size_t begin = chunk * STATES_PER_CHUNK;
+        const size_t end = std::min (begin + STATES_PER_CHUNK, states.size ());
+        const std::vector<const proto::SignedData*> part(
+            states.begin () + begin, states.begin () + end);
+
+        try
+          {
+            auto res = VerifyParticipantSignatures (rpc, channelId, meta,
+                                                    "state", part);
+            CHECK_EQ (res.size (), end - begin);
+
+            std::lock_guard<std::mutex> lock(mut);
+            for (size_t i = begin; i < end; ++i)
+              verified[i] = std::move (res[i - begin]);
+            chunkDone[chunk] = true;
+          }
+        catch (...)
+          {
+            std::lock_guard<std::mutex> lock(mut);
+            if (error == nullptr)
+              error = std::current_exception ();
+          }
+      }
+
+    /* The object may be destructed as soon as running drops to zero and
+       we release the lock, so nothing must be accessed afterwards.  */
+    std::lock_guard<std::mutex> lock(mut);
+    --running;
+    cvVerified.notify_all ();
+  }
+
+  /**
+   * Returns true if the signers of the i-th state are known.  Must be
+   * called with mut held.
+   */
+  bool
+  IsVerified (const size_t i) const
+  {
+    return chunkDone[i / STATES_PER_CHUNK];
+  }
+
+public:
+
+  explicit ProofSignatures (XayaRpcClient& r, const uint256& id,
+                            const proto::ChannelMetadata& m,
+                            const std::vector<const proto::SignedData*>& s)
+    : rpc(r), channelId(id), meta(m), states(s), verified(s.size ()),
+      cancelled(false)
+  {
+    const size_t numChunks
+        = (states.size () + STATES_PER_CHUNK - 1) / STATES_PER_CHUNK;
+
+    if (IsLocalVerificationEnabled () && states.size () > STATES_PER_CHUNK)
+      {
+        chunkDone.resize (numChunks, false);
+
+        {
+          std::lock_guard<std::mutex> lock(mut);
+          running = numChunks;
+        }
+        for (size_t c = 0; c < numChunks; ++c)
+          SubmitVerificationTask ([this, c] () { VerifyChunk (c); });
+
+        return;
+      }
+
+    verified = VerifyParticipantSignatures (rpc, channelId, meta,
+                                            "state", states);
+    chunkDone.resize (numChunks, true);
+  }
+
+  ~ProofSignatures ()
+  {
+    cancelled = true;
+
+    std::unique_lock<std::mutex> lock(mut);
+    cvVerified.wait (lock, [this] () { return running == 0; });
+  }
+
+  ProofSignatures () = delete;
+  ProofSignatures (const ProofSignatures&) = delete;
+  void operator= (const ProofSignatures&) = delete;
+
+  /**
+   * Returns the signers of the i-th state if they are known already,
+   * without blocking.
+   */
+  bool
+  TryGet (const size_t i, std::set<int>& res)
+  {
+    CHECK_LT (i, states.size ());
+
+    std::lock_guard<std::mutex> lock(mut);
+    if (error != nullptr)
+      std::rethrow_exception (error);
+
+    if (!IsVerified (i))
+      return false;
+
+    res = verified[i];
+    return true;
+  }
+
+  /**
+   * Returns the signers of the i-th state, waiting for them to be
+   * verified if necessary.
+   */
+  std::set<int>
+  Get (const size_t i)
+  {
+    CHECK_LT (i, states.size ());
+
+    std::unique_lock<std::mutex> lock(mut);
+    cvVerified.wait (lock, [this, i] ()
+      {
+        return error != nullptr || IsVerified (i);
+      });
+    if (error != nullptr)
+      std::rethrow_exception (error);
+
+    return verified[i];
+  }
+
+};
+
+/**
+ * Applies the move of a state transition and checks that it leads to the
+ * claimed new state, but does not verify the signatures on it.  This is
+ * used when validating a state proof, where the signatures are verified
+ * separately (see ProofSignatures).  The player whose turn it was (and who
+ * thus must have signed the new state) is returned in turn.
+ */
+bool
+ApplyStateTransition (XayaRpcClient& rpc, const BoardRules& rules,
+                      const uint256& channelId,
+                      const proto::ChannelMetadata& meta,
+                      const ParsedBoardState& oldState,
+                      const proto::StateTransition& transition,
+                      int& turn,
+                      std::unique_ptr<ParsedBoardState>& parsedNew)
+{
+  turn = oldState.WhoseTurn ();
   if (turn == ParsedBoardState::NO_TURN)
     {
       LOG (WARNING) << "State transition applied to 'no turn' state";
@@ -57,8 +252,16 @@ ExtraVerifyStateTransition (XayaRpcClient& rpc, const BoardRules& rules,
       return false;
     }
 
-  signatures = VerifyParticipantSignatures (rpc, channelId, meta, "state",
-                                            transition.new_state ());
+  return true;
+}
+
+/**
+ * Checks that the signatures found on the new state of a state transition
+ * include the one of the player whose turn it was.
+ */
+bool
+HasTurnSignature (const std::set<int>& signatures, const int turn)
+{
   if (signatures.count (turn) == 0)
     {
       LOG (WARNING)
@@ -85,10 +288,16 @@ VerifyStateTransition (XayaRpcClient& rpc, const BoardRules& rules,
       return false;
     }
 
+  int turn;
   std::unique_ptr<ParsedBoardState> parsedNew;
-  std::set<int> signatures;
-  return ExtraVerifyStateTransition (rpc, rules, channelId, meta, *parsedOld,
-                                     transition, signatures, parsedNew);
+  if (!ApplyStateTransition (rpc, rules, channelId, meta, *parsedOld,
+                             transition, turn, parsedNew))
+    return false;
+
+  const auto signatures
+      = VerifyParticipantSignatures (rpc, channelId, meta, "state",
+                                     transition.new_state ());
+  return HasTurnSignature (signatures, turn);
 }
 
 bool
@@ -99,10 +308,6 @@ VerifyStateProof (XayaRpcClient& rpc, const BoardRules& rules,
                   const proto::StateProof& proof,
                   BoardState& endState)
 {
-  std::set<int> signatures
-      = VerifyParticipantSignatures (rpc, channelId, meta, "state",
-                                     proof.initial_state ());
-
   auto parsed = rules.ParseState (channelId, meta,
                                   proof.initial_state ().data ());
   if (parsed == nullptr)
@@ -114,19 +319,56 @@ VerifyStateProof (XayaRpcClient& rpc, const BoardRules& rules,
   endState = proof.initial_state ().data ();
   const bool foundOnChain = parsed->Equals (reinitState);
 
+  /* The moves have to be applied in order, but the signatures on each state
+     are independent.  Thus they are verified while the moves are applied,
+     and the proof is rejected as soon as a required signature is known to
+     be missing, without applying any further moves.  */
+  std::vector<const proto::SignedData*> signedStates;
+  signedStates.push_back (&proof.initial_state ());
+  for (const auto& t : proof.transitions ())
+    signedStates.push_back (&t.new_state ());
+  ProofSignatures stateSignatures(rpc, channelId, meta, signedStates);
+
+  /* turns[i] is the player who must have signed state i (or NO_TURN for
+     the initial state).  The first "checked" states have their signatures
+     checked already, and the signers collected in signatures.  */
+  std::vector<int> turns = {ParsedBoardState::NO_TURN};
+  std::set<int> signatures;
+  size_t checked = 0;
+  const auto checkState = [&] (const std::set<int>& cur)
+    {
+      const int turn = turns[checked];
+      if (turn != ParsedBoardState::NO_TURN && !HasTurnSignature (cur, turn))
+        return false;
+
+      signatures.insert (cur.begin (), cur.end ());
+      ++checked;
+      return true;
+    };
+
   for (const auto& t : proof.transitions ())
     {
+      std::set<int> cur;
+      while (checked < turns.size () && stateSignatures.TryGet (checked, cur))
+        if (!checkState (cur))
+          return false;
+
+      int turn;
       std::unique_ptr<ParsedBoardState> parsedNew;
-      std::set<int> newSignatures;
-      if (!ExtraVerifyStateTransition (rpc, rules, channelId, meta, *parsed, t,
-                                       newSignatures, parsedNew))
+      if (!ApplyStateTransition (rpc, rules, channelId, meta, *parsed, t,
+                                 turn, parsedNew))
         return false;
 
-      signatures.insert (newSignatures.begin (), newSignatures.end ());
+      turns.push_back (turn);
       parsed = std::move (parsedNew);
       endState = t.new_state ().data ();
     }
 
+  CHECK_EQ (turns.size (), signedStates.size ());
+  while (checked < turns.size ())
+    if (!checkState (stateSignatures.Get (checked)))
+      return false;
+
   if (foundOnChain)
     {
       VLOG (1) << "StateProof starts from reinit state and is valid";
@@ -1,4 +1,4 @@
-// Copyright (C) 2019 The Xaya developers
+// Copyright (C) 2019-2020 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
@@ -34,6 +34,13 @@ bool VerifyStateTransition (XayaRpcClient& rpc, const BoardRules& rules,
  * Verifies a state proof for the given channel.  If the proof is complete
  * and valid, then true is returned and the resulting board state is returned
  * in endState.
+ *
+ * The moves are applied in order.  The signatures of the states are
+ * verified concurrently with that on a background thread if they can be
+ * checked locally and the proof is long, and otherwise all at once (through
+ * a single batch RPC call, see VerifyMessages) before applying the moves.
+ * Either way, no further moves are applied once a required signature is
+ * known to be missing.
  */
 bool VerifyStateProof (XayaRpcClient& rpc, const BoardRules& rules,
                        const uint256& channelId,
@@ -6,6 +6,7 @@
 
 #include "testgame.hpp"
 
+#include <xayagame/signatures.hpp>
 #include <xayautil/base64.hpp>
 #include <xayautil/hash.hpp>
 
@@ -18,6 +19,8 @@
 
 #include <glog/logging.h>
 
+#include <sstream>
+
 namespace xaya
 {
 namespace
@@ -383,6 +386,71 @@ TEST_F (StateProofTests, MultiSignedLaterState)
   EXPECT_EQ (endState, "43 6");
 }
 
+TEST_F (StateProofTests, LongProof)
+{
+  /* This proof is long enough for its signatures to be verified in chunks
+     if that is done locally (which it is not with the mock signatures).  */
+  proto::StateProof proof;
+  proof.mutable_initial_state ()->set_data ("0 1");
+  for (int i = 0; i < 20; ++i)
+    {
+      auto* t = proof.add_transitions ();
+      t->set_move ("1");
+      std::ostringstream state;
+      state << (i + 1) << " " << (i + 2);
+      t->mutable_new_state ()->set_data (state.str ());
+      t->mutable_new_state ()->add_signatures (i % 2 == 0 ? "sgn0" : "sgn1");
+    }
+
+  ASSERT_TRUE (VerifyStateProof (mockXayaServer.GetClient (),
+                                 game.rules, channelId, meta, "0 1",
+                                 proof, endState));
+  EXPECT_EQ (endState, "20 21");
+
+  proof.mutable_transitions (10)->mutable_new_state ()->set_signatures (
+      0, "sgn1");
+  EXPECT_FALSE (VerifyStateProof (mockXayaServer.GetClient (),
+                                  game.rules, channelId, meta, "0 1",
+                                  proof, endState));
+}
+
+TEST_F (StateProofTests, LongProofVerifiedLocally)
+{
+  /* Switch to local verification with a real signature, so that the
+     signatures of the proof are checked in chunks on the verification
+     pool.  The mock signatures are not valid locally, so the proof is
+     rejected even though Xaya Core would accept them.  */
+  const std::string msg = "Hello world!";
+  const std::string sgn = "H1wsv3UNrfO98DaxRcgzL/PuUZIRl8m4KS0dxs1jeNaxC0dlFgGxSg2hnvayMzIFb4xlPNq3nawSOquPKAN+KxU=";
+  Json::Value res(Json::objectValue);
+  res["valid"] = true;
+  res["address"] = "cbRMCi7xqwds7TTcNhRNVtNDWW7ZeuZzGL";
+  EXPECT_CALL (*mockXayaServer, verifymessage ("", msg, sgn))
+      .WillOnce (Return (res));
+
+  SetLocalMessageVerification (true);
+  VerifyMessage (mockXayaServer.GetClient (), msg, sgn);
+  ASSERT_TRUE (IsLocalVerificationEnabled ());
+
+  proto::StateProof proof;
+  proof.mutable_initial_state ()->set_data ("0 1");
+  for (int i = 0; i < 20; ++i)
+    {
+      auto* t = proof.add_transitions ();
+      t->set_move ("1");
+      std::ostringstream state;
+      state << (i + 1) << " " << (i + 2);
+      t->mutable_new_state ()->set_data (state.str ());
+      t->mutable_new_state ()->add_signatures (i % 2 == 0 ? "sgn0" : "sgn1");
+    }
+
+  EXPECT_FALSE (VerifyStateProof (mockXayaServer.GetClient (),
+                                  game.rules, channelId, meta, "0 1",
+                                  proof, endState));
+
+  ResetMessageVerification ();
+}
+
 /* ************************************************************************** */
 
 using UnverifiedProofEndStateTests = testing::Test;
@@ -24,12 +24,31 @@ DEFINE_string (xaya_rpc_url, "",
                "URL at which Xaya Core's JSON-RPC interface is available");
 DEFINE_bool (xaya_rpc_wait, false,
              "whether to wait on startup for Xaya Core to be available");
+DEFINE_int32 (xaya_rpc_connections, 4,
+              "maximum number of concurrent connections to Xaya Core");
 
 DEFINE_int32 (game_rpc_port, 0,
               "the port at which the game daemon's JSON-RPC server will be"
               " started (if non-zero)");
 DEFINE_bool (game_rpc_listen_locally, true,
              "whether the game daemon's JSON-RPC server should listen locally");
+DEFINE_bool (game_rpc_raw_tcp, false,
+             "if true, the JSON-RPC server at --game_rpc_port uses"
+             " newline-delimited JSON over raw TCP instead of HTTP");
+DEFINE_string (game_rpc_socket, "",
+               "if set, start the game daemon's JSON-RPC server with"
+               " newline-delimited JSON on this UNIX socket");
+DEFINE_int32 (game_rpc_compress_min_size, 0,
+              "if non-zero, HTTP responses of the game daemon's JSON-RPC"
+              " server with at least that many bytes are compressed"
+              " for clients that accept it");
+DEFINE_int32 (game_rpc_worker_threads, 0,
+              "if non-zero, the number of threads processing requests of the"
+              " game daemon's JSON-RPC server; methods other than the"
+              " asynchronous waits occupy a thread while they run");
+DEFINE_int32 (game_rpc_max_connections, 0,
+              "if non-zero, the maximum number of simultaneous connections"
+              " to the game daemon's JSON-RPC server");
 
 DEFINE_int32 (enable_pruning, -1,
               "if non-negative (including zero), enable pruning of old undo"
@@ -37,6 +56,10 @@ DEFINE_int32 (enable_pruning, -1,
 
 DEFINE_string (storage_type, "memory",
                "the type of storage to use for game data (memory or sqlite)");
+DEFINE_bool (undo_log, false,
+             "if true, keep undo data in an append-only log of files in"
+             " the data directory instead of in the storage (not supported"
+             " for memory storage)");
 DEFINE_string (datadir, "",
                "base data directory for game data (will be extended by the"
                " game ID and chain); must be set if --storage_type is not"
@@ -73,14 +96,34 @@ main (int argc, char** argv)
   xaya::GameDaemonConfiguration config;
   config.XayaRpcUrl = FLAGS_xaya_rpc_url;
   config.XayaRpcWait = FLAGS_xaya_rpc_wait;
-  if (FLAGS_game_rpc_port != 0)
+  CHECK_GT (FLAGS_xaya_rpc_connections, 0)
+      << "--xaya_rpc_connections must be positive";
+  config.XayaRpcConnections = FLAGS_xaya_rpc_connections;
+  if (!FLAGS_game_rpc_socket.empty ())
     {
-      config.GameRpcServer = xaya::RpcServerType::HTTP;
+      config.GameRpcServer = xaya::RpcServerType::UNIX;
+      config.GameRpcSocket = FLAGS_game_rpc_socket;
+    }
+  else if (FLAGS_game_rpc_port != 0)
+    {
+      config.GameRpcServer = FLAGS_game_rpc_raw_tcp
+                                ? xaya::RpcServerType::TCP
+                                : xaya::RpcServerType::HTTP;
       config.GameRpcPort = FLAGS_game_rpc_port;
       config.GameRpcListenLocally = FLAGS_game_rpc_listen_locally;
+      CHECK_GE (FLAGS_game_rpc_compress_min_size, 0)
+          << "--game_rpc_compress_min_size must not be negative";
+      config.GameRpcCompressMinSize = FLAGS_game_rpc_compress_min_size;
     }
+  CHECK_GE (FLAGS_game_rpc_worker_threads, 0)
+      << "--game_rpc_worker_threads must not be negative";
+  config.GameRpcWorkerThreads = FLAGS_game_rpc_worker_threads;
+  CHECK_GE (FLAGS_game_rpc_max_connections, 0)
+      << "--game_rpc_max_connections must not be negative";
+  config.GameRpcMaxConnections = FLAGS_game_rpc_max_connections;
   config.EnablePruning = FLAGS_enable_pruning;
   config.StorageType = FLAGS_storage_type;
+  config.UseUndoLog = FLAGS_undo_log;
   config.DataDirectory = FLAGS_datadir;
 
   mover::PendingMoves pending;
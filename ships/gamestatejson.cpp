@@ -15,7 +15,7 @@ namespace ships
 {
 
 Json::Value
-GameStateJson::GetFullJson () const
+GameStateJson::GetGameStats () const
 {
   Json::Value stats(Json::objectValue);
   auto* stmt = db.PrepareRo (R"(
@@ -40,8 +40,14 @@ GameStateJson::GetFullJson () const
       stats[name] = cur;
     }
 
+  return stats;
+}
+
+Json::Value
+GameStateJson::GetFullJson () const
+{
   Json::Value res(Json::objectValue);
-  res["gamestats"] = stats;
+  res["gamestats"] = GetGameStats ();
 
   xaya::ChannelsTable tbl(const_cast<xaya::SQLiteDatabase&> (db));
   res["channels"] = xaya::AllChannelsGameStateJson (tbl, rules);
@@ -49,4 +55,17 @@ GameStateJson::GetFullJson () const
   return res;
 }
 
+void
+GameStateJson::WriteFullJson (xaya::JsonStreamWriter& out) const
+{
+  xaya::ChannelsTable tbl(const_cast<xaya::SQLiteDatabase&> (db));
+
+  out.BeginObject ();
+  out.Key ("channels");
+  xaya::WriteAllChannelsGameStateJson (tbl, rules, out);
+  out.Key ("gamestats");
+  out.Value (GetGameStats ());
+  out.EndObject ();
+}
+
 } // namespace ships
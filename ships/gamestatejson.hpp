@@ -7,6 +7,7 @@
 
 #include "board.hpp"
 
+#include <xayagame/jsonwriter.hpp>
 #include <xayagame/sqlitestorage.hpp>
 
 #include <json/json.h>
@@ -29,6 +30,11 @@ private:
   /** Our board rules.  */
   const ShipsBoardRules& rules;
 
+  /**
+   * Extracts the game stats of all players as JSON.
+   */
+  Json::Value GetGameStats () const;
+
 public:
 
   GameStateJson (const xaya::SQLiteDatabase& d, const ShipsBoardRules& r)
@@ -44,6 +50,12 @@ public:
    */
   Json::Value GetFullJson () const;
 
+  /**
+   * Writes the same data as GetFullJson to a streaming writer, without
+   * materialising the data for all channels at once.
+   */
+  void WriteFullJson (xaya::JsonStreamWriter& out) const;
+
 };
 
 } // namespace ships
@@ -170,5 +170,36 @@ TEST_F (GameStateJsonTests, TwoParticipantChannel)
   EXPECT_TRUE (MessageDifferencer::Equals (state, stateFromJson));
 }
 
+TEST_F (GameStateJsonTests, StreamedMatchesFull)
+{
+  CHECK_EQ (sqlite3_exec (*GetDb (), R"(
+    INSERT INTO `game_stats`
+      (`name`, `won`, `lost`) VALUES ('foo', 10, 2), ('bar', 5, 5)
+  )", nullptr, nullptr, nullptr), SQLITE_OK);
+
+  xaya::proto::ChannelMetadata meta;
+  CHECK (TextFormat::ParseFromString (R"(
+    participants:
+      {
+        name: "foo"
+        address: "addr"
+      }
+  )", &meta));
+  for (const std::string preimage : {"channel 1", "channel 2"})
+    {
+      auto h = tbl.CreateNew (xaya::SHA256::Hash (preimage));
+      h->Reinitialise (meta, "");
+    }
+
+  std::ostringstream out;
+  xaya::JsonStreamWriter w(out);
+  gsj.WriteFullJson (w);
+  ASSERT_TRUE (w.IsComplete ());
+
+  const auto streamed = ParseJson (out.str ());
+  EXPECT_EQ (streamed, gsj.GetFullJson ());
+  EXPECT_EQ (streamed["channels"].size (), 2);
+}
+
 } // anonymous namespace
 } // namespace ships
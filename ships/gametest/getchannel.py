@@ -6,7 +6,8 @@
 from shipstest import ShipsTest
 
 """
-Tests the getchannel RPC method of the (generic) channel GSP RPC server.
+Tests the getchannel and getchannels RPC methods of the (generic) channel
+GSP RPC server.
 """
 
 
@@ -59,6 +60,22 @@ class GetChannelTest (ShipsTest):
                       self.getCustomState,
                       "channel", "getchannel", "invalid id")
 
+    # Query multiple channels at once.
+    self.mainLogger.info ("getchannels...")
+    data = self.getCustomState ("channels", "getchannels",
+                                [channelId, nonExistantId])
+    self.assertEqual (data, {
+      channelId: ch,
+      nonExistantId: None,
+    })
+    data = self.getCustomState ("channels", "getchannels", [])
+    self.assertEqual (data, {})
+
+    self.mainLogger.info ("getchannels with invalid hex string...")
+    self.expectError (-32602, ".*not a valid uint256",
+                      self.getCustomState,
+                      "channels", "getchannels", [channelId, "invalid id"])
+
 
 if __name__ == "__main__":
   GetChannelTest ().main ()
@@ -543,6 +543,14 @@ ShipsLogic::GetStateAsJson (const xaya::SQLiteDatabase& db)
   return gsj.GetFullJson ();
 }
 
+void
+ShipsLogic::WriteStateAsJson (const xaya::SQLiteDatabase& db,
+                              xaya::JsonStreamWriter& out)
+{
+  GameStateJson gsj(db, boardRules);
+  gsj.WriteFullJson (out);
+}
+
 void
 ShipsPending::HandleDisputeResolution (xaya::SQLiteDatabase& db,
                                        const Json::Value& obj)
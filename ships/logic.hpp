@@ -90,6 +90,8 @@ protected:
                     const Json::Value& blockData) override;
 
   Json::Value GetStateAsJson (const xaya::SQLiteDatabase& db) override;
+  void WriteStateAsJson (const xaya::SQLiteDatabase& db,
+                         xaya::JsonStreamWriter& out) override;
 
 public:
 
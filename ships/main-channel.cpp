@@ -10,6 +10,8 @@
 #include <gamechannel/daemon.hpp>
 #include <gamechannel/rpcbroadcast.hpp>
 #include <xayagame/rpc-stubs/xayawalletrpcclient.h>
+#include <xayagame/signatures.hpp>
+#include <xayagame/socketrpcserver.hpp>
 
 #include <jsonrpccpp/client/connectors/httpclient.h>
 #include <jsonrpccpp/server.h>
@@ -40,6 +42,17 @@ DEFINE_int32 (rpc_port, 0,
               " started (if non-zero)");
 DEFINE_bool (rpc_listen_locally, true,
              "whether the JSON-RPC server should listen locally");
+DEFINE_bool (rpc_raw_tcp, false,
+             "if true, the JSON-RPC server at --rpc_port uses"
+             " newline-delimited JSON over raw TCP instead of HTTP");
+DEFINE_string (rpc_socket, "",
+               "if set, start the channel daemon's JSON-RPC server with"
+               " newline-delimited JSON on this UNIX socket");
+
+DEFINE_bool (local_signature_verification, false,
+             "if true, verify message signatures in-process once that has"
+             " been checked against Xaya Core (not yet tested against"
+             " fixtures recorded from Core)");
 
 DEFINE_string (playername, "",
                "the Xaya name of the player for this channel (without p/)");
@@ -86,6 +99,8 @@ main (int argc, char** argv)
       return EXIT_FAILURE;
     }
 
+  xaya::SetLocalMessageVerification (FLAGS_local_signature_verification);
+
   /* ChannelDaemon manages its own Xaya Core RPC connections, but we need
      a wallet connection also for the ShipsChannel (to construct signed
      winner statements).  */
@@ -104,7 +119,21 @@ main (int argc, char** argv)
   daemon.SetOffChainBroadcast (bc);
 
   std::unique_ptr<jsonrpc::AbstractServerConnector> serverConnector;
-  if (FLAGS_rpc_port != 0)
+  if (!FLAGS_rpc_socket.empty ())
+    {
+      serverConnector
+          = std::make_unique<xaya::UnixSocketRpcServer> (FLAGS_rpc_socket);
+      LOG (INFO) << "Starting JSON-RPC server on socket " << FLAGS_rpc_socket;
+    }
+  else if (FLAGS_rpc_port != 0 && FLAGS_rpc_raw_tcp)
+    {
+      auto srv = std::make_unique<xaya::TcpSocketRpcServer> (FLAGS_rpc_port);
+      if (FLAGS_rpc_listen_locally)
+        srv->BindLocalhost ();
+      serverConnector = std::move (srv);
+      LOG (INFO) << "Starting JSON-RPC TCP server at port " << FLAGS_rpc_port;
+    }
+  else if (FLAGS_rpc_port != 0)
     {
       auto srv = std::make_unique<jsonrpc::HttpServer> (FLAGS_rpc_port);
       if (FLAGS_rpc_listen_locally)
@@ -0,0 +1,71 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "asyncrpc.hpp"
+
+#include "jsonwriter.hpp"
+#include "rpcbatch.hpp"
+
+#include <jsonrpccpp/common/exception.h>
+
+#include <sstream>
+
+namespace xaya
+{
+
+void
+AsyncRpcServerConnector::AddAsyncMethod (const std::string& method,
+                                         const AsyncMethod& m)
+{
+  asyncMethods[method] = m;
+}
+
+bool
+AsyncRpcServerConnector::StartAsyncRequest (const std::string& request,
+                                            const ResponseCallback& done) const
+{
+  /* Only parse the request if it can possibly be a call to one of
+     the asynchronous methods at all.  */
+  bool mentioned = false;
+  for (const auto& entry : asyncMethods)
+    if (request.find ('"' + entry.first + '"') != std::string::npos)
+      {
+        mentioned = true;
+        break;
+      }
+  if (!mentioned)
+    return false;
+
+  Json::Value req;
+  Json::CharReaderBuilder rbuilder;
+  std::string parseErrs;
+  std::istringstream in(request);
+  if (!Json::parseFromStream (rbuilder, in, &req, &parseErrs)
+        || !req.isObject () || req["jsonrpc"] != "2.0"
+        || !req.isMember ("id") || !req["method"].isString ()
+        || req.isMember ("encoding"))
+    return false;
+
+  const auto mit = asyncMethods.find (req["method"].asString ());
+  if (mit == asyncMethods.end ())
+    return false;
+
+  const Json::Value id = req["id"];
+  try
+    {
+      mit->second (req["params"], [id, done] (const Json::Value& result)
+        {
+          done (CompactJson (RpcBatchHandler::ResultResponse (id, result)));
+        });
+    }
+  catch (const jsonrpc::JsonRpcException& exc)
+    {
+      done (CompactJson (RpcBatchHandler::ErrorResponse (
+          id, exc.GetCode (), exc.GetMessage ())));
+    }
+
+  return true;
+}
+
+} // namespace xaya
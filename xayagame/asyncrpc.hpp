@@ -0,0 +1,92 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAGAME_ASYNCRPC_HPP
+#define XAYAGAME_ASYNCRPC_HPP
+
+#include <json/json.h>
+#include <jsonrpccpp/server.h>
+
+#include <functional>
+#include <map>
+#include <string>
+
+namespace xaya
+{
+
+/**
+ * Base class for JSON-RPC server connectors that support asynchronous
+ * methods.  Calls to those bypass the request handler, and their response
+ * is sent whenever the method completes the call (e.g. from Game's
+ * long-polling worker for waitforchange).  Thus waiting clients do not
+ * occupy a server thread while they wait.
+ *
+ * The concrete connectors (SocketRpcServer and CompressingHttpServer)
+ * handle the transport, and use StartAsyncRequest to find out whether
+ * a request is for one of the asynchronous methods.
+ */
+class AsyncRpcServerConnector : public jsonrpc::AbstractServerConnector
+{
+
+public:
+
+  /**
+   * Callback for completing a call to an asynchronous method with
+   * its result.
+   */
+  using ResultCallback = std::function<void (const Json::Value& result)>;
+
+  /**
+   * Implementation of an asynchronous method.  It is passed the "params"
+   * of the request and must invoke the callback exactly once, possibly later
+   * and on a different thread.  Alternatively, it may throw
+   * a jsonrpc::JsonRpcException (without invoking the callback) to
+   * return an error.
+   */
+  using AsyncMethod = std::function<void (const Json::Value& params,
+                                          const ResultCallback& cb)>;
+
+private:
+
+  /**
+   * Registered asynchronous methods by name.  This is only modified before
+   * the server starts listening, so it can be read without locking.
+   */
+  std::map<std::string, AsyncMethod> asyncMethods;
+
+protected:
+
+  /** Callback receiving the (serialised) response for a request.  */
+  using ResponseCallback = std::function<void (const std::string& response)>;
+
+  AsyncRpcServerConnector () = default;
+
+  /**
+   * Checks if the request is a call to one of the asynchronous methods,
+   * and starts it if it is.  The serialised response is passed to the
+   * callback once available (which may be before this returns).  Returns
+   * false if the request should be processed by the request handler
+   * instead.
+   */
+  bool StartAsyncRequest (const std::string& request,
+                          const ResponseCallback& done) const;
+
+public:
+
+  AsyncRpcServerConnector (const AsyncRpcServerConnector&) = delete;
+  void operator= (const AsyncRpcServerConnector&) = delete;
+
+  /**
+   * Registers an asynchronous method.  Only simple requests (not batches
+   * and without an "encoding") are answered by it; other calls are passed
+   * on to the request handler as usual.  This must be called before
+   * StartListening.
+   */
+  void AddAsyncMethod (const std::string& method, const AsyncMethod& m);
+
+};
+
+} // namespace xaya
+
+#endif // XAYAGAME_ASYNCRPC_HPP
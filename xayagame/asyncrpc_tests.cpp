@@ -0,0 +1,139 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "asyncrpc.hpp"
+
+#include <jsonrpccpp/common/errors.h>
+#include <jsonrpccpp/common/exception.h>
+
+#include <gtest/gtest.h>
+
+#include <json/json.h>
+
+#include <sstream>
+#include <string>
+
+namespace xaya
+{
+namespace
+{
+
+Json::Value
+ParseJson (const std::string& str)
+{
+  std::istringstream in(str);
+  Json::Value res;
+  in >> res;
+  return res;
+}
+
+/**
+ * Connector that does not listen anywhere, and exposes StartAsyncRequest
+ * for testing.
+ */
+class TestConnector : public AsyncRpcServerConnector
+{
+
+public:
+
+  using AsyncRpcServerConnector::StartAsyncRequest;
+
+  bool
+  StartListening () override
+  {
+    return true;
+  }
+
+  bool
+  StopListening () override
+  {
+    return true;
+  }
+
+};
+
+class AsyncRpcServerConnectorTests : public testing::Test
+{
+
+protected:
+
+  TestConnector conn;
+
+  /** The callback of the last "wait" call.  */
+  AsyncRpcServerConnector::ResultCallback pending;
+
+  AsyncRpcServerConnectorTests ()
+  {
+    conn.AddAsyncMethod ("wait",
+        [this] (const Json::Value& params,
+                const AsyncRpcServerConnector::ResultCallback& cb)
+          {
+            if (!params.isArray ())
+              throw jsonrpc::JsonRpcException (
+                  jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS, "no array");
+            pending = cb;
+          });
+  }
+
+  /**
+   * Starts the given request, and stores its response (if any) in
+   * the output string.  Returns whether it was an asynchronous call.
+   */
+  bool
+  Start (const std::string& request, std::string& response)
+  {
+    response.clear ();
+    return conn.StartAsyncRequest (request,
+        [&response] (const std::string& r)
+          {
+            response = r;
+          });
+  }
+
+};
+
+TEST_F (AsyncRpcServerConnectorTests, OtherRequests)
+{
+  std::string response;
+  EXPECT_FALSE (Start (R"({"jsonrpc":"2.0","id":1,"method":"other"})",
+                       response));
+  EXPECT_FALSE (Start (R"([{"jsonrpc":"2.0","id":1,"method":"wait"}])",
+                       response));
+  EXPECT_FALSE (Start (R"({"jsonrpc":"2.0","method":"wait","params":[]})",
+                       response));
+  EXPECT_FALSE (Start (R"({"jsonrpc":"2.0","id":1,"method":"wait",
+                          "params":[],"encoding":"cbor"})", response));
+  EXPECT_FALSE (Start (R"(invalid "wait")", response));
+  EXPECT_EQ (response, "");
+}
+
+TEST_F (AsyncRpcServerConnectorTests, Result)
+{
+  std::string response;
+  ASSERT_TRUE (Start (R"({"jsonrpc":"2.0","id":5,"method":"wait",
+                          "params":[]})", response));
+  EXPECT_EQ (response, "");
+
+  pending (ParseJson (R"({"foo": 42})"));
+  EXPECT_EQ (ParseJson (response), ParseJson (R"({
+    "jsonrpc": "2.0",
+    "id": 5,
+    "result": {"foo": 42}
+  })"));
+}
+
+TEST_F (AsyncRpcServerConnectorTests, Error)
+{
+  std::string response;
+  ASSERT_TRUE (Start (R"({"jsonrpc":"2.0","id":"x","method":"wait",
+                          "params":{}})", response));
+
+  const auto val = ParseJson (response);
+  EXPECT_EQ (val["id"], "x");
+  EXPECT_EQ (val["error"]["code"].asInt (),
+             jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS);
+}
+
+} // anonymous namespace
+} // namespace xaya
@@ -0,0 +1,502 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+/* Benchmark for the StorageInterface implementations.  It simulates a game
+   processing a chain of blocks (with configurable sizes for game states and
+   undo data, batched transactions, reorgs and pruning) on each selected
+   backend, and reports throughput, latency and I/O statistics.  */
+
+#include "lmdbstorage.hpp"
+#include "sqlitestorage.hpp"
+#include "storage.hpp"
+#include "undolog.hpp"
+
+#include <xayautil/hash.hpp>
+#include <xayautil/uint256.hpp>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <experimental/filesystem>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+namespace fs = std::experimental::filesystem;
+
+DEFINE_string (backends, "memory,lmdb,sqlite",
+               "comma-separated list of storage backends to benchmark;"
+               " possible values are memory, lmdb and sqlite, each optionally"
+               " with a +undolog suffix to keep undo data in an UndoLog");
+DEFINE_string (datadir, "",
+               "directory in which the on-disk backends store their data;"
+               " if empty, a temporary directory is used and removed again");
+
+DEFINE_int32 (blocks, 10000, "number of blocks to attach");
+DEFINE_int32 (state_size, 1024, "size of the game state in bytes");
+DEFINE_int32 (undo_size, 256, "size of the undo data per block in bytes");
+DEFINE_int32 (batch_size, 1,
+              "number of blocks processed in a single transaction");
+DEFINE_int32 (reorg_interval, 0,
+              "if positive, do a reorg every that many attached blocks");
+DEFINE_int32 (reorg_depth, 3, "number of blocks detached in each reorg");
+DEFINE_int32 (prune_window, -1,
+              "if non-negative, prune undo data older than that many blocks");
+DEFINE_bool (catching_up, false,
+             "whether to tell the storage that the game is catching up");
+DEFINE_int32 (seed, 42, "seed for the random data that is generated");
+
+/**
+ * I/O counters of the process as reported by /proc/self/io.
+ */
+struct IoCounters
+{
+
+  /** Bytes passed to write-like syscalls.  */
+  uint64_t wchar = 0;
+
+  /** Bytes actually sent to the storage layer.  */
+  uint64_t writeBytes = 0;
+
+  /** Whether or not the counters are available.  */
+  bool available = false;
+
+  /**
+   * Reads the current counters.
+   */
+  static IoCounters
+  Read ()
+  {
+    IoCounters res;
+
+    std::ifstream in("/proc/self/io");
+    std::string key;
+    uint64_t value;
+    while (in >> key >> value)
+      {
+        if (key == "wchar:")
+          res.wchar = value;
+        else if (key == "write_bytes:")
+          {
+            res.writeBytes = value;
+            res.available = true;
+          }
+      }
+
+    return res;
+  }
+
+};
+
+/**
+ * Returns the total size of all files in the given directory (recursively).
+ */
+uint64_t
+GetDirectorySize (const fs::path& dir)
+{
+  uint64_t res = 0;
+  for (const auto& f : fs::recursive_directory_iterator (dir))
+    if (fs::is_regular_file (f.status ()))
+      res += fs::file_size (f.path ());
+  return res;
+}
+
+/**
+ * A storage instance for one of the benchmarked backends, including the
+ * possible UndoLog wrapper.
+ */
+class BenchmarkStorage
+{
+
+private:
+
+  /** The base storage instance.  */
+  std::unique_ptr<xaya::StorageInterface> base;
+
+  /** The undo-log wrapper, if any.  */
+  std::unique_ptr<xaya::StorageWithUndoLog> withLog;
+
+public:
+
+  /**
+   * Constructs the storage for the given backend, using the given directory
+   * for its data.
+   */
+  explicit BenchmarkStorage (const std::string& backend, const fs::path& dir)
+  {
+    std::string type = backend;
+    bool undoLog = false;
+
+    const std::string suffix = "+undolog";
+    if (type.size () > suffix.size ()
+          && type.compare (type.size () - suffix.size (), suffix.size (),
+                           suffix) == 0)
+      {
+        type = type.substr (0, type.size () - suffix.size ());
+        undoLog = true;
+      }
+
+    if (type == "memory")
+      base = std::make_unique<xaya::MemoryStorage> ();
+    else if (type == "lmdb")
+      {
+        const fs::path lmdbDir = dir / "lmdb";
+        CHECK (fs::create_directories (lmdbDir));
+        base = std::make_unique<xaya::LMDBStorage> (lmdbDir.string ());
+      }
+    else if (type == "sqlite")
+      {
+        const fs::path dbFile = dir / "storage.sqlite";
+        base = std::make_unique<xaya::SQLiteStorage> (dbFile.string ());
+      }
+    else
+      LOG (FATAL) << "Invalid backend: " << backend;
+
+    if (undoLog)
+      {
+        const fs::path logDir = dir / "undolog";
+        CHECK (fs::create_directories (logDir));
+        withLog = std::make_unique<xaya::StorageWithUndoLog> (
+            *base, logDir.string ());
+      }
+  }
+
+  BenchmarkStorage () = delete;
+  BenchmarkStorage (const BenchmarkStorage&) = delete;
+  void operator= (const BenchmarkStorage&) = delete;
+
+  ~BenchmarkStorage ()
+  {
+    /* The wrapper references the base storage, so has to go first.  */
+    withLog.reset ();
+    base.reset ();
+  }
+
+  xaya::StorageInterface&
+  operator* ()
+  {
+    if (withLog != nullptr)
+      return *withLog;
+    return *base;
+  }
+
+};
+
+/**
+ * Simulates the processing of a chain of blocks on a given storage,
+ * recording the latencies of all block attaches and detaches.
+ */
+class ChainSimulator
+{
+
+private:
+
+  using Clock = std::chrono::steady_clock;
+
+  /** The storage being used.  */
+  xaya::StorageInterface& storage;
+
+  /** Random generator for the data written.  */
+  std::mt19937 rnd;
+
+  /** Block hashes of the current chain, indexed by height.  */
+  std::vector<xaya::uint256> chain;
+
+  /** Counter used to generate unique block hashes.  */
+  uint64_t hashCounter = 0;
+
+  /** Number of blocks processed in the current transaction.  */
+  unsigned blocksInTxn = 0;
+
+  /** Height up to which undo data has been pruned.  */
+  unsigned prunedHeight = 0;
+
+  /**
+   * Generates a random string of the given size.
+   */
+  std::string
+  RandomData (const size_t size)
+  {
+    std::string res(size, '\0');
+    for (auto& c : res)
+      c = static_cast<char> (rnd () & 0xFF);
+    return res;
+  }
+
+  /**
+   * Returns a fresh block hash.
+   */
+  xaya::uint256
+  NewBlockHash ()
+  {
+    return xaya::SHA256::Hash (std::to_string (hashCounter++));
+  }
+
+  /**
+   * Starts a transaction if none is active yet.
+   */
+  void
+  MaybeBegin ()
+  {
+    if (blocksInTxn == 0)
+      storage.BeginTransaction ();
+  }
+
+  /**
+   * Marks one more block as processed in the current transaction, and commits
+   * it if the batch is full.
+   */
+  void
+  MaybeCommit ()
+  {
+    ++blocksInTxn;
+    if (blocksInTxn >= static_cast<unsigned> (FLAGS_batch_size))
+      {
+        storage.CommitTransaction ();
+        blocksInTxn = 0;
+      }
+  }
+
+public:
+
+  /** Latencies of all block operations in microseconds.  */
+  std::vector<double> latencies;
+
+  explicit ChainSimulator (xaya::StorageInterface& s)
+    : storage(s), rnd(FLAGS_seed)
+  {
+    storage.Clear ();
+    storage.SetCatchingUp (FLAGS_catching_up);
+
+    chain.push_back (NewBlockHash ());
+    storage.BeginTransaction ();
+    storage.SetCurrentGameState (chain.back (), RandomData (FLAGS_state_size));
+    storage.CommitTransaction ();
+  }
+
+  ChainSimulator () = delete;
+  ChainSimulator (const ChainSimulator&) = delete;
+  void operator= (const ChainSimulator&) = delete;
+
+  /**
+   * Attaches a new block on top of the current chain.
+   */
+  void
+  Attach ()
+  {
+    const xaya::uint256 hash = NewBlockHash ();
+    const std::string undo = RandomData (FLAGS_undo_size);
+    const std::string state = RandomData (FLAGS_state_size);
+
+    const auto start = Clock::now ();
+
+    MaybeBegin ();
+    const unsigned height = chain.size ();
+    storage.AddUndoData (hash, height, undo);
+    storage.SetCurrentGameState (hash, state);
+    chain.push_back (hash);
+
+    if (FLAGS_prune_window >= 0
+          && height > static_cast<unsigned> (FLAGS_prune_window))
+      {
+        prunedHeight = std::max<unsigned> (prunedHeight,
+                                           height - FLAGS_prune_window);
+        storage.PruneUndoData (height - FLAGS_prune_window);
+      }
+
+    MaybeCommit ();
+
+    const std::chrono::duration<double, std::micro> dur = Clock::now () - start;
+    latencies.push_back (dur.count ());
+  }
+
+  /**
+   * Detaches the current tip.
+   */
+  void
+  Detach ()
+  {
+    CHECK_GT (chain.size (), 1);
+    const std::string state = RandomData (FLAGS_state_size);
+
+    const auto start = Clock::now ();
+
+    MaybeBegin ();
+    const xaya::uint256 hash = chain.back ();
+    xaya::UndoData undo;
+    CHECK (storage.GetUndoData (hash, undo))
+        << "No undo data for block " << hash.ToHex ();
+    chain.pop_back ();
+    storage.SetCurrentGameState (chain.back (), state);
+    storage.ReleaseUndoData (hash);
+    MaybeCommit ();
+
+    const std::chrono::duration<double, std::micro> dur = Clock::now () - start;
+    latencies.push_back (dur.count ());
+  }
+
+  /**
+   * Returns true if the tip can be detached (i.e. its undo data has not
+   * been pruned and it is not the genesis state).
+   */
+  bool
+  CanDetach () const
+  {
+    return chain.size () > prunedHeight + 1;
+  }
+
+  /**
+   * Commits the currently open transaction, if any.
+   */
+  void
+  Finish ()
+  {
+    if (blocksInTxn > 0)
+      storage.CommitTransaction ();
+    blocksInTxn = 0;
+  }
+
+};
+
+/**
+ * Returns the given percentile of the (sorted) data.
+ */
+double
+Percentile (const std::vector<double>& sorted, const double p)
+{
+  if (sorted.empty ())
+    return 0.0;
+
+  const size_t ind = std::min<size_t> (sorted.size () - 1,
+                                       p * sorted.size ());
+  return sorted[ind];
+}
+
+/**
+ * Runs the benchmark for one backend and prints its results.
+ */
+void
+RunBackend (const std::string& backend, const fs::path& dir)
+{
+  /* Data left over from an earlier run with the same --datadir would
+     distort the results, so start from an empty directory.  */
+  fs::remove_all (dir);
+  CHECK (fs::create_directories (dir))
+      << "Could not create data directory " << dir;
+
+  BenchmarkStorage storage(backend, dir);
+  (*storage).Initialise ();
+  ChainSimulator sim(*storage);
+
+  const IoCounters ioBefore = IoCounters::Read ();
+  const auto start = std::chrono::steady_clock::now ();
+
+  for (int i = 1; i <= FLAGS_blocks; ++i)
+    {
+      sim.Attach ();
+
+      if (FLAGS_reorg_interval > 0 && i % FLAGS_reorg_interval == 0)
+        for (int j = 0; j < FLAGS_reorg_depth && sim.CanDetach (); ++j)
+          sim.Detach ();
+    }
+  sim.Finish ();
+
+  const std::chrono::duration<double> total
+      = std::chrono::steady_clock::now () - start;
+  const IoCounters ioAfter = IoCounters::Read ();
+
+  std::vector<double> lat = sim.latencies;
+  std::sort (lat.begin (), lat.end ());
+
+  std::cout << std::left << std::setw (16) << backend << std::right
+            << std::fixed << std::setprecision (1)
+            << std::setw (12) << lat.size () / total.count ()
+            << std::setw (12) << Percentile (lat, 0.5)
+            << std::setw (12) << Percentile (lat, 0.99);
+
+  if (ioAfter.available)
+    std::cout << std::setw (14) << (ioAfter.wchar - ioBefore.wchar)
+              << std::setw (14) << (ioAfter.writeBytes - ioBefore.writeBytes);
+  else
+    std::cout << std::setw (14) << "n/a" << std::setw (14) << "n/a";
+
+  std::cout << std::setw (14) << GetDirectorySize (dir) << std::endl;
+}
+
+} // anonymous namespace
+
+int
+main (int argc, char** argv)
+{
+  google::InitGoogleLogging (argv[0]);
+
+  gflags::SetUsageMessage ("Benchmark the game storage backends");
+  gflags::ParseCommandLineFlags (&argc, &argv, true);
+
+  if (FLAGS_blocks <= 0 || FLAGS_batch_size <= 0
+        || FLAGS_state_size < 0 || FLAGS_undo_size < 0
+        || FLAGS_reorg_depth < 0)
+    {
+      std::cerr << "Error: invalid benchmark parameters" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  fs::path baseDir;
+  const bool tempDir = FLAGS_datadir.empty ();
+  if (tempDir)
+    {
+      const std::string tmpl
+          = (fs::temp_directory_path () / "xayagame-bench-XXXXXX").string ();
+      std::vector<char> buf(tmpl.begin (), tmpl.end ());
+      buf.push_back ('\0');
+      PCHECK (mkdtemp (buf.data ()) != nullptr)
+          << "Failed to create temporary directory for " << tmpl;
+      baseDir = buf.data ();
+    }
+  else
+    {
+      baseDir = FLAGS_datadir;
+      fs::create_directories (baseDir);
+      CHECK (fs::is_directory (baseDir))
+          << "Could not create data directory " << baseDir;
+    }
+
+  std::vector<std::string> backends;
+  std::istringstream in(FLAGS_backends);
+  std::string backend;
+  while (std::getline (in, backend, ','))
+    if (!backend.empty ())
+      backends.push_back (backend);
+
+  std::cout << std::left << std::setw (16) << "backend" << std::right
+            << std::setw (12) << "ops/s"
+            << std::setw (12) << "p50 (us)"
+            << std::setw (12) << "p99 (us)"
+            << std::setw (14) << "written"
+            << std::setw (14) << "disk written"
+            << std::setw (14) << "final size"
+            << std::endl;
+
+  for (unsigned i = 0; i < backends.size (); ++i)
+    RunBackend (backends[i],
+                baseDir / fs::path (std::to_string (i) + "-" + backends[i]));
+
+  if (tempDir)
+    fs::remove_all (baseDir);
+
+  return EXIT_SUCCESS;
+}
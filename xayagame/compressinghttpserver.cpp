@@ -0,0 +1,643 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "compressinghttpserver.hpp"
+
+#include "rpcencoding.hpp"
+
+#include <xayautil/compression.hpp>
+
+#include <glog/logging.h>
+
+#include <microhttpd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+namespace xaya
+{
+
+namespace
+{
+
+#if MHD_VERSION >= 0x00097002
+using MhdResult = MHD_Result;
+#else
+using MhdResult = int;
+#endif
+
+#if MHD_VERSION >= 0x00095400
+constexpr unsigned MHD_SUSPEND_RESUME_FLAG = MHD_ALLOW_SUSPEND_RESUME;
+#else
+constexpr unsigned MHD_SUSPEND_RESUME_FLAG = MHD_USE_SUSPEND_RESUME;
+#endif
+
+/**
+ * Maximum size of a request body.  If a client sends more, the request
+ * is rejected.
+ */
+constexpr size_t MAX_REQUEST_SIZE = 64 << 20;
+
+/** HTTP status code for requests that are too large.  */
+constexpr unsigned HTTP_PAYLOAD_TOO_LARGE = 413;
+
+/**
+ * Trims whitespace from both ends of a string.
+ */
+std::string
+Trim (const std::string& str)
+{
+  const auto isSpace = [] (const char c)
+    {
+      return std::isspace (static_cast<unsigned char> (c));
+    };
+
+  const auto begin = std::find_if_not (str.begin (), str.end (), isSpace);
+  const auto end = std::find_if_not (str.rbegin (), str.rend (), isSpace);
+  if (begin == str.end ())
+    return "";
+
+  return std::string (begin, end.base ());
+}
+
+/**
+ * Converts a string to lower case.
+ */
+std::string
+ToLower (std::string str)
+{
+  for (auto& c : str)
+    c = std::tolower (static_cast<unsigned char> (c));
+  return str;
+}
+
+/**
+ * Parses the parameters of a single element in Accept or Accept-Encoding,
+ * and returns its q-value.  Returns false if the parameters are invalid.
+ */
+bool
+ParseQValue (std::istringstream& params, double& q)
+{
+  q = 1.0;
+
+  std::string param;
+  while (std::getline (params, param, ';'))
+    {
+      param = ToLower (Trim (param));
+      if (param.substr (0, 2) != "q=")
+        continue;
+
+      const std::string val = param.substr (2);
+      char* end;
+      q = std::strtod (val.c_str (), &end);
+      if (val.empty () || *end != '\0' || q < 0.0 || q > 1.0)
+        return false;
+    }
+
+  return true;
+}
+
+} // anonymous namespace
+
+/**
+ * An asynchronous call, whose connection is suspended while it waits
+ * for the response.  The fields are protected by the lock of AsyncState.
+ */
+struct CompressingHttpServer::PendingCall
+{
+
+  /** The connection while it is suspended, and null otherwise.  */
+  MHD_Connection* conn = nullptr;
+
+  /** Set once the response is there or the call has been cancelled.  */
+  bool done = false;
+
+  /** Set if the server stopped before the call was completed.  */
+  bool cancelled = false;
+
+  /** The response once it is there.  */
+  std::string response;
+
+};
+
+/**
+ * State shared between the server and completion callbacks of asynchronous
+ * calls, which keeps track of the suspended connections.
+ */
+struct CompressingHttpServer::AsyncState
+{
+
+  /** Lock for this state and the pending calls.  */
+  std::mutex mut;
+
+  /** Set when the server is stopping, so that no more calls are suspended.  */
+  bool stopping = false;
+
+  /** The calls whose connection is currently suspended.  */
+  std::set<std::shared_ptr<PendingCall>> suspended;
+
+  /**
+   * Resumes the connection of a call if it is suspended.  mut must be held.
+   */
+  void
+  Resume (const std::shared_ptr<PendingCall>& call)
+  {
+    if (call->conn == nullptr)
+      return;
+
+    MHD_resume_connection (call->conn);
+    call->conn = nullptr;
+    suspended.erase (call);
+  }
+
+  /**
+   * Completes a call with its response.  If the connection has been
+   * suspended already, it is resumed, so that microhttpd invokes the
+   * access handler again to send the response.
+   */
+  void
+  Complete (const std::shared_ptr<PendingCall>& call,
+            const std::string& response)
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    if (call->done)
+      return;
+
+    call->response = response;
+    call->done = true;
+    Resume (call);
+  }
+
+  /**
+   * Cancels all calls that are still waiting and resumes their connections.
+   * This is done before stopping the daemon, as microhttpd does not allow
+   * that while connections are suspended.
+   */
+  void
+  CancelAll ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    stopping = true;
+
+    const auto calls = suspended;
+    for (const auto& call : calls)
+      {
+        call->done = true;
+        call->cancelled = true;
+        Resume (call);
+      }
+    CHECK (suspended.empty ());
+  }
+
+};
+
+/**
+ * The callbacks registered with microhttpd, which have access to the
+ * internals of the server.
+ */
+struct CompressingHttpServer::Callbacks
+{
+
+  /**
+   * Data for one ongoing request, which is the body received so far.
+   */
+  struct Request
+  {
+
+    /** The request body.  */
+    std::string body;
+
+    /** Set to true if the body exceeded MAX_REQUEST_SIZE.  */
+    bool tooLarge = false;
+
+    /** The asynchronous call for this request, if any.  */
+    std::shared_ptr<PendingCall> call;
+
+  };
+
+  /**
+   * Starts processing the request as asynchronous call if it is one.
+   * Returns true if the connection has been suspended; in that case, the
+   * access handler will be called again once the response is there.
+   */
+  static bool
+  StartAsync (CompressingHttpServer& self, MHD_Connection* conn,
+              Request& req)
+  {
+    const auto state = self.async;
+    auto call = std::make_shared<PendingCall> ();
+    if (!self.StartAsyncRequest (req.body,
+            [state, call] (const std::string& response)
+              {
+                state->Complete (call, response);
+              }))
+      return false;
+    req.call = call;
+
+    /* The call may have been completed right away (or concurrently on
+       another thread).  Then there is no need to suspend.  */
+    std::lock_guard<std::mutex> lock(state->mut);
+    if (call->done)
+      return false;
+    if (state->stopping)
+      {
+        call->done = true;
+        call->cancelled = true;
+        return false;
+      }
+
+    call->conn = conn;
+    state->suspended.insert (call);
+    MHD_suspend_connection (conn);
+
+    return true;
+  }
+
+  /**
+   * Queues a response for the connection.
+   */
+  static MhdResult
+  SendResponse (MHD_Connection* conn, const unsigned status,
+                const std::string& body, const std::string& contentType,
+                const std::string& contentEncoding, const std::string& vary)
+  {
+    MHD_Response* res = MHD_create_response_from_buffer (
+        body.size (), const_cast<char*> (body.data ()),
+        MHD_RESPMEM_MUST_COPY);
+
+    MHD_add_response_header (res, MHD_HTTP_HEADER_CONTENT_TYPE,
+                             contentType.c_str ());
+    MHD_add_response_header (res, "Access-Control-Allow-Origin", "*");
+    if (!contentEncoding.empty ())
+      MHD_add_response_header (res, MHD_HTTP_HEADER_CONTENT_ENCODING,
+                               contentEncoding.c_str ());
+    if (!vary.empty ())
+      MHD_add_response_header (res, MHD_HTTP_HEADER_VARY, vary.c_str ());
+
+    const auto ret = MHD_queue_response (conn, status, res);
+    MHD_destroy_response (res);
+
+    return ret;
+  }
+
+  /**
+   * Queues the response to an OPTIONS request.
+   */
+  static MhdResult
+  SendOptions (MHD_Connection* conn)
+  {
+    MHD_Response* res
+        = MHD_create_response_from_buffer (0, nullptr, MHD_RESPMEM_PERSISTENT);
+
+    MHD_add_response_header (res, "Allow", "POST, OPTIONS");
+    MHD_add_response_header (res, "Access-Control-Allow-Origin", "*");
+    MHD_add_response_header (res, "Access-Control-Allow-Headers",
+                             "origin, content-type, accept");
+    MHD_add_response_header (res, "DAV", "1");
+
+    const auto ret = MHD_queue_response (conn, MHD_HTTP_OK, res);
+    MHD_destroy_response (res);
+
+    return ret;
+  }
+
+  static MhdResult
+  Access (void* cls, MHD_Connection* conn, const char* url,
+          const char* method, const char* version,
+          const char* uploadData, size_t* uploadDataSize, void** conCls)
+  {
+    auto* self = static_cast<CompressingHttpServer*> (cls);
+
+    if (*conCls == nullptr)
+      {
+        *conCls = new Request ();
+        return MHD_YES;
+      }
+    auto* req = static_cast<Request*> (*conCls);
+
+    if (std::strcmp (method, MHD_HTTP_METHOD_OPTIONS) == 0)
+      return SendOptions (conn);
+
+    if (std::strcmp (method, MHD_HTTP_METHOD_POST) != 0)
+      return SendResponse (conn, MHD_HTTP_METHOD_NOT_ALLOWED,
+                           "Not allowed HTTP Method", "text/plain", "", "");
+
+    if (*uploadDataSize > 0)
+      {
+        if (req->body.size () + *uploadDataSize > MAX_REQUEST_SIZE)
+          req->tooLarge = true;
+        if (!req->tooLarge)
+          req->body.append (uploadData, *uploadDataSize);
+        *uploadDataSize = 0;
+        return MHD_YES;
+      }
+
+    if (req->tooLarge)
+      {
+        LOG (WARNING) << "HTTP RPC request too large, rejecting";
+        return SendResponse (conn, HTTP_PAYLOAD_TOO_LARGE,
+                             "Request too large", "text/plain", "", "");
+      }
+
+    const char* accept = MHD_lookup_connection_value (
+        conn, MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT);
+    const char* acceptEncoding = MHD_lookup_connection_value (
+        conn, MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT_ENCODING);
+
+    std::string response;
+    if (req->call == nullptr)
+      {
+        if (StartAsync (*self, conn, *req))
+          return MHD_YES;
+        if (req->call == nullptr)
+          self->ProcessRequest (req->body, response);
+      }
+
+    if (req->call != nullptr)
+      {
+        std::lock_guard<std::mutex> lock(self->async->mut);
+        CHECK (req->call->done);
+        if (req->call->cancelled)
+          return SendResponse (conn, MHD_HTTP_SERVICE_UNAVAILABLE,
+                               "Server is shutting down", "text/plain",
+                               "", "");
+        response = std::move (req->call->response);
+      }
+
+    std::string contentType, contentEncoding;
+    self->EncodeResponse (accept == nullptr ? "" : accept,
+                          acceptEncoding == nullptr ? "" : acceptEncoding,
+                          response, contentType, contentEncoding);
+
+    std::string vary;
+    if (self->cborEnabled)
+      vary = MHD_HTTP_HEADER_ACCEPT;
+    if (self->compressMinSize > 0)
+      {
+        if (!vary.empty ())
+          vary += ", ";
+        vary += MHD_HTTP_HEADER_ACCEPT_ENCODING;
+      }
+
+    return SendResponse (conn, MHD_HTTP_OK, response, contentType,
+                         contentEncoding, vary);
+  }
+
+  static void
+  Completed (void* cls, MHD_Connection* conn, void** conCls,
+             const MHD_RequestTerminationCode code)
+  {
+    delete static_cast<Request*> (*conCls);
+    *conCls = nullptr;
+  }
+
+};
+
+CompressingHttpServer::CompressingHttpServer (const int p, const unsigned t)
+  : port(p), threads(t)
+{
+  CHECK_GT (threads, 0);
+}
+
+CompressingHttpServer::~CompressingHttpServer ()
+{
+  StopListening ();
+}
+
+void
+CompressingHttpServer::BindLocalhost ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (daemon == nullptr) << "CompressingHttpServer is already running";
+  bindLocalhost = true;
+}
+
+void
+CompressingHttpServer::SetCompressionThreshold (const size_t minSize)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (daemon == nullptr) << "CompressingHttpServer is already running";
+  compressMinSize = minSize;
+}
+
+void
+CompressingHttpServer::EnableCbor (const std::set<std::string>& blobKeys)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (daemon == nullptr) << "CompressingHttpServer is already running";
+  cborEnabled = true;
+  cborBlobKeys = blobKeys;
+}
+
+void
+CompressingHttpServer::SetMaxConnections (const unsigned n)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (daemon == nullptr) << "CompressingHttpServer is already running";
+  CHECK_GT (n, 0);
+  maxConnections = n;
+}
+
+bool
+CompressingHttpServer::StartListening ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  if (daemon != nullptr)
+    return false;
+
+  sockaddr_in addr;
+  std::memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (port);
+  addr.sin_addr.s_addr = htonl (bindLocalhost ? INADDR_LOOPBACK : INADDR_ANY);
+
+  /* The connection limit is only passed if one has been configured,
+     since microhttpd's default depends on the polling mechanism.  */
+  std::vector<MHD_OptionItem> extraOptions;
+  if (maxConnections > 0)
+    extraOptions.push_back ({MHD_OPTION_CONNECTION_LIMIT,
+                             static_cast<intptr_t> (maxConnections),
+                             nullptr});
+  extraOptions.push_back ({MHD_OPTION_END, 0, nullptr});
+
+  async = std::make_shared<AsyncState> ();
+  daemon = MHD_start_daemon (
+      MHD_USE_SELECT_INTERNALLY | MHD_SUSPEND_RESUME_FLAG, port,
+      nullptr, nullptr,
+      &Callbacks::Access, this,
+      MHD_OPTION_NOTIFY_COMPLETED, &Callbacks::Completed, nullptr,
+      MHD_OPTION_THREAD_POOL_SIZE, threads,
+      MHD_OPTION_SOCK_ADDR, reinterpret_cast<const sockaddr*> (&addr),
+      MHD_OPTION_ARRAY, extraOptions.data (),
+      MHD_OPTION_END);
+
+  if (daemon == nullptr)
+    {
+      LOG (ERROR) << "Failed to start HTTP RPC server on port " << port;
+      async.reset ();
+      return false;
+    }
+
+  return true;
+}
+
+bool
+CompressingHttpServer::StopListening ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  if (daemon == nullptr)
+    return false;
+
+  /* Waiting calls are answered with an error, and their callbacks (which
+     may still be invoked later) keep the AsyncState alive.  */
+  async->CancelAll ();
+  MHD_stop_daemon (daemon);
+  daemon = nullptr;
+  async.reset ();
+
+  return true;
+}
+
+void
+CompressingHttpServer::EncodeResponse (const std::string& accept,
+                                       const std::string& acceptEncoding,
+                                       std::string& response,
+                                       std::string& contentType,
+                                       std::string& contentEncoding) const
+{
+  contentType = "application/json";
+  if (!response.empty ()
+        && (static_cast<unsigned char> (response[0]) & 0x80) != 0)
+    contentType = "application/cbor";
+  else if (cborEnabled && !response.empty () && NegotiateCbor (accept))
+    {
+      std::string cbor;
+      if (TranscodeJsonToCbor (response, cborBlobKeys, cbor))
+        {
+          response = std::move (cbor);
+          contentType = "application/cbor";
+        }
+      else
+        LOG (WARNING) << "Failed to parse JSON-RPC response as JSON";
+    }
+
+  contentEncoding.clear ();
+  if (compressMinSize == 0 || response.size () < compressMinSize)
+    return;
+
+  const size_t rawSize = response.size ();
+  switch (NegotiateCompression (acceptEncoding))
+    {
+    case Compression::NONE:
+      return;
+
+    case Compression::GZIP:
+      response = CompressGzip (response);
+      contentEncoding = "gzip";
+      break;
+
+    case Compression::DEFLATE:
+      response = CompressZlib (response);
+      contentEncoding = "deflate";
+      break;
+    }
+
+  VLOG (1)
+      << "Compressed HTTP RPC response with " << contentEncoding
+      << " from " << rawSize << " to " << response.size () << " bytes";
+}
+
+CompressingHttpServer::Compression
+CompressingHttpServer::NegotiateCompression (const std::string& acceptEncoding)
+{
+  /* q-values of the codings we support, or negative if the coding is
+     not mentioned explicitly.  */
+  double qGzip = -1.0;
+  double qDeflate = -1.0;
+  double qAny = -1.0;
+
+  std::istringstream in(acceptEncoding);
+  std::string element;
+  while (std::getline (in, element, ','))
+    {
+      std::istringstream parts(element);
+      std::string coding;
+      std::getline (parts, coding, ';');
+      coding = ToLower (Trim (coding));
+
+      double q;
+      if (coding.empty () || !ParseQValue (parts, q))
+        continue;
+
+      if (coding == "gzip" || coding == "x-gzip")
+        qGzip = q;
+      else if (coding == "deflate")
+        qDeflate = q;
+      else if (coding == "*")
+        qAny = q;
+    }
+
+  if (qGzip < 0.0)
+    qGzip = qAny;
+  if (qDeflate < 0.0)
+    qDeflate = qAny;
+
+  if (qGzip <= 0.0 && qDeflate <= 0.0)
+    return Compression::NONE;
+  if (qGzip >= qDeflate)
+    return Compression::GZIP;
+  return Compression::DEFLATE;
+}
+
+bool
+CompressingHttpServer::NegotiateCbor (const std::string& accept)
+{
+  /* q-values of the media ranges that are relevant for us, or negative
+     if they are not mentioned.  */
+  double qCbor = -1.0;
+  double qJson = -1.0;
+  double qApplication = -1.0;
+  double qAny = -1.0;
+
+  std::istringstream in(accept);
+  std::string element;
+  while (std::getline (in, element, ','))
+    {
+      std::istringstream parts(element);
+      std::string type;
+      std::getline (parts, type, ';');
+      type = ToLower (Trim (type));
+
+      double q;
+      if (type.empty () || !ParseQValue (parts, q))
+        continue;
+
+      if (type == "application/cbor")
+        qCbor = q;
+      else if (type == "application/json")
+        qJson = q;
+      else if (type == "application/*")
+        qApplication = q;
+      else if (type == "*/*")
+        qAny = q;
+    }
+
+  if (qJson < 0.0)
+    qJson = qApplication;
+  if (qJson < 0.0)
+    qJson = qAny;
+
+  return qCbor > 0.0 && qCbor >= qJson;
+}
+
+} // namespace xaya
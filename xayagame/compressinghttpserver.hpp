@@ -0,0 +1,169 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAGAME_COMPRESSINGHTTPSERVER_HPP
+#define XAYAGAME_COMPRESSINGHTTPSERVER_HPP
+
+#include "asyncrpc.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+struct MHD_Daemon;
+
+namespace xaya
+{
+
+/**
+ * JSON-RPC server connector for HTTP, which can compress large responses.
+ * It behaves like jsonrpccpp's HttpServer, except that responses of at
+ * least a configured size are compressed with gzip or deflate if the client
+ * accepts that through its Accept-Encoding header.  This matters for
+ * e.g. getcurrentstate of a mature game, which can return many megabytes
+ * of very repetitive JSON to remote frontends.
+ *
+ * Responses in a binary encoding (see RpcEncodingHandler) are sent with
+ * content type application/cbor instead of application/json.  If CBOR is
+ * enabled (which RpcEncodingHandler does when installed), clients can also
+ * request it through the Accept header.  Then the JSON response is
+ * transcoded without the request having to be touched at all.
+ *
+ * Asynchronous methods (see AsyncRpcServerConnector) are supported by
+ * suspending the HTTP connection until the response is available.  While
+ * suspended, a request does not occupy a thread of the pool, but it still
+ * needs a connection of its own (see SetMaxConnections).
+ */
+class CompressingHttpServer : public AsyncRpcServerConnector
+{
+
+public:
+
+  /**
+   * The content codings we support for responses.
+   */
+  enum class Compression
+  {
+    NONE,
+    GZIP,
+    DEFLATE,
+  };
+
+private:
+
+  struct Callbacks;
+  friend struct Callbacks;
+
+  struct PendingCall;
+  struct AsyncState;
+
+  /** The port to listen on.  */
+  const int port;
+
+  /** Number of threads in the server's pool.  */
+  const unsigned threads;
+
+  /** Maximum number of simultaneous connections (zero for MHD's default).  */
+  unsigned maxConnections = 0;
+
+  /** Whether to bind only to the loopback interface.  */
+  bool bindLocalhost = false;
+
+  /**
+   * Minimum size in bytes of responses that get compressed.  Zero disables
+   * compression altogether.
+   */
+  size_t compressMinSize = 0;
+
+  /** Whether clients can request CBOR through the Accept header.  */
+  bool cborEnabled = false;
+
+  /** Keys of base64 blobs for encoding CBOR responses.  */
+  std::set<std::string> cborBlobKeys;
+
+  /** The running microhttpd daemon, if any.  */
+  MHD_Daemon* daemon = nullptr;
+
+  /**
+   * State for the suspended connections of asynchronous calls.  Their
+   * completion callbacks may be invoked even after the server has been
+   * stopped, so they hold on to it by shared_ptr.  This is null while
+   * not listening.
+   */
+  std::shared_ptr<AsyncState> async;
+
+  /** Lock for starting and stopping the daemon.  */
+  std::mutex mut;
+
+  /**
+   * Encodes a response returned by the request handler for sending, and
+   * returns its headers.  The returned contentEncoding is empty if the
+   * body is not compressed.
+   */
+  void EncodeResponse (const std::string& accept,
+                       const std::string& acceptEncoding,
+                       std::string& response, std::string& contentType,
+                       std::string& contentEncoding) const;
+
+public:
+
+  explicit CompressingHttpServer (int p, unsigned t = 50);
+  ~CompressingHttpServer ();
+
+  CompressingHttpServer () = delete;
+  CompressingHttpServer (const CompressingHttpServer&) = delete;
+  void operator= (const CompressingHttpServer&) = delete;
+
+  /**
+   * Binds the server only to the loopback interface.  Must be called before
+   * the server is started.
+   */
+  void BindLocalhost ();
+
+  /**
+   * Sets the minimum size of responses that are compressed (if the client
+   * supports it).  Zero (the default) disables compression.
+   */
+  void SetCompressionThreshold (size_t minSize);
+
+  /**
+   * Allows clients to request CBOR-encoded responses through the Accept
+   * header, using the given blob keys (see EncodeCbor).  Must be called
+   * before the server is started.
+   */
+  void EnableCbor (const std::set<std::string>& blobKeys);
+
+  /**
+   * Sets the maximum number of simultaneous connections.  Each client
+   * waiting in an asynchronous call keeps its connection, so this bounds
+   * the number of waiting clients as well.  Note that microhttpd's select
+   * loop cannot handle more than FD_SETSIZE sockets anyway.  Must be called
+   * before the server is started.
+   */
+  void SetMaxConnections (unsigned n);
+
+  bool StartListening () override;
+  bool StopListening () override;
+
+  /**
+   * Chooses the content coding to use for a response, based on the value
+   * of the request's Accept-Encoding header (as per RFC 7231).  gzip is
+   * preferred over deflate if both are equally acceptable.
+   */
+  static Compression NegotiateCompression (const std::string& acceptEncoding);
+
+  /**
+   * Returns true if a client with the given Accept header wants a CBOR
+   * response.  This is the case if application/cbor is acceptable and
+   * not less preferred than application/json.
+   */
+  static bool NegotiateCbor (const std::string& accept);
+
+};
+
+} // namespace xaya
+
+#endif // XAYAGAME_COMPRESSINGHTTPSERVER_HPP
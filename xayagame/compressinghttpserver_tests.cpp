@@ -0,0 +1,321 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "compressinghttpserver.hpp"
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <json/json.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+namespace xaya
+{
+namespace
+{
+
+/** Port used for the server in tests.  */
+constexpr int HTTP_PORT = 32120;
+
+/** Compression threshold used in the tests.  */
+constexpr size_t MIN_SIZE = 1'000;
+
+/* ************************************************************************** */
+
+using Compression = CompressingHttpServer::Compression;
+
+Compression
+Negotiate (const std::string& acceptEncoding)
+{
+  return CompressingHttpServer::NegotiateCompression (acceptEncoding);
+}
+
+TEST (CompressingHttpServerNegotiationTests, NoCompression)
+{
+  EXPECT_EQ (Negotiate (""), Compression::NONE);
+  EXPECT_EQ (Negotiate ("identity"), Compression::NONE);
+  EXPECT_EQ (Negotiate ("br, compress"), Compression::NONE);
+  EXPECT_EQ (Negotiate ("gzip;q=0, deflate;q=0"), Compression::NONE);
+  EXPECT_EQ (Negotiate ("*;q=0"), Compression::NONE);
+}
+
+TEST (CompressingHttpServerNegotiationTests, Basic)
+{
+  EXPECT_EQ (Negotiate ("gzip"), Compression::GZIP);
+  EXPECT_EQ (Negotiate ("x-gzip"), Compression::GZIP);
+  EXPECT_EQ (Negotiate (" GZip "), Compression::GZIP);
+  EXPECT_EQ (Negotiate ("deflate"), Compression::DEFLATE);
+  EXPECT_EQ (Negotiate ("*"), Compression::GZIP);
+  EXPECT_EQ (Negotiate ("gzip, deflate, br"), Compression::GZIP);
+}
+
+TEST (CompressingHttpServerNegotiationTests, QValues)
+{
+  EXPECT_EQ (Negotiate ("gzip;q=0.5, deflate"), Compression::DEFLATE);
+  EXPECT_EQ (Negotiate ("deflate;q=0.5, gzip;q=0.5"), Compression::GZIP);
+  EXPECT_EQ (Negotiate ("gzip;q=0, *"), Compression::DEFLATE);
+  EXPECT_EQ (Negotiate ("deflate; Q=0.8 ; x=y"), Compression::DEFLATE);
+}
+
+TEST (CompressingHttpServerNegotiationTests, InvalidElementsIgnored)
+{
+  EXPECT_EQ (Negotiate ("gzip;q=abc"), Compression::NONE);
+  EXPECT_EQ (Negotiate ("gzip;q=2, deflate"), Compression::DEFLATE);
+  EXPECT_EQ (Negotiate (",,;q=1, deflate"), Compression::DEFLATE);
+}
+
+TEST (CompressingHttpServerNegotiationTests, Cbor)
+{
+  using S = CompressingHttpServer;
+
+  EXPECT_FALSE (S::NegotiateCbor (""));
+  EXPECT_FALSE (S::NegotiateCbor ("*/*"));
+  EXPECT_FALSE (S::NegotiateCbor ("application/json"));
+  EXPECT_FALSE (S::NegotiateCbor ("application/cbor;q=0"));
+  EXPECT_FALSE (S::NegotiateCbor ("application/cbor;q=0.5, */*"));
+  EXPECT_FALSE (S::NegotiateCbor ("application/cbor;q=abc"));
+
+  EXPECT_TRUE (S::NegotiateCbor ("application/cbor"));
+  EXPECT_TRUE (S::NegotiateCbor (" Application/CBOR "));
+  EXPECT_TRUE (S::NegotiateCbor ("application/cbor, application/json"));
+  EXPECT_TRUE (S::NegotiateCbor ("application/json;q=0.5, application/cbor"));
+  EXPECT_TRUE (S::NegotiateCbor ("application/cbor, application/*;q=0.9"));
+  EXPECT_TRUE (S::NegotiateCbor ("application/cbor;q=0.5, */*;q=0.1"));
+}
+
+/* ************************************************************************** */
+
+/**
+ * Request handler for the tests.  It returns a string of the length
+ * given in the "params" as result.
+ */
+class TestHandler : public jsonrpc::IClientConnectionHandler
+{
+
+public:
+
+  void
+  HandleRequest (const std::string& request, std::string& response) override
+  {
+    Json::Value req;
+    std::istringstream in(request);
+    in >> req;
+
+    Json::Value res(Json::objectValue);
+    res["jsonrpc"] = "2.0";
+    res["id"] = req["id"];
+    res["result"] = std::string (req["params"].asInt (), 'x');
+
+    Json::StreamWriterBuilder wbuilder;
+    wbuilder["indentation"] = "";
+    response = Json::writeString (wbuilder, res);
+  }
+
+};
+
+/**
+ * HTTP response as received by the test client.
+ */
+struct HttpResponse
+{
+
+  /** The full header block, with header names in lower case.  */
+  std::string headers;
+
+  /** The response body.  */
+  std::string body;
+
+};
+
+/**
+ * Sends an HTTP POST request with the given body, Accept-Encoding and
+ * Accept headers to the test server, and returns the response.
+ */
+HttpResponse
+Post (const std::string& body, const std::string& acceptEncoding,
+      const std::string& accept = "")
+{
+  sockaddr_in addr;
+  std::memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (HTTP_PORT);
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  const int fd = socket (AF_INET, SOCK_STREAM, 0);
+  CHECK_GE (fd, 0);
+  CHECK_EQ (connect (fd, reinterpret_cast<const sockaddr*> (&addr),
+                     sizeof (addr)), 0);
+
+  std::ostringstream req;
+  req << "POST / HTTP/1.1\r\n"
+      << "Host: localhost\r\n"
+      << "Content-Type: application/json\r\n"
+      << "Content-Length: " << body.size () << "\r\n"
+      << "Connection: close\r\n";
+  if (!acceptEncoding.empty ())
+    req << "Accept-Encoding: " << acceptEncoding << "\r\n";
+  if (!accept.empty ())
+    req << "Accept: " << accept << "\r\n";
+  req << "\r\n" << body;
+
+  const std::string data = req.str ();
+  CHECK_EQ (send (fd, data.data (), data.size (), MSG_NOSIGNAL),
+            static_cast<ssize_t> (data.size ()));
+
+  std::string received;
+  char buf[4096];
+  while (true)
+    {
+      const ssize_t n = recv (fd, buf, sizeof (buf), 0);
+      CHECK_GE (n, 0);
+      if (n == 0)
+        break;
+      received.append (buf, n);
+    }
+  close (fd);
+
+  const size_t pos = received.find ("\r\n\r\n");
+  CHECK_NE (pos, std::string::npos);
+
+  HttpResponse res;
+  res.headers = received.substr (0, pos + 2);
+  for (auto& c : res.headers)
+    c = std::tolower (static_cast<unsigned char> (c));
+  res.body = received.substr (pos + 4);
+
+  return res;
+}
+
+/**
+ * Returns a JSON-RPC request for a result of the given length.
+ */
+std::string
+Request (const int len)
+{
+  std::ostringstream out;
+  out << R"({"jsonrpc":"2.0","method":"test","id":1,"params":)" << len << "}";
+  return out.str ();
+}
+
+class CompressingHttpServerTests : public testing::Test
+{
+
+protected:
+
+  TestHandler handler;
+  CompressingHttpServer srv;
+
+  CompressingHttpServerTests ()
+    : srv(HTTP_PORT, 4)
+  {
+    srv.BindLocalhost ();
+    srv.SetCompressionThreshold (MIN_SIZE);
+    srv.SetHandler (&handler);
+    CHECK (srv.StartListening ());
+  }
+
+  ~CompressingHttpServerTests ()
+  {
+    srv.StopListening ();
+  }
+
+};
+
+TEST_F (CompressingHttpServerTests, SmallResponseNotCompressed)
+{
+  const auto res = Post (Request (10), "gzip");
+  EXPECT_NE (res.headers.find ("content-type: application/json"),
+             std::string::npos);
+  EXPECT_EQ (res.headers.find ("content-encoding"), std::string::npos);
+  EXPECT_NE (res.body.find ("xxxxxxxxxx"), std::string::npos);
+}
+
+TEST_F (CompressingHttpServerTests, ClientWithoutCompression)
+{
+  const auto res = Post (Request (10'000), "");
+  EXPECT_EQ (res.headers.find ("content-encoding"), std::string::npos);
+  EXPECT_GT (res.body.size (), 10'000);
+}
+
+TEST_F (CompressingHttpServerTests, Gzip)
+{
+  const auto res = Post (Request (10'000), "deflate;q=0.5, gzip");
+  EXPECT_NE (res.headers.find ("content-encoding: gzip"), std::string::npos);
+  EXPECT_NE (res.headers.find ("vary: accept-encoding"), std::string::npos);
+  EXPECT_LT (res.body.size (), 1'000);
+  ASSERT_GE (res.body.size (), 2);
+  EXPECT_EQ (res.body.substr (0, 2), "\x1f\x8b");
+}
+
+TEST_F (CompressingHttpServerTests, Deflate)
+{
+  const auto res = Post (Request (10'000), "deflate");
+  EXPECT_NE (res.headers.find ("content-encoding: deflate"),
+             std::string::npos);
+  EXPECT_LT (res.body.size (), 1'000);
+}
+
+TEST_F (CompressingHttpServerTests, CborNotEnabled)
+{
+  const auto res = Post (Request (10), "", "application/cbor");
+  EXPECT_NE (res.headers.find ("content-type: application/json"),
+             std::string::npos);
+  EXPECT_NE (res.body.find ("xxxxxxxxxx"), std::string::npos);
+}
+
+TEST (CompressingHttpServerCborTests, AcceptHeader)
+{
+  TestHandler handler;
+  CompressingHttpServer srv(HTTP_PORT, 2);
+  srv.BindLocalhost ();
+  srv.EnableCbor ({});
+  srv.SetHandler (&handler);
+  ASSERT_TRUE (srv.StartListening ());
+
+  auto res = Post (Request (10), "", "application/json");
+  EXPECT_NE (res.headers.find ("content-type: application/json"),
+             std::string::npos);
+  EXPECT_NE (res.headers.find ("vary: accept"), std::string::npos);
+
+  res = Post (Request (3), "", "application/cbor");
+  EXPECT_NE (res.headers.find ("content-type: application/cbor"),
+             std::string::npos);
+  /* {"id": 1, "jsonrpc": "2.0", "result": "xxx"}  */
+  EXPECT_EQ (res.body, "\xa3" "\x62id" "\x01"
+                       "\x67jsonrpc" "\x63" "2.0"
+                       "\x66result" "\x63xxx");
+
+  ASSERT_TRUE (srv.StopListening ());
+}
+
+TEST (CompressingHttpServerStartStopTests, Restart)
+{
+  TestHandler handler;
+  CompressingHttpServer srv(HTTP_PORT, 2);
+  srv.BindLocalhost ();
+  srv.SetHandler (&handler);
+
+  for (int i = 0; i < 2; ++i)
+    {
+      ASSERT_TRUE (srv.StartListening ());
+      EXPECT_FALSE (srv.StartListening ());
+      const auto res = Post (Request (5), "");
+      EXPECT_NE (res.body.find ("xxxxx"), std::string::npos);
+      ASSERT_TRUE (srv.StopListening ());
+      EXPECT_FALSE (srv.StopListening ());
+    }
+}
+
+} // anonymous namespace
+} // namespace xaya
@@ -4,13 +4,18 @@
 
 #include "defaultmain.hpp"
 
+#include "compressinghttpserver.hpp"
 #include "gamerpcserver.hpp"
 #include "lmdbstorage.hpp"
+#include "rpcpool.hpp"
+#include "signatures.hpp"
+#include "socketrpcserver.hpp"
 #include "sqlitestorage.hpp"
+#include "undolog.hpp"
+#include "writebehindstorage.hpp"
 
 #include "rpc-stubs/xayarpcclient.h"
 
-#include <jsonrpccpp/client/connectors/httpclient.h>
 #include <jsonrpccpp/common/exception.h>
 
 #include <glog/logging.h>
@@ -78,7 +83,17 @@ CreateStorage (const GameDaemonConfiguration& config,
                const std::string& gameId, const Chain chain)
 {
   if (config.StorageType == "memory")
-    return std::make_unique<MemoryStorage> ();
+    {
+      auto res = std::make_unique<MemoryStorage> ();
+      if (config.MemoryUndoBudget > 0)
+        {
+          std::string spillDir;
+          if (!config.DataDirectory.empty ())
+            spillDir = GetGameDirectory (config, gameId, chain).string ();
+          res->SetUndoMemoryBudget (config.MemoryUndoBudget, spillDir);
+        }
+      return res;
+    }
 
   const fs::path gameDir = GetGameDirectory (config, gameId, chain);
 
@@ -96,13 +111,53 @@ CreateStorage (const GameDaemonConfiguration& config,
   if (config.StorageType == "sqlite")
     {
       const fs::path dbFile = gameDir / fs::path ("storage.sqlite");
-      return std::make_unique<SQLiteStorage> (dbFile.string ());
+      auto res = std::make_unique<SQLiteStorage> (dbFile.string ());
+      res->SetTuning (config.SQLiteCatchingUp, config.SQLiteUpToDate);
+      res->SetSnapshotPoolSize (config.SQLiteSnapshotPoolSize);
+      return res;
     }
 
   LOG (FATAL) << "Invalid storage type selected: " << config.StorageType;
   return nullptr;
 }
 
+/**
+ * Sets up an undo log in the game's data directory that wraps the given
+ * storage instance.
+ */
+std::unique_ptr<StorageWithUndoLog>
+CreateUndoLog (const GameDaemonConfiguration& config,
+               const std::string& gameId, const Chain chain,
+               StorageInterface& storage)
+{
+  CHECK (config.StorageType != "memory")
+      << "The undo log is not supported for memory storage";
+
+  const fs::path logDir
+      = GetGameDirectory (config, gameId, chain) / fs::path ("undolog");
+  if (!fs::is_directory (logDir))
+    {
+      LOG (INFO) << "Creating directory for the undo log: " << logDir;
+      CHECK (fs::create_directories (logDir));
+    }
+
+  return std::make_unique<StorageWithUndoLog> (storage, logDir.string ());
+}
+
+/**
+ * Applies the thread and connection limits from the configuration (if set)
+ * to one of the socket-based RPC servers.
+ */
+void
+ConfigureSocketRpcServer (const GameDaemonConfiguration& config,
+                          SocketRpcServer& srv)
+{
+  if (config.GameRpcWorkerThreads > 0)
+    srv.SetWorkerThreads (config.GameRpcWorkerThreads);
+  if (config.GameRpcMaxConnections > 0)
+    srv.SetMaxConnections (config.GameRpcMaxConnections);
+}
+
 /**
  * Constructs the server connector for the JSON-RPC server (if any) based
  * on the configuration.
@@ -121,11 +176,64 @@ CreateRpcServerConnector (const GameDaemonConfiguration& config)
             << "GameRpcPort must be specified for HTTP server type";
         LOG (INFO)
             << "Starting JSON-RPC HTTP server at port " << config.GameRpcPort;
+
+        if (config.GameRpcCompressMinSize > 0
+              || config.GameRpcWorkerThreads > 0
+              || config.GameRpcMaxConnections > 0)
+          {
+            std::unique_ptr<CompressingHttpServer> srv;
+            if (config.GameRpcWorkerThreads > 0)
+              srv = std::make_unique<CompressingHttpServer> (
+                  config.GameRpcPort, config.GameRpcWorkerThreads);
+            else
+              srv = std::make_unique<CompressingHttpServer> (
+                  config.GameRpcPort);
+
+            if (config.GameRpcCompressMinSize > 0)
+              {
+                LOG (INFO)
+                    << "Compressing RPC responses of at least "
+                    << config.GameRpcCompressMinSize << " bytes";
+                srv->SetCompressionThreshold (config.GameRpcCompressMinSize);
+              }
+            if (config.GameRpcMaxConnections > 0)
+              srv->SetMaxConnections (config.GameRpcMaxConnections);
+            if (config.GameRpcListenLocally)
+              srv->BindLocalhost ();
+            return srv;
+          }
+
         auto srv = std::make_unique<jsonrpc::HttpServer> (config.GameRpcPort);
         if (config.GameRpcListenLocally)
           srv->BindLocalhost ();
         return srv;
       }
+
+    case RpcServerType::UNIX:
+      {
+        CHECK (!config.GameRpcSocket.empty ())
+            << "GameRpcSocket must be specified for UNIX server type";
+        LOG (INFO)
+            << "Starting JSON-RPC server on UNIX socket "
+            << config.GameRpcSocket;
+        auto srv
+            = std::make_unique<UnixSocketRpcServer> (config.GameRpcSocket);
+        ConfigureSocketRpcServer (config, *srv);
+        return srv;
+      }
+
+    case RpcServerType::TCP:
+      {
+        CHECK (config.GameRpcPort != 0)
+            << "GameRpcPort must be specified for TCP server type";
+        LOG (INFO)
+            << "Starting JSON-RPC TCP server at port " << config.GameRpcPort;
+        auto srv = std::make_unique<TcpSocketRpcServer> (config.GameRpcPort);
+        ConfigureSocketRpcServer (config, *srv);
+        if (config.GameRpcListenLocally)
+          srv->BindLocalhost ();
+        return srv;
+      }
     }
 
   LOG (FATAL)
@@ -189,27 +297,57 @@ DefaultMain (const GameDaemonConfiguration& config, const std::string& gameId,
 
       CHECK (!config.XayaRpcUrl.empty ()) << "XayaRpcUrl must be configured";
       const std::string jsonRpcUrl(config.XayaRpcUrl);
-      jsonrpc::HttpClient httpConnector(jsonRpcUrl);
+      auto xayaConnector
+          = RpcConnectorPool::ForHttp (jsonRpcUrl, config.XayaRpcConnections);
 
       if (config.XayaRpcWait)
-        WaitForXaya (httpConnector);
+        WaitForXaya (*xayaConnector);
+
+      SetLocalMessageVerification (config.LocalSignatureVerification);
 
       auto game = std::make_unique<Game> (gameId);
-      game->ConnectRpcClient (httpConnector);
+      game->ConnectRpcClient (*xayaConnector);
       VerifyXayaVersion (config, game->GetXayaVersion ());
       CHECK (game->DetectZmqEndpoint ());
 
       std::unique_ptr<StorageInterface> storage
           = CreateStorage (config, gameId, game->GetChain ());
-      game->SetStorage (*storage);
+      std::unique_ptr<StorageWithUndoLog> undoLog;
+      if (config.UseUndoLog)
+        undoLog = CreateUndoLog (config, gameId, game->GetChain (), *storage);
+      StorageInterface& baseStorage
+          = undoLog != nullptr ? *undoLog : *storage;
+
+      std::unique_ptr<WriteBehindStorage> writeBehind;
+      if (config.WriteBehindCommits > 0)
+        {
+          writeBehind = std::make_unique<WriteBehindStorage> (
+              baseStorage, config.WriteBehindCommits);
+          game->SetStorage (*writeBehind);
+        }
+      else
+        game->SetStorage (baseStorage);
 
       game->SetGameLogic (rules);
 
       if (config.PendingMoves != nullptr)
-        game->SetPendingMoveProcessor (*config.PendingMoves);
+        {
+          config.PendingMoves->SetMemoryLimits (config.PendingMoveMaxCount,
+                                                config.PendingMoveMaxBytes,
+                                                config.PendingMoveEviction);
+          config.PendingMoves->SetFullSyncInterval (
+              std::chrono::milliseconds (config.PendingMoveFullSyncMs));
+          game->SetPendingMoveProcessor (*config.PendingMoves);
+        }
+      game->SetPendingMoveBatching (
+          std::chrono::milliseconds (config.PendingMoveWindowMs),
+          config.PendingMoveMaxBatch);
+      if (config.AsyncPendingMoves && config.PendingMoves != nullptr)
+        game->EnableAsyncPendingMoves ();
 
       if (config.EnablePruning >= 0)
         game->EnablePruning (config.EnablePruning);
+      game->SetStateCacheSize (config.StateCacheSize);
 
       auto components = instanceFact->BuildGameComponents (*game);
 
@@ -262,30 +400,51 @@ SQLiteMain (const GameDaemonConfiguration& config, const std::string& gameId,
 
       CHECK (!config.XayaRpcUrl.empty ()) << "XayaRpcUrl must be configured";
       const std::string jsonRpcUrl(config.XayaRpcUrl);
-      jsonrpc::HttpClient httpConnector(jsonRpcUrl);
+      auto xayaConnector
+          = RpcConnectorPool::ForHttp (jsonRpcUrl, config.XayaRpcConnections);
 
       if (config.XayaRpcWait)
-        WaitForXaya (httpConnector);
+        WaitForXaya (*xayaConnector);
 
       auto game = std::make_unique<Game> (gameId);
-      game->ConnectRpcClient (httpConnector);
+      game->ConnectRpcClient (*xayaConnector);
       VerifyXayaVersion (config, game->GetXayaVersion ());
       CHECK (game->DetectZmqEndpoint ());
 
+      CHECK_EQ (config.WriteBehindCommits, 0)
+          << "Write-behind commits are not supported for SQLiteGame";
+      CHECK (!config.UseUndoLog)
+          << "The undo log is not supported for SQLiteGame";
+
       const fs::path gameDir = GetGameDirectory (config, gameId,
                                                  game->GetChain ());
       const fs::path dbFile = gameDir / fs::path ("storage.sqlite");
 
       rules.Initialise (dbFile.string ());
+      rules.SetTuning (config.SQLiteCatchingUp, config.SQLiteUpToDate);
+      rules.SetSnapshotPoolSize (config.SQLiteSnapshotPoolSize);
       game->SetStorage (rules.GetStorage ());
 
       game->SetGameLogic (rules);
 
       if (config.PendingMoves != nullptr)
-        game->SetPendingMoveProcessor (*config.PendingMoves);
+        {
+          config.PendingMoves->SetMemoryLimits (config.PendingMoveMaxCount,
+                                                config.PendingMoveMaxBytes,
+                                                config.PendingMoveEviction);
+          config.PendingMoves->SetFullSyncInterval (
+              std::chrono::milliseconds (config.PendingMoveFullSyncMs));
+          game->SetPendingMoveProcessor (*config.PendingMoves);
+        }
+      game->SetPendingMoveBatching (
+          std::chrono::milliseconds (config.PendingMoveWindowMs),
+          config.PendingMoveMaxBatch);
+      if (config.AsyncPendingMoves && config.PendingMoves != nullptr)
+        game->EnableAsyncPendingMoves ();
 
       if (config.EnablePruning >= 0)
         game->EnablePruning (config.EnablePruning);
+      game->SetStateCacheSize (config.StateCacheSize);
 
       auto components = instanceFact->BuildGameComponents (*game);
 
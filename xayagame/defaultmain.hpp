@@ -9,12 +9,14 @@
 #include "gamelogic.hpp"
 #include "pendingmoves.hpp"
 #include "sqlitegame.hpp"
+#include "sqlitestorage.hpp"
 #include "storage.hpp"
 
 #include <jsonrpccpp/server/connectors/httpserver.h>
 
 #include <json/json.h>
 
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <vector>
@@ -32,6 +34,10 @@ enum class RpcServerType
   NONE = 0,
   /** Start a JSON-RPC server listening through HTTP.  */
   HTTP = 1,
+  /** Start a newline-delimited JSON-RPC server on a UNIX socket.  */
+  UNIX = 2,
+  /** Start a newline-delimited JSON-RPC server on a raw TCP port.  */
+  TCP = 3,
 };
 
 /**
@@ -187,6 +193,14 @@ struct GameDaemonConfiguration
    */
   bool XayaRpcWait = false;
 
+  /**
+   * Maximum number of connections to Xaya Core's JSON-RPC interface.  They
+   * are kept open and shared between the block-processing thread and
+   * e.g. RPC handlers of the game (see RpcConnectorPool), so that calls
+   * from different threads do not have to wait for each other.
+   */
+  unsigned XayaRpcConnections = 4;
+
   /**
    * The type of JSON-RPC server that should be started for the game
    * (if any).
@@ -206,6 +220,49 @@ struct GameDaemonConfiguration
    */
   bool GameRpcListenLocally = true;
 
+  /**
+   * The path of the UNIX socket on which the game daemon's JSON-RPC server
+   * should listen.  This must be set if GameRpcServer is set to UNIX.
+   */
+  std::string GameRpcSocket;
+
+  /**
+   * If non-zero and the HTTP server type is used, responses of at least
+   * that many bytes are compressed with gzip or deflate for clients that
+   * accept it (see CompressingHttpServer).  Zero (the default) disables
+   * compression.
+   */
+  size_t GameRpcCompressMinSize = 0;
+
+  /**
+   * If non-zero, the number of threads processing requests of the game
+   * daemon's JSON-RPC server.  Zero (the default) keeps the default of
+   * the connector.  Waiting calls that are handled asynchronously (like
+   * waitforchange on the socket servers or with the HTTP server used for
+   * compression) do not occupy a thread, but all other methods do while
+   * they run.  Thus long-blocking methods need enough threads so that they
+   * do not stall other clients.  This is not supported for the plain HTTP
+   * server; setting it selects the same server as for compression.
+   */
+  unsigned GameRpcWorkerThreads = 0;
+
+  /**
+   * If non-zero, the maximum number of simultaneous connections to the
+   * game daemon's JSON-RPC server.  Zero (the default) keeps the default
+   * of the connector.  Clients waiting in an asynchronous call keep their
+   * connection, so this also bounds the number of waiting clients.  Like
+   * GameRpcWorkerThreads, this selects the compressing HTTP server.
+   */
+  unsigned GameRpcMaxConnections = 0;
+
+  /**
+   * If set to true, message signatures are verified in-process once that
+   * has been checked against Xaya Core (see SetLocalMessageVerification).
+   * This is disabled by default, since the local implementation has not
+   * yet been tested against fixtures recorded from Xaya Core.
+   */
+  bool LocalSignatureVerification = false;
+
   /**
    * If non-negative (including zero), pruning of old undo data is enabled.
    * The specified value determines how many of the latest blocks are
@@ -213,12 +270,61 @@ struct GameDaemonConfiguration
    */
   int EnablePruning = -1;
 
+  /**
+   * Number of block hashes for which the getcurrentstate result is cached
+   * (see Game::SetStateCacheSize).  Zero disables the cache.
+   */
+  unsigned StateCacheSize = 1;
+
   /**
    * The storage type to be used.  Can be "memory" (default), "lmdb"
    * or "sqlite".
    */
   std::string StorageType = "memory";
 
+  /**
+   * If non-zero and memory storage is used, then at most that many bytes
+   * of undo data are kept in memory.  Undo data of older blocks is spilled
+   * to a temporary directory on disk (inside the game's data directory if
+   * DataDirectory is set, and in the system's temporary directory otherwise).
+   */
+  uint64_t MemoryUndoBudget = 0;
+
+  /**
+   * If true, undo data is not kept in the storage itself but in an
+   * append-only log of files (see StorageWithUndoLog) in the game's
+   * data directory.  This is not supported for memory storage (which can
+   * use MemoryUndoBudget instead) and for SQLiteMain.
+   */
+  bool UseUndoLog = false;
+
+  /**
+   * If non-zero, then commits to the storage are done asynchronously by
+   * a dedicated I/O thread (see WriteBehindStorage), with at most that many
+   * committed transactions waiting to be written.  This is not supported
+   * for SQLiteMain.
+   */
+  unsigned WriteBehindCommits = 0;
+
+  /**
+   * SQLite tuning settings to use while the game is catching up, if the
+   * storage is based on SQLite (i.e. for "sqlite" storage and for
+   * SQLiteMain).
+   */
+  SQLiteTuning SQLiteCatchingUp = SQLiteTuning::ForCatchingUp ();
+
+  /**
+   * SQLite tuning settings to use while the game is up-to-date and mainly
+   * serving requests.
+   */
+  SQLiteTuning SQLiteUpToDate;
+
+  /**
+   * Number of idle read-only SQLite connections that are kept for reuse
+   * by snapshots (used e.g. for RPC calls that query the game state).
+   */
+  unsigned SQLiteSnapshotPoolSize = 4;
+
   /**
    * The base data directory for persistent storage.  Must be set unless memory
    * storage is selected.  The game ID is added as an additional directory part
@@ -233,6 +339,52 @@ struct GameDaemonConfiguration
    */
   PendingMoveProcessor* PendingMoves = nullptr;
 
+  /**
+   * If non-zero, pending moves are coalesced into batches for up to that
+   * many milliseconds before they are processed and clients notified
+   * (see Game::SetPendingMoveBatching).
+   */
+  unsigned PendingMoveWindowMs = 0;
+
+  /**
+   * Maximum number of pending moves in a coalesced batch.  Zero means
+   * that batches are only limited by PendingMoveWindowMs.
+   */
+  unsigned PendingMoveMaxBatch = 0;
+
+  /**
+   * If true, pending moves are processed on a separate worker thread
+   * that does not block the processing of blocks
+   * (see Game::EnableAsyncPendingMoves).
+   */
+  bool AsyncPendingMoves = false;
+
+  /**
+   * Maximum number of pending moves kept in memory, zero for no limit
+   * (see PendingMoveProcessor::SetMemoryLimits).
+   */
+  size_t PendingMoveMaxCount = 0;
+
+  /**
+   * Maximum approximate size in bytes of the pending moves kept in memory,
+   * zero for no limit.
+   */
+  size_t PendingMoveMaxBytes = 0;
+
+  /**
+   * The policy for evicting pending moves if one of the limits
+   * is exceeded.
+   */
+  PendingMoveProcessor::EvictionPolicy PendingMoveEviction
+      = PendingMoveProcessor::EvictionPolicy::OLDEST_FIRST;
+
+  /**
+   * Minimum time in milliseconds between full syncs of the pending moves
+   * with the mempool, or zero to do a full sync for every attached block
+   * (see PendingMoveProcessor::SetFullSyncInterval).
+   */
+  unsigned PendingMoveFullSyncMs = 0;
+
   /**
    * Factory class for customed instances of certain optional classes
    * like the RPC server.  If not set, default classes are used instead.
@@ -4,12 +4,17 @@
 
 #include "game.hpp"
 
+#include "signatures.hpp"
+
 #include <jsonrpccpp/common/errors.h>
 #include <jsonrpccpp/common/exception.h>
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <chrono>
+#include <map>
+#include <set>
 #include <sstream>
 #include <thread>
 
@@ -34,15 +39,40 @@ constexpr const char* CALLBACK_DURATION_UNIT = "us";
  */
 constexpr auto WAITFORCHANGE_TIMEOUT = std::chrono::seconds (5);
 
+/**
+ * Maximum number of detached blocks that are queued while catching up
+ * before they are undone (with merged undo data if possible).
+ */
+constexpr size_t MAX_QUEUED_DETACHES = 100;
+
+/**
+ * Maximum number of computed pending states that are kept, so that deltas
+ * to them can be returned from WaitForPendingDelta.
+ */
+constexpr size_t PENDING_HISTORY_SIZE = 16;
+
+/**
+ * Maximum total size (of the serialised JSON) of the pending states kept
+ * for WaitForPendingDelta.  Older states are dropped once this is exceeded,
+ * although the current state is always kept.
+ */
+constexpr size_t PENDING_HISTORY_BYTES = 16 << 20;
+
 } // anonymous namespace
 
 Game::Game (const std::string& id)
-  : gameId(id)
+  : gameId(id), confirmedGeneration(0),
+    stateWaiters(WAITFORCHANGE_TIMEOUT), pendingWaiters(WAITFORCHANGE_TIMEOUT)
 {
   genesisHash.SetNull ();
   zmq.AddListener (gameId, this);
 }
 
+Game::~Game ()
+{
+  StopPendingFlusher ();
+}
+
 jsonrpc::clientVersion_t Game::rpcClientVersion = jsonrpc::JSONRPC_CLIENT_V1;
 
 std::string
@@ -168,6 +198,125 @@ Game::UpdateStateForDetach (const uint256& parent, const uint256& hash,
   return true;
 }
 
+bool
+Game::QueueDetach (const uint256& parent, const uint256& hash,
+                   const Json::Value& blockData)
+{
+  uint256 expectedHash;
+  if (queuedDetaches.empty ())
+    CHECK (storage->GetCurrentBlockHash (expectedHash));
+  else
+    CHECK (expectedHash.FromHex (
+        queuedDetaches.back ()["block"]["parent"].asString ()));
+
+  if (expectedHash != hash)
+    {
+      LOG (WARNING)
+          << "Expected state hash " << expectedHash.ToHex ()
+          << " does not match detached block's hash " << hash.ToHex ();
+      return false;
+    }
+
+  VLOG (1)
+      << "Queueing detach of " << hash.ToHex ()
+      << " (parent " << parent.ToHex () << ")";
+  queuedDetaches.push_back (blockData);
+
+  return true;
+}
+
+bool
+Game::FlushDetaches ()
+{
+  std::vector<Json::Value> blocks;
+  blocks.swap (queuedDetaches);
+
+  if (blocks.size () > 1)
+    {
+      /* Undo data is merged in the order in which the blocks were attached,
+         which is the reverse of the order they were detached in.  */
+      std::vector<UndoData> undos;
+      for (auto it = blocks.rbegin (); it != blocks.rend (); ++it)
+        {
+          uint256 hash;
+          CHECK (hash.FromHex ((*it)["block"]["hash"].asString ()));
+
+          UndoData undo;
+          if (!storage->GetUndoData (hash, undo))
+            {
+              LOG (ERROR)
+                  << "Failed to retrieve undo data for block " << hash.ToHex ()
+                  << ".  Need to resync from scratch.";
+              transactionManager.TryAbortTransaction ();
+              storage->Clear ();
+              return false;
+            }
+          undos.push_back (std::move (undo));
+        }
+
+      UndoData merged;
+      if (rules->MergeUndoData (undos, merged))
+        {
+          /* The merged undo data is applied together with the block data of
+             the oldest detached block, whose parent is the resulting state.  */
+          const Json::Value& oldest = blocks.back ();
+          uint256 parent;
+          CHECK (parent.FromHex (oldest["block"]["parent"].asString ()));
+          const unsigned height = oldest["block"]["height"].asUInt ();
+          CHECK_GT (height, 0);
+
+          const GameStateData newState = storage->GetCurrentGameState ();
+
+          {
+            internal::ActiveTransaction tx(transactionManager);
+
+            const auto start = PerformanceTimer::now ();
+            const GameStateData oldState
+                = rules->ProcessBackwards (newState, oldest, merged);
+            const auto end = PerformanceTimer::now ();
+
+            LOG (INFO)
+                << "Undoing " << blocks.size () << " blocks down to height "
+                << height << " took "
+                << std::chrono::duration_cast<CallbackDuration> (
+                      end - start).count ()
+                << " " << CALLBACK_DURATION_UNIT;
+
+            storage->SetCurrentGameStateWithHeight (parent, height - 1,
+                                                    oldState);
+            for (const auto& b : blocks)
+              {
+                uint256 hash;
+                CHECK (hash.FromHex (b["block"]["hash"].asString ()));
+                storage->ReleaseUndoData (hash);
+              }
+
+            tx.Commit ();
+          }
+
+          LOG (INFO)
+              << "Detached " << blocks.size ()
+              << " blocks, restored state for block " << parent.ToHex ();
+          NotifyStateChange ();
+
+          return true;
+        }
+    }
+
+  for (const auto& b : blocks)
+    {
+      uint256 parent;
+      CHECK (parent.FromHex (b["block"]["parent"].asString ()));
+      uint256 hash;
+      CHECK (hash.FromHex (b["block"]["hash"].asString ()));
+
+      if (!UpdateStateForDetach (parent, hash, b))
+        return false;
+    }
+
+  return true;
+}
+
 bool
 Game::IsReqtokenRelevant (const Json::Value& data) const
 {
@@ -196,6 +345,16 @@ Game::BlockAttach (const std::string& id, const Json::Value& data,
 
   std::lock_guard<std::mutex> lock(mut);
 
+  /* Pending moves received before the block need to be known to the
+     PendingMoveProcessor before it syncs its state for the block.  In the
+     asynchronous mode, we must not process them while holding mut.  The
+     worker thread will instead process them later against the new
+     confirmed state, and we just drop those confirmed by the block.  */
+  if (asyncPendingMoves)
+    DropQueuedMovesInBlock (data);
+  else
+    ProcessQueuedPendingMoves ();
+
   /* If we missed notifications, always reinitialise the state to make sure
      that all is again consistent.  */
   if (seqMismatch)
@@ -230,7 +389,9 @@ Game::BlockAttach (const std::string& id, const Json::Value& data,
           break;
 
         case State::CATCHING_UP:
-          if (!UpdateStateForAttach (parent, hash, data))
+          /* Blocks detached before (e.g. for a reorg) need to be undone
+             before we can attach the new ones on top.  */
+          if (!FlushDetaches () || !UpdateStateForAttach (parent, hash, data))
             needReinit = true;
 
           /* If we are now at the last catching-up's target block hash,
@@ -269,6 +430,7 @@ Game::BlockAttach (const std::string& id, const Json::Value& data,
 
   if (state == State::UP_TO_DATE && pending != nullptr)
     {
+      std::lock_guard<std::mutex> lockPending(mutPendingProcessor);
       pending->ProcessAttachedBlock (storage->GetCurrentGameState (), data);
       NotifyPendingStateChange ();
     }
@@ -289,6 +451,11 @@ Game::BlockDetach (const std::string& id, const Json::Value& data,
 
   std::lock_guard<std::mutex> lock(mut);
 
+  /* In the asynchronous mode, queued moves are left to the worker thread,
+     which processes them on top of the new confirmed state.  */
+  if (!asyncPendingMoves)
+    ProcessQueuedPendingMoves ();
+
   /* If we missed notifications, always reinitialise the state to make sure
      that all is again consistent.  */
   if (seqMismatch)
@@ -318,7 +485,7 @@ Game::BlockDetach (const std::string& id, const Json::Value& data,
           break;
 
         case State::CATCHING_UP:
-          if (!UpdateStateForDetach (parent, hash, data))
+          if (!QueueDetach (parent, hash, data))
             needReinit = true;
 
           /* We may reach a catching-up target also when detaching blocks.  This
@@ -330,6 +497,12 @@ Game::BlockDetach (const std::string& id, const Json::Value& data,
           if (parent == targetBlockHash)
             needReinit = true;
 
+          /* Undo the queued blocks if we are done detaching for now, or if
+             the queue has grown large enough.  */
+          if ((needReinit || queuedDetaches.size () >= MAX_QUEUED_DETACHES)
+                && !FlushDetaches ())
+            needReinit = true;
+
           break;
 
         case State::UP_TO_DATE:
@@ -365,6 +538,7 @@ Game::BlockDetach (const std::string& id, const Json::Value& data,
       const unsigned height = data["block"]["height"].asUInt ();
       CHECK_GT (height, 0);
 
+      std::lock_guard<std::mutex> lockPending(mutPendingProcessor);
       pending->ProcessDetachedBlock (storage->GetCurrentGameState (), data);
       NotifyPendingStateChange ();
     }
@@ -381,17 +555,189 @@ Game::PendingMove (const std::string& id, const Json::Value& data)
   VLOG (1) << "Processing pending move " << txid.ToHex ();
 
   std::lock_guard<std::mutex> lock(mut);
+  if (state != State::UP_TO_DATE)
+    {
+      VLOG (1) << "Ignoring pending move while not up-to-date: " << data;
+      return;
+    }
+
+  CHECK (pending != nullptr);
+  queuedPendingMoves.push_back (data);
+
+  const bool batchFull
+      = pendingWindow == std::chrono::milliseconds::zero ()
+          || (pendingMaxBatch > 0
+                && queuedPendingMoves.size () >= pendingMaxBatch);
+
+  if (asyncPendingMoves)
+    {
+      /* In the asynchronous mode, the worker thread does all processing.
+         We just need to make sure it wakes up at the right time.  */
+      const auto now = std::chrono::steady_clock::now ();
+      if (queuedPendingMoves.size () == 1)
+        pendingDeadline = now + pendingWindow;
+      if (batchFull)
+        pendingDeadline = now;
+      cvPendingQueued.notify_all ();
+      return;
+    }
+
+  if (batchFull)
+    {
+      ProcessQueuedPendingMoves ();
+      return;
+    }
+
+  if (queuedPendingMoves.size () == 1)
+    {
+      pendingDeadline = std::chrono::steady_clock::now () + pendingWindow;
+      cvPendingQueued.notify_all ();
+    }
+}
+
+void
+Game::ProcessQueuedPendingMoves ()
+{
+  if (queuedPendingMoves.empty ())
+    return;
+
   if (state == State::UP_TO_DATE)
     {
+      VLOG (1)
+          << "Processing batch of " << queuedPendingMoves.size ()
+          << " pending moves";
+
       uint256 hash;
       CHECK (storage->GetCurrentBlockHash (hash));
 
       CHECK (pending != nullptr);
-      pending->ProcessMove (storage->GetCurrentGameState (), data);
+      const GameStateData confirmed = storage->GetCurrentGameState ();
+      {
+        std::lock_guard<std::mutex> lockPending(mutPendingProcessor);
+        for (const auto& mv : queuedPendingMoves)
+          pending->ProcessMove (confirmed, mv);
+      }
       NotifyPendingStateChange ();
     }
   else
-    VLOG (1) << "Ignoring pending move while not up-to-date: " << data;
+    VLOG (1)
+        << "Dropping " << queuedPendingMoves.size ()
+        << " queued pending moves while not up-to-date";
+
+  queuedPendingMoves.clear ();
+}
+
+void
+Game::DropQueuedMovesInBlock (const Json::Value& blockData)
+{
+  if (queuedPendingMoves.empty ())
+    return;
+
+  std::set<std::string> confirmed;
+  for (const auto& mv : blockData["moves"])
+    confirmed.insert (mv["txid"].asString ());
+
+  const auto mit = std::remove_if (
+      queuedPendingMoves.begin (), queuedPendingMoves.end (),
+      [&confirmed] (const Json::Value& mv)
+        {
+          return confirmed.count (mv["txid"].asString ()) > 0;
+        });
+
+  const size_t num = queuedPendingMoves.end () - mit;
+  if (num > 0)
+    VLOG (1) << "Dropping " << num << " queued pending moves confirmed in block";
+  queuedPendingMoves.erase (mit, queuedPendingMoves.end ());
+}
+
+void
+Game::ProcessQueuedPendingMovesUnlocked (std::unique_lock<std::mutex>& lock)
+{
+  if (queuedPendingMoves.empty ())
+    return;
+
+  if (state != State::UP_TO_DATE)
+    {
+      VLOG (1)
+          << "Dropping " << queuedPendingMoves.size ()
+          << " queued pending moves while not up-to-date";
+      queuedPendingMoves.clear ();
+      return;
+    }
+
+  CHECK (pending != nullptr);
+  std::vector<Json::Value> moves;
+  moves.swap (queuedPendingMoves);
+  const GameStateData confirmed = storage->GetCurrentGameState ();
+  const unsigned generation = confirmedGeneration;
+
+  VLOG (1)
+      << "Processing batch of " << moves.size ()
+      << " pending moves asynchronously";
+
+  lock.unlock ();
+  bool processed = false;
+  {
+    std::lock_guard<std::mutex> lockPending(mutPendingProcessor);
+
+    /* If the confirmed state changed in the mean time, then the
+       PendingMoveProcessor may already have been reset for the new state.
+       In that case we must not feed it the old state, and will instead
+       retry the moves with the new one.  */
+    if (generation == confirmedGeneration)
+      {
+        for (const auto& mv : moves)
+          pending->ProcessMove (confirmed, mv, true);
+        processed = true;
+      }
+  }
+  lock.lock ();
+
+  if (!processed)
+    {
+      VLOG (1) << "Confirmed state changed, retrying pending moves";
+      queuedPendingMoves.insert (queuedPendingMoves.begin (),
+                                 moves.begin (), moves.end ());
+      return;
+    }
+
+  NotifyPendingStateChange ();
+}
+
+void
+Game::RunPendingFlusher ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  while (!stopPendingFlusher)
+    {
+      if (queuedPendingMoves.empty ())
+        cvPendingQueued.wait (lock);
+      else if (std::chrono::steady_clock::now () >= pendingDeadline)
+        {
+          if (asyncPendingMoves)
+            ProcessQueuedPendingMovesUnlocked (lock);
+          else
+            ProcessQueuedPendingMoves ();
+        }
+      else
+        cvPendingQueued.wait_until (lock, pendingDeadline);
+    }
+}
+
+void
+Game::StopPendingFlusher ()
+{
+  if (pendingFlusher == nullptr)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    stopPendingFlusher = true;
+    cvPendingQueued.notify_all ();
+  }
+
+  pendingFlusher->join ();
+  pendingFlusher.reset ();
 }
 
 void
@@ -507,6 +853,51 @@ Game::SetPendingMoveProcessor (PendingMoveProcessor& p)
     pending->InitialiseGameContext (chain, gameId, rpcClient.get ());
 }
 
+void
+Game::SetPendingMoveBatching (const std::chrono::milliseconds window,
+                              const unsigned maxMoves)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (!mainLoop.IsRunning ());
+  CHECK (pendingFlusher == nullptr);
+
+  pendingWindow = window;
+  pendingMaxBatch = maxMoves;
+}
+
+void
+Game::EnableAsyncPendingMoves ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (!mainLoop.IsRunning ());
+  CHECK (pendingFlusher == nullptr);
+  CHECK (pending != nullptr)
+      << "The PendingMoveProcessor must be set before enabling async mode";
+
+  if (!pending->SupportsConcurrentProcessing ())
+    {
+      LOG (WARNING)
+          << "The PendingMoveProcessor does not support concurrent processing,"
+             " processing pending moves synchronously";
+      return;
+    }
+
+  LOG (INFO) << "Processing pending moves on a separate worker thread";
+  asyncPendingMoves = true;
+}
+
+void
+Game::SetStateCacheSize (const unsigned size)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (!mainLoop.IsRunning ());
+
+  std::lock_guard<std::mutex> lockCache(mutStateCache);
+  stateCacheSize = size;
+  stateCache.reset ();
+  stateHistory.clear ();
+}
+
 void
 Game::EnablePruning (const unsigned nBlocks)
 {
@@ -624,40 +1015,525 @@ Game::GetCustomStateData (
     });
 }
 
+/**
+ * The result of GetCurrentJsonState for some state, together with its lazily
+ * computed serialisation.
+ */
+class Game::CachedCurrentState
+{
+
+private:
+
+  /** Flag for computing the serialised string exactly once.  */
+  mutable std::once_flag serialisedFlag;
+
+  /** The serialised JSON string (once computed).  */
+  mutable std::string serialised;
+
+public:
+
+  /** The JSON value.  */
+  const Json::Value json;
+
+  /** Whether or not there is a current block (and game state).  */
+  const bool hasBlock;
+
+  /** The block hash of the state, if there is one.  */
+  const uint256 hash;
+
+  explicit CachedCurrentState (Json::Value&& j, const bool b, const uint256& h)
+    : json(std::move (j)), hasBlock(b), hash(h)
+  {}
+
+  CachedCurrentState () = delete;
+  CachedCurrentState (const CachedCurrentState&) = delete;
+  void operator= (const CachedCurrentState&) = delete;
+
+  /**
+   * Returns the JSON value serialised as compact string.
+   */
+  const std::string&
+  GetSerialised () const
+  {
+    std::call_once (serialisedFlag, [this] ()
+      {
+        serialised = CompactJson (json);
+      });
+
+    return serialised;
+  }
+
+};
+
+void
+Game::InvalidateStateCache () const
+{
+  std::lock_guard<std::mutex> lock(mutStateCache);
+  stateCache.reset ();
+}
+
+std::shared_ptr<const Game::CachedCurrentState>
+Game::GetCachedCurrentState () const
+{
+  {
+    std::lock_guard<std::mutex> lockCache(mutStateCache);
+    CHECK_GT (stateCacheSize, 0);
+    if (stateCache != nullptr)
+      return stateCache;
+  }
+
+  /* As with the pending state, we compute the JSON while holding mut, so
+     that it is consistent with the current state.  This is also required
+     by GameStateToJson, e.g. for SQLiteGame.  */
+  std::lock_guard<std::mutex> lock(mut);
+  return UnlockedCachedCurrentState ();
+}
+
+std::shared_ptr<const Game::CachedCurrentState>
+Game::UnlockedCachedCurrentState () const
+{
+  {
+    std::lock_guard<std::mutex> lockCache(mutStateCache);
+    if (stateCache != nullptr)
+      return stateCache;
+  }
+
+  bool hasBlock;
+  uint256 hash;
+  Json::Value res = UnlockedCurrentJsonState (hasBlock, hash);
+
+  std::lock_guard<std::mutex> lockCache(mutStateCache);
+  stateCache = std::make_shared<const CachedCurrentState> (std::move (res),
+                                                           hasBlock, hash);
+
+  /* Keep at most one entry per block hash (the newest one).  */
+  for (auto it = stateHistory.begin (); it != stateHistory.end (); )
+    if ((*it)->hasBlock == hasBlock && (*it)->hash == hash)
+      it = stateHistory.erase (it);
+    else
+      ++it;
+  stateHistory.push_back (stateCache);
+  while (stateHistory.size () > stateCacheSize)
+    stateHistory.pop_front ();
+
+  return stateCache;
+}
+
 Json::Value
-Game::GetCurrentJsonState () const
+Game::UnlockedCurrentJsonState (bool& hasBlock, uint256& hash) const
 {
-  return GetCustomStateData ("gamestate",
-      [this] (const GameStateData& state,
-              const uint256& hash, const unsigned height,
-              std::unique_lock<std::mutex> lock)
+  Json::Value res(Json::objectValue);
+  res["gameid"] = gameId;
+  res["chain"] = ChainToString (chain);
+  res["state"] = StateToString (state);
+
+  unsigned height;
+  hasBlock = storage->GetCurrentBlockHashWithHeight (hash, height);
+  if (hasBlock)
+    {
+      res["blockhash"] = hash.ToHex ();
+      res["height"] = height;
+
+      std::shared_ptr<const CachedCurrentState> reuse;
+      {
+        std::lock_guard<std::mutex> lockCache(mutStateCache);
+        for (const auto& entry : stateHistory)
+          if (entry->hasBlock && entry->hash == hash)
+            reuse = entry;
+      }
+
+      if (reuse != nullptr)
         {
-          /* We keep the lock for the callback here, since e.g. SQLiteGame
-             requires the state to be locked during GameStateToJson.  This
-             method is not meant for performance critical tasks anyway, in
-             which case specific data should be extracted using
-             GetCustomStateData instead.  */
-          return rules->GameStateToJson (state);
-        });
+          VLOG (1) << "Reusing cached game state for block " << hash.ToHex ();
+          res["gamestate"] = reuse->json["gamestate"];
+        }
+      else
+        {
+          VLOG (1) << "Computing game-state JSON for block " << hash.ToHex ();
+          res["gamestate"]
+              = rules->GameStateToJson (storage->GetCurrentGameState ());
+        }
+    }
+  else
+    hash.SetNull ();
+
+  return res;
+}
+
+bool
+Game::IsStateCacheEnabled () const
+{
+  std::lock_guard<std::mutex> lockCache(mutStateCache);
+  return stateCacheSize > 0;
+}
+
+Json::Value
+Game::GetCurrentJsonState () const
+{
+  if (!IsStateCacheEnabled ())
+    return UncachedCurrentJsonState ();
+
+  return GetCachedCurrentState ()->json;
+}
+
+std::string
+Game::GetCurrentJsonString () const
+{
+  if (!IsStateCacheEnabled ())
+    return CompactJson (UncachedCurrentJsonState ());
+
+  return GetCachedCurrentState ()->GetSerialised ();
+}
+
+void
+Game::WriteCurrentJsonState (std::ostream& out) const
+{
+  const bool useCache = IsStateCacheEnabled ();
+
+  /* If caching is enabled, we fill the cache on a miss, so that further
+     calls (e.g. from many clients polling getcurrentstate) just write out
+     the cached string.  */
+  if (useCache)
+    {
+      out << GetCachedCurrentState ()->GetSerialised ();
+      return;
+    }
+
+  /* As with GetCachedCurrentState, we need to hold mut while producing
+     the game-state JSON.  The keys are written in sorted order, so that
+     the output matches the serialisation of GetCurrentJsonState.  */
+  std::lock_guard<std::mutex> lock(mut);
+
+  uint256 hash;
+  unsigned height;
+  const bool hasBlock = storage->GetCurrentBlockHashWithHeight (hash, height);
+
+  JsonStreamWriter w(out);
+  w.BeginObject ();
+  if (hasBlock)
+    {
+      w.Key ("blockhash");
+      w.String (hash.ToHex ());
+    }
+  w.Key ("chain");
+  w.String (ChainToString (chain));
+  w.Key ("gameid");
+  w.String (gameId);
+  if (hasBlock)
+    {
+      VLOG (1) << "Streaming game-state JSON for block " << hash.ToHex ();
+      w.Key ("gamestate");
+      rules->WriteGameStateJson (storage->GetCurrentGameState (), w);
+      w.Key ("height");
+      w.UInt (height);
+    }
+  w.Key ("state");
+  w.String (StateToString (state));
+  w.EndObject ();
+}
+
+Json::Value
+Game::UncachedCurrentJsonState () const
+{
+  /* We keep the lock while converting the state to JSON, since e.g.
+     SQLiteGame requires the state to be locked during GameStateToJson.  */
+  std::lock_guard<std::mutex> lock(mut);
+
+  bool hasBlock;
+  uint256 hash;
+  return UnlockedCurrentJsonState (hasBlock, hash);
 }
 
 Json::Value
 Game::GetNullJsonState () const
 {
-  Json::Value res = GetCustomStateData ("data",
-      [] (const GameStateData& state)
-        {
-          return Json::Value ();
-        });
-  res.removeMember ("data");
+  std::lock_guard<std::mutex> lock(mut);
+  return UnlockedNullJsonState ();
+}
+
+Json::Value
+Game::UnlockedNullJsonState () const
+{
+  Json::Value res(Json::objectValue);
+  res["gameid"] = gameId;
+  res["chain"] = ChainToString (chain);
+  res["state"] = StateToString (state);
+
+  uint256 hash;
+  unsigned height;
+  if (storage->GetCurrentBlockHashWithHeight (hash, height))
+    {
+      res["blockhash"] = hash.ToHex ();
+      res["height"] = height;
+    }
+
+  StorageInterface::UndoStats stats;
+  if (storage->GetUndoStats (stats))
+    {
+      Json::Value memory(Json::objectValue);
+      memory["entries"] = static_cast<Json::UInt64> (stats.memoryEntries);
+      memory["bytes"] = static_cast<Json::UInt64> (stats.memoryBytes);
+
+      Json::Value disk(Json::objectValue);
+      disk["entries"] = static_cast<Json::UInt64> (stats.diskEntries);
+      disk["bytes"] = static_cast<Json::UInt64> (stats.diskBytes);
+
+      Json::Value undo(Json::objectValue);
+      undo["memory"] = memory;
+      undo["disk"] = disk;
+      res["undo"] = undo;
+    }
+
+  if (pending != nullptr)
+    {
+      std::lock_guard<std::mutex> lockPending(mutPendingProcessor);
+      const auto pendingStats = pending->GetMemoryStats ();
+
+      Json::Value memory(Json::objectValue);
+      memory["moves"] = static_cast<Json::UInt64> (pendingStats.moves);
+      memory["bytes"] = static_cast<Json::UInt64> (pendingStats.bytes);
+      memory["evicted"] = static_cast<Json::UInt64> (pendingStats.evicted);
+      res["pending"] = memory;
+    }
+
+  const auto sigStats = GetSignatureCacheStats ();
+  if (sigStats.hits + sigStats.misses > 0)
+    {
+      Json::Value signatures(Json::objectValue);
+      signatures["entries"] = static_cast<Json::UInt64> (sigStats.entries);
+      signatures["hits"] = static_cast<Json::UInt64> (sigStats.hits);
+      signatures["misses"] = static_cast<Json::UInt64> (sigStats.misses);
+      res["signatures"] = signatures;
+    }
+
   return res;
 }
 
+/**
+ * The pending-state JSON for one version of the pending state, together
+ * with its lazily computed serialisation.
+ */
+class Game::CachedPendingState
+{
+
+private:
+
+  /** Flag for computing the serialised string exactly once.  */
+  mutable std::once_flag serialisedFlag;
+
+  /** The serialised JSON string (once computed).  */
+  mutable std::string serialised;
+
+  /** Lock for deltas.  */
+  mutable std::mutex mutDeltas;
+
+  /**
+   * Deltas of the "pending" data from older versions to this one that
+   * have been computed already.  If no delta can be computed for some
+   * version, the entry is null.
+   */
+  mutable std::map<int, Json::Value> deltas;
+
+public:
+
+  /** The JSON value.  */
+  const Json::Value json;
+
+  /** The pending version of this state.  */
+  const int version;
+
+  explicit CachedPendingState (Json::Value&& j)
+    : json(std::move (j)), version(json["version"].asInt ())
+  {}
+
+  CachedPendingState () = delete;
+  CachedPendingState (const CachedPendingState&) = delete;
+  void operator= (const CachedPendingState&) = delete;
+
+  /**
+   * Returns the JSON value serialised as compact string.
+   */
+  const std::string&
+  GetSerialised () const
+  {
+    std::call_once (serialisedFlag, [this] ()
+      {
+        serialised = CompactJson (json);
+      });
+
+    return serialised;
+  }
+
+  /**
+   * Computes (or looks up) the delta of the "pending" data from the given
+   * older state to this one.  Returns false if none can be computed.
+   */
+  bool
+  GetDelta (const CachedPendingState& old, const PendingMoveProcessor& proc,
+            Json::Value& delta) const
+  {
+    std::lock_guard<std::mutex> lock(mutDeltas);
+
+    auto mit = deltas.find (old.version);
+    if (mit == deltas.end ())
+      {
+        Json::Value d;
+        if (!proc.ToJsonDelta (old.json["pending"], json["pending"], d))
+          d = Json::Value ();
+        mit = deltas.emplace (old.version, std::move (d)).first;
+      }
+
+    if (mit->second.isNull ())
+      return false;
+
+    delta = mit->second;
+    return true;
+  }
+
+};
+
+void
+Game::InvalidatePendingCache () const
+{
+  std::lock_guard<std::mutex> lock(mutPendingCache);
+  pendingCache.reset ();
+}
+
+std::shared_ptr<const Game::CachedPendingState>
+Game::GetCachedPendingState () const
+{
+  {
+    std::lock_guard<std::mutex> lockCache(mutPendingCache);
+    if (pendingCache != nullptr)
+      return pendingCache;
+  }
+
+  /* The cache is only invalidated while mut is held.  Thus by computing
+     the JSON and storing it while we hold mut, we make sure that it is
+     consistent with the current state.  Other threads that miss the cache
+     in the mean time just wait for mut and then find our result.  */
+  std::lock_guard<std::mutex> lock(mut);
+  return UnlockedCachedPendingState ();
+}
+
+std::shared_ptr<const Game::CachedPendingState>
+Game::UnlockedCachedPendingState () const
+{
+  {
+    std::lock_guard<std::mutex> lockCache(mutPendingCache);
+    if (pendingCache != nullptr)
+      return pendingCache;
+  }
+
+  VLOG (1)
+      << "Computing pending state JSON for version " << pendingStateVersion;
+  auto computed = std::make_shared<const CachedPendingState> (
+      UnlockedPendingJsonState ());
+
+  /* The serialised size is what we use to bound the memory of the history.
+     It is computed before locking the cache (but still holding mut, so that
+     nobody else fills it in the mean time).  */
+  const size_t bytes = computed->GetSerialised ().size ();
+
+  std::lock_guard<std::mutex> lockCache(mutPendingCache);
+  CHECK (pendingCache == nullptr);
+  pendingCache = std::move (computed);
+
+  /* The cache may also be invalidated without a change to the version
+     (e.g. when a block is attached while catching up).  In that case,
+     the "pending" data is the same, and we just replace the entry.  */
+  if (!pendingHistory.empty ()
+        && pendingHistory.back ()->version == pendingCache->version)
+    {
+      pendingHistoryBytes -= pendingHistory.back ()->GetSerialised ().size ();
+      pendingHistory.pop_back ();
+    }
+  pendingHistory.push_back (pendingCache);
+  pendingHistoryBytes += bytes;
+
+  while (pendingHistory.size () > 1
+           && (pendingHistory.size () > PENDING_HISTORY_SIZE
+                || pendingHistoryBytes > PENDING_HISTORY_BYTES))
+    {
+      pendingHistoryBytes -= pendingHistory.front ()->GetSerialised ().size ();
+      pendingHistory.pop_front ();
+    }
+
+  return pendingCache;
+}
+
+void
+Game::GetJsonStates (Json::Value* current, Json::Value* nullState,
+                     Json::Value* pending) const
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  /* stateCacheSize is only changed while holding mut as well, so we can
+     read it without locking mutStateCache.  */
+  if (current != nullptr)
+    {
+      if (stateCacheSize > 0)
+        *current = UnlockedCachedCurrentState ()->json;
+      else
+        {
+          bool hasBlock;
+          uint256 hash;
+          *current = UnlockedCurrentJsonState (hasBlock, hash);
+        }
+    }
+
+  if (nullState != nullptr)
+    *nullState = UnlockedNullJsonState ();
+
+  if (pending != nullptr)
+    *pending = UnlockedCachedPendingState ()->json;
+}
+
 Json::Value
 Game::GetPendingJsonState () const
 {
-  std::unique_lock<std::mutex> lock(mut);
-  return UnlockedPendingJsonState ();
+  return GetCachedPendingState ()->json;
+}
+
+std::string
+Game::GetPendingJsonString () const
+{
+  return GetCachedPendingState ()->GetSerialised ();
+}
+
+Json::Value
+Game::GetPendingJsonDelta (const int oldVersion) const
+{
+  const auto cur = GetCachedPendingState ();
+
+  std::shared_ptr<const CachedPendingState> old;
+  {
+    std::lock_guard<std::mutex> lock(mutPendingCache);
+    for (const auto& entry : pendingHistory)
+      if (entry->version == oldVersion)
+        old = entry;
+  }
+
+  Json::Value res(Json::objectValue);
+  for (const auto& key : cur->json.getMemberNames ())
+    if (key != "pending")
+      res[key] = cur->json[key];
+
+  Json::Value delta;
+  if (old != nullptr && cur->GetDelta (*old, *pending, delta))
+    {
+      res["fromversion"] = oldVersion;
+      res["delta"] = std::move (delta);
+    }
+  else
+    {
+      VLOG (1)
+          << "No delta available from pending version " << oldVersion
+          << " to " << cur->version << ", returning full state";
+      res["pending"] = cur->json["pending"];
+    }
+
+  return res;
 }
 
 Json::Value
@@ -682,7 +1558,10 @@ Game::UnlockedPendingJsonState () const
       res["height"] = height;
     }
 
-  res["pending"] = pending->ToJson ();
+  {
+    std::lock_guard<std::mutex> lockPending(mutPendingProcessor);
+    res["pending"] = pending->ToJson ();
+  }
 
   return res;
 }
@@ -693,7 +1572,11 @@ Game::NotifyStateChange () const
   /* Callers are expected to already hold the mut lock here (as that is the
      typical case when they make changes to the state anyway).  */
   VLOG (1) << "Notifying waiting threads about state change...";
+  ++confirmedGeneration;
+  InvalidateStateCache ();
+  InvalidatePendingCache ();
   cvStateChanged.notify_all ();
+  stateWaiters.NotifyAll ();
 }
 
 void
@@ -703,10 +1586,12 @@ Game::NotifyPendingStateChange ()
      typical case when they make changes to the state anyway).  */
   CHECK_GT (pendingStateVersion, WAITFORCHANGE_ALWAYS_BLOCK);
   ++pendingStateVersion;
+  InvalidatePendingCache ();
   VLOG (1)
       << "Notifying waiting threads about change of pending state,"
       << " new version: " << pendingStateVersion;
   cvPendingStateChanged.notify_all ();
+  pendingWaiters.NotifyAll ();
 }
 
 void
@@ -738,8 +1623,8 @@ Game::WaitForChange (const uint256& oldBlock, uint256& newBlock) const
     newBlock.SetNull ();
 }
 
-Json::Value
-Game::WaitForPendingChange (const int oldVersion) const
+void
+Game::WaitForPendingVersion (const int oldVersion) const
 {
   std::unique_lock<std::mutex> lock(mut);
 
@@ -749,21 +1634,141 @@ Game::WaitForPendingChange (const int oldVersion) const
       VLOG (1)
           << "Known version differs from current one,"
              " returning immediately from WaitForPendingState";
-      return UnlockedPendingJsonState ();
     }
-
-  if (zmq.IsRunning () && zmq.IsPendingEnabled ())
+  else if (zmq.IsRunning () && zmq.IsPendingEnabled ())
     {
-      VLOG (1) << "Waiting for pending state change on condition variable...";
+      VLOG (1)
+          << "Waiting for pending state change on condition variable...";
       cvPendingStateChanged.wait_for (lock, WAITFORCHANGE_TIMEOUT);
       VLOG (1) << "Potential state change detected in WaitForPendingChange";
     }
   else
     LOG (WARNING)
-        << "WaitForPendingChange called with no ZMQ listener on pending moves,"
-           " returning immediately";
+        << "WaitForPendingChange called with no ZMQ listener on pending"
+           " moves, returning immediately";
+}
+
+Json::Value
+Game::WaitForPendingChange (const int oldVersion) const
+{
+  WaitForPendingVersion (oldVersion);
+
+  /* The result is retrieved after releasing mut, so that all the threads
+     woken up at the same time can share the cached JSON.  */
+  return GetPendingJsonState ();
+}
+
+Json::Value
+Game::WaitForPendingDelta (const int oldVersion) const
+{
+  WaitForPendingVersion (oldVersion);
+  return GetPendingJsonDelta (oldVersion);
+}
+
+void
+Game::AsyncWaitForChange (const uint256& oldBlock,
+                          const ChangeCallback& cb) const
+{
+  uint256 newBlock;
+  {
+    std::lock_guard<std::mutex> lock(mut);
 
-  return UnlockedPendingJsonState ();
+    const bool hasBlock = storage->GetCurrentBlockHash (newBlock);
+    if (!oldBlock.IsNull () && hasBlock && newBlock != oldBlock)
+      VLOG (1)
+          << "Current block is different from old block,"
+             " immediate return from AsyncWaitForChange";
+    else if (zmq.IsRunning ())
+      {
+        VLOG (1) << "Parking request for state change";
+        stateWaiters.Add ([this, cb] ()
+          {
+            uint256 block;
+            {
+              std::lock_guard<std::mutex> lock(mut);
+              if (!storage->GetCurrentBlockHash (block))
+                block.SetNull ();
+            }
+            cb (block);
+          });
+        return;
+      }
+    else
+      LOG (WARNING)
+          << "AsyncWaitForChange called with no active ZMQ listener,"
+             " returning immediately";
+
+    if (!hasBlock)
+      newBlock.SetNull ();
+  }
+
+  cb (newBlock);
+}
+
+void
+Game::AsyncWaitForPendingVersion (const int oldVersion,
+                                  const std::function<void ()>& cb) const
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+
+    if (oldVersion != WAITFORCHANGE_ALWAYS_BLOCK
+          && oldVersion != pendingStateVersion)
+      VLOG (1)
+          << "Known version differs from current one,"
+             " returning immediately from asynchronous pending wait";
+    else if (zmq.IsRunning () && zmq.IsPendingEnabled ())
+      {
+        VLOG (1) << "Parking request for pending state change";
+        pendingWaiters.Add (cb);
+        return;
+      }
+    else
+      LOG (WARNING)
+          << "Asynchronous pending wait called with no ZMQ listener on"
+             " pending moves, returning immediately";
+  }
+
+  cb ();
+}
+
+void
+Game::AsyncWaitForPendingChange (const int oldVersion,
+                                 const PendingChangeCallback& cb) const
+{
+  AsyncWaitForPendingVersion (oldVersion, [this, cb] ()
+    {
+      cb (GetPendingJsonState ());
+    });
+}
+
+void
+Game::AsyncWaitForPendingDelta (const int oldVersion,
+                                const PendingChangeCallback& cb) const
+{
+  AsyncWaitForPendingVersion (oldVersion, [this, oldVersion, cb] ()
+    {
+      cb (GetPendingJsonDelta (oldVersion));
+    });
+}
+
+void
+Game::AsyncWaitForPendingVersionChange (const int oldVersion,
+                                        const PendingVersionCallback& cb) const
+{
+  if (!zmq.IsPendingEnabled ())
+    throw jsonrpc::JsonRpcException (jsonrpc::Errors::ERROR_RPC_INTERNAL_ERROR,
+                                     "pending moves are not tracked");
+
+  AsyncWaitForPendingVersion (oldVersion, [this, cb] ()
+    {
+      int version;
+      {
+        std::lock_guard<std::mutex> lock(mut);
+        version = pendingStateVersion;
+      }
+      cb (version);
+    });
 }
 
 void
@@ -795,6 +1800,17 @@ Game::Start ()
       zmq.SetEndpointForPending ("");
     }
 
+  if (pendingWindow > std::chrono::milliseconds::zero () || asyncPendingMoves)
+    {
+      std::lock_guard<std::mutex> lock(mut);
+      CHECK (pendingFlusher == nullptr);
+      stopPendingFlusher = false;
+      pendingFlusher = std::make_unique<std::thread> ([this] ()
+        {
+          RunPendingFlusher ();
+        });
+    }
+
   TrackGame ();
   zmq.Start ();
 
@@ -806,6 +1822,7 @@ void
 Game::Stop ()
 {
   zmq.Stop ();
+  StopPendingFlusher ();
   UntrackGame ();
 
   /* Make sure to wake up all listeners waiting for a state update (as there
@@ -843,6 +1860,7 @@ Game::SyncFromCurrentState (const Json::Value& blockchainInfo,
       LOG (INFO) << "Game state matches current tip, we are up-to-date";
       state = State::UP_TO_DATE;
       transactionManager.SetBatchSize (1);
+      storage->SetCatchingUp (false);
       return;
     }
 
@@ -860,6 +1878,7 @@ Game::SyncFromCurrentState (const Json::Value& blockchainInfo,
 
   state = State::CATCHING_UP;
   transactionManager.SetBatchSize (transactionBatchSize);
+  storage->SetCatchingUp (true);
 
   CHECK (targetBlockHash.FromHex (upd["toblock"].asString ()));
   reqToken = upd["reqtoken"].asString ();
@@ -868,6 +1887,17 @@ Game::SyncFromCurrentState (const Json::Value& blockchainInfo,
 void
 Game::ReinitialiseState ()
 {
+  /* The state (and potentially the current block) changes here, which is
+     part of the current and pending JSON.  */
+  ++confirmedGeneration;
+  InvalidateStateCache ();
+  InvalidatePendingCache ();
+
+  /* Detaches that are still queued have not touched the storage yet.  If we
+     need them, they will be sent again after syncing from the current
+     state in the storage.  */
+  queuedDetaches.clear ();
+
   state = State::UNKNOWN;
   LOG (INFO) << "Reinitialising game state";
 
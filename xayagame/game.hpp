@@ -7,6 +7,7 @@
 
 #include "gamelogic.hpp"
 #include "heightcache.hpp"
+#include "longpoll.hpp"
 #include "mainloop.hpp"
 #include "pendingmoves.hpp"
 #include "pruningqueue.hpp"
@@ -21,11 +22,17 @@
 #include <json/json.h>
 #include <jsonrpccpp/client.h>
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <ostream>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace xaya
 {
@@ -152,6 +159,28 @@ private:
   /** The processor for pending moves, if any.  */
   PendingMoveProcessor* pending = nullptr;
 
+  /**
+   * Lock for accessing the PendingMoveProcessor.  This is needed in addition
+   * to mut, since pending moves may be processed on the worker thread without
+   * holding mut (see asyncPendingMoves).  If both are needed, then mut
+   * must be locked first.
+   */
+  mutable std::mutex mutPendingProcessor;
+
+  /**
+   * Counter that is incremented whenever the confirmed state changes.  It is
+   * used by the pending-move worker to detect that the confirmed state it
+   * used has become outdated while it was waiting for mutPendingProcessor.
+   */
+  mutable std::atomic<unsigned> confirmedGeneration;
+
+  /**
+   * If true, pending moves are processed on the worker thread without
+   * holding mut, so that expensive processing of pending moves does not
+   * delay the processing of confirmed blocks.
+   */
+  bool asyncPendingMoves = false;
+
   /**
    * Version number of the "current" pending state.  This number is incremented
    * whenever the pending state may have changed, and is used to identify
@@ -159,6 +188,66 @@ private:
    */
   int pendingStateVersion = 1;
 
+  class CachedCurrentState;
+
+  /**
+   * Lock for stateCache and stateHistory.  If both this and mut are needed,
+   * then mut must be locked first.
+   */
+  mutable std::mutex mutStateCache;
+
+  /**
+   * The result of GetCurrentJsonState for the current confirmed state, if it
+   * has been computed already.  This is reset whenever the confirmed state
+   * (or the syncing state) changes, so that repeated requests (e.g. from
+   * many frontends polling getcurrentstate) are served without calling
+   * GameLogic::GameStateToJson or locking mut.
+   */
+  mutable std::shared_ptr<const CachedCurrentState> stateCache;
+
+  /**
+   * The most recently computed states (oldest first), which are kept to
+   * reuse the game-state JSON for a block hash again (e.g. after the syncing
+   * state changed or a reorg switched back to a known block).  Guarded by
+   * mutStateCache as well.
+   */
+  mutable std::deque<std::shared_ptr<const CachedCurrentState>> stateHistory;
+
+  /**
+   * Number of entries kept in stateHistory.  If zero, the current state is
+   * not cached at all.
+   */
+  unsigned stateCacheSize = 1;
+
+  class CachedPendingState;
+
+  /**
+   * Lock for pendingCache.  If both this and mut are needed, then mut must
+   * be locked first.
+   */
+  mutable std::mutex mutPendingCache;
+
+  /**
+   * The pending-state JSON (as returned by GetPendingJsonState) for the
+   * current pending version and confirmed state, if it has been computed
+   * already.  This is reset whenever either of them changes, and allows us
+   * to serve repeated requests (e.g. from many frontends long-polling
+   * waitforpendingchange) without calling PendingMoveProcessor::ToJson
+   * or locking mut each time.
+   */
+  mutable std::shared_ptr<const CachedPendingState> pendingCache;
+
+  /**
+   * The last few computed pending states (oldest first), so that we can
+   * compute deltas to them for clients of WaitForPendingDelta.  This is
+   * guarded by mutPendingCache as well.  It is bounded both in the number
+   * of entries and in their total serialised size.
+   */
+  mutable std::deque<std::shared_ptr<const CachedPendingState>> pendingHistory;
+
+  /** Total serialised size of the states in pendingHistory.  */
+  mutable size_t pendingHistoryBytes = 0;
+
   /**
    * Desired size for batches of atomic transactions while the game is
    * catching up.  <= 1 means no batching even in these situations.
@@ -174,6 +263,62 @@ private:
   /** The pruning queue if we are pruning.  */
   std::unique_ptr<internal::PruningQueue> pruningQueue;
 
+  /**
+   * Block data of detach notifications received while catching up that
+   * have not yet been applied to the storage, most recently detached
+   * block first.  The storage still holds the state before them.
+   */
+  std::vector<Json::Value> queuedDetaches;
+
+  /**
+   * Time window for coalescing pending moves.  If non-zero, then pending
+   * moves are not processed immediately when received.  Instead, they are
+   * queued and processed in a batch (with a single notification of waiting
+   * clients) at most this long after the first of them was received.
+   */
+  std::chrono::milliseconds pendingWindow = std::chrono::milliseconds::zero ();
+
+  /**
+   * Maximum number of pending moves in a coalesced batch.  When that many
+   * are queued, they are processed right away.  Zero means no limit.
+   */
+  unsigned pendingMaxBatch = 0;
+
+  /** Pending moves received but not yet processed.  */
+  std::vector<Json::Value> queuedPendingMoves;
+
+  /** Time at which the currently queued pending moves must be processed.  */
+  std::chrono::steady_clock::time_point pendingDeadline;
+
+  /**
+   * Condition variable signalled when the first move of a new batch is queued
+   * (and when the flusher thread should stop).  It is used with mut.
+   */
+  std::condition_variable cvPendingQueued;
+
+  /** Set to true when the flusher thread should stop.  */
+  bool stopPendingFlusher = false;
+
+  /**
+   * Thread processing queued pending moves once their window is over
+   * (or right away in the asynchronous mode).
+   */
+  std::unique_ptr<std::thread> pendingFlusher;
+
+  /**
+   * Parked requests of AsyncWaitForChange.  They are completed on the next
+   * NotifyStateChange.  This is declared after everything the callbacks
+   * may access, so that it is destructed (and remaining requests are
+   * completed) while those are still alive.
+   */
+  mutable internal::LongPollQueue stateWaiters;
+
+  /**
+   * Parked requests of AsyncWaitForPendingChange, which are completed on
+   * the next NotifyPendingStateChange.
+   */
+  mutable internal::LongPollQueue pendingWaiters;
+
   /**
    * The JSON-RPC version to use for talking to Xaya Core.  The actual daemon
    * needs V1, but for the unit test (where the server is mocked and set up
@@ -235,6 +380,27 @@ private:
   void SyncFromCurrentState (const Json::Value& blockchainInfo,
                              const uint256& currentHash);
 
+  /**
+   * Handles a detached block while catching up.  Instead of undoing it right
+   * away, the block is added to queuedDetaches so that a series of detaches
+   * (e.g. for a reorg) can be undone in one step by FlushDetaches.
+   *
+   * Returns false if the block does not correspond to the state we would
+   * have after the already queued detaches.
+   */
+  bool QueueDetach (const uint256& parent, const uint256& child,
+                    const Json::Value& blockData);
+
+  /**
+   * Undoes all blocks in queuedDetaches.  If the game logic supports merging
+   * of undo data, this is done with a single call to ProcessBackwards.
+   * Otherwise the blocks are detached one by one.
+   *
+   * Returns false if the blocks could not be detached and the state needs
+   * to be reinitialised.
+   */
+  bool FlushDetaches ();
+
   /**
    * Re-initialises the current game state.  This is called whenever we are not
    * sure, like when ZMQ notifications have been missed or during start up.
@@ -260,6 +426,112 @@ private:
    */
   Json::Value UnlockedPendingJsonState () const;
 
+  /**
+   * Drops the cached current-state JSON.  This must be called (with mut held)
+   * whenever something that is part of it changes.
+   */
+  void InvalidateStateCache () const;
+
+  /**
+   * Returns whether the current-state JSON is cached at all (i.e. the
+   * cache size is non-zero).  mutStateCache must not be held by the caller.
+   */
+  bool IsStateCacheEnabled () const;
+
+  /**
+   * Returns the cached current-state JSON, computing it first if necessary.
+   * mut must not be held by the caller, and caching must be enabled.
+   */
+  std::shared_ptr<const CachedCurrentState> GetCachedCurrentState () const;
+
+  /**
+   * Returns the cached current-state JSON like GetCachedCurrentState, but
+   * assuming that the caller already holds mut.
+   */
+  std::shared_ptr<const CachedCurrentState> UnlockedCachedCurrentState () const;
+
+  /**
+   * Computes the result of GetCurrentJsonState, assuming that the caller
+   * already holds mut.  Returns whether or not there is a current block and
+   * its hash (or null) in the output arguments.
+   */
+  Json::Value UnlockedCurrentJsonState (bool& hasBlock, uint256& hash) const;
+
+  /**
+   * Returns the result of GetNullJsonState, assuming that the caller
+   * already holds mut.
+   */
+  Json::Value UnlockedNullJsonState () const;
+
+  /**
+   * Computes the result of GetCurrentJsonState without using the cache.
+   */
+  Json::Value UncachedCurrentJsonState () const;
+
+  /**
+   * Drops the cached pending-state JSON.  This must be called (with mut held)
+   * whenever something that is part of it changes.
+   */
+  void InvalidatePendingCache () const;
+
+  /**
+   * Returns the cached pending-state JSON, computing it first if necessary.
+   * mut must not be held by the caller.
+   */
+  std::shared_ptr<const CachedPendingState> GetCachedPendingState () const;
+
+  /**
+   * Returns the cached pending-state JSON like GetCachedPendingState, but
+   * assuming that the caller already holds mut.
+   */
+  std::shared_ptr<const CachedPendingState> UnlockedCachedPendingState () const;
+
+  /**
+   * Blocks until the pending state version differs from the given one
+   * (with the semantics of WaitForPendingChange).  mut must not be held
+   * by the caller.
+   */
+  void WaitForPendingVersion (int oldVersion) const;
+
+  /**
+   * Asynchronous variant of WaitForPendingVersion:  The callback is invoked
+   * once the pending state version may have changed (or right away), with
+   * the same semantics as for AsyncWaitForChange.
+   */
+  void AsyncWaitForPendingVersion (int oldVersion,
+                                   const std::function<void ()>& cb) const;
+
+  /**
+   * Processes all queued pending moves (if any) and notifies waiting
+   * clients once.  mut must be held.
+   */
+  void ProcessQueuedPendingMoves ();
+
+  /**
+   * Removes all queued pending moves that are confirmed in the given block
+   * (as per the block notification's data).  This is used in the
+   * asynchronous mode when attaching a block.  mut must be held.
+   */
+  void DropQueuedMovesInBlock (const Json::Value& blockData);
+
+  /**
+   * Processes all queued pending moves in the asynchronous mode.  This
+   * takes a copy of the confirmed state and then releases mut (which must
+   * be held through the given lock) while the moves are processed.
+   * When the function returns, mut is held again.
+   */
+  void ProcessQueuedPendingMovesUnlocked (std::unique_lock<std::mutex>& lock);
+
+  /**
+   * Main function of the pendingFlusher thread.
+   */
+  void RunPendingFlusher ();
+
+  /**
+   * Stops the pendingFlusher thread if it is running.  mut must not be held.
+   */
+  void StopPendingFlusher ();
+
   /**
    * Converts a state enum value to a string for use in log messages and the
    * JSON-RPC interface.
@@ -301,6 +573,7 @@ public:
     = std::function<Json::Value (const GameStateData& state)>;
 
   explicit Game (const std::string& id);
+  ~Game ();
 
   Game () = delete;
   Game (const Game&) = delete;
@@ -308,7 +581,9 @@ public:
 
   /**
    * Sets up the RPC client based on the given connector.  This must only
-   * be called once.
+   * be called once.  The client is used from the block-processing thread
+   * and from GameLogic and RPC handlers at the same time, so the connector
+   * should be thread-safe (e.g. an RpcConnectorPool).
    */
   void ConnectRpcClient (jsonrpc::IClientConnector& conn);
 
@@ -352,6 +627,44 @@ public:
    */
   void SetPendingMoveProcessor (PendingMoveProcessor& p);
 
+  /**
+   * Enables coalescing of pending moves:  Instead of processing each pending
+   * move and notifying waiting clients immediately, moves are queued and
+   * processed in batches.  A batch is processed at most window after its
+   * first move has been received, or as soon as maxMoves are queued (unless
+   * maxMoves is zero).  Bursts of pending moves thus only lead to few
+   * notifications of clients.
+   *
+   * A zero window disables coalescing (which is the default).  This must be
+   * called before the main loop is started.
+   */
+  void SetPendingMoveBatching (std::chrono::milliseconds window,
+                               unsigned maxMoves);
+
+  /**
+   * Enables processing of pending moves on a dedicated worker thread,
+   * which works with a copy of the confirmed state and does not hold the
+   * main lock.  This way, expensive pending-move logic never delays the
+   * processing of blocks.  This has no effect if the PendingMoveProcessor
+   * does not support it (see
+   * PendingMoveProcessor::SupportsConcurrentProcessing).
+   *
+   * This must be called before the main loop is started.
+   */
+  void EnableAsyncPendingMoves ();
+
+  /**
+   * Sets the number of block hashes for which the result of
+   * GetCurrentJsonState is kept in memory.  The result for the current block
+   * is cached until the state changes, and older entries are reused if the
+   * state goes back to their block (e.g. in a reorg).  Since each entry
+   * holds the full game-state JSON, this should be small for games with
+   * a large state.  Zero disables caching; the default is one.
+   *
+   * This must be called before the main loop is started.
+   */
+  void SetStateCacheSize (unsigned size);
+
   /**
    * Enables (or changes) pruning with the given number of blocks to keep.
    * Must be called after the storage is set already.
@@ -424,11 +737,37 @@ public:
    */
   Json::Value GetCurrentJsonState () const;
 
+  /**
+   * Returns the same data as GetCurrentJsonState, but already serialised
+   * to a (compact) JSON string.  The serialisation is cached together with
+   * the state (see SetStateCacheSize).
+   */
+  std::string GetCurrentJsonString () const;
+
+  /**
+   * Writes the same data as GetCurrentJsonState (as compact JSON) to the
+   * given stream.  If state caching is enabled, this uses (and fills) the
+   * cache like GetCurrentJsonString.  Otherwise the game state is streamed
+   * through GameLogic::WriteGameStateJson without building it as
+   * Json::Value first.
+   */
+  void WriteCurrentJsonState (std::ostream& out) const;
+
   /**
    * Returns a JSON object that just contains basic stats about the game daemon
    * itself (e.g. syncing state, current block height) but no specific pieces
    * of data about the game state.  This is useful as the cheapest possible
    * way to check on the health and connection state of a game daemon.
+   *
+   * If the storage keeps statistics about its undo data (e.g. a MemoryStorage
+   * with a budget for undo data), the "undo" field contains the amount of
+   * undo data held in memory and on disk (see StorageInterface::GetUndoStats).
+   * If a PendingMoveProcessor is attached, the "pending" field contains
+   * statistics about the memory used for pending moves (see
+   * PendingMoveProcessor::GetMemoryStats).
+   * If any signatures have been verified through VerifyMessage, the
+   * "signatures" field contains the statistics of the signature cache
+   * (which is shared by the whole process, see GetSignatureCacheStats).
    */
   Json::Value GetNullJsonState () const;
 
@@ -441,6 +780,25 @@ public:
    */
   Json::Value GetPendingJsonState () const;
 
+  /**
+   * Returns several of the states as per GetCurrentJsonState,
+   * GetNullJsonState and GetPendingJsonState at once.  They are computed
+   * (or taken from the caches) under a single acquisition of the game lock,
+   * so that they are consistent with each other.  States whose output
+   * pointer is null are not returned.  If the pending state is requested
+   * but pending moves are not tracked, this raises a JSON-RPC error.
+   */
+  void GetJsonStates (Json::Value* current, Json::Value* nullState,
+                      Json::Value* pending) const;
+
+  /**
+   * Returns the same data as GetPendingJsonState, but already serialised
+   * to a (compact) JSON string.  The serialisation is cached for each
+   * version of the pending state, so that this is cheap for servers
+   * that send the result to many clients.
+   */
+  std::string GetPendingJsonString () const;
+
   /**
    * Blocks the calling thread until a change to the game state has
    * (potentially) been made.  This can be used to implement long-polling
@@ -467,6 +825,25 @@ public:
    */
   void WaitForChange (const uint256& oldBlock, uint256& newBlock) const;
 
+  /** Callback for AsyncWaitForChange, which gets passed the new block.  */
+  using ChangeCallback = std::function<void (const uint256& newBlock)>;
+
+  /**
+   * Waits for a change to the game state like WaitForChange, but without
+   * blocking the calling thread.  Instead, the request is parked and the
+   * callback invoked with the new best block once a change happens or the
+   * request times out.  Any number of requests can be parked this way with
+   * a constant number of threads, which allows servers to support long
+   * polling for many clients.
+   *
+   * If the request can be answered right away, then the callback is invoked
+   * directly on the calling thread.  Otherwise, it is invoked later on
+   * a dedicated worker thread shared by all requests.  In that case it must
+   * not throw and should return quickly.
+   */
+  void AsyncWaitForChange (const uint256& oldBlock,
+                           const ChangeCallback& cb) const;
+
   /**
    * Blocks the calling thread until a change to the pending state has
    * been made.  Note that this function may return spuriously.
@@ -479,6 +856,60 @@ public:
    */
   Json::Value WaitForPendingChange (int oldState) const;
 
+  /**
+   * Callback for AsyncWaitForPendingChange, which gets passed the new
+   * pending state.
+   */
+  using PendingChangeCallback = std::function<void (const Json::Value& state)>;
+
+  /**
+   * Waits for a change to the pending state like WaitForPendingChange, but
+   * asynchronously with the same semantics as AsyncWaitForChange.
+   */
+  void AsyncWaitForPendingChange (int oldVersion,
+                                  const PendingChangeCallback& cb) const;
+
+  /**
+   * Returns the pending state like GetPendingJsonState, but as a delta
+   * relative to the given old version if possible.  If the old version
+   * is still known and a delta can be computed (see
+   * PendingMoveProcessor::ToJsonDelta), then the result has a "delta" field
+   * with the change of the "pending" data and a "fromversion" field set to
+   * oldVersion.  Otherwise (e.g. if the client is too far behind), the full
+   * "pending" field is returned instead.  All other fields are as for
+   * GetPendingJsonState.
+   */
+  Json::Value GetPendingJsonDelta (int oldVersion) const;
+
+  /**
+   * Waits for a change to the pending state like WaitForPendingChange
+   * and returns the new state as per GetPendingJsonDelta.
+   */
+  Json::Value WaitForPendingDelta (int oldVersion) const;
+
+  /**
+   * Waits for a change to the pending state like WaitForPendingDelta, but
+   * asynchronously with the same semantics as AsyncWaitForChange.
+   */
+  void AsyncWaitForPendingDelta (int oldVersion,
+                                 const PendingChangeCallback& cb) const;
+
+  /**
+   * Callback for AsyncWaitForPendingVersionChange, which gets passed the
+   * new pending state version.
+   */
+  using PendingVersionCallback = std::function<void (int version)>;
+
+  /**
+   * Waits for a change to the pending state like AsyncWaitForPendingChange,
+   * but only passes the new version to the callback.  This is cheaper for
+   * callers that just need to know when the pending state changed, as no
+   * JSON is built for it.  Throws (right away) if pending moves are not
+   * tracked at all.
+   */
+  void AsyncWaitForPendingVersionChange (
+      int oldVersion, const PendingVersionCallback& cb) const;
+
   /**
    * Starts the ZMQ subscriber and other logic.  Must not be called before
    * the ZMQ endpoint has been configured, and must not be called when
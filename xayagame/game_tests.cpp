@@ -5,6 +5,8 @@
 #include "game.hpp"
 
 #include "gamelogic.hpp"
+#include "gamerpcserver.hpp"
+#include "signatures.hpp"
 
 #include "testutils.hpp"
 
@@ -252,6 +254,8 @@ protected:
     CHECK (GetContext ().GetChain () == Chain::MAIN);
     CHECK_EQ (GetContext ().GetGameId (), GAME_ID);
 
+    ++backwardsCalls;
+
     Map state = DecodeMap (newState);
     const Map undo = DecodeMap (undoData);
 
@@ -268,9 +272,38 @@ protected:
 
 public:
 
+  /** Number of times GameStateToJson has been called.  */
+  unsigned toJsonCalls = 0;
+
+  /** Number of times ProcessBackwards has been called.  */
+  unsigned backwardsCalls = 0;
+
+  /** Whether or not we support merging of undo data.  */
+  bool mergeUndo = false;
+
+  bool
+  MergeUndoData (const std::vector<UndoData>& undos,
+                 UndoData& merged) override
+  {
+    if (!mergeUndo)
+      return false;
+
+    /* The undo data of the earliest block changing a name is what
+       restores its value from before all of the blocks.  */
+    Map res;
+    for (const auto& u : undos)
+      for (const auto& e : DecodeMap (u))
+        res.emplace (e.first, e.second);
+
+    merged = EncodeMap (res);
+    return true;
+  }
+
   Json::Value
   GameStateToJson (const GameStateData& state) override
   {
+    ++toJsonCalls;
+
     Json::Value res(Json::objectValue);
     res["state"] = state;
     return res;
@@ -324,6 +357,9 @@ protected:
 
 public:
 
+  /** Number of calls to ToJson made.  */
+  mutable unsigned toJsonCalls = 0;
+
   TestPendingMoves ()
     : data(Json::objectValue)
   {}
@@ -331,6 +367,7 @@ public:
   Json::Value
   ToJson () const override
   {
+    ++toJsonCalls;
     return data;
   }
 
@@ -653,6 +690,29 @@ TEST_F (InitialStateTests, MismatchingGenesisHash)
 
 /* ************************************************************************** */
 
+/**
+ * Server connector that does not listen anywhere, and just allows
+ * passing requests to the RPC server.
+ */
+class TestConnector : public jsonrpc::AbstractServerConnector
+{
+
+public:
+
+  bool
+  StartListening () override
+  {
+    return true;
+  }
+
+  bool
+  StopListening () override
+  {
+    return true;
+  }
+
+};
+
 using GetCurrentJsonStateTests = InitialStateTests;
 
 TEST_F (GetCurrentJsonStateTests, NoStateYet)
@@ -731,6 +791,146 @@ TEST_F (GetCurrentJsonStateTests, HeightResolvedViaRpc)
   EXPECT_EQ (state["gamestate"]["state"], "");
 }
 
+TEST_F (GetCurrentJsonStateTests, CachedPerBlock)
+{
+  g.SetStateCacheSize (2);
+  mockXayaServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+  SetStartingBlock (TestGame::GenesisBlockHash ());
+
+  /* The state holds the height as unsigned value, while parsing yields
+     a signed one.  Thus compare after parsing both sides.  */
+  const auto state = g.GetCurrentJsonState ();
+  EXPECT_EQ (g.GetCurrentJsonState (), state);
+  EXPECT_EQ (ParseJson (g.GetCurrentJsonString ()),
+             ParseJson (state.toStyledString ()));
+  EXPECT_EQ (rules.toJsonCalls, 1);
+
+  AttachBlock (g, BlockHash (11), Moves ("a0b1"));
+  EXPECT_EQ (g.GetCurrentJsonState ()["gamestate"]["state"], "a0b1");
+  EXPECT_EQ (rules.toJsonCalls, 2);
+
+  /* Going back to the genesis block reuses its cached game state.  */
+  DetachBlock (g);
+  const auto detached = g.GetCurrentJsonState ();
+  EXPECT_EQ (detached["blockhash"], GAME_GENESIS_HASH);
+  EXPECT_EQ (detached["gamestate"], state["gamestate"]);
+  EXPECT_EQ (rules.toJsonCalls, 2);
+}
+
+TEST_F (GetCurrentJsonStateTests, CacheDisabled)
+{
+  g.SetStateCacheSize (0);
+  mockXayaServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+
+  const auto state = g.GetCurrentJsonState ();
+  EXPECT_EQ (ParseJson (g.GetCurrentJsonString ()),
+             ParseJson (state.toStyledString ()));
+  EXPECT_EQ (rules.toJsonCalls, 2);
+
+  /* Writing the state to a stream does not cache it either.  */
+  std::ostringstream out;
+  g.WriteCurrentJsonState (out);
+  EXPECT_EQ (out.str (), g.GetCurrentJsonString ());
+  EXPECT_EQ (rules.toJsonCalls, 4);
+}
+
+TEST_F (GetCurrentJsonStateTests, WriteFillsCache)
+{
+  mockXayaServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+
+  std::ostringstream first;
+  g.WriteCurrentJsonState (first);
+  EXPECT_EQ (rules.toJsonCalls, 1);
+
+  std::ostringstream second;
+  g.WriteCurrentJsonState (second);
+  EXPECT_EQ (second.str (), first.str ());
+  EXPECT_EQ (g.GetCurrentJsonString (), first.str ());
+  EXPECT_EQ (rules.toJsonCalls, 1);
+}
+
+TEST_F (GetCurrentJsonStateTests, CachedThroughRpcServer)
+{
+  mockXayaServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+
+  TestConnector conn;
+  GameRpcServer srv(g, conn);
+
+  const std::string request
+      = R"({"jsonrpc":"2.0","id":1,"method":"getcurrentstate"})";
+  std::string first, second;
+  conn.ProcessRequest (request, first);
+  conn.ProcessRequest (request, second);
+
+  EXPECT_EQ (rules.toJsonCalls, 1);
+  EXPECT_EQ (second, first);
+
+  const Json::Value response = ParseJson (first);
+  EXPECT_EQ (response["id"].asInt (), 1);
+  EXPECT_EQ (response["result"]["blockhash"], GAME_GENESIS_HASH);
+  EXPECT_EQ (response["result"]["gamestate"]["state"], "");
+}
+
+TEST_F (GetCurrentJsonStateTests, StateBatchThroughRpcServer)
+{
+  mockXayaServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+
+  TestConnector conn;
+  GameRpcServer srv(g, conn);
+
+  std::string response;
+  conn.ProcessRequest (R"([
+    {"jsonrpc": "2.0", "id": 1, "method": "getcurrentstate"},
+    {"jsonrpc": "2.0", "method": "getnullstate"},
+    {"jsonrpc": "2.0", "id": 2, "method": "getnullstate", "params": []},
+    {"jsonrpc": "2.0", "id": 3, "method": "getcurrentstate"}
+  ])", response);
+  EXPECT_EQ (rules.toJsonCalls, 1);
+
+  const Json::Value responses = ParseJson (response);
+  ASSERT_TRUE (responses.isArray ());
+  ASSERT_EQ (responses.size (), 3);
+
+  EXPECT_EQ (responses[0]["id"].asInt (), 1);
+  EXPECT_EQ (responses[0]["result"],
+             ParseJson (g.GetCurrentJsonState ().toStyledString ()));
+  EXPECT_EQ (responses[1]["id"].asInt (), 2);
+  EXPECT_EQ (responses[1]["result"]["blockhash"], GAME_GENESIS_HASH);
+  EXPECT_FALSE (responses[1]["result"].isMember ("gamestate"));
+  EXPECT_EQ (responses[2]["id"].asInt (), 3);
+  EXPECT_EQ (responses[2]["result"], responses[0]["result"]);
+}
+
+TEST_F (GetCurrentJsonStateTests, OtherBatchesThroughRpcServer)
+{
+  TestConnector conn;
+  GameRpcServer srv(g, conn);
+
+  /* Batches with other methods or with a pending-state call while pending
+     moves are not tracked are processed call-by-call.  */
+  std::string response;
+  conn.ProcessRequest (R"([
+    {"jsonrpc": "2.0", "id": 1, "method": "getcurrentstate"},
+    {"jsonrpc": "2.0", "id": 2, "method": "getpendingstate"}
+  ])", response);
+
+  const Json::Value responses = ParseJson (response);
+  ASSERT_TRUE (responses.isArray ());
+  ASSERT_EQ (responses.size (), 2);
+  EXPECT_EQ (responses[0]["result"]["gameid"], GAME_ID);
+  EXPECT_TRUE (responses[1].isMember ("error"));
+}
+
 TEST_F (GetCurrentJsonStateTests, CallbackUnblocked)
 {
   mockXayaServer->SetBestBlock (GAME_GENESIS_HEIGHT,
@@ -772,6 +972,67 @@ TEST_F (GetCurrentJsonStateTests, CallbackUnblocked)
 
 /* ************************************************************************** */
 
+using GetNullJsonStateTests = InitialStateTests;
+
+TEST_F (GetNullJsonStateTests, Basic)
+{
+  mockXayaServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+
+  const Json::Value state = g.GetNullJsonState ();
+  EXPECT_EQ (state["gameid"], GAME_ID);
+  EXPECT_EQ (state["state"], "up-to-date");
+  EXPECT_EQ (state["blockhash"], GAME_GENESIS_HASH);
+  EXPECT_FALSE (state.isMember ("data"));
+  EXPECT_FALSE (state.isMember ("undo"));
+}
+
+TEST_F (GetNullJsonStateTests, UndoStats)
+{
+  storage.SetUndoMemoryBudget (1);
+
+  mockXayaServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+  SetStartingBlock (TestGame::GenesisBlockHash ());
+  AttachBlock (g, BlockHash (11), Moves ("a0b1"));
+  AttachBlock (g, BlockHash (12), Moves ("a2"));
+
+  const Json::Value undo = g.GetNullJsonState ()["undo"];
+  ASSERT_TRUE (undo.isObject ());
+  EXPECT_EQ (undo["memory"]["entries"].asInt (), 0);
+  EXPECT_EQ (undo["memory"]["bytes"].asInt (), 0);
+  EXPECT_EQ (undo["disk"]["entries"].asInt (), 2);
+  EXPECT_GT (undo["disk"]["bytes"].asInt (), 0);
+}
+
+TEST_F (GetNullJsonStateTests, SignatureCacheStats)
+{
+  ResetMessageVerification ();
+
+  mockXayaServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+  EXPECT_FALSE (g.GetNullJsonState ().isMember ("signatures"));
+
+  EXPECT_CALL (*mockXayaServer, verifymessage ("", "msg", "sgn"))
+      .WillOnce (Return (ParseJson (R"({"valid": false})")));
+  for (unsigned i = 0; i < 2; ++i)
+    EXPECT_EQ (VerifyMessage (mockXayaServer.GetClient (), "msg", "sgn"),
+               "invalid");
+
+  const Json::Value sig = g.GetNullJsonState ()["signatures"];
+  ASSERT_TRUE (sig.isObject ());
+  EXPECT_EQ (sig["entries"].asInt (), 1);
+  EXPECT_EQ (sig["hits"].asInt (), 1);
+  EXPECT_EQ (sig["misses"].asInt (), 1);
+
+  ResetMessageVerification ();
+}
+
+/* ************************************************************************** */
+
 class GetPendingJsonStateTests : public InitialStateTests
 {
 
@@ -857,6 +1118,187 @@ TEST_F (GetPendingJsonStateTests, PendingState)
       "a": "x"
     }
   )"));
+  EXPECT_FALSE (state.isMember ("memory"));
+}
+
+TEST_F (GetPendingJsonStateTests, MemoryStatsInNullState)
+{
+  EXPECT_FALSE (g.GetNullJsonState ().isMember ("pending"));
+
+  TestPendingMoves proc;
+  g.SetPendingMoveProcessor (proc);
+
+  SetupZmqEndpoints (true);
+  g.Start ();
+
+  mockXayaServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+
+  AttachBlock (g, BlockHash (11), Moves (""));
+  CallPendingMove (g, Moves ("ax")[0]);
+  CallPendingMove (g, Moves ("by")[0]);
+
+  const auto stats = g.GetNullJsonState ()["pending"];
+  ASSERT_TRUE (stats.isObject ());
+  EXPECT_EQ (stats["moves"].asInt (), 2);
+  EXPECT_GT (stats["bytes"].asInt (), 0);
+  EXPECT_EQ (stats["evicted"].asInt (), 0);
+}
+
+TEST_F (GetPendingJsonStateTests, CachedPerVersion)
+{
+  TestPendingMoves proc;
+  g.SetPendingMoveProcessor (proc);
+
+  SetupZmqEndpoints (true);
+  g.Start ();
+
+  mockXayaServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+
+  AttachBlock (g, BlockHash (11), Moves (""));
+  CallPendingMove (g, Moves ("ax")[0]);
+
+  const unsigned before = proc.toJsonCalls;
+  const auto state = g.GetPendingJsonState ();
+  EXPECT_EQ (g.GetPendingJsonState (), state);
+  /* Both sides are parsed, so that integers compare equal irrespective of
+     whether they are signed or unsigned in the JSON value.  */
+  EXPECT_EQ (ParseJson (g.GetPendingJsonString ()),
+             ParseJson (state.toStyledString ()));
+  EXPECT_EQ (proc.toJsonCalls, before + 1);
+
+  CallPendingMove (g, Moves ("by")[0]);
+  const auto newState = g.GetPendingJsonState ();
+  EXPECT_EQ (proc.toJsonCalls, before + 2);
+  EXPECT_EQ (newState["version"].asInt (), state["version"].asInt () + 1);
+  EXPECT_EQ (newState["pending"]["b"], "y");
+
+  /* Attaching a block changes the block hash in the JSON.  */
+  AttachBlock (g, BlockHash (12), Moves (""));
+  EXPECT_EQ (g.GetPendingJsonState ()["blockhash"], BlockHash (12).ToHex ());
+}
+
+TEST_F (GetPendingJsonStateTests, Delta)
+{
+  TestPendingMoves proc;
+  g.SetPendingMoveProcessor (proc);
+
+  SetupZmqEndpoints (true);
+  g.Start ();
+
+  mockXayaServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+
+  AttachBlock (g, BlockHash (11), Moves (""));
+  CallPendingMove (g, Moves ("ax")[0]);
+  const int oldVersion = g.GetPendingJsonState ()["version"].asInt ();
+
+  CallPendingMove (g, Moves ("by")[0]);
+  const auto full = g.GetPendingJsonState ();
+
+  auto delta = g.GetPendingJsonDelta (oldVersion);
+  EXPECT_EQ (delta["version"], full["version"]);
+  EXPECT_EQ (delta["blockhash"], full["blockhash"]);
+  EXPECT_EQ (delta["fromversion"].asInt (), oldVersion);
+  EXPECT_FALSE (delta.isMember ("pending"));
+  EXPECT_EQ (delta["delta"], ParseJson (R"({"b": "y"})"));
+
+  /* An unknown version yields the full state.  */
+  delta = g.GetPendingJsonDelta (oldVersion - 100);
+  EXPECT_FALSE (delta.isMember ("delta"));
+  EXPECT_EQ (delta["pending"], full["pending"]);
+}
+
+TEST_F (GetPendingJsonStateTests, CoalescingByCount)
+{
+  TestPendingMoves proc;
+  g.SetPendingMoveProcessor (proc);
+  g.SetPendingMoveBatching (std::chrono::hours (1), 2);
+
+  SetupZmqEndpoints (true);
+  g.Start ();
+
+  mockXayaServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+  AttachBlock (g, BlockHash (11), Moves (""));
+
+  const auto before = g.GetPendingJsonState ();
+  CallPendingMove (g, Moves ("ax")[0]);
+  EXPECT_EQ (g.GetPendingJsonState (), before);
+
+  CallPendingMove (g, Moves ("by")[0]);
+  const auto after = g.GetPendingJsonState ();
+  EXPECT_EQ (after["version"].asInt (), before["version"].asInt () + 1);
+  EXPECT_EQ (after["pending"], ParseJson (R"(
+    {
+      "state": "",
+      "height": 2,
+      "a": "x",
+      "b": "y"
+    }
+  )"));
+}
+
+TEST_F (GetPendingJsonStateTests, CoalescingByTime)
+{
+  TestPendingMoves proc;
+  g.SetPendingMoveProcessor (proc);
+  g.SetPendingMoveBatching (std::chrono::milliseconds (10), 0);
+
+  SetupZmqEndpoints (true);
+  g.Start ();
+
+  mockXayaServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+  AttachBlock (g, BlockHash (11), Moves (""));
+
+  const int before = g.GetPendingJsonState ()["version"].asInt ();
+  CallPendingMove (g, Moves ("ax")[0]);
+  CallPendingMove (g, Moves ("by")[0]);
+  CallPendingMove (g, Moves ("cz")[0]);
+
+  std::this_thread::sleep_for (std::chrono::milliseconds (100));
+  const auto after = g.GetPendingJsonState ();
+  EXPECT_EQ (after["version"].asInt (), before + 1);
+  EXPECT_EQ (after["pending"]["c"], "z");
+}
+
+TEST_F (GetPendingJsonStateTests, AsyncProcessing)
+{
+  TestPendingMoves proc;
+  g.SetPendingMoveProcessor (proc);
+  g.EnableAsyncPendingMoves ();
+
+  SetupZmqEndpoints (true);
+  g.Start ();
+
+  mockXayaServer->SetBestBlock (GAME_GENESIS_HEIGHT,
+                                TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+  AttachBlock (g, BlockHash (11), Moves (""));
+
+  CallPendingMove (g, Moves ("ax")[0]);
+  SleepSome ();
+  EXPECT_EQ (g.GetPendingJsonState ()["pending"], ParseJson (R"(
+    {
+      "state": "",
+      "height": 2,
+      "a": "x"
+    }
+  )"));
+
+  /* Moves that are still queued when a block is attached are left to the
+     worker thread, which processes them on top of the new block.  */
+  CallPendingMove (g, Moves ("by")[0]);
+  AttachBlock (g, BlockHash (12), Moves (""));
+  SleepSome ();
+  EXPECT_EQ (g.GetPendingJsonState ()["blockhash"], BlockHash (12).ToHex ());
 }
 
 /* ************************************************************************** */
@@ -1043,6 +1485,47 @@ TEST_F (WaitForChangeTests, OutdatedOldBlock)
   EXPECT_TRUE (newBlock == BlockHash (11));
 }
 
+TEST_F (WaitForChangeTests, AsyncManyWaiters)
+{
+  mockXayaServer->SetBestBlock (10, TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+  EXPECT_EQ (GetState (g), State::UP_TO_DATE);
+
+  constexpr unsigned numWaiters = 1000;
+  std::atomic<unsigned> done;
+  done = 0;
+  for (unsigned i = 0; i < numWaiters; ++i)
+    g.AsyncWaitForChange (TestGame::GenesisBlockHash (),
+      [&done] (const uint256& newBlock)
+      {
+        EXPECT_EQ (newBlock, BlockHash (11));
+        ++done;
+      });
+
+  SleepSome ();
+  EXPECT_EQ (done, 0);
+
+  AttachBlock (g, BlockHash (11), Moves (""));
+  while (done < numWaiters)
+    SleepSome ();
+}
+
+TEST_F (WaitForChangeTests, AsyncImmediateReturn)
+{
+  mockXayaServer->SetBestBlock (10, TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+  AttachBlock (g, BlockHash (11), Moves (""));
+
+  bool done = false;
+  g.AsyncWaitForChange (TestGame::GenesisBlockHash (),
+    [&done] (const uint256& newBlock)
+    {
+      EXPECT_EQ (newBlock, BlockHash (11));
+      done = true;
+    });
+  EXPECT_TRUE (done);
+}
+
 /* ************************************************************************** */
 
 class WaitForPendingChangeTests : public GetPendingJsonStateTests
@@ -1209,6 +1692,58 @@ TEST_F (WaitForPendingChangeTests, PendingMove)
   )"));
 }
 
+TEST_F (WaitForPendingChangeTests, AsyncPendingMove)
+{
+  SetupZmqEndpoints (true);
+  g.Start ();
+  AttachBlock (g, BlockHash (11), Moves (""));
+
+  std::atomic<bool> done;
+  done = false;
+  Json::Value out;
+  g.AsyncWaitForPendingChange (Game::WAITFORCHANGE_ALWAYS_BLOCK,
+    [&] (const Json::Value& state)
+    {
+      out = state;
+      done = true;
+    });
+
+  SleepSome ();
+  EXPECT_FALSE (done);
+
+  CallPendingMove (g, Moves ("ax")[0]);
+  while (!done)
+    SleepSome ();
+  EXPECT_EQ (out["pending"]["a"], "x");
+}
+
+TEST_F (WaitForPendingChangeTests, AsyncDelta)
+{
+  SetupZmqEndpoints (true);
+  g.Start ();
+  AttachBlock (g, BlockHash (11), Moves (""));
+  CallPendingMove (g, Moves ("ax")[0]);
+  const int oldVersion = g.GetPendingJsonState ()["version"].asInt ();
+
+  std::atomic<bool> done;
+  done = false;
+  Json::Value out;
+  g.AsyncWaitForPendingDelta (oldVersion, [&] (const Json::Value& state)
+    {
+      out = state;
+      done = true;
+    });
+
+  SleepSome ();
+  EXPECT_FALSE (done);
+
+  CallPendingMove (g, Moves ("by")[0]);
+  while (!done)
+    SleepSome ();
+  EXPECT_EQ (out["fromversion"].asInt (), oldVersion);
+  EXPECT_EQ (out["delta"], ParseJson (R"({"b": "y"})"));
+}
+
 TEST_F (WaitForPendingChangeTests, AttachedBlock)
 {
   SetupZmqEndpoints (true);
@@ -1396,16 +1931,125 @@ TEST_F (SyncingTests, CatchingUpBackwards)
   EXPECT_EQ (GetState (g), State::CATCHING_UP);
   ExpectGameState (BlockHash (12), "a2b1c3");
 
+  /* Detaches while catching up are queued and only undone once the
+     target block is reached.  */
   CallBlockDetach (g, "reqtoken", BlockHash (11), BlockHash (12), 12,
                    NO_SEQ_MISMATCH);
   EXPECT_EQ (GetState (g), State::CATCHING_UP);
-  ExpectGameState (BlockHash (11), "a0b1");
+  ExpectGameState (BlockHash (12), "a2b1c3");
+
+  CallBlockDetach (g, "reqtoken",
+                   TestGame::GenesisBlockHash (), BlockHash (11), 11,
+                   NO_SEQ_MISMATCH);
+  EXPECT_EQ (GetState (g), State::UP_TO_DATE);
+  ExpectGameState (TestGame::GenesisBlockHash (), "");
+  EXPECT_EQ (rules.backwardsCalls, 2);
+}
+
+TEST_F (SyncingTests, CatchingUpBackwardsMerged)
+{
+  rules.mergeUndo = true;
+
+  EXPECT_CALL (*mockXayaServer,
+               game_sendupdates (BlockHash (13).ToHex (), GAME_ID))
+      .WillOnce (Return (SendupdatesResponse (TestGame::GenesisBlockHash (),
+                                              "reqtoken")));
+
+  AttachBlock (g, BlockHash (11), Moves ("a0b1"));
+  AttachBlock (g, BlockHash (12), Moves ("a2c3"));
+  AttachBlock (g, BlockHash (13), Moves ("b4d5"));
+  ExpectGameState (BlockHash (13), "a2b4c3d5");
+
+  mockXayaServer->SetBestBlock (10, TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+  EXPECT_EQ (GetState (g), State::CATCHING_UP);
+
+  CallBlockDetach (g, "reqtoken", BlockHash (12), BlockHash (13), 13,
+                   NO_SEQ_MISMATCH);
+  CallBlockDetach (g, "reqtoken", BlockHash (11), BlockHash (12), 12,
+                   NO_SEQ_MISMATCH);
+  EXPECT_EQ (GetState (g), State::CATCHING_UP);
+  ExpectGameState (BlockHash (13), "a2b4c3d5");
 
   CallBlockDetach (g, "reqtoken",
                    TestGame::GenesisBlockHash (), BlockHash (11), 11,
                    NO_SEQ_MISMATCH);
   EXPECT_EQ (GetState (g), State::UP_TO_DATE);
   ExpectGameState (TestGame::GenesisBlockHash (), "");
+  EXPECT_EQ (rules.backwardsCalls, 1);
+
+  UndoData undo;
+  EXPECT_FALSE (storage.GetUndoData (BlockHash (11), undo));
+  EXPECT_FALSE (storage.GetUndoData (BlockHash (13), undo));
+}
+
+TEST_F (SyncingTests, CatchingUpReorgMerged)
+{
+  rules.mergeUndo = true;
+
+  EXPECT_CALL (*mockXayaServer,
+               game_sendupdates (BlockHash (12).ToHex (), GAME_ID))
+      .WillOnce (Return (SendupdatesResponse (BlockHash (21), "reqtoken")));
+
+  AttachBlock (g, BlockHash (11), Moves ("a0b1"));
+  AttachBlock (g, BlockHash (12), Moves ("a2c3"));
+
+  mockXayaServer->SetBestBlock (11, BlockHash (21));
+  ReinitialiseState (g);
+  EXPECT_EQ (GetState (g), State::CATCHING_UP);
+
+  CallBlockDetach (g, "reqtoken", BlockHash (11), BlockHash (12), 12,
+                   NO_SEQ_MISMATCH);
+  CallBlockDetach (g, "reqtoken",
+                   TestGame::GenesisBlockHash (), BlockHash (11), 11,
+                   NO_SEQ_MISMATCH);
+  ExpectGameState (BlockHash (12), "a2b1c3");
+
+  /* The queued detaches are undone before attaching the new branch.  */
+  CallBlockAttach (g, "reqtoken",
+                   TestGame::GenesisBlockHash (), BlockHash (21), 11,
+                   Moves ("x7"), NO_SEQ_MISMATCH);
+  EXPECT_EQ (GetState (g), State::UP_TO_DATE);
+  ExpectGameState (BlockHash (21), "x7");
+  EXPECT_EQ (rules.backwardsCalls, 1);
+}
+
+TEST_F (SyncingTests, CatchingUpDetachMismatch)
+{
+  rules.mergeUndo = true;
+
+  {
+    InSequence dummy;
+    EXPECT_CALL (*mockXayaServer,
+                 game_sendupdates (BlockHash (12).ToHex (), GAME_ID))
+        .WillOnce (Return (SendupdatesResponse (TestGame::GenesisBlockHash (),
+                                                "a")));
+    EXPECT_CALL (*mockXayaServer,
+                 game_sendupdates (BlockHash (11).ToHex (), GAME_ID))
+        .WillOnce (Return (SendupdatesResponse (TestGame::GenesisBlockHash (),
+                                                "b")));
+  }
+
+  AttachBlock (g, BlockHash (11), Moves ("a0b1"));
+  AttachBlock (g, BlockHash (12), Moves ("a2c3"));
+
+  mockXayaServer->SetBestBlock (10, TestGame::GenesisBlockHash ());
+  ReinitialiseState (g);
+
+  /* The second detach does not match the queued one.  The first is still
+     undone before the state is reinitialised.  */
+  CallBlockDetach (g, "a", BlockHash (11), BlockHash (12), 12,
+                   NO_SEQ_MISMATCH);
+  CallBlockDetach (g, "a", BlockHash (19), BlockHash (20), 20,
+                   NO_SEQ_MISMATCH);
+  EXPECT_EQ (GetState (g), State::CATCHING_UP);
+  ExpectGameState (BlockHash (11), "a0b1");
+
+  CallBlockDetach (g, "b",
+                   TestGame::GenesisBlockHash (), BlockHash (11), 11,
+                   NO_SEQ_MISMATCH);
+  EXPECT_EQ (GetState (g), State::UP_TO_DATE);
+  ExpectGameState (TestGame::GenesisBlockHash (), "");
 }
 
 TEST_F (SyncingTests, CatchingUpMultistep)
@@ -1552,11 +2196,12 @@ TEST_F (PendingMoveUpdateTests, CatchingUp)
   EXPECT_EQ (GetState (g), State::CATCHING_UP);
   ExpectGameState (BlockHash (11), "a0b1");
 
+  /* The detach is queued until the next attach or the target block.  */
   CallBlockDetach (g, "reqtoken",
                    TestGame::GenesisBlockHash (), BlockHash (11), 11,
                    NO_SEQ_MISMATCH);
   EXPECT_EQ (GetState (g), State::CATCHING_UP);
-  ExpectGameState (TestGame::GenesisBlockHash (), "");
+  ExpectGameState (BlockHash (11), "a0b1");
 
   CallPendingMove (g, Moves ("ax")[0]);
 
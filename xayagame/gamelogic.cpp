@@ -217,6 +217,20 @@ GameLogic::GameStateToJson (const GameStateData& state)
   return state;
 }
 
+void
+GameLogic::WriteGameStateJson (const GameStateData& state,
+                               JsonStreamWriter& out)
+{
+  out.Value (GameStateToJson (state));
+}
+
+bool
+GameLogic::MergeUndoData (const std::vector<UndoData>& undos,
+                          UndoData& merged)
+{
+  return false;
+}
+
 /* ************************************************************************** */
 
 GameStateData
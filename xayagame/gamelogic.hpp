@@ -5,6 +5,7 @@
 #ifndef XAYAGAME_GAMELOGIC_HPP
 #define XAYAGAME_GAMELOGIC_HPP
 
+#include "jsonwriter.hpp"
 #include "storage.hpp"
 
 #include "rpc-stubs/xayarpcclient.h"
@@ -15,6 +16,7 @@
 #include <json/json.h>
 
 #include <string>
+#include <vector>
 
 namespace xaya
 {
@@ -85,6 +87,7 @@ protected:
   /**
    * Returns the configured RPC connection to Xaya Core.  Must only be called
    * after InitialiseGameContext was invoked with a non-null RPC client.
+   * With DefaultMain, the client is safe to use from multiple threads.
    */
   XayaRpcClient& GetXayaRpc ();
 
@@ -283,6 +286,29 @@ public:
    */
   virtual Json::Value GameStateToJson (const GameStateData& state);
 
+  /**
+   * Writes the same JSON as GameStateToJson directly to a streaming writer.
+   * Games with big states can override this to produce the output
+   * incrementally, without building it as Json::Value.  The default
+   * implementation just writes the result of GameStateToJson.
+   */
+  virtual void WriteGameStateJson (const GameStateData& state,
+                                   JsonStreamWriter& out);
+
+  /**
+   * Merges the undo data of a series of consecutive blocks (given in the
+   * order in which they were attached) into a single undo data value, which
+   * can be passed to ProcessBackwards together with the block data of the
+   * first block to detach all of them in one step.  This is used by Game
+   * to undo reorgs while catching up.
+   *
+   * Returns false if the game does not support this, which is what
+   * the default implementation does.  In that case, blocks are always
+   * detached one by one.
+   */
+  virtual bool MergeUndoData (const std::vector<UndoData>& undos,
+                              UndoData& merged);
+
 };
 
 /**
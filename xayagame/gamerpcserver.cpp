@@ -4,11 +4,68 @@
 
 #include "gamerpcserver.hpp"
 
+#include <jsonrpccpp/common/errors.h>
+#include <jsonrpccpp/common/exception.h>
+
 #include <glog/logging.h>
 
+#include <vector>
+
 namespace xaya
 {
 
+namespace
+{
+
+/**
+ * Parses the known block passed to waitforchange.  Invalid or empty
+ * values yield the null hash.
+ */
+uint256
+ParseKnownBlock (const std::string& knownBlock)
+{
+  uint256 oldBlock;
+  oldBlock.SetNull ();
+  if (!knownBlock.empty () && !oldBlock.FromHex (knownBlock))
+    {
+      LOG (ERROR)
+          << "Invalid block hash passed as known block: " << knownBlock;
+      oldBlock.SetNull ();
+    }
+
+  return oldBlock;
+}
+
+/**
+ * Converts the new block hash to the result of waitforchange.
+ */
+std::string
+WaitForChangeResult (const uint256& newBlock)
+{
+  /* If there is no best block so far, return empty string.  */
+  if (newBlock.IsNull ())
+    return "";
+
+  /* Otherwise, return the block hash.  */
+  return newBlock.ToHex ();
+}
+
+/**
+ * Extracts the single positional argument of an asynchronous wait method,
+ * throwing an invalid-params error if there is none.
+ */
+const Json::Value&
+SingleParam (const Json::Value& params)
+{
+  if (!params.isArray () || params.size () != 1)
+    throw jsonrpc::JsonRpcException (jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+                                     "expected a single parameter");
+
+  return params[0u];
+}
+
+} // anonymous namespace
+
 void
 GameRpcServer::stop ()
 {
@@ -51,25 +108,189 @@ GameRpcServer::waitforpendingchange (const int oldVersion)
   return game.WaitForPendingChange (oldVersion);
 }
 
+Json::Value
+GameRpcServer::waitforpendingdelta (const int oldVersion)
+{
+  LOG (INFO) << "RPC method called: waitforpendingdelta " << oldVersion;
+  return game.WaitForPendingDelta (oldVersion);
+}
+
+void
+GameRpcServer::AddRawStateMethods (const Game& g, RpcRawResultHandler& h)
+{
+  h.AddMethod ("getcurrentstate", [&g] (std::ostream& out)
+    {
+      LOG (INFO) << "RPC method called: getcurrentstate";
+      g.WriteCurrentJsonState (out);
+    });
+  h.AddMethod ("getpendingstate", [&g] (std::ostream& out)
+    {
+      LOG (INFO) << "RPC method called: getpendingstate";
+      out << g.GetPendingJsonString ();
+    });
+}
+
+bool
+GameRpcServer::ProcessStateBatch (const Game& g, const Json::Value& batch,
+                                  Json::Value& responses)
+{
+  /* The state methods of the calls in the batch.  */
+  enum class StateMethod
+  {
+    CURRENT,
+    NULL_STATE,
+    PENDING,
+  };
+
+  /* We only handle batches where all calls are well-formed state requests
+     without parameters.  Everything else is processed call-by-call by
+     the normal server, which also takes care of error reporting.  */
+  std::vector<StateMethod> methods;
+  bool current = false;
+  bool nullState = false;
+  bool pending = false;
+  for (const auto& req : batch)
+    {
+      if (!req.isObject () || req["jsonrpc"] != "2.0"
+            || !req["method"].isString ())
+        return false;
+
+      const auto& params = req["params"];
+      if (!params.isNull () && !(params.isArray () && params.empty ())
+            && !(params.isObject () && params.empty ()))
+        return false;
+
+      const std::string method = req["method"].asString ();
+      if (method == "getcurrentstate")
+        {
+          methods.push_back (StateMethod::CURRENT);
+          current = true;
+        }
+      else if (method == "getnullstate")
+        {
+          methods.push_back (StateMethod::NULL_STATE);
+          nullState = true;
+        }
+      else if (method == "getpendingstate")
+        {
+          methods.push_back (StateMethod::PENDING);
+          pending = true;
+        }
+      else
+        return false;
+    }
+
+  LOG (INFO) << "RPC batch with " << batch.size () << " state calls";
+
+  Json::Value currentRes, nullRes, pendingRes;
+  try
+    {
+      g.GetJsonStates (current ? &currentRes : nullptr,
+                       nullState ? &nullRes : nullptr,
+                       pending ? &pendingRes : nullptr);
+    }
+  catch (const jsonrpc::JsonRpcException&)
+    {
+      /* This happens if the pending state is requested but not available.
+         Let the server report the error for the affected calls.  */
+      return false;
+    }
+
+  for (unsigned i = 0; i < batch.size (); ++i)
+    {
+      const auto& req = batch[i];
+      if (!req.isMember ("id"))
+        continue;
+
+      const Json::Value* result = nullptr;
+      switch (methods[i])
+        {
+        case StateMethod::CURRENT:
+          result = &currentRes;
+          break;
+        case StateMethod::NULL_STATE:
+          result = &nullRes;
+          break;
+        case StateMethod::PENDING:
+          result = &pendingRes;
+          break;
+        }
+      CHECK (result != nullptr);
+
+      responses.append (RpcBatchHandler::ResultResponse (req["id"], *result));
+    }
+
+  return true;
+}
+
+void
+GameRpcServer::AddAsyncWaitMethods (const Game& g,
+                                    jsonrpc::AbstractServerConnector& conn)
+{
+  auto* srv = dynamic_cast<AsyncRpcServerConnector*> (&conn);
+  if (srv == nullptr)
+    return;
+
+  srv->AddAsyncMethod ("waitforchange",
+      [&g] (const Json::Value& params,
+            const AsyncRpcServerConnector::ResultCallback& cb)
+        {
+          const auto& knownBlock = SingleParam (params);
+          if (!knownBlock.isString ())
+            throw jsonrpc::JsonRpcException (
+                jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+                "known block must be a string");
+
+          LOG (INFO)
+              << "RPC method called: waitforchange " << knownBlock.asString ();
+          g.AsyncWaitForChange (ParseKnownBlock (knownBlock.asString ()),
+                                [cb] (const uint256& newBlock)
+                                  {
+                                    cb (WaitForChangeResult (newBlock));
+                                  });
+        });
+
+  srv->AddAsyncMethod ("waitforpendingchange",
+      [&g] (const Json::Value& params,
+            const AsyncRpcServerConnector::ResultCallback& cb)
+        {
+          const auto& oldVersion = SingleParam (params);
+          if (!oldVersion.isInt ())
+            throw jsonrpc::JsonRpcException (
+                jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+                "known version must be an integer");
+
+          LOG (INFO)
+              << "RPC method called: waitforpendingchange "
+              << oldVersion.asInt ();
+          g.AsyncWaitForPendingChange (oldVersion.asInt (), cb);
+        });
+
+  srv->AddAsyncMethod ("waitforpendingdelta",
+      [&g] (const Json::Value& params,
+            const AsyncRpcServerConnector::ResultCallback& cb)
+        {
+          const auto& oldVersion = SingleParam (params);
+          if (!oldVersion.isInt ())
+            throw jsonrpc::JsonRpcException (
+                jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+                "known version must be an integer");
+
+          LOG (INFO)
+              << "RPC method called: waitforpendingdelta "
+              << oldVersion.asInt ();
+          g.AsyncWaitForPendingDelta (oldVersion.asInt (), cb);
+        });
+}
+
 std::string
 GameRpcServer::DefaultWaitForChange (const Game& g,
                                      const std::string& knownBlock)
 {
-  uint256 oldBlock;
-  oldBlock.SetNull ();
-  if (!knownBlock.empty () && !oldBlock.FromHex (knownBlock))
-    LOG (ERROR)
-        << "Invalid block hash passed as known block: " << knownBlock;
-
   uint256 newBlock;
-  g.WaitForChange (oldBlock, newBlock);
-
-  /* If there is no best block so far, return empty string.  */
-  if (newBlock.IsNull ())
-    return "";
+  g.WaitForChange (ParseKnownBlock (knownBlock), newBlock);
 
-  /* Otherwise, return the block hash.  */
-  return newBlock.ToHex ();
+  return WaitForChangeResult (newBlock);
 }
 
 } // namespace xaya
@@ -5,7 +5,11 @@
 #ifndef XAYAGAME_GAMERPCSERVER_HPP
 #define XAYAGAME_GAMERPCSERVER_HPP
 
+#include "asyncrpc.hpp"
 #include "game.hpp"
+#include "rpcbatch.hpp"
+#include "rpcencoding.hpp"
+#include "rpcrawresult.hpp"
 
 #include "rpc-stubs/gamerpcserverstub.h"
 
@@ -24,6 +28,11 @@ namespace xaya
  * Games which want to expose additional specific functions should create
  * their own implementation and may use the Game functions directly for
  * implementing them.
+ *
+ * JSON-RPC batches consisting only of the state methods are answered with
+ * a single acquisition of the game lock (see ProcessStateBatch).
+ *
+ * Clients can request CBOR-encoded responses, see RpcEncodingHandler.
  */
 class GameRpcServer : public GameRpcServerStub
 {
@@ -33,11 +42,29 @@ private:
   /** The game instance whose methods we expose through RPC.  */
   Game& game;
 
+  /** Handler answering the state methods with cached strings.  */
+  RpcRawResultHandler rawHandler;
+
+  /** Handler for answering batches of state calls as a whole.  */
+  RpcBatchHandler batchHandler;
+
+  /** Handler for clients that opt into a binary response encoding.  */
+  RpcEncodingHandler encodingHandler;
+
 public:
 
   explicit GameRpcServer (Game& g, jsonrpc::AbstractServerConnector& conn)
-    : GameRpcServerStub(conn), game(g)
-  {}
+    : GameRpcServerStub(conn), game(g), rawHandler(conn),
+      batchHandler(conn, [this] (const Json::Value& batch,
+                                 Json::Value& responses)
+        {
+          return ProcessStateBatch (game, batch, responses);
+        }),
+      encodingHandler(conn)
+  {
+    AddRawStateMethods (game, rawHandler);
+    AddAsyncWaitMethods (game, conn);
+  }
 
   virtual void stop () override;
   virtual Json::Value getcurrentstate () override;
@@ -45,6 +72,7 @@ public:
   virtual Json::Value getpendingstate () override;
   virtual std::string waitforchange (const std::string& knownBlock) override;
   virtual Json::Value waitforpendingchange (int oldVersion) override;
+  virtual Json::Value waitforpendingdelta (int oldVersion) override;
 
   /**
    * Implements the standard waitforchange RPC method independent of a
@@ -54,6 +82,35 @@ public:
   static std::string DefaultWaitForChange (const Game& g,
                                            const std::string& knownBlock);
 
+  /**
+   * Adds the standard methods to a RpcRawResultHandler that can be answered
+   * directly with the serialised JSON cached by the Game instance
+   * (getcurrentstate and getpendingstate).  The current state is written
+   * with Game::WriteCurrentJsonState, which fills the cache on a miss.
+   * Customised RPC servers can use this to speed up those methods as well.
+   */
+  static void AddRawStateMethods (const Game& g, RpcRawResultHandler& h);
+
+  /**
+   * Tries to process a JSON-RPC batch consisting only of getcurrentstate,
+   * getnullstate and getpendingstate calls.  All of them are answered
+   * from Game::GetJsonStates, i.e. with a single acquisition of the game
+   * lock.  This is meant as callback for a RpcBatchHandler, and can be
+   * used by customised RPC servers as well.
+   */
+  static bool ProcessStateBatch (const Game& g, const Json::Value& batch,
+                                 Json::Value& responses);
+
+  /**
+   * If the connector supports asynchronous methods (SocketRpcServer and
+   * CompressingHttpServer), registers waitforchange, waitforpendingchange
+   * and waitforpendingdelta with it based on Game::AsyncWaitForChange and
+   * friends.  That way, waiting clients do not block a server thread.
+   * For other connectors, this does nothing.
+   */
+  static void AddAsyncWaitMethods (const Game& g,
+                                   jsonrpc::AbstractServerConnector& conn);
+
 };
 
 } // namespace xaya
@@ -1,4 +1,4 @@
-// Copyright (C) 2019 The Xaya developers
+// Copyright (C) 2019-2020 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
@@ -160,6 +160,18 @@ public:
     storage->PruneUndoData (height);
   }
 
+  bool
+  GetUndoStats (UndoStats& stats) const override
+  {
+    return storage->GetUndoStats (stats);
+  }
+
+  void
+  SetCatchingUp (const bool val) override
+  {
+    storage->SetCatchingUp (val);
+  }
+
   void
   BeginTransaction () override
   {
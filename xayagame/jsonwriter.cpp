@@ -0,0 +1,180 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsonwriter.hpp"
+
+#include <glog/logging.h>
+
+namespace xaya
+{
+
+namespace
+{
+
+/**
+ * Configures a StreamWriterBuilder for producing compact JSON.
+ */
+void
+SetCompactSettings (Json::StreamWriterBuilder& wbuilder)
+{
+  wbuilder["commentStyle"] = "None";
+  wbuilder["indentation"] = "";
+  wbuilder["enableYAMLCompatibility"] = false;
+}
+
+} // anonymous namespace
+
+std::string
+CompactJson (const Json::Value& val)
+{
+  Json::StreamWriterBuilder wbuilder;
+  SetCompactSettings (wbuilder);
+  return Json::writeString (wbuilder, val);
+}
+
+JsonStreamWriter::JsonStreamWriter (std::ostream& o)
+  : out(o)
+{
+  Json::StreamWriterBuilder wbuilder;
+  SetCompactSettings (wbuilder);
+  valueWriter.reset (wbuilder.newStreamWriter ());
+}
+
+void
+JsonStreamWriter::BeginValue ()
+{
+  CHECK (!complete) << "JSON document has already been completed";
+  if (stack.empty ())
+    return;
+
+  auto& top = stack.back ();
+  if (top.isObject)
+    {
+      CHECK (top.hasKey) << "Missing key for value in JSON object";
+      top.hasKey = false;
+      return;
+    }
+
+  if (!top.empty)
+    out << ',';
+  top.empty = false;
+}
+
+void
+JsonStreamWriter::EndValue ()
+{
+  if (stack.empty ())
+    complete = true;
+}
+
+void
+JsonStreamWriter::BeginObject ()
+{
+  BeginValue ();
+  out << '{';
+  stack.push_back ({true, true, false});
+}
+
+void
+JsonStreamWriter::EndObject ()
+{
+  CHECK (!stack.empty () && stack.back ().isObject)
+      << "No JSON object is open";
+  CHECK (!stack.back ().hasKey) << "Missing value for key in JSON object";
+  stack.pop_back ();
+  out << '}';
+  EndValue ();
+}
+
+void
+JsonStreamWriter::BeginArray ()
+{
+  BeginValue ();
+  out << '[';
+  stack.push_back ({false, true, false});
+}
+
+void
+JsonStreamWriter::EndArray ()
+{
+  CHECK (!stack.empty () && !stack.back ().isObject)
+      << "No JSON array is open";
+  stack.pop_back ();
+  out << ']';
+  EndValue ();
+}
+
+void
+JsonStreamWriter::Key (const std::string& key)
+{
+  CHECK (!stack.empty () && stack.back ().isObject)
+      << "Keys can only be written inside JSON objects";
+  auto& top = stack.back ();
+  CHECK (!top.hasKey) << "Missing value for previous key in JSON object";
+
+  if (!top.empty)
+    out << ',';
+  top.empty = false;
+  top.hasKey = true;
+
+  out << Json::valueToQuotedString (key.c_str ()) << ':';
+}
+
+void
+JsonStreamWriter::String (const std::string& val)
+{
+  BeginValue ();
+  out << Json::valueToQuotedString (val.c_str ());
+  EndValue ();
+}
+
+void
+JsonStreamWriter::Int (const int64_t val)
+{
+  BeginValue ();
+  out << Json::valueToString (static_cast<Json::LargestInt> (val));
+  EndValue ();
+}
+
+void
+JsonStreamWriter::UInt (const uint64_t val)
+{
+  BeginValue ();
+  out << Json::valueToString (static_cast<Json::LargestUInt> (val));
+  EndValue ();
+}
+
+void
+JsonStreamWriter::Double (const double val)
+{
+  BeginValue ();
+  out << Json::valueToString (val);
+  EndValue ();
+}
+
+void
+JsonStreamWriter::Bool (const bool val)
+{
+  BeginValue ();
+  out << (val ? "true" : "false");
+  EndValue ();
+}
+
+void
+JsonStreamWriter::Null ()
+{
+  BeginValue ();
+  out << "null";
+  EndValue ();
+}
+
+void
+JsonStreamWriter::Value (const Json::Value& val)
+{
+  BeginValue ();
+  valueWriter->write (val, &out);
+  EndValue ();
+}
+
+} // namespace xaya
@@ -0,0 +1,126 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAGAME_JSONWRITER_HPP
+#define XAYAGAME_JSONWRITER_HPP
+
+#include <json/json.h>
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace xaya
+{
+
+/**
+ * Writer that produces compact JSON incrementally (SAX-style) on an output
+ * stream, without materialising the full document as Json::Value first.
+ * This allows big game states to be serialised straight into a file or
+ * reusable buffer without a temporary copy as Json::Value.
+ *
+ * The produced output is the same as serialising the corresponding
+ * Json::Value compactly, provided that object keys are written in sorted
+ * order (as Json::Value does).  Misuse (e.g. a value in an object without
+ * a key or unbalanced containers) is a programming error and CHECK'ed.
+ */
+class JsonStreamWriter
+{
+
+private:
+
+  /**
+   * Data about a currently open container.
+   */
+  struct Level
+  {
+
+    /** True if this is an object, false for an array.  */
+    bool isObject;
+
+    /** Whether nothing has been written into the container yet.  */
+    bool empty;
+
+    /** For objects, whether a key has been written and awaits its value.  */
+    bool hasKey;
+
+  };
+
+  /** The stream we write to.  */
+  std::ostream& out;
+
+  /** The currently open containers.  */
+  std::vector<Level> stack;
+
+  /** Set to true when a complete top-level value has been written.  */
+  bool complete = false;
+
+  /** Writer used for embedding Json::Value subtrees.  */
+  std::unique_ptr<Json::StreamWriter> valueWriter;
+
+  /**
+   * Prepares for writing a value, i.e. writes a separator if needed and
+   * checks that the value is allowed at this point.
+   */
+  void BeginValue ();
+
+  /**
+   * Updates the state after a full value has been written.
+   */
+  void EndValue ();
+
+public:
+
+  explicit JsonStreamWriter (std::ostream& o);
+
+  JsonStreamWriter () = delete;
+  JsonStreamWriter (const JsonStreamWriter&) = delete;
+  void operator= (const JsonStreamWriter&) = delete;
+
+  void BeginObject ();
+  void EndObject ();
+  void BeginArray ();
+  void EndArray ();
+
+  /**
+   * Writes the key for the next value in the current object.
+   */
+  void Key (const std::string& key);
+
+  void String (const std::string& val);
+  void Int (int64_t val);
+  void UInt (uint64_t val);
+  void Double (double val);
+  void Bool (bool val);
+  void Null ();
+
+  /**
+   * Writes a full Json::Value as value.  This can be used to embed smaller
+   * parts of the document that are easiest constructed as Json::Value.
+   */
+  void Value (const Json::Value& val);
+
+  /**
+   * Returns true if a complete top-level value has been written.
+   */
+  bool
+  IsComplete () const
+  {
+    return complete;
+  }
+
+};
+
+/**
+ * Serialises a JSON value in compact form (without any whitespace), which
+ * matches the output of JsonStreamWriter.  This is what we use whenever
+ * serialised JSON is sent to clients or cached.
+ */
+std::string CompactJson (const Json::Value& val);
+
+} // namespace xaya
+
+#endif // XAYAGAME_JSONWRITER_HPP
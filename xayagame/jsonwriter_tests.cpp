@@ -0,0 +1,153 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsonwriter.hpp"
+
+#include <gtest/gtest.h>
+
+#include <limits>
+#include <sstream>
+
+namespace xaya
+{
+namespace
+{
+
+Json::Value
+ParseJson (const std::string& str)
+{
+  std::istringstream in(str);
+  Json::Value res;
+  in >> res;
+  return res;
+}
+
+class JsonStreamWriterTests : public testing::Test
+{
+
+protected:
+
+  std::ostringstream out;
+  JsonStreamWriter w;
+
+  JsonStreamWriterTests ()
+    : w(out)
+  {}
+
+};
+
+TEST_F (JsonStreamWriterTests, Scalars)
+{
+  w.BeginArray ();
+  w.String ("foo \"bar\"\n\xc3\xa4");
+  w.Int (-42);
+  w.Int (std::numeric_limits<int64_t>::min ());
+  w.UInt (std::numeric_limits<uint64_t>::max ());
+  w.Double (1.5);
+  w.Bool (true);
+  w.Bool (false);
+  w.Null ();
+  w.EndArray ();
+  EXPECT_TRUE (w.IsComplete ());
+
+  Json::Value expected(Json::arrayValue);
+  expected.append ("foo \"bar\"\n\xc3\xa4");
+  expected.append (-42);
+  expected.append (static_cast<Json::Int64> (
+      std::numeric_limits<int64_t>::min ()));
+  expected.append (static_cast<Json::UInt64> (
+      std::numeric_limits<uint64_t>::max ()));
+  expected.append (1.5);
+  expected.append (true);
+  expected.append (false);
+  expected.append (Json::Value ());
+
+  EXPECT_EQ (out.str (), CompactJson (expected));
+  EXPECT_EQ (ParseJson (out.str ()), expected);
+}
+
+TEST_F (JsonStreamWriterTests, Nested)
+{
+  w.BeginObject ();
+  w.Key ("a");
+  w.BeginArray ();
+  w.BeginObject ();
+  w.EndObject ();
+  w.BeginArray ();
+  w.EndArray ();
+  w.Int (1);
+  w.EndArray ();
+  w.Key ("b");
+  w.BeginObject ();
+  w.Key ("x");
+  w.Value (ParseJson (R"({"foo": [1, 2, {"bar": null}]})"));
+  w.Key ("y");
+  w.String ("z");
+  w.EndObject ();
+  w.Key ("c");
+  w.Value (ParseJson ("42"));
+  w.EndObject ();
+  EXPECT_TRUE (w.IsComplete ());
+
+  const auto expected = ParseJson (R"({
+    "a": [{}, [], 1],
+    "b": {"x": {"foo": [1, 2, {"bar": null}]}, "y": "z"},
+    "c": 42
+  })");
+  EXPECT_EQ (out.str (), CompactJson (expected));
+}
+
+TEST_F (JsonStreamWriterTests, TopLevelScalar)
+{
+  EXPECT_FALSE (w.IsComplete ());
+  w.String ("foo");
+  EXPECT_TRUE (w.IsComplete ());
+  EXPECT_EQ (out.str (), "\"foo\"");
+}
+
+TEST_F (JsonStreamWriterTests, TopLevelValue)
+{
+  const auto val = ParseJson (R"({"foo": "bar", "abc": [1, 2, 3]})");
+  w.Value (val);
+  EXPECT_TRUE (w.IsComplete ());
+  EXPECT_EQ (out.str (), CompactJson (val));
+}
+
+using JsonStreamWriterDeathTest = JsonStreamWriterTests;
+
+TEST_F (JsonStreamWriterDeathTest, ValueWithoutKey)
+{
+  w.BeginObject ();
+  EXPECT_DEATH (w.Int (42), "Missing key");
+}
+
+TEST_F (JsonStreamWriterDeathTest, KeyWithoutValue)
+{
+  w.BeginObject ();
+  w.Key ("foo");
+  EXPECT_DEATH (w.Key ("bar"), "Missing value");
+  EXPECT_DEATH (w.EndObject (), "Missing value");
+}
+
+TEST_F (JsonStreamWriterDeathTest, KeyInArray)
+{
+  w.BeginArray ();
+  EXPECT_DEATH (w.Key ("foo"), "only be written inside JSON objects");
+}
+
+TEST_F (JsonStreamWriterDeathTest, Unbalanced)
+{
+  w.BeginArray ();
+  EXPECT_DEATH (w.EndObject (), "No JSON object");
+  EXPECT_DEATH (w.EndArray (); w.EndArray (), "No JSON array");
+}
+
+TEST_F (JsonStreamWriterDeathTest, AlreadyComplete)
+{
+  w.Null ();
+  EXPECT_DEATH (w.Null (), "already been completed");
+}
+
+} // anonymous namespace
+} // namespace xaya
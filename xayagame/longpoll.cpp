@@ -0,0 +1,120 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "longpoll.hpp"
+
+#include <glog/logging.h>
+
+namespace xaya
+{
+namespace internal
+{
+
+LongPollQueue::~LongPollQueue ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    if (worker == nullptr)
+      {
+        CHECK (waiting.empty ());
+        return;
+      }
+
+    if (!waiting.empty ())
+      LOG (INFO)
+          << "Completing " << waiting.size ()
+          << " waiting long-poll requests on shutdown";
+    for (auto& w : waiting)
+      ready.push_back (std::move (w.cb));
+    waiting.clear ();
+
+    shouldStop = true;
+    cv.notify_all ();
+  }
+
+  worker->join ();
+}
+
+void
+LongPollQueue::RunWorker ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  while (true)
+    {
+      const auto now = Clock::now ();
+      while (!waiting.empty () && waiting.front ().deadline <= now)
+        {
+          ready.push_back (std::move (waiting.front ().cb));
+          waiting.pop_front ();
+        }
+
+      if (!ready.empty ())
+        {
+          std::vector<Callback> toRun;
+          toRun.swap (ready);
+
+          lock.unlock ();
+          VLOG (1) << "Completing " << toRun.size () << " long-poll requests";
+          for (const auto& cb : toRun)
+            cb ();
+          lock.lock ();
+
+          continue;
+        }
+
+      if (shouldStop && waiting.empty ())
+        return;
+
+      if (waiting.empty ())
+        cv.wait (lock);
+      else
+        cv.wait_until (lock, waiting.front ().deadline);
+    }
+}
+
+void
+LongPollQueue::Add (Callback cb)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (!shouldStop);
+
+  if (worker == nullptr)
+    worker = std::make_unique<std::thread> ([this] ()
+      {
+        RunWorker ();
+      });
+
+  const bool wasEmpty = waiting.empty ();
+  waiting.push_back ({Clock::now () + timeout, std::move (cb)});
+
+  /* The worker only needs to recompute its wake-up time if this is the
+     first waiting request.  Otherwise, the new deadline is after the
+     one it is already waiting for.  */
+  if (wasEmpty)
+    cv.notify_all ();
+}
+
+void
+LongPollQueue::NotifyAll ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  if (waiting.empty ())
+    return;
+
+  for (auto& w : waiting)
+    ready.push_back (std::move (w.cb));
+  waiting.clear ();
+
+  cv.notify_all ();
+}
+
+size_t
+LongPollQueue::GetNumWaiting () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return waiting.size ();
+}
+
+} // namespace internal
+} // namespace xaya
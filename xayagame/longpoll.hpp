@@ -0,0 +1,131 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAGAME_LONGPOLL_HPP
+#define XAYAGAME_LONGPOLL_HPP
+
+/* This file is an implementation detail of Game and should not be
+   used directly by external code!  */
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace xaya
+{
+namespace internal
+{
+
+/**
+ * A queue of parked long-poll requests.  Each request is just a callback,
+ * which is invoked (exactly once) when the queue is notified about a change
+ * or when the request times out.  The callbacks are run on a single worker
+ * thread owned by the queue, so that any number of waiting requests can be
+ * kept without blocking a thread for each of them.
+ *
+ * Callbacks must not throw.  They may call Add on the queue again, except
+ * while it is being destroyed.
+ */
+class LongPollQueue
+{
+
+public:
+
+  /** Type of the callbacks.  */
+  using Callback = std::function<void ()>;
+
+  /** Clock used for the timeouts.  */
+  using Clock = std::chrono::steady_clock;
+
+private:
+
+  /**
+   * Data for a request that is waiting.
+   */
+  struct Waiter
+  {
+
+    /** The time at which the request times out.  */
+    Clock::time_point deadline;
+
+    /** The callback to invoke.  */
+    Callback cb;
+
+  };
+
+  /** The timeout for requests.  */
+  const Clock::duration timeout;
+
+  /** Lock for the state of the queue.  */
+  mutable std::mutex mut;
+
+  /** Condition variable to wake up the worker thread.  */
+  std::condition_variable cv;
+
+  /**
+   * Requests that are waiting.  Since all have the same timeout, they are
+   * also ordered by their deadline.
+   */
+  std::deque<Waiter> waiting;
+
+  /** Callbacks that are ready to be invoked.  */
+  std::vector<Callback> ready;
+
+  /** Set to true when the worker should stop.  */
+  bool shouldStop = false;
+
+  /** The worker thread (started when the first request is added).  */
+  std::unique_ptr<std::thread> worker;
+
+  /**
+   * Main function of the worker thread.
+   */
+  void RunWorker ();
+
+public:
+
+  /**
+   * Constructs the queue with the given timeout for requests.
+   */
+  explicit LongPollQueue (Clock::duration t)
+    : timeout(t)
+  {}
+
+  /**
+   * Invokes the callbacks of all still waiting requests and stops
+   * the worker thread.
+   */
+  ~LongPollQueue ();
+
+  LongPollQueue () = delete;
+  LongPollQueue (const LongPollQueue&) = delete;
+  void operator= (const LongPollQueue&) = delete;
+
+  /**
+   * Parks a new request with the given callback.
+   */
+  void Add (Callback cb);
+
+  /**
+   * Marks all currently waiting requests as ready, so that their callbacks
+   * will be invoked (asynchronously) by the worker thread.
+   */
+  void NotifyAll ();
+
+  /**
+   * Returns the number of requests that are currently waiting.
+   */
+  size_t GetNumWaiting () const;
+
+};
+
+} // namespace internal
+} // namespace xaya
+
+#endif // XAYAGAME_LONGPOLL_HPP
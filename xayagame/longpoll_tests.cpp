@@ -0,0 +1,129 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "longpoll.hpp"
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+namespace xaya
+{
+namespace internal
+{
+namespace
+{
+
+class LongPollQueueTests : public testing::Test
+{
+
+protected:
+
+  /** Number of callbacks that have been invoked.  */
+  std::atomic<unsigned> completed;
+
+  LongPollQueueTests ()
+  {
+    completed = 0;
+  }
+
+  /**
+   * Returns a callback that increments completed.
+   */
+  LongPollQueue::Callback
+  Counter ()
+  {
+    return [this] ()
+      {
+        ++completed;
+      };
+  }
+
+  /**
+   * Waits until the given number of callbacks have been invoked.
+   */
+  void
+  WaitForCompleted (const unsigned expected)
+  {
+    while (completed < expected)
+      std::this_thread::sleep_for (std::chrono::milliseconds (1));
+  }
+
+};
+
+TEST_F (LongPollQueueTests, NotifyCompletesAll)
+{
+  LongPollQueue queue(std::chrono::hours (1));
+
+  for (unsigned i = 0; i < 1000; ++i)
+    queue.Add (Counter ());
+  EXPECT_EQ (queue.GetNumWaiting (), 1000);
+  EXPECT_EQ (completed, 0);
+
+  queue.NotifyAll ();
+  WaitForCompleted (1000);
+  EXPECT_EQ (queue.GetNumWaiting (), 0);
+
+  /* Requests added later wait for the next notification.  */
+  queue.Add (Counter ());
+  std::this_thread::sleep_for (std::chrono::milliseconds (10));
+  EXPECT_EQ (completed, 1000);
+  queue.NotifyAll ();
+  WaitForCompleted (1001);
+}
+
+TEST_F (LongPollQueueTests, Timeout)
+{
+  LongPollQueue queue(std::chrono::milliseconds (10));
+
+  queue.Add (Counter ());
+  queue.Add (Counter ());
+  WaitForCompleted (2);
+  EXPECT_EQ (queue.GetNumWaiting (), 0);
+}
+
+TEST_F (LongPollQueueTests, ReAddFromCallback)
+{
+  LongPollQueue queue(std::chrono::hours (1));
+
+  queue.Add ([this, &queue] ()
+    {
+      ++completed;
+      queue.Add (Counter ());
+    });
+
+  queue.NotifyAll ();
+  WaitForCompleted (1);
+  while (queue.GetNumWaiting () == 0)
+    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+
+  queue.NotifyAll ();
+  WaitForCompleted (2);
+}
+
+TEST_F (LongPollQueueTests, DestructorCompletesWaiting)
+{
+  {
+    LongPollQueue queue(std::chrono::hours (1));
+    for (unsigned i = 0; i < 10; ++i)
+      queue.Add (Counter ());
+  }
+
+  EXPECT_EQ (completed, 10);
+}
+
+TEST_F (LongPollQueueTests, UnusedQueue)
+{
+  LongPollQueue queue(std::chrono::hours (1));
+  queue.NotifyAll ();
+  EXPECT_EQ (queue.GetNumWaiting (), 0);
+}
+
+} // anonymous namespace
+} // namespace internal
+} // namespace xaya
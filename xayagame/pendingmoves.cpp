@@ -6,6 +6,8 @@
 
 #include <glog/logging.h>
 
+#include <set>
+
 namespace xaya
 {
 
@@ -15,6 +17,44 @@ namespace
 /** Size of the in-memory block queue that is kept.  */
 constexpr size_t BLOCK_QUEUE_SIZE = 100;
 
+/**
+ * When the limits on pending moves are exceeded, we evict moves until
+ * the usage is below this percentage of the limits.
+ */
+constexpr unsigned EVICTION_TARGET_PERCENT = 90;
+
+/**
+ * Returns the approximate memory used by a JSON value in bytes.  This is
+ * not exact, but good enough to bound the memory used for pending moves.
+ */
+size_t
+ApproximateJsonSize (const Json::Value& val)
+{
+  size_t res = sizeof (Json::Value);
+
+  switch (val.type ())
+    {
+    case Json::stringValue:
+      res += val.asString ().size ();
+      break;
+
+    case Json::arrayValue:
+      for (const auto& entry : val)
+        res += ApproximateJsonSize (entry);
+      break;
+
+    case Json::objectValue:
+      for (auto it = val.begin (); it != val.end (); ++it)
+        res += it.name ().size () + ApproximateJsonSize (*it);
+      break;
+
+    default:
+      break;
+    }
+
+  return res;
+}
+
 } // anonymous namespace
 
 /**
@@ -35,12 +75,12 @@ public:
    * Sets the context based on the current state.
    */
   explicit ContextSetter (PendingMoveProcessor& p, const GameStateData& s,
-                          const Json::Value& blk)
+                          const Json::Value& blk, const bool concurrent)
     : proc(p)
   {
     CHECK (proc.ctx == nullptr);
     CHECK (blk.isObject ());
-    proc.ctx = std::make_unique<CurrentState> (s, blk);
+    proc.ctx = std::make_unique<CurrentState> (s, blk, concurrent);
   }
 
   /**
@@ -49,6 +89,7 @@ public:
   ~ContextSetter ()
   {
     CHECK (proc.ctx != nullptr);
+    proc.CallbackFinished ();
     proc.ctx.reset ();
   }
 
@@ -68,14 +109,195 @@ PendingMoveProcessor::GetConfirmedBlock () const
   return ctx->block;
 }
 
+bool
+PendingMoveProcessor::IsConcurrentCallback () const
+{
+  CHECK (ctx != nullptr) << "No callback is running at the moment";
+  return ctx->concurrent;
+}
+
 void
-PendingMoveProcessor::Reset (const GameStateData& state)
+PendingMoveProcessor::SetFullSyncInterval (
+    const std::chrono::steady_clock::duration interval)
 {
-  const auto mempool = GetXayaRpc ().getrawmempool ();
-  VLOG (1)
-      << "Rebuilding pending move state with " << mempool.size ()
-      << " transactions in the (full) mempool...";
+  fullSyncInterval = interval;
+}
+
+void
+PendingMoveProcessor::SetMemoryLimits (const size_t moves, const size_t bytes,
+                                       const EvictionPolicy policy)
+{
+  maxMoves = moves;
+  maxBytes = bytes;
+  evictionPolicy = policy;
+}
+
+PendingMoveProcessor::MemoryStats
+PendingMoveProcessor::GetMemoryStats () const
+{
+  MemoryStats res;
+  res.moves = pending.size ();
+  res.bytes = pendingBytes;
+  res.evicted = numEvicted;
+
+  return res;
+}
+
+bool
+PendingMoveProcessor::InsertPending (const uint256& txid, const Json::Value& mv)
+{
+  PendingMove entry;
+  entry.data = mv;
+  if (mv["name"].isString ())
+    entry.name = mv["name"].asString ();
+  entry.bytes = ApproximateJsonSize (mv);
+
+  const auto inserted = pending.emplace (txid, std::move (entry));
+  if (!inserted.second)
+    return false;
+
+  const auto& added = inserted.first->second;
+  pendingBytes += added.bytes;
+  UpdateNameCount (added.name, 1);
+
+  return true;
+}
+
+void
+PendingMoveProcessor::ErasePending (const uint256& txid)
+{
+  const auto mit = pending.find (txid);
+  if (mit == pending.end ())
+    return;
+
+  CHECK_GE (pendingBytes, mit->second.bytes);
+  pendingBytes -= mit->second.bytes;
+
+  UpdateNameCount (mit->second.name, -1);
+
+  pending.erase (mit);
+}
+
+void
+PendingMoveProcessor::UpdateNameCount (const std::string& name,
+                                       const int delta)
+{
+  CHECK (delta == 1 || delta == -1);
+
+  size_t& cnt = movesPerName[name];
+  if (cnt > 0)
+    namesByCount.erase (std::make_pair (cnt, name));
+
+  if (delta < 0)
+    {
+      CHECK_GT (cnt, 0);
+      --cnt;
+    }
+  else
+    ++cnt;
+
+  if (cnt > 0)
+    namesByCount.emplace (cnt, name);
+  else
+    {
+      movesPerName.erase (name);
+      orderPerName.erase (name);
+    }
+}
+
+void
+PendingMoveProcessor::RebuildOrderPerName ()
+{
+  orderPerName.clear ();
+  for (const auto& txid : order)
+    {
+      const auto mit = pending.find (txid);
+      if (mit != pending.end ())
+        orderPerName[mit->second.name].push_back (txid);
+    }
+}
+
+bool
+PendingMoveProcessor::ExceedsLimits (const unsigned percent) const
+{
+  if (maxMoves > 0 && 100 * pending.size () > percent * maxMoves)
+    return true;
+  if (maxBytes > 0 && 100 * pendingBytes > percent * maxBytes)
+    return true;
+
+  return false;
+}
+
+bool
+PendingMoveProcessor::EnforceLimits ()
+{
+  if (!ExceedsLimits (100))
+    return false;
+
+  const size_t oldSize = pending.size ();
+  while (!pending.empty () && ExceedsLimits (EVICTION_TARGET_PERCENT))
+    {
+      switch (evictionPolicy)
+        {
+        case EvictionPolicy::OLDEST_FIRST:
+          {
+            /* All moves in pending are also in order, so we are guaranteed
+               to find one before order runs empty.  */
+            CHECK (!order.empty ());
+            const uint256 txid = order.front ();
+            order.pop_front ();
+            ErasePending (txid);
+            break;
+          }
+
+        case EvictionPolicy::PER_NAME:
+          {
+            /* Evict the oldest move of the name with the most moves.  If
+               several names have the same number, use the first one.  */
+            CHECK (!namesByCount.empty ());
+            const size_t maxCount = namesByCount.rbegin ()->first;
+            const std::string name
+                = namesByCount.lower_bound (
+                    std::make_pair (maxCount, std::string ()))->second;
+
+            /* All moves in pending are also in order, so we are guaranteed
+               to find one for the name.  */
+            auto& queue = orderPerName[name];
+            while (true)
+              {
+                CHECK (!queue.empty ());
+                const uint256 txid = queue.front ();
+                queue.pop_front ();
+
+                const auto mit = pending.find (txid);
+                if (mit != pending.end () && mit->second.name == name)
+                  {
+                    ErasePending (txid);
+                    break;
+                  }
+              }
+            break;
+          }
+
+        default:
+          LOG (FATAL)
+              << "Invalid eviction policy: "
+              << static_cast<int> (evictionPolicy);
+        }
+    }
 
+  numEvicted += oldSize - pending.size ();
+  LOG (WARNING)
+      << "Evicted " << (oldSize - pending.size ()) << " pending moves"
+      << " due to the memory limits, keeping " << pending.size ()
+      << " moves with approximately " << pendingBytes << " bytes";
+
+  return true;
+}
+
+void
+PendingMoveProcessor::Replay (const GameStateData& state, const bool concurrent)
+{
   /* We clear the state in any case, even if the blockQueue is empty.  This is
      fine, as Clear is not supposed to have a context anyway.  And it will
      ensure that we get at least an empty state if we can't process pending
@@ -88,28 +310,89 @@ PendingMoveProcessor::Reset (const GameStateData& state)
   if (blockQueue.empty ())
     LOG (WARNING) << "Block queue is empty, ignoring pending moves for now";
   else
-    setter = std::make_unique<ContextSetter> (*this, state, blockQueue.back ());
+    setter = std::make_unique<ContextSetter> (*this, state, blockQueue.back (),
+                                              concurrent);
 
-  std::map<uint256, Json::Value> newPending;
-  for (const auto& txidStr : mempool)
+  std::deque<uint256> newOrder;
+  std::set<uint256> added;
+  for (const auto& txid : order)
     {
-      uint256 txid;
-      CHECK (txidStr.isString ());
-      CHECK (txid.FromHex (txidStr.asString ()));
-
       const auto mit = pending.find (txid);
       if (mit == pending.end ())
         continue;
 
-      newPending.emplace (txid, mit->second);
+      if (!added.insert (txid).second)
+        continue;
+
+      newOrder.push_back (txid);
       if (ctx != nullptr)
-        AddPendingMove (mit->second);
+        AddPendingMove (mit->second.data);
     }
 
+  order = std::move (newOrder);
+  RebuildOrderPerName ();
+}
+
+void
+PendingMoveProcessor::Reset (const GameStateData& state)
+{
+  const auto now = std::chrono::steady_clock::now ();
+  if (fullSyncInterval == std::chrono::steady_clock::duration::zero ()
+        || now - lastFullSync >= fullSyncInterval)
+    needFullSync = true;
+
+  /* Determine the txids of the moves that are still pending, in the order
+     in which we want to process them.  */
+  std::vector<uint256> newOrder;
+  if (needFullSync)
+    {
+      const auto mempool = GetXayaRpc ().getrawmempool ();
+      VLOG (1)
+          << "Rebuilding pending move state with " << mempool.size ()
+          << " transactions in the (full) mempool...";
+
+      for (const auto& txidStr : mempool)
+        {
+          uint256 txid;
+          CHECK (txidStr.isString ());
+          CHECK (txid.FromHex (txidStr.asString ()));
+
+          if (pending.count (txid) > 0)
+            newOrder.push_back (txid);
+        }
+
+      needFullSync = false;
+      lastFullSync = now;
+    }
+  else
+    {
+      VLOG (1)
+          << "Rebuilding pending move state incrementally from "
+          << pending.size () << " known moves...";
+
+      for (const auto& txid : order)
+        if (pending.count (txid) > 0)
+          newOrder.push_back (txid);
+    }
+
+  /* Drop all moves that are no longer pending.  */
+  const std::set<uint256> stillPending(newOrder.begin (), newOrder.end ());
+  const size_t oldSize = pending.size ();
+  std::vector<uint256> dropped;
+  for (const auto& entry : pending)
+    if (stillPending.count (entry.first) == 0)
+      dropped.push_back (entry.first);
+  for (const auto& txid : dropped)
+    ErasePending (txid);
+
   VLOG (1)
-      << "Sync with real mempool reduced size of pending moves from "
-      << pending.size () << " to " << newPending.size ();
-  pending = std::move (newPending);
+      << "Sync with mempool reduced size of pending moves from "
+      << oldSize << " to " << pending.size ();
+  order.assign (newOrder.begin (), newOrder.end ());
+  RebuildOrderPerName ();
+
+  EnforceLimits ();
+  Replay (state, false);
 }
 
 namespace
@@ -155,6 +438,14 @@ PendingMoveProcessor::ProcessAttachedBlock (const GameStateData& state,
   while (blockQueue.size () > BLOCK_QUEUE_SIZE)
     blockQueue.pop_front ();
 
+  /* Moves confirmed in the block are no longer pending.  This is what
+     the incremental mode relies on, and is also correct (but redundant)
+     when we sync with the full mempool.  */
+  const auto& mvArray = blockData["moves"];
+  CHECK (mvArray.isArray ());
+  for (const auto& mv : mvArray)
+    ErasePending (GetMoveTxid (mv));
+
   Reset (state);
 }
 
@@ -168,10 +459,7 @@ PendingMoveProcessor::ProcessDetachedBlock (const GameStateData& state,
   const auto& mvArray = blockData["moves"];
   CHECK (mvArray.isArray ());
   for (const auto& mv : mvArray)
-    {
-      const uint256 txid = GetMoveTxid (mv);
-      pending.emplace (txid, mv);
-    }
+    InsertPending (GetMoveTxid (mv), mv);
 
   VLOG (1)
       << "Updating pending state for detached block "
@@ -193,31 +481,135 @@ PendingMoveProcessor::ProcessDetachedBlock (const GameStateData& state,
         }
     }
 
+  /* The moves from the detached block should typically be back in the
+     mempool, but since we have no information about their order with
+     respect to the other moves (and other changes to the mempool may
+     have happened), always do a full sync here.  */
+  needFullSync = true;
   Reset (state);
 }
 
 void
 PendingMoveProcessor::ProcessMove (const GameStateData& state,
-                                   const Json::Value& mv)
+                                   const Json::Value& mv,
+                                   const bool concurrent)
 {
   const uint256 txid = GetMoveTxid (mv);
   VLOG (1) << "Processing pending move: " << txid.ToHex ();
   VLOG (2) << "Full data: " << mv;
 
-  const auto inserted = pending.emplace (txid, mv);
-  if (!inserted.second)
+  if (!InsertPending (txid, mv))
     {
       VLOG (1) << "The move is already known";
       return;
     }
+  order.push_back (txid);
+  orderPerName[pending.at (txid).name].push_back (txid);
+
+  /* If moves have been evicted, they may have been added to the pending
+     state already.  Thus we have to rebuild it from the moves that are
+     kept (which may or may not include the new one).  */
+  if (EnforceLimits ())
+    {
+      Replay (state, concurrent);
+      return;
+    }
 
   if (blockQueue.empty ())
     LOG (WARNING) << "Block queue is empty, ignoring pending move for now";
   else
     {
-      ContextSetter setter(*this, state, blockQueue.back ());
+      ContextSetter setter(*this, state, blockQueue.back (), concurrent);
       AddPendingMove (mv);
     }
 }
 
+namespace
+{
+
+/**
+ * Returns true if the given value, when used inside a JSON Merge Patch,
+ * would not reproduce itself, i.e. if it contains objects with null members.
+ * Arrays are copied as a whole by a merge patch, so their content does
+ * not matter.
+ */
+bool
+HasNullMembers (const Json::Value& val)
+{
+  if (!val.isObject ())
+    return false;
+
+  for (const auto& member : val)
+    if (member.isNull () || HasNullMembers (member))
+      return true;
+
+  return false;
+}
+
+/**
+ * Computes a merge patch from oldVal to newVal, assuming that both are
+ * objects.  Returns false if newVal contains null members that can't be
+ * represented in the patch.
+ */
+bool
+ObjectMergePatch (const Json::Value& oldVal, const Json::Value& newVal,
+                  Json::Value& patch)
+{
+  CHECK (oldVal.isObject () && newVal.isObject ());
+  patch = Json::Value (Json::objectValue);
+
+  for (const auto& key : oldVal.getMemberNames ())
+    if (!newVal.isMember (key))
+      patch[key] = Json::Value ();
+
+  for (const auto& key : newVal.getMemberNames ())
+    {
+      const auto& n = newVal[key];
+      if (n.isNull ())
+        return false;
+
+      if (!oldVal.isMember (key))
+        {
+          if (HasNullMembers (n))
+            return false;
+          patch[key] = n;
+          continue;
+        }
+
+      const auto& o = oldVal[key];
+      if (o == n)
+        continue;
+
+      if (o.isObject () && n.isObject ())
+        {
+          Json::Value sub;
+          if (!ObjectMergePatch (o, n, sub))
+            return false;
+          patch[key] = sub;
+          continue;
+        }
+
+      if (HasNullMembers (n))
+        return false;
+      patch[key] = n;
+    }
+
+  return true;
+}
+
+} // anonymous namespace
+
+bool
+PendingMoveProcessor::ToJsonDelta (const Json::Value& oldJson,
+                                   const Json::Value& newJson,
+                                   Json::Value& delta) const
+{
+  /* A merge patch that is not an object replaces the target as a whole.
+     That is not useful as delta, so we only handle objects.  */
+  if (!oldJson.isObject () || !newJson.isObject ())
+    return false;
+
+  return ObjectMergePatch (oldJson, newJson, delta);
+}
+
 } // namespace xaya
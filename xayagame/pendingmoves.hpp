@@ -12,9 +12,15 @@
 
 #include <json/json.h>
 
+#include <chrono>
+#include <cstdint>
 #include <deque>
 #include <memory>
 #include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace xaya
 {
@@ -28,8 +34,63 @@ namespace xaya
 class PendingMoveProcessor : public GameProcessorWithContext
 {
 
+public:
+
+  /**
+   * Policies for choosing which moves to evict if the configured limits
+   * on pending moves are exceeded.
+   */
+  enum class EvictionPolicy
+  {
+
+    /** The oldest pending moves are evicted first.  */
+    OLDEST_FIRST,
+
+    /**
+     * The oldest move of the name with the most pending moves is evicted.
+     * This ensures that a single name sending lots of moves cannot push
+     * out the moves of everyone else.
+     */
+    PER_NAME,
+
+  };
+
+  /**
+   * Statistics about the memory used for pending moves.
+   */
+  struct MemoryStats
+  {
+
+    /** Number of pending moves currently kept.  */
+    size_t moves;
+
+    /** Approximate size in bytes of the pending moves kept.  */
+    size_t bytes;
+
+    /** Number of moves evicted due to the limits so far.  */
+    uint64_t evicted;
+
+  };
+
 private:
 
+  /**
+   * Data kept for each known pending move.
+   */
+  struct PendingMove
+  {
+
+    /** The move data as JSON.  */
+    Json::Value data;
+
+    /** The name that sent the move.  */
+    std::string name;
+
+    /** Approximate size of the move data in bytes.  */
+    size_t bytes;
+
+  };
+
   /**
    * Data about the "current state" accessible to the callbacks while they
    * are being executed.
@@ -46,8 +107,15 @@ private:
      */
     const Json::Value& block;
 
-    explicit CurrentState (const GameStateData& s, const Json::Value& blk)
-      : state(s), block(blk)
+    /**
+     * Whether the callback is run concurrently to updates of the confirmed
+     * state (i.e. not under the Game's lock).
+     */
+    const bool concurrent;
+
+    explicit CurrentState (const GameStateData& s, const Json::Value& blk,
+                           const bool c)
+      : state(s), block(blk), concurrent(c)
     {}
 
   };
@@ -57,7 +125,67 @@ private:
    * to check whether a new move is already known, and also to retrieve the
    * actual data when we sync with getrawmempool.
    */
-  std::map<uint256, Json::Value> pending;
+  std::map<uint256, PendingMove> pending;
+
+  /**
+   * The txids of all pending moves in the order in which they have been
+   * passed to AddPendingMove.  This is used to replay the moves in the same
+   * order when rebuilding the state without syncing to getrawmempool,
+   * and to find the oldest moves for eviction.
+   * It may contain txids that are no longer in pending; those are
+   * just skipped.
+   */
+  std::deque<uint256> order;
+
+  /** Number of entries in pending for each name.  */
+  std::map<std::string, size_t> movesPerName;
+
+  /**
+   * The names with pending moves, ordered by their number of moves
+   * (as per movesPerName).  This is used to find the name with the most
+   * moves for eviction with the PER_NAME policy.
+   */
+  std::set<std::pair<size_t, std::string>> namesByCount;
+
+  /**
+   * For each name with pending moves, the txids of its moves in the order
+   * in which they appear in order.  Like order itself, this may contain
+   * txids that are no longer pending (or have been re-added), which are
+   * skipped.  This is used to find the oldest move of a name for eviction
+   * without scanning order.
+   */
+  std::map<std::string, std::deque<uint256>> orderPerName;
+
+  /** Sum of the approximate sizes of all entries in pending.  */
+  size_t pendingBytes = 0;
+
+  /** Maximum number of pending moves kept (zero for no limit).  */
+  size_t maxMoves = 0;
+
+  /** Maximum approximate size of all pending moves (zero for no limit).  */
+  size_t maxBytes = 0;
+
+  /** The policy used to choose moves for eviction.  */
+  EvictionPolicy evictionPolicy = EvictionPolicy::OLDEST_FIRST;
+
+  /** Total number of moves evicted so far.  */
+  uint64_t numEvicted = 0;
+
+  /**
+   * Minimum time between full syncs with getrawmempool.  If zero, a full
+   * sync is done for every block (which is the default).  Otherwise, moves
+   * confirmed in attached blocks are dropped from the pending state directly
+   * and the remaining ones replayed, and only after this interval has passed
+   * is the full mempool reconciled again.
+   */
+  std::chrono::steady_clock::duration fullSyncInterval
+      = std::chrono::steady_clock::duration::zero ();
+
+  /** Time of the last full sync with getrawmempool.  */
+  std::chrono::steady_clock::time_point lastFullSync;
+
+  /** Set to true if the next Reset must do a full sync.  */
+  bool needFullSync = true;
 
   /** While a callback is running, the state context.  */
   std::unique_ptr<CurrentState> ctx;
@@ -76,11 +204,59 @@ private:
 
   /**
    * Resets the internal state, by clearing and then rebuilding from the
-   * list of pending moves, and syncing them with getrawmempool.  This sets
+   * list of pending moves.  If a full sync is due (see fullSyncInterval),
+   * the moves are synced with getrawmempool.  This sets
    * up the state context for the given game state and using our blockQueue.
    */
   void Reset (const GameStateData& state);
 
+  /**
+   * Adds a move to pending (if it is not yet known), updating the memory
+   * accounting.  Returns false if the move was already known.
+   */
+  bool InsertPending (const uint256& txid, const Json::Value& mv);
+
+  /**
+   * Removes a move from pending (if it is there), updating the memory
+   * accounting.
+   */
+  void ErasePending (const uint256& txid);
+
+  /**
+   * Updates movesPerName and namesByCount for a change in the number of
+   * moves of the given name by delta (which must be +1 or -1).
+   */
+  void UpdateNameCount (const std::string& name, int delta);
+
+  /**
+   * Rebuilds orderPerName from order.  This must be called whenever order
+   * is reassigned.
+   */
+  void RebuildOrderPerName ();
+
+  /**
+   * Returns true if the pending moves exceed the configured limits scaled
+   * by the given factor (in percent).
+   */
+  bool ExceedsLimits (unsigned percent) const;
+
+  /**
+   * Evicts moves according to the eviction policy if the limits are
+   * exceeded.  In that case, moves are evicted until the usage is below
+   * a fraction of the limits, so that the pending state (which has to be
+   * rebuilt after evictions) is not rebuilt for every new move once the
+   * limits are reached.  Returns true if any moves have been evicted.
+   */
+  bool EnforceLimits ();
+
+  /**
+   * Clears the pending state and adds all moves in pending again, in
+   * the order given by order.  The latter is also cleaned from stale
+   * entries.  This sets up the state context for the given game state and
+   * using our blockQueue.
+   */
+  void Replay (const GameStateData& state, bool concurrent);
+
   class ContextSetter;
 
 protected:
@@ -100,6 +276,27 @@ protected:
    */
   const Json::Value& GetConfirmedBlock () const;
 
+  /**
+   * Returns true if the currently running callback has been invoked
+   * concurrently to updates of the confirmed state, i.e. from a worker
+   * thread without holding the Game's lock.  In that case, the state
+   * returned by GetConfirmedState is an immutable copy, but any other
+   * means of accessing the confirmed state (e.g. a database) must be done
+   * through a snapshot.
+   *
+   * The function must only be called while a callback is running.
+   */
+  bool IsConcurrentCallback () const;
+
+  /**
+   * Called after a callback with state context has finished.  Subclasses
+   * can override this to release resources they acquired for accessing the
+   * confirmed state during the callback (e.g. database snapshots).
+   */
+  virtual void
+  CallbackFinished ()
+  {}
+
   /**
    * Clears the state, so it corresponds to an empty mempool.  This is called
    * whenever the confirmed on-chain state changes.  It may also be called
@@ -127,9 +324,39 @@ public:
 
   PendingMoveProcessor () = default;
 
+  /**
+   * Enables the incremental mode for attached blocks:  Instead of querying
+   * the full mempool with getrawmempool for each attached block, moves
+   * confirmed in the block are just removed from the pending state, and
+   * a full reconciliation with the mempool is only done if at least the
+   * given interval has passed since the last one.  Detached blocks always
+   * trigger a full sync.  Setting an interval of zero disables the
+   * incremental mode again.
+   */
+  void SetFullSyncInterval (std::chrono::steady_clock::duration interval);
+
+  /**
+   * Limits the memory used for pending moves.  If more than maxMoves moves
+   * are pending or their approximate total size exceeds maxBytes, moves are
+   * evicted according to the given policy; evicted moves are dropped from
+   * the pending state even if they are still in the mempool.  Since the
+   * pending state of the subclass is rebuilt from the kept moves after an
+   * eviction, this bounds also its memory usage.  A zero limit means
+   * that the corresponding value is not limited (which is the default).
+   */
+  void SetMemoryLimits (size_t maxMoves, size_t maxBytes,
+                        EvictionPolicy policy = EvictionPolicy::OLDEST_FIRST);
+
+  /**
+   * Returns statistics about the memory usage of pending moves.  This must
+   * not be called concurrently with the processing functions.
+   */
+  MemoryStats GetMemoryStats () const;
+
   /**
    * Processes a newly attached block.  This checks the current mempool
-   * of Xaya Core and then rebuilds the pending state based on known moves
+   * of Xaya Core (or, in incremental mode, removes the moves confirmed
+   * in the block) and then rebuilds the pending state based on known moves
    * that are still in the mempool.
    */
   void ProcessAttachedBlock (const GameStateData& state,
@@ -147,9 +374,26 @@ public:
                              const Json::Value& blockData);
 
   /**
-   * Processes a newly received pending move.
+   * Processes a newly received pending move.  If concurrent is true, then
+   * the call is made without holding the Game's lock, i.e. concurrently
+   * to updates of the confirmed state.  This is only done if
+   * SupportsConcurrentProcessing returns true.
+   */
+  void ProcessMove (const GameStateData& state, const Json::Value& mv,
+                    bool concurrent = false);
+
+  /**
+   * Returns true if this processor supports processing of new pending moves
+   * concurrently to updates of the confirmed state (see ProcessMove).
+   * By default this is the case, since the confirmed state is passed as
+   * an immutable copy.  Subclasses that access the confirmed state in
+   * other ways have to override this if they can't do so safely.
    */
-  void ProcessMove (const GameStateData& state, const Json::Value& mv);
+  virtual bool
+  SupportsConcurrentProcessing () const
+  {
+    return true;
+  }
 
   /**
    * Returns a JSON representation of the current state.  This is exposed
@@ -157,6 +401,25 @@ public:
    */
   virtual Json::Value ToJson () const = 0;
 
+  /**
+   * Computes a delta that transforms an older result of ToJson into a newer
+   * one, so that clients that know the old state do not need to download
+   * the full new state.  Returns false if no delta can be computed, in which
+   * case clients get the full state instead.
+   *
+   * The default implementation produces a JSON Merge Patch (RFC 7386),
+   * which works well if the state is an object with many members (e.g. one
+   * per name or account) of which only few change with each move.  It fails
+   * if the new state contains explicit null values inside objects, since
+   * those can't be represented in a merge patch.
+   *
+   * This function may be called concurrently with the other methods, and
+   * must thus only depend on its arguments and not on the current state.
+   */
+  virtual bool ToJsonDelta (const Json::Value& oldJson,
+                            const Json::Value& newJson,
+                            Json::Value& delta) const;
+
 };
 
 } // namespace xaya
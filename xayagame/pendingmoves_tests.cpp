@@ -12,6 +12,9 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <chrono>
+#include <thread>
+
 namespace xaya
 {
 namespace
@@ -349,6 +352,272 @@ TEST_F (PendingMovesTests, BlockQueuePruning)
   EXPECT_EQ (proc.ToJson (), ParseJson (R"({"names": {}})"));
 }
 
+TEST_F (PendingMovesTests, IncrementalAttach)
+{
+  proc.SetFullSyncInterval (std::chrono::hours (1));
+
+  /* The first block does a full sync in any case.  */
+  SetMempool ({});
+  proc.ProcessAttachedBlock ("", BlockJson (10, {}));
+
+  proc.ProcessMove ("old", MoveJson ("foo", "c"));
+  proc.ProcessMove ("old", MoveJson ("foo", "a"));
+  proc.ProcessMove ("old", MoveJson ("bar", "x"));
+
+  /* The mempool returned by the RPC is ignored now, only moves confirmed
+     in the block are removed.  */
+  proc.ProcessAttachedBlock ("new", BlockJson (11,
+    {
+      MoveJson ("foo", "a"),
+    }));
+
+  EXPECT_EQ (proc.ToJson (), ParseJson (R"({
+    "confirmed": "new",
+    "height": 11,
+    "names":
+      {
+        "foo": ["c"],
+        "bar": ["x"]
+      }
+  })"));
+}
+
+TEST_F (PendingMovesTests, IncrementalDetachSyncs)
+{
+  proc.SetFullSyncInterval (std::chrono::hours (1));
+  proc.ProcessAttachedBlock ("", BlockJson (10, {}));
+  proc.ProcessAttachedBlock ("", BlockJson (11, {}));
+
+  proc.ProcessMove ("new", MoveJson ("foo", "b"));
+  proc.ProcessMove ("new", MoveJson ("bar", "x"));
+
+  SetMempool ({"a", "x"});
+  proc.ProcessDetachedBlock ("old", BlockJson (11,
+    {
+      MoveJson ("foo", "a"),
+    }));
+
+  EXPECT_EQ (proc.ToJson (), ParseJson (R"({
+    "confirmed": "old",
+    "height": 10,
+    "names":
+      {
+        "foo": ["a"],
+        "bar": ["x"]
+      }
+  })"));
+}
+
+TEST_F (PendingMovesTests, PeriodicFullSync)
+{
+  proc.SetFullSyncInterval (std::chrono::milliseconds (10));
+  proc.ProcessAttachedBlock ("", BlockJson (10, {}));
+
+  proc.ProcessMove ("state", MoveJson ("foo", "a"));
+  proc.ProcessMove ("state", MoveJson ("foo", "b"));
+
+  SetMempool ({"b"});
+  std::this_thread::sleep_for (std::chrono::milliseconds (20));
+  proc.ProcessAttachedBlock ("state", BlockJson (11, {}));
+
+  EXPECT_EQ (proc.ToJson (), ParseJson (R"({
+    "confirmed": "state",
+    "height": 11,
+    "names":
+      {
+        "foo": ["b"]
+      }
+  })"));
+}
+
+TEST_F (PendingMovesTests, MemoryStats)
+{
+  proc.ProcessAttachedBlock ("", BlockJson (10, {}));
+  EXPECT_EQ (proc.GetMemoryStats ().moves, 0);
+  EXPECT_EQ (proc.GetMemoryStats ().bytes, 0);
+
+  proc.ProcessMove ("state", MoveJson ("foo", "a"));
+  proc.ProcessMove ("state", MoveJson ("foo", "b"));
+  const auto stats = proc.GetMemoryStats ();
+  EXPECT_EQ (stats.moves, 2);
+  EXPECT_GT (stats.bytes, 0);
+  EXPECT_EQ (stats.evicted, 0);
+
+  SetMempool ({"b"});
+  proc.ProcessAttachedBlock ("state", BlockJson (11, {}));
+  EXPECT_EQ (proc.GetMemoryStats ().moves, 1);
+  EXPECT_EQ (proc.GetMemoryStats ().bytes, stats.bytes / 2);
+}
+
+TEST_F (PendingMovesTests, EvictOldestFirst)
+{
+  proc.SetMemoryLimits (10, 0);
+  proc.ProcessAttachedBlock ("", BlockJson (10, {}));
+
+  for (unsigned i = 0; i < 10; ++i)
+    proc.ProcessMove ("state", MoveJson ("foo", std::to_string (i)));
+  EXPECT_EQ (proc.GetMemoryStats ().moves, 10);
+  EXPECT_EQ (proc.GetMemoryStats ().evicted, 0);
+
+  /* Exceeding the limit evicts the oldest moves until we are at 90%.  */
+  proc.ProcessMove ("state", MoveJson ("bar", "x"));
+  EXPECT_EQ (proc.GetMemoryStats ().moves, 9);
+  EXPECT_EQ (proc.GetMemoryStats ().evicted, 2);
+
+  EXPECT_EQ (proc.ToJson (), ParseJson (R"({
+    "confirmed": "state",
+    "height": 10,
+    "names":
+      {
+        "foo": ["2", "3", "4", "5", "6", "7", "8", "9"],
+        "bar": ["x"]
+      }
+  })"));
+}
+
+TEST_F (PendingMovesTests, EvictPerName)
+{
+  proc.SetMemoryLimits (10, 0,
+                        PendingMoveProcessor::EvictionPolicy::PER_NAME);
+  proc.ProcessAttachedBlock ("", BlockJson (10, {}));
+
+  proc.ProcessMove ("state", MoveJson ("bar", "x"));
+  proc.ProcessMove ("state", MoveJson ("baz", "y"));
+  for (unsigned i = 0; i < 9; ++i)
+    proc.ProcessMove ("state", MoveJson ("foo", std::to_string (i)));
+
+  /* The moves of bar and baz are older, but foo has the most pending
+     moves and thus gets its moves evicted.  */
+  EXPECT_EQ (proc.GetMemoryStats ().evicted, 2);
+  EXPECT_EQ (proc.ToJson (), ParseJson (R"({
+    "confirmed": "state",
+    "height": 10,
+    "names":
+      {
+        "foo": ["2", "3", "4", "5", "6", "7", "8"],
+        "bar": ["x"],
+        "baz": ["y"]
+      }
+  })"));
+}
+
+TEST_F (PendingMovesTests, EvictPerNameInterleaved)
+{
+  proc.SetMemoryLimits (4, 0,
+                        PendingMoveProcessor::EvictionPolicy::PER_NAME);
+  proc.ProcessAttachedBlock ("", BlockJson (10, {}));
+
+  proc.ProcessMove ("state", MoveJson ("foo", "1"));
+  proc.ProcessMove ("state", MoveJson ("bar", "x"));
+  proc.ProcessMove ("state", MoveJson ("foo", "2"));
+  proc.ProcessMove ("state", MoveJson ("bar", "y"));
+  proc.ProcessMove ("state", MoveJson ("foo", "3"));
+
+  /* First the oldest move of foo (with three moves) is evicted.  Then both
+     names have the same number of moves, and the oldest move of bar (the
+     first name) is evicted.  */
+  EXPECT_EQ (proc.GetMemoryStats ().evicted, 2);
+  EXPECT_EQ (proc.ToJson ()["names"], ParseJson (R"({
+    "foo": ["2", "3"],
+    "bar": ["y"]
+  })"));
+}
+
+TEST_F (PendingMovesTests, EvictByBytes)
+{
+  proc.ProcessAttachedBlock ("", BlockJson (10, {}));
+  proc.ProcessMove ("state", MoveJson ("foo", "a"));
+  const size_t perMove = proc.GetMemoryStats ().bytes;
+
+  proc.SetMemoryLimits (0, 3 * perMove);
+  proc.ProcessMove ("state", MoveJson ("foo", "b"));
+  proc.ProcessMove ("state", MoveJson ("foo", "c"));
+  EXPECT_EQ (proc.GetMemoryStats ().evicted, 0);
+
+  proc.ProcessMove ("state", MoveJson ("foo", "d"));
+  EXPECT_EQ (proc.GetMemoryStats ().moves, 2);
+  EXPECT_LE (proc.GetMemoryStats ().bytes, 2 * perMove);
+  EXPECT_EQ (proc.ToJson ()["names"], ParseJson (R"({
+    "foo": ["c", "d"]
+  })"));
+}
+
+TEST_F (PendingMovesTests, LimitsAppliedOnReset)
+{
+  proc.ProcessAttachedBlock ("", BlockJson (10, {}));
+  for (unsigned i = 0; i < 5; ++i)
+    proc.ProcessMove ("state", MoveJson ("foo", std::to_string (i)));
+
+  proc.SetMemoryLimits (3, 0);
+  SetMempool ({"0", "1", "2", "3", "4"});
+  proc.ProcessAttachedBlock ("state", BlockJson (11, {}));
+
+  EXPECT_EQ (proc.GetMemoryStats ().moves, 2);
+  EXPECT_EQ (proc.ToJson ()["names"], ParseJson (R"({
+    "foo": ["3", "4"]
+  })"));
+}
+
+/* ************************************************************************** */
+
+class PendingDeltaTests : public PendingMovesTests
+{
+
+protected:
+
+  /**
+   * Computes the delta between two JSON values given as strings and
+   * checks that it matches the expected one.
+   */
+  void
+  ExpectDelta (const std::string& oldJson, const std::string& newJson,
+               const std::string& expected)
+  {
+    Json::Value delta;
+    ASSERT_TRUE (proc.ToJsonDelta (ParseJson (oldJson), ParseJson (newJson),
+                                   delta));
+    EXPECT_EQ (delta, ParseJson (expected));
+  }
+
+  /**
+   * Expects that no delta can be computed.
+   */
+  void
+  ExpectNoDelta (const std::string& oldJson, const std::string& newJson)
+  {
+    Json::Value delta;
+    EXPECT_FALSE (proc.ToJsonDelta (ParseJson (oldJson), ParseJson (newJson),
+                                    delta));
+  }
+
+};
+
+TEST_F (PendingDeltaTests, MergePatch)
+{
+  ExpectDelta ("{}", "{}", "{}");
+  ExpectDelta (R"({"a": 1, "b": 2})", R"({"a": 1, "b": 2})", "{}");
+  ExpectDelta (R"({"a": 1, "b": 2})", R"({"a": 1, "c": 3})",
+               R"({"b": null, "c": 3})");
+  ExpectDelta (R"({"a": [1, 2], "b": "x"})", R"({"a": [1], "b": "y"})",
+               R"({"a": [1], "b": "y"})");
+  ExpectDelta (R"({"n": {"a": 1, "b": {"x": 1}}})",
+               R"({"n": {"a": 1, "b": {"x": 2}}})",
+               R"({"n": {"b": {"x": 2}}})");
+  ExpectDelta (R"({"a": 1})", R"({"a": {"x": 1}})",
+               R"({"a": {"x": 1}})");
+  ExpectDelta (R"({"a": {"x": 1}})", R"({"a": [null]})",
+               R"({"a": [null]})");
+}
+
+TEST_F (PendingDeltaTests, NotRepresentable)
+{
+  ExpectNoDelta ("[1]", "[2]");
+  ExpectNoDelta ("{}", "42");
+  ExpectNoDelta (R"({"a": 1})", R"({"a": null})");
+  ExpectNoDelta (R"({"a": 1})", R"({"a": {"x": null}})");
+  ExpectNoDelta (R"({"a": {"x": 1}})", R"({"a": {"x": 1, "y": null}})");
+}
+
 /* ************************************************************************** */
 
 } // anonymous namespace
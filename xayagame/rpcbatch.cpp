@@ -0,0 +1,115 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcbatch.hpp"
+
+#include "jsonwriter.hpp"
+
+#include <glog/logging.h>
+
+#include <sstream>
+
+namespace xaya
+{
+
+namespace
+{
+
+/**
+ * Checks if the request looks like a batch, i.e. its first non-whitespace
+ * character opens an array.  This is used to avoid parsing requests
+ * that are not batches anyway.
+ */
+bool
+LooksLikeBatch (const std::string& request)
+{
+  for (const char c : request)
+    switch (c)
+      {
+      case ' ':
+      case '\t':
+      case '\r':
+      case '\n':
+        continue;
+      default:
+        return c == '[';
+      }
+
+  return false;
+}
+
+} // anonymous namespace
+
+RpcBatchHandler::RpcBatchHandler (jsonrpc::AbstractServerConnector& c,
+                                  const BatchCallback& b)
+  : conn(c), original(c.GetHandler ()), cb(b)
+{
+  CHECK (original != nullptr)
+      << "RpcBatchHandler must be installed after the RPC server";
+  conn.SetHandler (this);
+}
+
+RpcBatchHandler::~RpcBatchHandler ()
+{
+  conn.SetHandler (original);
+}
+
+void
+RpcBatchHandler::HandleRequest (const std::string& request,
+                                std::string& response)
+{
+  if (LooksLikeBatch (request))
+    {
+      Json::Value batch;
+      Json::CharReaderBuilder rbuilder;
+      std::string parseErrs;
+      std::istringstream in(request);
+
+      if (Json::parseFromStream (rbuilder, in, &batch, &parseErrs)
+            && batch.isArray () && !batch.empty ())
+        {
+          Json::Value responses(Json::arrayValue);
+          if (cb (batch, responses))
+            {
+              VLOG (1)
+                  << "Processed RPC batch of " << batch.size () << " calls";
+
+              response.clear ();
+              if (!responses.empty ())
+                response = CompactJson (responses);
+              return;
+            }
+        }
+    }
+
+  original->HandleRequest (request, response);
+}
+
+Json::Value
+RpcBatchHandler::ResultResponse (const Json::Value& id,
+                                 const Json::Value& result)
+{
+  Json::Value res(Json::objectValue);
+  res["jsonrpc"] = "2.0";
+  res["id"] = id;
+  res["result"] = result;
+  return res;
+}
+
+Json::Value
+RpcBatchHandler::ErrorResponse (const Json::Value& id, const int code,
+                                const std::string& message)
+{
+  Json::Value err(Json::objectValue);
+  err["code"] = code;
+  err["message"] = message;
+
+  Json::Value res(Json::objectValue);
+  res["jsonrpc"] = "2.0";
+  res["id"] = id;
+  res["error"] = err;
+  return res;
+}
+
+} // namespace xaya
@@ -0,0 +1,82 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAGAME_RPCBATCH_HPP
+#define XAYAGAME_RPCBATCH_HPP
+
+#include <json/json.h>
+#include <jsonrpccpp/server.h>
+
+#include <functional>
+#include <string>
+
+namespace xaya
+{
+
+/**
+ * Connection handler that intercepts JSON-RPC batch requests (arrays of
+ * calls) on a server connector, so that an RPC server can process suitable
+ * batches as a whole (e.g. against a single consistent state snapshot
+ * and with a single lock acquisition) instead of call by call.
+ *
+ * On construction, it installs itself as handler on the connector and
+ * forwards everything it does not process to the previous handler (i.e.
+ * the jsonrpccpp protocol handler of the server).  Thus it must be
+ * constructed after the RPC server itself, and destructed before it.
+ */
+class RpcBatchHandler : public jsonrpc::IClientConnectionHandler
+{
+
+public:
+
+  /**
+   * Callback that tries to process a batch.  It receives the parsed batch
+   * array and fills in the responses (one for each call that is not a
+   * notification).  If it returns false, the batch is instead processed
+   * by the server call by call.
+   */
+  using BatchCallback
+      = std::function<bool (const Json::Value& batch, Json::Value& responses)>;
+
+private:
+
+  /** The connector on which we are installed.  */
+  jsonrpc::AbstractServerConnector& conn;
+
+  /** The previous handler, to which we forward other requests.  */
+  jsonrpc::IClientConnectionHandler* const original;
+
+  /** The callback processing batches.  */
+  const BatchCallback cb;
+
+public:
+
+  explicit RpcBatchHandler (jsonrpc::AbstractServerConnector& c,
+                            const BatchCallback& b);
+  ~RpcBatchHandler ();
+
+  RpcBatchHandler () = delete;
+  RpcBatchHandler (const RpcBatchHandler&) = delete;
+  void operator= (const RpcBatchHandler&) = delete;
+
+  void HandleRequest (const std::string& request,
+                      std::string& response) override;
+
+  /**
+   * Constructs a JSON-RPC 2.0 success response.
+   */
+  static Json::Value ResultResponse (const Json::Value& id,
+                                     const Json::Value& result);
+
+  /**
+   * Constructs a JSON-RPC 2.0 error response.
+   */
+  static Json::Value ErrorResponse (const Json::Value& id, int code,
+                                    const std::string& message);
+
+};
+
+} // namespace xaya
+
+#endif // XAYAGAME_RPCBATCH_HPP
@@ -0,0 +1,214 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcbatch.hpp"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <sstream>
+
+namespace xaya
+{
+namespace
+{
+
+/**
+ * Server connector that does not listen anywhere, and just allows
+ * passing requests to the handler.
+ */
+class TestConnector : public jsonrpc::AbstractServerConnector
+{
+
+public:
+
+  bool
+  StartListening () override
+  {
+    return true;
+  }
+
+  bool
+  StopListening () override
+  {
+    return true;
+  }
+
+};
+
+/**
+ * Handler that takes the role of the RPC server.  It just records the
+ * requests it gets.
+ */
+class FallbackHandler : public jsonrpc::IClientConnectionHandler
+{
+
+public:
+
+  /** The last request received.  */
+  std::string lastRequest;
+
+  void
+  HandleRequest (const std::string& request, std::string& response) override
+  {
+    lastRequest = request;
+    response = "fallback";
+  }
+
+};
+
+Json::Value
+ParseJson (const std::string& str)
+{
+  std::istringstream in(str);
+  Json::Value res;
+  in >> res;
+  return res;
+}
+
+class RpcBatchHandlerTests : public testing::Test
+{
+
+protected:
+
+  TestConnector conn;
+  FallbackHandler fallback;
+
+  /** Number of times the batch callback was invoked.  */
+  unsigned batchCalls = 0;
+
+  RpcBatchHandlerTests ()
+  {
+    conn.SetHandler (&fallback);
+  }
+
+  /**
+   * Batch callback for the tests.  It handles batches of "echo" calls.
+   */
+  bool
+  HandleBatch (const Json::Value& batch, Json::Value& responses)
+  {
+    ++batchCalls;
+
+    for (const auto& call : batch)
+      if (call["method"] != "echo")
+        return false;
+
+    for (const auto& call : batch)
+      if (call.isMember ("id"))
+        responses.append (RpcBatchHandler::ResultResponse (call["id"],
+                                                           call["params"]));
+
+    return true;
+  }
+
+  /**
+   * Installs a batch handler using HandleBatch on the connector.
+   */
+  std::unique_ptr<RpcBatchHandler>
+  Install ()
+  {
+    return std::make_unique<RpcBatchHandler> (conn,
+        [this] (const Json::Value& batch, Json::Value& responses)
+        {
+          return HandleBatch (batch, responses);
+        });
+  }
+
+  std::string
+  Process (const std::string& request)
+  {
+    std::string response;
+    conn.ProcessRequest (request, response);
+    return response;
+  }
+
+};
+
+TEST_F (RpcBatchHandlerTests, InstallsAndRestores)
+{
+  {
+    auto handler = Install ();
+    EXPECT_EQ (conn.GetHandler (), handler.get ());
+  }
+
+  EXPECT_EQ (conn.GetHandler (), &fallback);
+}
+
+TEST_F (RpcBatchHandlerTests, SingleRequestsForwarded)
+{
+  auto handler = Install ();
+
+  const std::string req = R"({"jsonrpc":"2.0","method":"echo","id":1})";
+  EXPECT_EQ (Process (req), "fallback");
+  EXPECT_EQ (fallback.lastRequest, req);
+  EXPECT_EQ (batchCalls, 0);
+}
+
+TEST_F (RpcBatchHandlerTests, InvalidBatchesForwarded)
+{
+  auto handler = Install ();
+
+  for (const std::string req : {"[", " [] ", "[1, 2"})
+    {
+      EXPECT_EQ (Process (req), "fallback");
+      EXPECT_EQ (fallback.lastRequest, req);
+    }
+  EXPECT_EQ (batchCalls, 0);
+}
+
+TEST_F (RpcBatchHandlerTests, BatchProcessed)
+{
+  auto handler = Install ();
+
+  const auto res = ParseJson (Process (R"(
+    [
+      {"jsonrpc": "2.0", "method": "echo", "params": [1], "id": 1},
+      {"jsonrpc": "2.0", "method": "echo", "params": [2]},
+      {"jsonrpc": "2.0", "method": "echo", "params": [3], "id": "foo"}
+    ]
+  )"));
+  EXPECT_EQ (batchCalls, 1);
+
+  ASSERT_TRUE (res.isArray ());
+  ASSERT_EQ (res.size (), 2);
+  EXPECT_EQ (res[0]["id"], 1);
+  EXPECT_EQ (res[0]["result"], ParseJson ("[1]"));
+  EXPECT_EQ (res[1]["id"], "foo");
+  EXPECT_EQ (res[1]["result"], ParseJson ("[3]"));
+}
+
+TEST_F (RpcBatchHandlerTests, OnlyNotifications)
+{
+  auto handler = Install ();
+
+  EXPECT_EQ (Process (R"([{"jsonrpc": "2.0", "method": "echo"}])"), "");
+  EXPECT_EQ (batchCalls, 1);
+}
+
+TEST_F (RpcBatchHandlerTests, BatchRejected)
+{
+  auto handler = Install ();
+
+  const std::string req = R"([
+    {"jsonrpc": "2.0", "method": "echo", "id": 1},
+    {"jsonrpc": "2.0", "method": "other", "id": 2}
+  ])";
+  EXPECT_EQ (Process (req), "fallback");
+  EXPECT_EQ (fallback.lastRequest, req);
+  EXPECT_EQ (batchCalls, 1);
+}
+
+TEST_F (RpcBatchHandlerTests, ErrorResponse)
+{
+  const auto res = RpcBatchHandler::ErrorResponse (42, -32602, "bad");
+  EXPECT_EQ (res, ParseJson (R"({
+    "jsonrpc": "2.0",
+    "id": 42,
+    "error": {"code": -32602, "message": "bad"}
+  })"));
+}
+
+} // anonymous namespace
+} // namespace xaya
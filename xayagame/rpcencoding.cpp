@@ -0,0 +1,675 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcencoding.hpp"
+
+#include "compressinghttpserver.hpp"
+#include "jsonwriter.hpp"
+#include "rpcbatch.hpp"
+
+#include <xayautil/base64.hpp>
+
+#include <glog/logging.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <utility>
+
+namespace xaya
+{
+
+namespace
+{
+
+/** CBOR major types.  */
+enum class CborType : uint8_t
+{
+  UNSIGNED = 0,
+  NEGATIVE = 1,
+  BYTES = 2,
+  TEXT = 3,
+  ARRAY = 4,
+  MAP = 5,
+  TAG = 6,
+  SIMPLE = 7,
+};
+
+/** CBOR tag for "expected conversion to base64".  */
+constexpr uint64_t TAG_BASE64 = 22;
+
+/** JSON-RPC error code for invalid parameters (an unknown encoding).  */
+constexpr int INVALID_PARAMS = -32602;
+
+/**
+ * Helper class for building up CBOR data.
+ */
+class CborEncoder
+{
+
+protected:
+
+  /** Keys of object members holding base64 blobs.  */
+  const std::set<std::string>& blobKeys;
+
+  /** The encoded data so far.  */
+  std::string out;
+
+  /**
+   * Writes the big-endian representation of the given number with
+   * the given number of bytes.
+   */
+  void
+  WriteBigEndian (const uint64_t val, const unsigned bytes)
+  {
+    for (unsigned i = bytes; i > 0; --i)
+      out.push_back (static_cast<char> ((val >> (8 * (i - 1))) & 0xFF));
+  }
+
+  /**
+   * Writes the head of a data item, i.e. its major type and argument.
+   */
+  void
+  WriteHead (const CborType type, const uint64_t arg)
+  {
+    const uint8_t major = static_cast<uint8_t> (type) << 5;
+
+    if (arg < 24)
+      out.push_back (static_cast<char> (major | arg));
+    else if (arg <= 0xFF)
+      {
+        out.push_back (static_cast<char> (major | 24));
+        WriteBigEndian (arg, 1);
+      }
+    else if (arg <= 0xFFFF)
+      {
+        out.push_back (static_cast<char> (major | 25));
+        WriteBigEndian (arg, 2);
+      }
+    else if (arg <= 0xFFFFFFFF)
+      {
+        out.push_back (static_cast<char> (major | 26));
+        WriteBigEndian (arg, 4);
+      }
+    else
+      {
+        out.push_back (static_cast<char> (major | 27));
+        WriteBigEndian (arg, 8);
+      }
+  }
+
+  void
+  WriteString (const CborType type, const std::string& str)
+  {
+    WriteHead (type, str.size ());
+    out.append (str);
+  }
+
+  /**
+   * Writes a string value that is potentially a base64 blob.
+   */
+  void
+  WriteBlob (const std::string& str)
+  {
+    std::string data;
+    if (str.size () % 4 == 0 && DecodeBase64 (str, data)
+          && EncodeBase64 (data) == str)
+      {
+        WriteHead (CborType::TAG, TAG_BASE64);
+        WriteString (CborType::BYTES, data);
+        return;
+      }
+
+    WriteString (CborType::TEXT, str);
+  }
+
+public:
+
+  explicit CborEncoder (const std::set<std::string>& b)
+    : blobKeys(b)
+  {}
+
+  void
+  Write (const Json::Value& val)
+  {
+    switch (val.type ())
+      {
+      case Json::nullValue:
+        out.push_back (static_cast<char> (0xF6));
+        return;
+
+      case Json::booleanValue:
+        out.push_back (static_cast<char> (val.asBool () ? 0xF5 : 0xF4));
+        return;
+
+      case Json::intValue:
+        {
+          const int64_t n = val.asInt64 ();
+          if (n >= 0)
+            WriteHead (CborType::UNSIGNED, n);
+          else
+            WriteHead (CborType::NEGATIVE, -(n + 1));
+          return;
+        }
+
+      case Json::uintValue:
+        WriteHead (CborType::UNSIGNED, val.asUInt64 ());
+        return;
+
+      case Json::realValue:
+        {
+          const double d = val.asDouble ();
+          uint64_t bits;
+          static_assert (sizeof (bits) == sizeof (d),
+                         "double is not 64 bits wide");
+          std::memcpy (&bits, &d, sizeof (bits));
+          out.push_back (static_cast<char> (0xFB));
+          WriteBigEndian (bits, 8);
+          return;
+        }
+
+      case Json::stringValue:
+        WriteString (CborType::TEXT, val.asString ());
+        return;
+
+      case Json::arrayValue:
+        WriteHead (CborType::ARRAY, val.size ());
+        for (const auto& entry : val)
+          Write (entry);
+        return;
+
+      case Json::objectValue:
+        WriteHead (CborType::MAP, val.size ());
+        for (auto it = val.begin (); it != val.end (); ++it)
+          {
+            const std::string key = it.name ();
+            WriteString (CborType::TEXT, key);
+            if (it->isString () && blobKeys.count (key) > 0)
+              WriteBlob (it->asString ());
+            else
+              Write (*it);
+          }
+        return;
+      }
+
+    LOG (FATAL) << "Unexpected JSON value type: " << val.type ();
+  }
+
+  const std::string&
+  GetOutput () const
+  {
+    return out;
+  }
+
+};
+
+/**
+ * Converts JSON text to CBOR in a single pass, without building up
+ * a Json::Value for it.  Containers are written with definite lengths
+ * by inserting their head once all members have been transcoded.
+ */
+class CborTranscoder : public CborEncoder
+{
+
+private:
+
+  /** The JSON text being converted.  */
+  const std::string& in;
+
+  /** Current position in the input.  */
+  size_t pos = 0;
+
+  void
+  SkipSpace ()
+  {
+    while (pos < in.size ()
+            && (in[pos] == ' ' || in[pos] == '\t'
+                  || in[pos] == '\n' || in[pos] == '\r'))
+      ++pos;
+  }
+
+  /**
+   * Consumes the given character (after optional whitespace) if it is next
+   * in the input.  Returns true if it was.
+   */
+  bool
+  Consume (const char c)
+  {
+    SkipSpace ();
+    if (pos >= in.size () || in[pos] != c)
+      return false;
+
+    ++pos;
+    return true;
+  }
+
+  /**
+   * Consumes the given literal, returning false if it is not next.
+   */
+  bool
+  ConsumeLiteral (const std::string& lit)
+  {
+    if (in.compare (pos, lit.size (), lit) != 0)
+      return false;
+
+    pos += lit.size ();
+    return true;
+  }
+
+  /**
+   * Inserts the head of a container with the given number of elements
+   * at the given position in the output.
+   */
+  void
+  InsertHead (const size_t headPos, const CborType type, const uint64_t n)
+  {
+    const std::string content = out.substr (headPos);
+    out.resize (headPos);
+    WriteHead (type, n);
+    out.append (content);
+  }
+
+  /**
+   * Reads four hex digits of a \u escape.
+   */
+  bool
+  ParseHex4 (unsigned& code)
+  {
+    if (pos + 4 > in.size ())
+      return false;
+
+    code = 0;
+    for (unsigned i = 0; i < 4; ++i)
+      {
+        const char c = in[pos++];
+        code <<= 4;
+        if (c >= '0' && c <= '9')
+          code |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+          code |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+          code |= c - 'A' + 10;
+        else
+          return false;
+      }
+
+    return true;
+  }
+
+  /**
+   * Appends the UTF-8 encoding of a code point to the string.
+   */
+  static void
+  AppendUtf8 (const unsigned code, std::string& str)
+  {
+    if (code < 0x80)
+      str.push_back (static_cast<char> (code));
+    else if (code < 0x800)
+      {
+        str.push_back (static_cast<char> (0xC0 | (code >> 6)));
+        str.push_back (static_cast<char> (0x80 | (code & 0x3F)));
+      }
+    else if (code < 0x10000)
+      {
+        str.push_back (static_cast<char> (0xE0 | (code >> 12)));
+        str.push_back (static_cast<char> (0x80 | ((code >> 6) & 0x3F)));
+        str.push_back (static_cast<char> (0x80 | (code & 0x3F)));
+      }
+    else
+      {
+        str.push_back (static_cast<char> (0xF0 | (code >> 18)));
+        str.push_back (static_cast<char> (0x80 | ((code >> 12) & 0x3F)));
+        str.push_back (static_cast<char> (0x80 | ((code >> 6) & 0x3F)));
+        str.push_back (static_cast<char> (0x80 | (code & 0x3F)));
+      }
+  }
+
+  /**
+   * Parses a string literal (including the quotes) and returns its
+   * unescaped value.
+   */
+  bool
+  ParseString (std::string& str)
+  {
+    if (!Consume ('"'))
+      return false;
+
+    str.clear ();
+    while (pos < in.size ())
+      {
+        const char c = in[pos++];
+        if (c == '"')
+          return true;
+        if (static_cast<unsigned char> (c) < 0x20)
+          return false;
+        if (c != '\\')
+          {
+            str.push_back (c);
+            continue;
+          }
+
+        if (pos >= in.size ())
+          return false;
+        switch (in[pos++])
+          {
+          case '"':
+            str.push_back ('"');
+            break;
+          case '\\':
+            str.push_back ('\\');
+            break;
+          case '/':
+            str.push_back ('/');
+            break;
+          case 'b':
+            str.push_back ('\b');
+            break;
+          case 'f':
+            str.push_back ('\f');
+            break;
+          case 'n':
+            str.push_back ('\n');
+            break;
+          case 'r':
+            str.push_back ('\r');
+            break;
+          case 't':
+            str.push_back ('\t');
+            break;
+          case 'u':
+            {
+              unsigned code;
+              if (!ParseHex4 (code))
+                return false;
+              if (code >= 0xDC00 && code <= 0xDFFF)
+                return false;
+              if (code >= 0xD800 && code <= 0xDBFF)
+                {
+                  unsigned low;
+                  if (!ConsumeLiteral ("\\u") || !ParseHex4 (low)
+                        || low < 0xDC00 || low > 0xDFFF)
+                    return false;
+                  code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                }
+              AppendUtf8 (code, str);
+              break;
+            }
+          default:
+            return false;
+          }
+      }
+
+    return false;
+  }
+
+  /**
+   * Transcodes a number.  Integers that fit into 64 bits are written as
+   * such, everything else as double (in the same way as jsoncpp
+   * classifies numbers).
+   */
+  bool
+  TranscodeNumber ()
+  {
+    const size_t start = pos;
+    bool isInteger = true;
+    while (pos < in.size ())
+      {
+        const char c = in[pos];
+        if (c == '.' || c == 'e' || c == 'E')
+          isInteger = false;
+        else if (c != '-' && c != '+' && (c < '0' || c > '9'))
+          break;
+        ++pos;
+      }
+
+    const std::string num = in.substr (start, pos - start);
+    if (num.empty () || (num[0] != '-' && (num[0] < '0' || num[0] > '9')))
+      return false;
+
+    char* end;
+    if (isInteger)
+      {
+        errno = 0;
+        if (num[0] == '-')
+          {
+            const long long n = std::strtoll (num.c_str (), &end, 10);
+            if (*end != '\0')
+              return false;
+            if (errno != ERANGE)
+              {
+                if (n >= 0)
+                  WriteHead (CborType::UNSIGNED, n);
+                else
+                  WriteHead (CborType::NEGATIVE, -(n + 1));
+                return true;
+              }
+          }
+        else
+          {
+            const unsigned long long n = std::strtoull (num.c_str (), &end, 10);
+            if (*end != '\0')
+              return false;
+            if (errno != ERANGE)
+              {
+                WriteHead (CborType::UNSIGNED, n);
+                return true;
+              }
+          }
+      }
+
+    const double d = std::strtod (num.c_str (), &end);
+    if (*end != '\0')
+      return false;
+
+    Write (Json::Value (d));
+    return true;
+  }
+
+  /**
+   * Transcodes the next value.  If blob is true, it is the value of
+   * a member whose key is in blobKeys.
+   */
+  bool
+  TranscodeValue (const bool blob)
+  {
+    SkipSpace ();
+    if (pos >= in.size ())
+      return false;
+
+    switch (in[pos])
+      {
+      case '{':
+        {
+          ++pos;
+          const size_t headPos = out.size ();
+          uint64_t n = 0;
+          if (!Consume ('}'))
+            while (true)
+              {
+                std::string key;
+                if (!ParseString (key) || !Consume (':'))
+                  return false;
+                WriteString (CborType::TEXT, key);
+                if (!TranscodeValue (blobKeys.count (key) > 0))
+                  return false;
+                ++n;
+
+                if (Consume ('}'))
+                  break;
+                if (!Consume (','))
+                  return false;
+              }
+          InsertHead (headPos, CborType::MAP, n);
+          return true;
+        }
+
+      case '[':
+        {
+          ++pos;
+          const size_t headPos = out.size ();
+          uint64_t n = 0;
+          if (!Consume (']'))
+            while (true)
+              {
+                if (!TranscodeValue (false))
+                  return false;
+                ++n;
+
+                if (Consume (']'))
+                  break;
+                if (!Consume (','))
+                  return false;
+              }
+          InsertHead (headPos, CborType::ARRAY, n);
+          return true;
+        }
+
+      case '"':
+        {
+          std::string str;
+          if (!ParseString (str))
+            return false;
+          if (blob)
+            WriteBlob (str);
+          else
+            WriteString (CborType::TEXT, str);
+          return true;
+        }
+
+      case 't':
+        if (!ConsumeLiteral ("true"))
+          return false;
+        out.push_back (static_cast<char> (0xF5));
+        return true;
+
+      case 'f':
+        if (!ConsumeLiteral ("false"))
+          return false;
+        out.push_back (static_cast<char> (0xF4));
+        return true;
+
+      case 'n':
+        if (!ConsumeLiteral ("null"))
+          return false;
+        out.push_back (static_cast<char> (0xF6));
+        return true;
+
+      default:
+        return TranscodeNumber ();
+      }
+  }
+
+public:
+
+  explicit CborTranscoder (const std::string& json,
+                           const std::set<std::string>& b)
+    : CborEncoder(b), in(json)
+  {}
+
+  /**
+   * Transcodes the full input.  Returns false if it is not valid JSON.
+   */
+  bool
+  Transcode ()
+  {
+    if (!TranscodeValue (false))
+      return false;
+
+    SkipSpace ();
+    return pos == in.size ();
+  }
+
+};
+
+} // anonymous namespace
+
+std::string
+EncodeCbor (const Json::Value& val, const std::set<std::string>& blobKeys)
+{
+  CborEncoder enc(blobKeys);
+  enc.Write (val);
+  return enc.GetOutput ();
+}
+
+bool
+TranscodeJsonToCbor (const std::string& json,
+                     const std::set<std::string>& blobKeys, std::string& cbor)
+{
+  CborTranscoder enc(json, blobKeys);
+  if (!enc.Transcode ())
+    return false;
+
+  cbor = enc.GetOutput ();
+  return true;
+}
+
+RpcEncodingHandler::RpcEncodingHandler (jsonrpc::AbstractServerConnector& c,
+                                        const std::set<std::string>& b)
+  : conn(c), original(c.GetHandler ()), blobKeys(b)
+{
+  CHECK (original != nullptr)
+      << "RpcEncodingHandler must be installed after the RPC server";
+  conn.SetHandler (this);
+
+  auto* http = dynamic_cast<CompressingHttpServer*> (&conn);
+  if (http != nullptr)
+    http->EnableCbor (blobKeys);
+}
+
+RpcEncodingHandler::~RpcEncodingHandler ()
+{
+  conn.SetHandler (original);
+}
+
+void
+RpcEncodingHandler::HandleRequest (const std::string& request,
+                                   std::string& response)
+{
+  /* Most requests do not ask for a special encoding.  Avoid parsing
+     them here at all in that case.  */
+  if (request.find ("\"encoding\"") == std::string::npos)
+    {
+      original->HandleRequest (request, response);
+      return;
+    }
+
+  Json::Value req;
+  Json::CharReaderBuilder rbuilder;
+  std::string parseErrs;
+  std::istringstream in(request);
+  if (!Json::parseFromStream (rbuilder, in, &req, &parseErrs)
+        || !req.isObject () || !req.isMember ("encoding"))
+    {
+      original->HandleRequest (request, response);
+      return;
+    }
+
+  const Json::Value encoding = req["encoding"];
+  req.removeMember ("encoding");
+
+  if (encoding != "json" && encoding != "cbor")
+    {
+      VLOG (1) << "Unsupported response encoding requested: " << encoding;
+      response = CompactJson (RpcBatchHandler::ErrorResponse (
+          req["id"], INVALID_PARAMS, "unsupported encoding"));
+      return;
+    }
+
+  original->HandleRequest (CompactJson (req), response);
+  if (encoding == "json" || response.empty ())
+    return;
+
+  std::string cbor;
+  if (!TranscodeJsonToCbor (response, blobKeys, cbor))
+    {
+      LOG (WARNING) << "Failed to parse JSON-RPC response as JSON";
+      return;
+    }
+
+  response = std::move (cbor);
+}
+
+} // namespace xaya
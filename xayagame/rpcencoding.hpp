@@ -0,0 +1,89 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAGAME_RPCENCODING_HPP
+#define XAYAGAME_RPCENCODING_HPP
+
+#include <json/json.h>
+#include <jsonrpccpp/server.h>
+
+#include <set>
+#include <string>
+
+namespace xaya
+{
+
+/**
+ * Encodes a JSON value as CBOR (RFC 8949).  String values of object members
+ * whose key is in blobKeys and which are canonical base64 are encoded as
+ * byte strings with tag 22 ("expected conversion to base64") instead, so
+ * that the binary data is transferred directly.  A generic CBOR-to-JSON
+ * conversion yields back the original value.
+ */
+std::string EncodeCbor (const Json::Value& val,
+                        const std::set<std::string>& blobKeys = {});
+
+/**
+ * Converts JSON text directly to CBOR, handling blobs in the same way as
+ * EncodeCbor.  No Json::Value is built up in between.  The result is the
+ * same as EncodeCbor of the parsed value if the object keys in the text are
+ * sorted (as in JSON serialised from a Json::Value).  Returns false if
+ * the input is not valid JSON.
+ */
+bool TranscodeJsonToCbor (const std::string& json,
+                          const std::set<std::string>& blobKeys,
+                          std::string& cbor);
+
+/**
+ * Connection handler that allows clients of an RPC server to opt into
+ * a compact binary encoding of the responses.  For this, a client adds
+ * the member "encoding" to its (non-batch) JSON-RPC request object.  The
+ * supported values are "json" (the default) and "cbor".
+ *
+ * With "cbor", the full JSON-RPC response object is returned encoded as
+ * CBOR with TranscodeJsonToCbor.  Since CBOR data items are self-delimiting
+ * and the response is a map (i.e. never starts with an ASCII character), the
+ * socket RPC servers send such responses length-prefixed instead of
+ * terminated by a newline.  See SocketRpcServer for the framing.
+ *
+ * HTTP clients of a CompressingHttpServer can instead ask for CBOR through
+ * the Accept header, which avoids parsing the request here.  Installing
+ * this handler on such a connector enables that (with our blob keys).
+ *
+ * Like RpcBatchHandler, this installs itself on the connector and forwards
+ * requests to the previous handler.  Thus it must be constructed after the
+ * RPC server itself, and destructed before it.
+ */
+class RpcEncodingHandler : public jsonrpc::IClientConnectionHandler
+{
+
+private:
+
+  /** The connector on which we are installed.  */
+  jsonrpc::AbstractServerConnector& conn;
+
+  /** The previous handler, to which we forward requests.  */
+  jsonrpc::IClientConnectionHandler* const original;
+
+  /** Keys of object members holding base64 blobs.  */
+  const std::set<std::string> blobKeys;
+
+public:
+
+  explicit RpcEncodingHandler (jsonrpc::AbstractServerConnector& c,
+                               const std::set<std::string>& b = {});
+  ~RpcEncodingHandler ();
+
+  RpcEncodingHandler () = delete;
+  RpcEncodingHandler (const RpcEncodingHandler&) = delete;
+  void operator= (const RpcEncodingHandler&) = delete;
+
+  void HandleRequest (const std::string& request,
+                      std::string& response) override;
+
+};
+
+} // namespace xaya
+
+#endif // XAYAGAME_RPCENCODING_HPP
@@ -0,0 +1,380 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcencoding.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <sstream>
+
+namespace xaya
+{
+namespace
+{
+
+Json::Value
+ParseJson (const std::string& str)
+{
+  std::istringstream in(str);
+  Json::Value res;
+  in >> res;
+  return res;
+}
+
+/**
+ * Converts binary data to lower-case hex for easy comparison.
+ */
+std::string
+ToHex (const std::string& data)
+{
+  std::ostringstream out;
+  for (const unsigned char c : data)
+    {
+      char buf[3];
+      std::snprintf (buf, sizeof (buf), "%02x", c);
+      out << buf;
+    }
+  return out.str ();
+}
+
+/* ************************************************************************** */
+
+class EncodeCborTests : public testing::Test
+{
+
+protected:
+
+  /**
+   * Encodes the given JSON string as CBOR and returns the result as hex.
+   */
+  static std::string
+  Encode (const std::string& json,
+          const std::set<std::string>& blobKeys = {})
+  {
+    return ToHex (EncodeCbor (ParseJson (json), blobKeys));
+  }
+
+};
+
+TEST_F (EncodeCborTests, Integers)
+{
+  /* Test vectors from RFC 8949, appendix A.  */
+  EXPECT_EQ (Encode ("0"), "00");
+  EXPECT_EQ (Encode ("23"), "17");
+  EXPECT_EQ (Encode ("24"), "1818");
+  EXPECT_EQ (Encode ("100"), "1864");
+  EXPECT_EQ (Encode ("1000"), "1903e8");
+  EXPECT_EQ (Encode ("1000000"), "1a000f4240");
+  EXPECT_EQ (Encode ("1000000000000"), "1b000000e8d4a51000");
+  EXPECT_EQ (Encode ("18446744073709551615"), "1bffffffffffffffff");
+  EXPECT_EQ (Encode ("-1"), "20");
+  EXPECT_EQ (Encode ("-10"), "29");
+  EXPECT_EQ (Encode ("-100"), "3863");
+  EXPECT_EQ (Encode ("-1000"), "3903e7");
+  EXPECT_EQ (Encode ("-9223372036854775808"), "3b7fffffffffffffff");
+}
+
+TEST_F (EncodeCborTests, Simple)
+{
+  EXPECT_EQ (Encode ("1.1"), "fb3ff199999999999a");
+  EXPECT_EQ (Encode ("-4.1"), "fbc010666666666666");
+  EXPECT_EQ (Encode ("false"), "f4");
+  EXPECT_EQ (Encode ("true"), "f5");
+  EXPECT_EQ (Encode ("null"), "f6");
+}
+
+TEST_F (EncodeCborTests, Strings)
+{
+  EXPECT_EQ (Encode (R"("")"), "60");
+  EXPECT_EQ (Encode (R"("a")"), "6161");
+  EXPECT_EQ (Encode (R"("IETF")"), "6449455446");
+  EXPECT_EQ (Encode (R"("ü")"), "62c3bc");
+}
+
+TEST_F (EncodeCborTests, Containers)
+{
+  EXPECT_EQ (Encode ("[]"), "80");
+  EXPECT_EQ (Encode ("[1, 2, 3]"), "83010203");
+  EXPECT_EQ (Encode ("[1, [2, 3], [4, 5]]"), "8301820203820405");
+  EXPECT_EQ (Encode ("{}"), "a0");
+  EXPECT_EQ (Encode (R"({"a": 1, "b": [2, 3]})"), "a26161016162820203");
+  EXPECT_EQ (Encode (R"(["a", {"b": "c"}])"), "826161a161626163");
+}
+
+TEST_F (EncodeCborTests, Blobs)
+{
+  /* "AQID" is base64 for 0x010203.  */
+  EXPECT_EQ (Encode (R"({"data": "AQID"})", {"data"}),
+             "a16464617461" "d643010203");
+  EXPECT_EQ (Encode (R"({"data": ""})", {"data"}), "a16464617461" "d640");
+
+  /* Not a blob key.  */
+  EXPECT_EQ (Encode (R"({"data": "AQID"})", {"other"}),
+             "a16464617461" "6441514944");
+
+  /* Values that are not (canonical) base64 remain strings.  */
+  EXPECT_EQ (Encode (R"({"data": "abc"})", {"data"}),
+             "a16464617461" "63616263");
+  EXPECT_EQ (Encode (R"({"data": "a+b!"})", {"data"}),
+             "a16464617461" "64612b6221");
+
+  /* Non-string values are encoded normally, including their members.  */
+  EXPECT_EQ (Encode (R"({"data": {"data": "AQID"}})", {"data"}),
+             "a16464617461" "a16464617461" "d643010203");
+  EXPECT_EQ (Encode (R"({"data": 5})", {"data"}), "a16464617461" "05");
+}
+
+/* ************************************************************************** */
+
+/**
+ * Transcodes the given JSON text and expects that it succeeds and yields
+ * the same as EncodeCbor of the parsed value.
+ */
+void
+ExpectTranscodesLikeEncode (const std::string& json,
+                            const std::set<std::string>& blobKeys = {})
+{
+  std::string cbor;
+  ASSERT_TRUE (TranscodeJsonToCbor (json, blobKeys, cbor)) << json;
+  EXPECT_EQ (ToHex (cbor), ToHex (EncodeCbor (ParseJson (json), blobKeys)))
+      << json;
+}
+
+TEST (TranscodeJsonToCborTests, MatchesEncode)
+{
+  for (const std::string json : {
+          "0", "23", "24", "1000000000000", "18446744073709551615",
+          "-1", "-1000", "-9223372036854775808", "-0",
+          "1.1", "-4.1", "1e3", "2.5E-3", "18446744073709551616",
+          "-9223372036854775809",
+          "false", "true", "null",
+          R"("")", R"("IETF")", R"("ü")", R"("a\"b\\c\/d")",
+          R"("\b\f\n\r\t")", R"("\u00fc\u20AC")", R"("\ud83d\ude00")",
+          "[]", "[1, 2, 3]", "[1, [2, 3], [4, 5]]", " [ 1 , {} ] ",
+          "{}", R"({"a": 1, "b": [2, 3]})", R"(["a", {"b": "c"}])",
+        })
+    ExpectTranscodesLikeEncode (json);
+}
+
+TEST (TranscodeJsonToCborTests, Blobs)
+{
+  for (const std::string json : {
+          R"({"data": "AQID"})", R"({"data": ""})", R"({"data": "abc"})",
+          R"({"data": "a+b!"})", R"({"data": {"data": "AQID"}})",
+          R"({"data": 5})", R"({"data": ["AQID"]})",
+        })
+    ExpectTranscodesLikeEncode (json, {"data"});
+}
+
+TEST (TranscodeJsonToCborTests, KeepsKeyOrder)
+{
+  std::string cbor;
+  ASSERT_TRUE (TranscodeJsonToCbor (R"({"b": 1, "a": 2})", {}, cbor));
+  EXPECT_EQ (ToHex (cbor), "a2616201616102");
+}
+
+TEST (TranscodeJsonToCborTests, LargeContainer)
+{
+  std::ostringstream json;
+  json << "[";
+  for (int i = 0; i < 1000; ++i)
+    json << (i > 0 ? "," : "") << R"({"n":)" << i << "}";
+  json << "]";
+
+  ExpectTranscodesLikeEncode (json.str ());
+}
+
+TEST (TranscodeJsonToCborTests, Invalid)
+{
+  for (const std::string json : {
+          "", "[", "[1,]", "{", R"({"a"})", R"({"a":1,})", R"({1:2})",
+          "tru", "nul", "+1", "-", "1 2", R"("abc)", R"("\x")",
+          R"("\u12")", R"("\ud83d")", R"("\ude00")", "[1] x",
+        })
+    {
+      std::string cbor;
+      EXPECT_FALSE (TranscodeJsonToCbor (json, {}, cbor)) << json;
+    }
+}
+
+/* ************************************************************************** */
+
+/**
+ * Server connector that does not listen anywhere, and just allows
+ * passing requests to the handler.
+ */
+class TestConnector : public jsonrpc::AbstractServerConnector
+{
+
+public:
+
+  bool
+  StartListening () override
+  {
+    return true;
+  }
+
+  bool
+  StopListening () override
+  {
+    return true;
+  }
+
+};
+
+/**
+ * Handler that takes the role of the RPC server.  It records the
+ * requests it gets and returns a fixed response.
+ */
+class FallbackHandler : public jsonrpc::IClientConnectionHandler
+{
+
+public:
+
+  /** The last request received.  */
+  std::string lastRequest;
+
+  /**
+   * The response to return.  The keys are sorted like in responses
+   * serialised from a Json::Value.
+   */
+  std::string response
+      = R"({"id": 1, "jsonrpc": "2.0", "result": {"proto": "AQID"}})";
+
+  void
+  HandleRequest (const std::string& request, std::string& res) override
+  {
+    lastRequest = request;
+    res = response;
+  }
+
+};
+
+class RpcEncodingHandlerTests : public testing::Test
+{
+
+protected:
+
+  TestConnector conn;
+  FallbackHandler fallback;
+
+  RpcEncodingHandlerTests ()
+  {
+    conn.SetHandler (&fallback);
+  }
+
+  std::string
+  Process (const std::string& request)
+  {
+    std::string response;
+    conn.ProcessRequest (request, response);
+    return response;
+  }
+
+};
+
+TEST_F (RpcEncodingHandlerTests, InstallsAndRestores)
+{
+  {
+    RpcEncodingHandler handler(conn);
+    EXPECT_EQ (conn.GetHandler (), &handler);
+  }
+
+  EXPECT_EQ (conn.GetHandler (), &fallback);
+}
+
+TEST_F (RpcEncodingHandlerTests, DefaultIsJson)
+{
+  RpcEncodingHandler handler(conn, {"proto"});
+
+  const std::string req = R"({"jsonrpc":"2.0","method":"foo","id":1})";
+  EXPECT_EQ (Process (req), fallback.response);
+  EXPECT_EQ (fallback.lastRequest, req);
+}
+
+TEST_F (RpcEncodingHandlerTests, ExplicitJson)
+{
+  RpcEncodingHandler handler(conn, {"proto"});
+
+  EXPECT_EQ (Process (R"({
+    "jsonrpc": "2.0",
+    "method": "foo",
+    "id": 1,
+    "encoding": "json"
+  })"), fallback.response);
+  EXPECT_EQ (ParseJson (fallback.lastRequest), ParseJson (R"({
+    "jsonrpc": "2.0",
+    "method": "foo",
+    "id": 1
+  })"));
+}
+
+TEST_F (RpcEncodingHandlerTests, Cbor)
+{
+  RpcEncodingHandler handler(conn, {"proto"});
+
+  const std::string res = Process (R"({
+    "jsonrpc": "2.0",
+    "method": "foo",
+    "params": [42],
+    "id": 1,
+    "encoding": "cbor"
+  })");
+  EXPECT_EQ (ParseJson (fallback.lastRequest), ParseJson (R"({
+    "jsonrpc": "2.0",
+    "method": "foo",
+    "params": [42],
+    "id": 1
+  })"));
+
+  EXPECT_EQ (res, EncodeCbor (ParseJson (fallback.response), {"proto"}));
+  EXPECT_NE (ToHex (res).find ("d643010203"), std::string::npos);
+}
+
+TEST_F (RpcEncodingHandlerTests, CborNotification)
+{
+  RpcEncodingHandler handler(conn);
+
+  fallback.response = "";
+  EXPECT_EQ (Process (R"({
+    "jsonrpc": "2.0",
+    "method": "foo",
+    "encoding": "cbor"
+  })"), "");
+  EXPECT_NE (fallback.lastRequest, "");
+}
+
+TEST_F (RpcEncodingHandlerTests, UnsupportedEncoding)
+{
+  RpcEncodingHandler handler(conn);
+
+  const auto res = ParseJson (Process (R"({
+    "jsonrpc": "2.0",
+    "method": "foo",
+    "id": 5,
+    "encoding": "xml"
+  })"));
+  EXPECT_EQ (fallback.lastRequest, "");
+  EXPECT_EQ (res["id"], 5);
+  EXPECT_EQ (res["error"]["code"], -32602);
+}
+
+TEST_F (RpcEncodingHandlerTests, OtherRequestsForwarded)
+{
+  RpcEncodingHandler handler(conn);
+
+  for (const std::string req : {
+          R"([{"jsonrpc":"2.0","method":"foo","id":1,"encoding":"cbor"}])",
+          R"({"jsonrpc":"2.0","method":"foo","params":["encoding"],"id":1})",
+          R"({"encoding": )",
+        })
+    {
+      EXPECT_EQ (Process (req), fallback.response);
+      EXPECT_EQ (fallback.lastRequest, req);
+    }
+}
+
+} // anonymous namespace
+} // namespace xaya
@@ -0,0 +1,114 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcpool.hpp"
+
+#include <jsonrpccpp/client/connectors/httpclient.h>
+
+#include <glog/logging.h>
+
+namespace xaya
+{
+
+/**
+ * RAII helper that takes a connector from the pool (waiting for one if
+ * necessary) and returns it when destructed, also if the call threw.
+ */
+class RpcConnectorPool::Lease
+{
+
+private:
+
+  /** The pool we belong to.  */
+  RpcConnectorPool& pool;
+
+  /** The connector we hold.  */
+  std::unique_ptr<jsonrpc::IClientConnector> conn;
+
+public:
+
+  explicit Lease (RpcConnectorPool& p)
+    : pool(p)
+  {
+    std::unique_lock<std::mutex> lock(pool.mut);
+    while (pool.idle.empty () && pool.created >= pool.maxSize)
+      pool.cvReturned.wait (lock);
+
+    if (!pool.idle.empty ())
+      {
+        conn = std::move (pool.idle.back ());
+        pool.idle.pop_back ();
+        return;
+      }
+
+    /* We count the new connector already here, so that other threads do
+       not create too many while we construct it without holding the lock.  */
+    ++pool.created;
+    VLOG (1) << "Creating RPC connector #" << pool.created << " for pool";
+    lock.unlock ();
+
+    try
+      {
+        conn = pool.factory ();
+        CHECK (conn != nullptr);
+      }
+    catch (...)
+      {
+        lock.lock ();
+        --pool.created;
+        pool.cvReturned.notify_one ();
+        throw;
+      }
+  }
+
+  ~Lease ()
+  {
+    std::lock_guard<std::mutex> lock(pool.mut);
+    pool.idle.push_back (std::move (conn));
+    pool.cvReturned.notify_one ();
+  }
+
+  Lease () = delete;
+  Lease (const Lease&) = delete;
+  void operator= (const Lease&) = delete;
+
+  jsonrpc::IClientConnector*
+  operator-> ()
+  {
+    return conn.get ();
+  }
+
+};
+
+RpcConnectorPool::RpcConnectorPool (const Factory& f, const unsigned s)
+  : factory(f), maxSize(s)
+{
+  CHECK_GT (maxSize, 0) << "RPC connector pool must not be empty";
+}
+
+void
+RpcConnectorPool::SendRPCMessage (const std::string& message,
+                                  std::string& result)
+{
+  Lease conn(*this);
+  conn->SendRPCMessage (message, result);
+}
+
+unsigned
+RpcConnectorPool::GetNumCreated ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return created;
+}
+
+std::unique_ptr<RpcConnectorPool>
+RpcConnectorPool::ForHttp (const std::string& url, const unsigned size)
+{
+  return std::make_unique<RpcConnectorPool> ([url] ()
+    {
+      return std::make_unique<jsonrpc::HttpClient> (url);
+    }, size);
+}
+
+} // namespace xaya
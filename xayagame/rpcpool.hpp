@@ -0,0 +1,90 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAGAME_RPCPOOL_HPP
+#define XAYAGAME_RPCPOOL_HPP
+
+#include <jsonrpccpp/client.h>
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace xaya
+{
+
+/**
+ * JSON-RPC client connector that dispatches calls to a pool of underlying
+ * connectors, so that it can be used from multiple threads at the same time.
+ * Each underlying connector is used by only one call at a time.  For HTTP,
+ * each has its own persistent (keep-alive) connection.
+ *
+ * This is used for the connection to Xaya Core, which is shared by the
+ * block-processing thread of the Game and e.g. RPC handlers calling
+ * verifymessage.  With a single jsonrpc::HttpClient, those calls would
+ * not be thread-safe and would have to be serialised.
+ *
+ * Underlying connectors are created on demand.  If all of them are busy
+ * and the maximum size is reached, calls wait until one becomes free.
+ */
+class RpcConnectorPool : public jsonrpc::IClientConnector
+{
+
+public:
+
+  /** Function that creates a new underlying connector.  */
+  using Factory = std::function<std::unique_ptr<jsonrpc::IClientConnector> ()>;
+
+private:
+
+  class Lease;
+
+  /** The factory for creating new connectors.  */
+  const Factory factory;
+
+  /** Maximum number of connectors to create.  */
+  const unsigned maxSize;
+
+  /** Lock for the pool state.  */
+  std::mutex mut;
+
+  /** Notified when a connector is returned to the pool.  */
+  std::condition_variable cvReturned;
+
+  /** Connectors that are currently free.  */
+  std::vector<std::unique_ptr<jsonrpc::IClientConnector>> idle;
+
+  /** Total number of connectors created so far.  */
+  unsigned created = 0;
+
+public:
+
+  explicit RpcConnectorPool (const Factory& f, unsigned s);
+
+  RpcConnectorPool () = delete;
+  RpcConnectorPool (const RpcConnectorPool&) = delete;
+  void operator= (const RpcConnectorPool&) = delete;
+
+  void SendRPCMessage (const std::string& message,
+                       std::string& result) override;
+
+  /**
+   * Returns the number of underlying connectors created so far.
+   */
+  unsigned GetNumCreated ();
+
+  /**
+   * Constructs a pool of HTTP connectors to the given URL.
+   */
+  static std::unique_ptr<RpcConnectorPool> ForHttp (const std::string& url,
+                                                    unsigned size);
+
+};
+
+} // namespace xaya
+
+#endif // XAYAGAME_RPCPOOL_HPP
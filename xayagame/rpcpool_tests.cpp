@@ -0,0 +1,172 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcpool.hpp"
+
+#include <jsonrpccpp/common/exception.h>
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace xaya
+{
+namespace
+{
+
+/**
+ * Fake connector for the tests.  It echoes back the message after a short
+ * delay, and keeps track of how many calls are active at the same time.
+ * Messages starting with "throw" make it throw instead.
+ */
+class FakeConnector : public jsonrpc::IClientConnector
+{
+
+private:
+
+  /** Number of calls active on all connectors.  */
+  std::atomic<unsigned>& active;
+
+  /** Maximum of active seen.  */
+  std::atomic<unsigned>& maxActive;
+
+  /** Whether this particular connector is in use.  */
+  std::atomic<bool> busy;
+
+public:
+
+  explicit FakeConnector (std::atomic<unsigned>& a, std::atomic<unsigned>& m)
+    : active(a), maxActive(m), busy(false)
+  {}
+
+  void
+  SendRPCMessage (const std::string& message, std::string& result) override
+  {
+    CHECK (!busy.exchange (true)) << "Connector used concurrently";
+
+    const unsigned cur = ++active;
+    unsigned prev = maxActive;
+    while (prev < cur && !maxActive.compare_exchange_weak (prev, cur))
+      ;
+
+    std::this_thread::sleep_for (std::chrono::milliseconds (10));
+
+    --active;
+    busy = false;
+
+    if (message.substr (0, 5) == "throw")
+      throw jsonrpc::JsonRpcException (-1, "fake error");
+
+    result = message;
+  }
+
+};
+
+class RpcConnectorPoolTests : public testing::Test
+{
+
+protected:
+
+  std::atomic<unsigned> active;
+  std::atomic<unsigned> maxActive;
+
+  RpcConnectorPoolTests ()
+    : active(0), maxActive(0)
+  {}
+
+  /**
+   * Constructs a pool with the given size over fake connectors.
+   */
+  std::unique_ptr<RpcConnectorPool>
+  MakePool (const unsigned size)
+  {
+    return std::make_unique<RpcConnectorPool> ([this] ()
+      {
+        return std::make_unique<FakeConnector> (active, maxActive);
+      }, size);
+  }
+
+  /**
+   * Sends a message through the pool and returns the result.
+   */
+  static std::string
+  Send (RpcConnectorPool& pool, const std::string& msg)
+  {
+    std::string result;
+    pool.SendRPCMessage (msg, result);
+    return result;
+  }
+
+};
+
+TEST_F (RpcConnectorPoolTests, SequentialCallsReuseConnector)
+{
+  auto pool = MakePool (5);
+  for (unsigned i = 0; i < 10; ++i)
+    EXPECT_EQ (Send (*pool, "foo" + std::to_string (i)),
+               "foo" + std::to_string (i));
+  EXPECT_EQ (pool->GetNumCreated (), 1);
+}
+
+TEST_F (RpcConnectorPoolTests, ConcurrentCalls)
+{
+  constexpr unsigned poolSize = 3;
+  constexpr unsigned numThreads = 10;
+  constexpr unsigned callsPerThread = 5;
+
+  auto pool = MakePool (poolSize);
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < numThreads; ++i)
+    threads.emplace_back ([this, &pool, i] ()
+      {
+        for (unsigned j = 0; j < callsPerThread; ++j)
+          {
+            const std::string msg
+                = std::to_string (i) + "/" + std::to_string (j);
+            EXPECT_EQ (Send (*pool, msg), msg);
+          }
+      });
+  for (auto& t : threads)
+    t.join ();
+
+  EXPECT_EQ (pool->GetNumCreated (), poolSize);
+  EXPECT_LE (maxActive, poolSize);
+  EXPECT_GT (maxActive, 1);
+}
+
+TEST_F (RpcConnectorPoolTests, ExceptionReturnsConnector)
+{
+  auto pool = MakePool (1);
+
+  EXPECT_THROW (Send (*pool, "throw"), jsonrpc::JsonRpcException);
+  EXPECT_EQ (Send (*pool, "foo"), "foo");
+  EXPECT_EQ (pool->GetNumCreated (), 1);
+}
+
+TEST_F (RpcConnectorPoolTests, FactoryFailure)
+{
+  bool fail = true;
+  RpcConnectorPool pool([this, &fail] ()
+    {
+      if (fail)
+        throw jsonrpc::JsonRpcException (-1, "factory failed");
+      return std::make_unique<FakeConnector> (active, maxActive);
+    }, 1);
+
+  EXPECT_THROW (Send (pool, "foo"), jsonrpc::JsonRpcException);
+  EXPECT_EQ (pool.GetNumCreated (), 0);
+
+  fail = false;
+  EXPECT_EQ (Send (pool, "foo"), "foo");
+  EXPECT_EQ (pool.GetNumCreated (), 1);
+}
+
+} // anonymous namespace
+} // namespace xaya
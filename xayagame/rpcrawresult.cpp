@@ -0,0 +1,114 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcrawresult.hpp"
+
+#include "jsonwriter.hpp"
+#include "rpcbatch.hpp"
+
+#include <json/json.h>
+#include <jsonrpccpp/common/exception.h>
+
+#include <glog/logging.h>
+
+#include <sstream>
+
+namespace xaya
+{
+
+namespace
+{
+
+/**
+ * Returns true if the given value is acceptable as "params" for a method
+ * without parameters.
+ */
+bool
+IsEmptyParams (const Json::Value& params)
+{
+  return params.isNull ()
+            || ((params.isArray () || params.isObject ()) && params.empty ());
+}
+
+} // anonymous namespace
+
+RpcRawResultHandler::RpcRawResultHandler (jsonrpc::AbstractServerConnector& c)
+  : conn(c), original(c.GetHandler ())
+{
+  CHECK (original != nullptr)
+      << "RpcRawResultHandler must be installed after the RPC server";
+  conn.SetHandler (this);
+}
+
+RpcRawResultHandler::~RpcRawResultHandler ()
+{
+  conn.SetHandler (original);
+}
+
+void
+RpcRawResultHandler::AddMethod (const std::string& method,
+                                const ResultWriter& writer)
+{
+  methods[method] = writer;
+}
+
+void
+RpcRawResultHandler::HandleRequest (const std::string& request,
+                                    std::string& response)
+{
+  /* Only parse the request if it can possibly be a call to one of
+     our methods at all.  */
+  bool mentioned = false;
+  for (const auto& entry : methods)
+    if (request.find ('"' + entry.first + '"') != std::string::npos)
+      {
+        mentioned = true;
+        break;
+      }
+  if (!mentioned)
+    {
+      original->HandleRequest (request, response);
+      return;
+    }
+
+  Json::Value req;
+  Json::CharReaderBuilder rbuilder;
+  std::string parseErrs;
+  std::istringstream in(request);
+  if (!Json::parseFromStream (rbuilder, in, &req, &parseErrs)
+        || !req.isObject () || req["jsonrpc"] != "2.0"
+        || !req.isMember ("id") || !req["method"].isString ()
+        || !IsEmptyParams (req["params"]))
+    {
+      original->HandleRequest (request, response);
+      return;
+    }
+
+  const auto mit = methods.find (req["method"].asString ());
+  if (mit == methods.end ())
+    {
+      original->HandleRequest (request, response);
+      return;
+    }
+
+  std::ostringstream out;
+  out << R"({"id":)" << CompactJson (req["id"])
+      << R"(,"jsonrpc":"2.0","result":)";
+
+  try
+    {
+      mit->second (out);
+    }
+  catch (const jsonrpc::JsonRpcException& exc)
+    {
+      response = CompactJson (RpcBatchHandler::ErrorResponse (
+          req["id"], exc.GetCode (), exc.GetMessage ()));
+      return;
+    }
+
+  out << '}';
+  response = out.str ();
+}
+
+} // namespace xaya
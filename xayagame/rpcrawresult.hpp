@@ -0,0 +1,75 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAGAME_RPCRAWRESULT_HPP
+#define XAYAGAME_RPCRAWRESULT_HPP
+
+#include <jsonrpccpp/server.h>
+
+#include <functional>
+#include <map>
+#include <ostream>
+#include <string>
+
+namespace xaya
+{
+
+/**
+ * Connection handler that answers calls to certain methods without
+ * parameters directly with a result that is already serialised as JSON.
+ * This is used for methods like getcurrentstate, whose result is cached
+ * (or can be streamed) as string by the Game instance.  Going through the
+ * normal jsonrpccpp server would instead require a deep copy as Json::Value
+ * and another serialisation of it for every call.
+ *
+ * Like RpcBatchHandler, this installs itself on the connector and forwards
+ * everything it does not process to the previous handler.  Thus it must be
+ * constructed after the RPC server itself, and destructed before it.
+ */
+class RpcRawResultHandler : public jsonrpc::IClientConnectionHandler
+{
+
+public:
+
+  /**
+   * Callback that writes the serialised JSON result of a method to the
+   * given stream.  It may throw jsonrpc::JsonRpcException, which is turned
+   * into an error response.
+   */
+  using ResultWriter = std::function<void (std::ostream& out)>;
+
+private:
+
+  /** The connector on which we are installed.  */
+  jsonrpc::AbstractServerConnector& conn;
+
+  /** The previous handler, to which we forward other requests.  */
+  jsonrpc::IClientConnectionHandler* const original;
+
+  /** The methods we process, with their result writers.  */
+  std::map<std::string, ResultWriter> methods;
+
+public:
+
+  explicit RpcRawResultHandler (jsonrpc::AbstractServerConnector& c);
+  ~RpcRawResultHandler ();
+
+  RpcRawResultHandler () = delete;
+  RpcRawResultHandler (const RpcRawResultHandler&) = delete;
+  void operator= (const RpcRawResultHandler&) = delete;
+
+  /**
+   * Adds a method that should be processed by this handler.  This must be
+   * done before the connector starts listening.
+   */
+  void AddMethod (const std::string& method, const ResultWriter& writer);
+
+  void HandleRequest (const std::string& request,
+                      std::string& response) override;
+
+};
+
+} // namespace xaya
+
+#endif // XAYAGAME_RPCRAWRESULT_HPP
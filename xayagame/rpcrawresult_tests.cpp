@@ -0,0 +1,187 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcrawresult.hpp"
+
+#include <jsonrpccpp/common/errors.h>
+#include <jsonrpccpp/common/exception.h>
+
+#include <gtest/gtest.h>
+
+#include <json/json.h>
+
+#include <memory>
+#include <sstream>
+
+namespace xaya
+{
+namespace
+{
+
+/**
+ * Server connector that does not listen anywhere, and just allows
+ * passing requests to the handler.
+ */
+class TestConnector : public jsonrpc::AbstractServerConnector
+{
+
+public:
+
+  bool
+  StartListening () override
+  {
+    return true;
+  }
+
+  bool
+  StopListening () override
+  {
+    return true;
+  }
+
+};
+
+/**
+ * Handler that takes the role of the RPC server.  It just records the
+ * requests it gets.
+ */
+class FallbackHandler : public jsonrpc::IClientConnectionHandler
+{
+
+public:
+
+  /** The last request received.  */
+  std::string lastRequest;
+
+  void
+  HandleRequest (const std::string& request, std::string& response) override
+  {
+    lastRequest = request;
+    response = "fallback";
+  }
+
+};
+
+Json::Value
+ParseJson (const std::string& str)
+{
+  std::istringstream in(str);
+  Json::Value res;
+  in >> res;
+  return res;
+}
+
+class RpcRawResultHandlerTests : public testing::Test
+{
+
+protected:
+
+  TestConnector conn;
+  FallbackHandler fallback;
+
+  /** Number of times the "state" method was invoked.  */
+  unsigned stateCalls = 0;
+
+  RpcRawResultHandlerTests ()
+  {
+    conn.SetHandler (&fallback);
+  }
+
+  /**
+   * Installs a handler that processes the methods "state" (returning a fixed
+   * JSON object) and "error" (throwing a JSON-RPC error).
+   */
+  std::unique_ptr<RpcRawResultHandler>
+  Install ()
+  {
+    auto res = std::make_unique<RpcRawResultHandler> (conn);
+    res->AddMethod ("state", [this] (std::ostream& out)
+      {
+        ++stateCalls;
+        out << R"({"foo":[1,2,3]})";
+      });
+    res->AddMethod ("error", [] (std::ostream& out)
+      {
+        out << "partial";
+        throw jsonrpc::JsonRpcException (
+            jsonrpc::Errors::ERROR_RPC_INTERNAL_ERROR, "some error");
+      });
+    return res;
+  }
+
+  std::string
+  Process (const std::string& request)
+  {
+    std::string response;
+    conn.ProcessRequest (request, response);
+    return response;
+  }
+
+};
+
+TEST_F (RpcRawResultHandlerTests, InstallsAndRestores)
+{
+  {
+    auto handler = Install ();
+    EXPECT_EQ (conn.GetHandler (), handler.get ());
+  }
+
+  EXPECT_EQ (conn.GetHandler (), &fallback);
+}
+
+TEST_F (RpcRawResultHandlerTests, OtherRequestsForwarded)
+{
+  auto handler = Install ();
+
+  for (const std::string req :
+        {
+          R"({"jsonrpc":"2.0","method":"other","id":1})",
+          R"({"jsonrpc":"2.0","method":"other","params":["state"],"id":1})",
+          R"({"jsonrpc":"2.0","method":"state","params":[1],"id":1})",
+          R"({"jsonrpc":"2.0","method":"state","params":{"a":1},"id":1})",
+          R"({"jsonrpc":"2.0","method":"state"})",
+          R"({"method":"state","id":1})",
+          R"([{"jsonrpc":"2.0","method":"state","id":1}])",
+          R"({"jsonrpc":"2.0","method":"state",)",
+        })
+    {
+      EXPECT_EQ (Process (req), "fallback");
+      EXPECT_EQ (fallback.lastRequest, req);
+    }
+  EXPECT_EQ (stateCalls, 0);
+}
+
+TEST_F (RpcRawResultHandlerTests, MethodProcessed)
+{
+  auto handler = Install ();
+
+  for (const std::string req :
+        {
+          R"({"jsonrpc":"2.0","method":"state","id":"x"})",
+          R"({"jsonrpc":"2.0","method":"state","params":[],"id":"x"})",
+          R"({"jsonrpc":"2.0","method":"state","params":{},"id":"x"})",
+        })
+    {
+      fallback.lastRequest.clear ();
+      EXPECT_EQ (Process (req),
+                 R"({"id":"x","jsonrpc":"2.0","result":{"foo":[1,2,3]}})");
+      EXPECT_EQ (fallback.lastRequest, "");
+    }
+  EXPECT_EQ (stateCalls, 3);
+}
+
+TEST_F (RpcRawResultHandlerTests, Error)
+{
+  auto handler = Install ();
+
+  const auto res
+      = ParseJson (Process (R"({"jsonrpc":"2.0","method":"error","id":5})"));
+  EXPECT_EQ (res["id"], 5);
+  EXPECT_FALSE (res.isMember ("result"));
+  EXPECT_EQ (res["error"]["code"], jsonrpc::Errors::ERROR_RPC_INTERNAL_ERROR);
+  EXPECT_EQ (res["error"]["message"], "some error");
+}
+
+} // anonymous namespace
+} // namespace xaya
@@ -1,27 +1,995 @@
-// Copyright (C) 2019 The Xaya developers
+// Copyright (C) 2019-2020 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "signatures.hpp"
 
+#include <xayautil/base64.hpp>
+#include <xayautil/hash.hpp>
+#include <xayautil/uint256.hpp>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/err.h>
+#include <openssl/obj_mac.h>
+#include <openssl/ripemd.h>
+
+#include <jsonrpccpp/common/exception.h>
+
 #include <glog/logging.h>
 
 #include <json/json.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
 namespace xaya
 {
 
+namespace
+{
+
+/** Prefix used by Xaya Core for hashing signed messages.  */
+const std::string MESSAGE_MAGIC = "Xaya Signed Message:\n";
+
+/** Length of a (binary) compact signature.  */
+constexpr size_t SIGNATURE_BYTES = 65;
+
+/** Length of a compact signature encoded as base64.  */
+constexpr size_t SIGNATURE_BASE64_CHARS = 88;
+
+/** Alphabet used for base58 encoding.  */
+const std::string BASE58_ALPHABET
+    = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+
+/** Value of learntVersion if we do not know yet.  */
+constexpr int VERSION_UNKNOWN = -1;
+/** Value of learntVersion if local verification is disabled.  */
+constexpr int VERSION_DISABLED = -2;
+
+/**
+ * The address version byte learnt from Xaya Core, with which local
+ * verification is enabled.  Or VERSION_UNKNOWN if we have not yet checked
+ * against Core, or VERSION_DISABLED if the check failed.
+ */
+std::atomic<int> learntVersion(VERSION_UNKNOWN);
+
+/**
+ * Whether local verification has been enabled (see
+ * SetLocalMessageVerification).  If not, learntVersion stays at
+ * VERSION_UNKNOWN, since we never calibrate against Xaya Core.
+ */
+std::atomic<bool> localVerificationEnabled(false);
+
+/**
+ * Serialises a string with a CompactSize length prefix, as Xaya Core does
+ * when hashing a signed message.
+ */
 std::string
-VerifyMessage (XayaRpcClient& rpc,
-               const std::string& msg, const std::string& sgn)
+SerialiseString (const std::string& str)
+{
+  std::string res;
+
+  const uint64_t len = str.size ();
+  unsigned numBytes;
+  if (len < 0xFD)
+    {
+      res.push_back (static_cast<char> (len));
+      numBytes = 0;
+    }
+  else if (len <= 0xFFFF)
+    {
+      res.push_back (static_cast<char> (0xFD));
+      numBytes = 2;
+    }
+  else if (len <= 0xFFFFFFFF)
+    {
+      res.push_back (static_cast<char> (0xFE));
+      numBytes = 4;
+    }
+  else
+    {
+      res.push_back (static_cast<char> (0xFF));
+      numBytes = 8;
+    }
+
+  for (unsigned i = 0; i < numBytes; ++i)
+    res.push_back (static_cast<char> ((len >> (8 * i)) & 0xFF));
+
+  return res + str;
+}
+
+/**
+ * Computes the hash that is signed for a given message.
+ */
+uint256
+MessageHash (const std::string& msg)
+{
+  SHA256 hasher;
+  hasher << SerialiseString (MESSAGE_MAGIC) << SerialiseString (msg);
+  return SHA256::Hash (hasher.Finalise ().GetBinaryString ());
+}
+
+/**
+ * Computes RIPEMD160(SHA256(data)) as binary string.
+ */
+std::string
+Hash160 (const std::string& data)
+{
+  const uint256 sha = SHA256::Hash (data);
+
+  unsigned char res[RIPEMD160_DIGEST_LENGTH];
+  RIPEMD160 (sha.GetBlob (), uint256::NUM_BYTES, res);
+
+  return std::string (reinterpret_cast<const char*> (res), sizeof (res));
+}
+
+/**
+ * Computes the four-byte checksum used in base58check.
+ */
+std::string
+Base58Checksum (const std::string& data)
+{
+  const uint256 hash = SHA256::Hash (SHA256::Hash (data).GetBinaryString ());
+  return hash.GetBinaryString ().substr (0, 4);
+}
+
+/**
+ * Encodes a binary payload (including the version byte) as base58check.
+ */
+std::string
+EncodeBase58Check (const std::string& payload)
+{
+  const std::string data = payload + Base58Checksum (payload);
+
+  /* Digits in base 58, little endian.  */
+  std::vector<unsigned char> digits;
+  for (const unsigned char c : data)
+    {
+      unsigned carry = c;
+      for (auto& d : digits)
+        {
+          carry += static_cast<unsigned> (d) << 8;
+          d = carry % 58;
+          carry /= 58;
+        }
+      while (carry > 0)
+        {
+          digits.push_back (carry % 58);
+          carry /= 58;
+        }
+    }
+
+  std::string res;
+  for (const unsigned char c : data)
+    {
+      if (c != 0)
+        break;
+      res.push_back (BASE58_ALPHABET[0]);
+    }
+  for (auto it = digits.rbegin (); it != digits.rend (); ++it)
+    res.push_back (BASE58_ALPHABET[*it]);
+
+  return res;
+}
+
+/**
+ * Decodes a base58check string to its payload (including the version byte).
+ * Returns false if the string is invalid.
+ */
+bool
+DecodeBase58Check (const std::string& str, std::string& payload)
+{
+  /* Bytes of the result, little endian.  */
+  std::vector<unsigned char> bytes;
+  for (const char c : str)
+    {
+      const size_t pos = BASE58_ALPHABET.find (c);
+      if (pos == std::string::npos)
+        return false;
+
+      unsigned carry = pos;
+      for (auto& b : bytes)
+        {
+          carry += 58 * static_cast<unsigned> (b);
+          b = carry & 0xFF;
+          carry >>= 8;
+        }
+      while (carry > 0)
+        {
+          bytes.push_back (carry & 0xFF);
+          carry >>= 8;
+        }
+    }
+
+  std::string data;
+  for (const char c : str)
+    {
+      if (c != BASE58_ALPHABET[0])
+        break;
+      data.push_back ('\0');
+    }
+  data.append (bytes.rbegin (), bytes.rend ());
+
+  if (data.size () < 4)
+    return false;
+
+  payload = data.substr (0, data.size () - 4);
+  return Base58Checksum (payload) == data.substr (data.size () - 4);
+}
+
+/**
+ * Simple RAII wrapper around the OpenSSL objects needed for public-key
+ * recovery on secp256k1.  Setting up the curve is relatively expensive,
+ * so instances are meant to be kept around (one per thread, as the
+ * objects are not thread-safe) and reused for many recoveries.
+ */
+class Secp256k1
+{
+
+private:
+
+  EC_GROUP* group;
+  BN_CTX* ctx;
+
+  /**
+   * Helper that opens a BN_CTX frame for the duration of one recovery,
+   * and clears OpenSSL's error queue afterwards.
+   */
+  class Frame
+  {
+
+  private:
+
+    BN_CTX* ctx;
+
+  public:
+
+    explicit Frame (BN_CTX* c)
+      : ctx(c)
+    {
+      BN_CTX_start (ctx);
+    }
+
+    ~Frame ()
+    {
+      BN_CTX_end (ctx);
+
+      /* Failed operations (e.g. for invalid signatures) may have left
+         errors in OpenSSL's thread-local queue, which we do not want
+         to keep.  */
+      ERR_clear_error ();
+    }
+
+    Frame (const Frame&) = delete;
+    void operator= (const Frame&) = delete;
+
+  };
+
+public:
+
+  Secp256k1 ()
+  {
+    group = EC_GROUP_new_by_curve_name (NID_secp256k1);
+    CHECK (group != nullptr);
+    ctx = BN_CTX_new ();
+    CHECK (ctx != nullptr);
+  }
+
+  ~Secp256k1 ()
+  {
+    BN_CTX_free (ctx);
+    EC_GROUP_free (group);
+  }
+
+  Secp256k1 (const Secp256k1&) = delete;
+  void operator= (const Secp256k1&) = delete;
+
+  /**
+   * Recovers the public key from a compact signature (in binary form)
+   * on the given message hash.  Returns false if the signature is invalid.
+   */
+  bool RecoverPublicKey (const uint256& hash, const std::string& sig,
+                         std::string& pubkey);
+
+};
+
+bool
+Secp256k1::RecoverPublicKey (const uint256& hash, const std::string& sig,
+                             std::string& pubkey)
+{
+  CHECK_EQ (sig.size (), SIGNATURE_BYTES);
+  const unsigned char* sigBytes
+      = reinterpret_cast<const unsigned char*> (sig.data ());
+
+  /* Decode the header byte exactly like Xaya Core (CPubKey::RecoverCompact)
+     does:  Only the low three bits of (header - 27) matter, and there is
+     no range check on the header itself.  */
+  const unsigned char header = sigBytes[0] - 27;
+  const unsigned recid = header & 3;
+  const bool compressed = (header & 4) != 0;
+
+  Frame frame(ctx);
+  BIGNUM* order = BN_CTX_get (ctx);
+  BIGNUM* p = BN_CTX_get (ctx);
+  BIGNUM* a = BN_CTX_get (ctx);
+  BIGNUM* b = BN_CTX_get (ctx);
+  BIGNUM* r = BN_CTX_get (ctx);
+  BIGNUM* s = BN_CTX_get (ctx);
+  BIGNUM* x = BN_CTX_get (ctx);
+  BIGNUM* e = BN_CTX_get (ctx);
+  BIGNUM* rInv = BN_CTX_get (ctx);
+  BIGNUM* u1 = BN_CTX_get (ctx);
+  BIGNUM* u2 = BN_CTX_get (ctx);
+  CHECK (u2 != nullptr);
+
+  CHECK (EC_GROUP_get_order (group, order, ctx));
+  CHECK (EC_GROUP_get_curve (group, p, a, b, ctx));
+
+  CHECK (BN_bin2bn (sigBytes + 1, 32, r) != nullptr);
+  CHECK (BN_bin2bn (sigBytes + 33, 32, s) != nullptr);
+  if (BN_is_zero (r) || BN_cmp (r, order) >= 0
+        || BN_is_zero (s) || BN_cmp (s, order) >= 0)
+    return false;
+
+  /* The x coordinate of R is r + j * order for j = recid / 2.  */
+  CHECK (BN_copy (x, r) != nullptr);
+  if (recid & 2)
+    CHECK (BN_add (x, x, order));
+  if (BN_cmp (x, p) >= 0)
+    return false;
+
+  using PointPtr = std::unique_ptr<EC_POINT, decltype (&EC_POINT_free)>;
+  PointPtr pointR(EC_POINT_new (group), &EC_POINT_free);
+  PointPtr pointQ(EC_POINT_new (group), &EC_POINT_free);
+  CHECK (pointR != nullptr && pointQ != nullptr);
+
+  if (!EC_POINT_set_compressed_coordinates (group, pointR.get (), x,
+                                            recid & 1, ctx))
+    return false;
+
+  /* Q = r^-1 (s R - e G).  */
+  CHECK (BN_bin2bn (hash.GetBlob (), uint256::NUM_BYTES, e) != nullptr);
+  CHECK (BN_mod_inverse (rInv, r, order, ctx) != nullptr);
+  CHECK (BN_mod_mul (u1, e, rInv, order, ctx));
+  CHECK (BN_mod_sub (u1, order, u1, order, ctx));
+  CHECK (BN_mod_mul (u2, s, rInv, order, ctx));
+  CHECK (EC_POINT_mul (group, pointQ.get (), u1, pointR.get (), u2, ctx));
+  if (EC_POINT_is_at_infinity (group, pointQ.get ()))
+    return false;
+
+  const auto form
+      = compressed ? POINT_CONVERSION_COMPRESSED : POINT_CONVERSION_UNCOMPRESSED;
+  unsigned char buf[65];
+  const size_t len = EC_POINT_point2oct (group, pointQ.get (), form,
+                                         buf, sizeof (buf), ctx);
+  CHECK_EQ (len, compressed ? 33 : 65);
+
+  pubkey = std::string (reinterpret_cast<const char*> (buf), len);
+  return true;
+}
+
+/**
+ * Recovers the hash160 of the public key that signed the given message.
+ * Returns false if the signature is invalid.
+ */
+bool
+RecoverKeyHash (const std::string& msg, const std::string& sgn,
+                std::string& keyHash)
+{
+  /* Check the length first, so that we do not spam the log with errors
+     from DecodeBase64 for arbitrary invalid input.  */
+  if (sgn.size () != SIGNATURE_BASE64_CHARS)
+    return false;
+
+  std::string sig;
+  if (!DecodeBase64 (sgn, sig) || sig.size () != SIGNATURE_BYTES)
+    return false;
+
+  std::string pubkey;
+  thread_local Secp256k1 ec;
+  if (!ec.RecoverPublicKey (MessageHash (msg), sig, pubkey))
+    return false;
+
+  keyHash = Hash160 (pubkey);
+  return true;
+}
+
+/**
+ * Bounded LRU cache of signature verification results.  Entries are keyed
+ * by a hash of the message and signature, and map to the address returned
+ * by VerifyMessage (which may be "invalid").
+ */
+class SignatureCache
 {
+
+private:
+
+  /** An entry in the LRU list.  */
+  using Entry = std::pair<uint256, std::string>;
+
+  /** Lock for this instance.  */
+  std::mutex mut;
+
+  /** Maximum number of entries.  */
+  size_t maxEntries = DEFAULT_SIGNATURE_CACHE_SIZE;
+
+  /** The entries, ordered with most recently used first.  */
+  std::list<Entry> entries;
+
+  /** Index of the entries by key.  */
+  std::map<uint256, std::list<Entry>::iterator> index;
+
+  /** Number of cache hits.  */
+  uint64_t hits = 0;
+
+  /** Number of cache misses.  */
+  uint64_t misses = 0;
+
+  /**
+   * Evicts least recently used entries until we are within the size limit.
+   * Must be called with the lock held.
+   */
+  void
+  Shrink ()
+  {
+    while (entries.size () > maxEntries)
+      {
+        index.erase (entries.back ().first);
+        entries.pop_back ();
+      }
+  }
+
+public:
+
+  SignatureCache () = default;
+
+  SignatureCache (const SignatureCache&) = delete;
+  void operator= (const SignatureCache&) = delete;
+
+  /**
+   * Computes the cache key for a message and signature.
+   */
+  static uint256
+  Key (const std::string& msg, const std::string& sgn)
+  {
+    SHA256 hasher;
+    hasher << SerialiseString (msg) << SerialiseString (sgn);
+    return hasher.Finalise ();
+  }
+
+  /**
+   * Looks up the given key.  Returns true and sets addr if it is found.
+   */
+  bool
+  Get (const uint256& key, std::string& addr)
+  {
+    std::lock_guard<std::mutex> lock(mut);
+
+    const auto mit = index.find (key);
+    if (mit == index.end ())
+      {
+        ++misses;
+        return false;
+      }
+
+    ++hits;
+    entries.splice (entries.begin (), entries, mit->second);
+    addr = mit->second->second;
+    return true;
+  }
+
+  /**
+   * Adds a result to the cache.
+   */
+  void
+  Put (const uint256& key, const std::string& addr)
+  {
+    std::lock_guard<std::mutex> lock(mut);
+
+    /* Another thread may have verified the same signature concurrently.  */
+    if (maxEntries == 0 || index.count (key) > 0)
+      return;
+
+    entries.emplace_front (key, addr);
+    index.emplace (key, entries.begin ());
+    Shrink ();
+  }
+
+  void
+  SetMaxEntries (const size_t n)
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    maxEntries = n;
+    Shrink ();
+  }
+
+  SignatureCacheStats
+  GetStats ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+
+    SignatureCacheStats res;
+    res.entries = entries.size ();
+    res.hits = hits;
+    res.misses = misses;
+
+    return res;
+  }
+
+  /**
+   * Removes all entries and resets the statistics.  The size limit is kept.
+   */
+  void
+  Clear ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    entries.clear ();
+    index.clear ();
+    hits = 0;
+    misses = 0;
+  }
+
+};
+
+/**
+ * The process-wide signature cache.  The addresses in it depend on the
+ * chain of the Xaya Core we talk to, which is assumed to be the same for
+ * all calls (see VerifyMessage).
+ */
+SignatureCache signatureCache;
+
+/**
+ * Checks the local verification against a valid result returned from
+ * Xaya Core, and enables or disables local verification accordingly.
+ */
+void
+CalibrateLocalVerification (const std::string& msg, const std::string& sgn,
+                            const std::string& addr)
+{
+  std::string keyHash, payload;
+  if (RecoverKeyHash (msg, sgn, keyHash)
+        && DecodeBase58Check (addr, payload)
+        && payload.size () == 1 + keyHash.size ()
+        && payload.substr (1) == keyHash)
+    {
+      const int version = static_cast<unsigned char> (payload[0]);
+      int expected = VERSION_UNKNOWN;
+      if (learntVersion.compare_exchange_strong (expected, version))
+        LOG (INFO)
+            << "Local signature verification matches Xaya Core,"
+            << " using address version " << version;
+      return;
+    }
+
+  LOG (WARNING)
+      << "Local signature verification does not match Xaya Core"
+      << " for address " << addr << ", using only RPC";
+  learntVersion = VERSION_DISABLED;
+}
+
+} // anonymous namespace
+
+namespace
+{
+
+/**
+ * Verifies a message without looking at the cache.
+ */
+std::string
+VerifyUncached (XayaRpcClient& rpc,
+                const std::string& msg, const std::string& sgn)
+{
+  const int version = learntVersion;
+  if (version >= 0)
+    return VerifyMessageLocally (msg, sgn, version);
+
   const Json::Value res = rpc.verifymessage ("", msg, sgn);
   CHECK (res.isObject ());
 
   if (!res["valid"].asBool ())
     return "invalid";
 
-  return res["address"].asString ();
+  const std::string addr = res["address"].asString ();
+  if (version == VERSION_UNKNOWN && localVerificationEnabled)
+    CalibrateLocalVerification (msg, sgn, addr);
+
+  return addr;
+}
+
+/**
+ * Batches with fewer signatures than this are verified locally on the
+ * calling thread, as handing them to the worker pool is not worth it.
+ */
+constexpr size_t MIN_PARALLEL_SIGNATURES = 4;
+
+/**
+ * Persistent pool of threads for verifying signatures locally.  It is
+ * created on first use with one thread less than the hardware concurrency,
+ * since the calling thread takes part in the work as well.  Keeping the
+ * threads around avoids spawning new ones for every batch, and lets them
+ * reuse their thread-local curve setup (see RecoverKeyHash).
+ */
+class VerificationPool
+{
+
+private:
+
+  /** A batch of work submitted through Run.  */
+  struct Job
+  {
+
+    /** The function to call for each item.  */
+    const std::function<void (size_t)>* fn;
+
+    /** Total number of items.  */
+    size_t size;
+
+    /** Next item that has not yet been claimed.  */
+    size_t next;
+
+    /** Number of items that have not yet been finished.  */
+    size_t pending;
+
+  };
+
+  /** Lock for the pool state and all jobs.  */
+  std::mutex mut;
+
+  /** Notified when a new job is submitted or the pool is stopped.  */
+  std::condition_variable cvJobs;
+
+  /** Notified when a job has been finished completely.  */
+  std::condition_variable cvDone;
+
+  /** Jobs that still have unclaimed items.  */
+  std::deque<Job*> jobs;
+
+  /**
+   * Asynchronous tasks submitted through Submit.  Jobs are preferred over
+   * them, since a caller of Run is blocked until its job is done.
+   */
+  std::deque<std::function<void ()>> tasks;
+
+  /** Set when the pool is being destructed.  */
+  bool stopping = false;
+
+  /** The worker threads.  */
+  std::vector<std::thread> threads;
+
+  /**
+   * Claims and processes items of the given job until none are left.
+   * Must be called with the lock held, which is released while the
+   * items are processed.
+   */
+  void
+  WorkOn (Job& job, std::unique_lock<std::mutex>& lock)
+  {
+    while (job.next < job.size)
+      {
+        const size_t i = job.next++;
+        if (job.next == job.size)
+          jobs.erase (std::find (jobs.begin (), jobs.end (), &job));
+
+        lock.unlock ();
+        (*job.fn) (i);
+        lock.lock ();
+
+        /* Once the last item is done, the job may be destructed as soon
+           as we release the lock, so we must not touch it anymore.  */
+        if (--job.pending == 0)
+          {
+            cvDone.notify_all ();
+            return;
+          }
+      }
+  }
+
+  void
+  RunWorker ()
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    while (true)
+      {
+        cvJobs.wait (lock, [this] ()
+          {
+            return stopping || !jobs.empty () || !tasks.empty ();
+          });
+        if (stopping)
+          return;
+
+        if (!jobs.empty ())
+          {
+            WorkOn (*jobs.front (), lock);
+            continue;
+          }
+
+        const std::function<void ()> task = std::move (tasks.front ());
+        tasks.pop_front ();
+        lock.unlock ();
+        task ();
+        lock.lock ();
+      }
+  }
+
+public:
+
+  VerificationPool ()
+  {
+    const unsigned n = std::max (1u, std::thread::hardware_concurrency ());
+    for (unsigned i = 1; i < n; ++i)
+      threads.emplace_back ([this] () { RunWorker (); });
+  }
+
+  ~VerificationPool ()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mut);
+      stopping = true;
+    }
+    cvJobs.notify_all ();
+
+    for (auto& t : threads)
+      t.join ();
+  }
+
+  VerificationPool (const VerificationPool&) = delete;
+  void operator= (const VerificationPool&) = delete;
+
+  /**
+   * Calls fn for each index in [0, n) on the pool threads and the current
+   * thread, and returns once all calls are done.
+   */
+  void
+  Run (const size_t n, const std::function<void (size_t)>& fn)
+  {
+    if (n == 0)
+      return;
+
+    Job job;
+    job.fn = &fn;
+    job.size = n;
+    job.next = 0;
+    job.pending = n;
+
+    std::unique_lock<std::mutex> lock(mut);
+    jobs.push_back (&job);
+    cvJobs.notify_all ();
+
+    WorkOn (job, lock);
+    cvDone.wait (lock, [&job] () { return job.pending == 0; });
+  }
+
+  /**
+   * Queues a task to be run asynchronously on one of the pool threads.
+   * If the pool has no threads of its own, the task is run right away
+   * on the calling thread instead.  Tasks still queued when the pool
+   * is destructed are dropped.
+   */
+  void
+  Submit (const std::function<void ()>& task)
+  {
+    if (threads.empty ())
+      {
+        task ();
+        return;
+      }
+
+    {
+      std::lock_guard<std::mutex> lock(mut);
+      tasks.push_back (task);
+    }
+    cvJobs.notify_one ();
+  }
+
+  /**
+   * Returns the process-wide instance.
+   */
+  static VerificationPool&
+  Get ()
+  {
+    static VerificationPool pool;
+    return pool;
+  }
+
+};
+
+/**
+ * Verifies the messages with the given indices locally, distributing them
+ * onto the worker pool if there are enough.  The results are written to
+ * the corresponding elements of res.
+ */
+void
+VerifyLocallyInParallel (const std::vector<SignedMessage>& msgs,
+                         const std::vector<size_t>& indices,
+                         const unsigned char version,
+                         std::vector<std::string>& res)
+{
+  const std::function<void (size_t)> verify = [&] (const size_t j)
+    {
+      const auto& m = msgs[indices[j]];
+      res[indices[j]] = VerifyMessageLocally (m.msg, m.sgn, version);
+    };
+
+  if (indices.size () < MIN_PARALLEL_SIGNATURES)
+    {
+      for (size_t j = 0; j < indices.size (); ++j)
+        verify (j);
+      return;
+    }
+
+  VerificationPool::Get ().Run (indices.size (), verify);
+}
+
+/**
+ * Verifies the messages with the given indices through a single JSON-RPC
+ * batch request to Xaya Core.  The results are written to the corresponding
+ * elements of res.
+ */
+void
+VerifyWithBatchRpc (XayaRpcClient& rpc,
+                    const std::vector<SignedMessage>& msgs,
+                    const std::vector<size_t>& indices,
+                    std::vector<std::string>& res)
+{
+  jsonrpc::BatchCall batch;
+  std::vector<int> ids;
+  for (const size_t i : indices)
+    {
+      Json::Value params(Json::objectValue);
+      params["address"] = "";
+      params["message"] = msgs[i].msg;
+      params["signature"] = msgs[i].sgn;
+      ids.push_back (batch.addCall ("verifymessage", params));
+    }
+
+  jsonrpc::BatchResponse responses = rpc.CallProcedures (batch);
+
+  bool calibrate
+      = (learntVersion == VERSION_UNKNOWN && localVerificationEnabled);
+  for (size_t j = 0; j < indices.size (); ++j)
+    {
+      Json::Value id(ids[j]);
+      const int errorCode = responses.getErrorCode (id);
+      if (errorCode != 0)
+        throw jsonrpc::JsonRpcException (errorCode,
+                                         responses.getErrorMessage (id));
+
+      const Json::Value cur = responses.getResult (ids[j]);
+      CHECK (cur.isObject ());
+
+      const size_t i = indices[j];
+      if (!cur["valid"].asBool ())
+        {
+          res[i] = "invalid";
+          continue;
+        }
+
+      res[i] = cur["address"].asString ();
+      if (calibrate)
+        {
+          CalibrateLocalVerification (msgs[i].msg, msgs[i].sgn, res[i]);
+          calibrate = false;
+        }
+    }
+}
+
+} // anonymous namespace
+
+std::string
+VerifyMessage (XayaRpcClient& rpc,
+               const std::string& msg, const std::string& sgn)
+{
+  const uint256 key = SignatureCache::Key (msg, sgn);
+
+  std::string addr;
+  if (signatureCache.Get (key, addr))
+    return addr;
+
+  addr = VerifyUncached (rpc, msg, sgn);
+  signatureCache.Put (key, addr);
+
+  return addr;
+}
+
+std::string
+VerifyMessageLocally (const std::string& msg, const std::string& sgn,
+                      const unsigned char addressVersion)
+{
+  std::string keyHash;
+  if (!RecoverKeyHash (msg, sgn, keyHash))
+    return "invalid";
+
+  return EncodeBase58Check (std::string (1, addressVersion) + keyHash);
+}
+
+std::vector<std::string>
+VerifyMessages (XayaRpcClient& rpc, const std::vector<SignedMessage>& msgs)
+{
+  std::vector<std::string> res(msgs.size ());
+  std::vector<uint256> keys;
+  std::vector<size_t> uncached;
+  for (size_t i = 0; i < msgs.size (); ++i)
+    {
+      keys.push_back (SignatureCache::Key (msgs[i].msg, msgs[i].sgn));
+      if (!signatureCache.Get (keys.back (), res[i]))
+        uncached.push_back (i);
+    }
+
+  if (uncached.empty ())
+    return res;
+
+  const int version = learntVersion;
+  if (version >= 0)
+    VerifyLocallyInParallel (msgs, uncached, version, res);
+  else if (uncached.size () == 1)
+    {
+      const auto& m = msgs[uncached.front ()];
+      res[uncached.front ()] = VerifyUncached (rpc, m.msg, m.sgn);
+    }
+  else
+    VerifyWithBatchRpc (rpc, msgs, uncached, res);
+
+  for (const size_t i : uncached)
+    signatureCache.Put (keys[i], res[i]);
+
+  return res;
+}
+
+void
+SetSignatureCacheSize (const size_t maxEntries)
+{
+  signatureCache.SetMaxEntries (maxEntries);
+}
+
+void
+SetLocalMessageVerification (const bool enable)
+{
+  if (enable)
+    LOG (WARNING)
+        << "Enabling local signature verification, which has not yet been"
+           " tested against fixtures recorded from Xaya Core";
+
+  localVerificationEnabled = enable;
+  if (!enable)
+    learntVersion = VERSION_UNKNOWN;
+}
+
+void
+SubmitVerificationTask (const std::function<void ()>& task)
+{
+  VerificationPool::Get ().Submit (task);
+}
+
+bool
+IsLocalVerificationEnabled ()
+{
+  return learntVersion >= 0;
+}
+
+SignatureCacheStats
+GetSignatureCacheStats ()
+{
+  return signatureCache.GetStats ();
+}
+
+void
+ResetMessageVerification ()
+{
+  localVerificationEnabled = false;
+  learntVersion = VERSION_UNKNOWN;
+  signatureCache.Clear ();
 }
 
 } // namespace xaya
@@ -1,4 +1,4 @@
-// Copyright (C) 2019 The Xaya developers
+// Copyright (C) 2019-2020 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
@@ -7,7 +7,11 @@
 
 #include "rpc-stubs/xayarpcclient.h"
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <vector>
 
 namespace xaya
 {
@@ -22,10 +26,134 @@ namespace xaya
  * which must be compared to the expected address.  If the signature is invalid
  * in general, then the string "invalid" is returned (which is unequal to any
  * valid Xaya address).
+ *
+ * If enabled with SetLocalMessageVerification, signatures are recovered
+ * in-process (see VerifyMessageLocally) once that has been checked against
+ * Xaya Core:  The first valid signature seen is verified through RPC, and
+ * if the locally recovered address matches the one returned by Xaya Core,
+ * all further verifications are done locally.  Otherwise (or until then),
+ * the RPC method is used.
+ *
+ * Results are kept in a bounded, process-wide LRU cache keyed by the message
+ * and signature, so that verifying the same signatures again (e.g. when
+ * a state proof is checked repeatedly) is cheap.
+ *
+ * Note that both the cache and the learnt address version are global and
+ * not tied to the passed-in RPC client.  The cached addresses are encoded
+ * with the version of the chain that Xaya Core is running on, so all calls
+ * in one process must be made against Xaya Core instances for the same
+ * chain (which is the case for a game daemon).  ResetMessageVerification
+ * must be called before switching to a different chain.
  */
 std::string VerifyMessage (XayaRpcClient& rpc,
                            const std::string& msg, const std::string& sgn);
 
+/**
+ * A message together with its signature, for verifying many at once.
+ */
+struct SignedMessage
+{
+
+  /** The message (as passed to VerifyMessage).  */
+  std::string msg;
+
+  /** The base64-encoded signature.  */
+  std::string sgn;
+
+};
+
+/**
+ * Verifies a batch of message signatures, returning the addresses (or
+ * "invalid") in the same order as the input.  The results are the same as
+ * calling VerifyMessage on each, but the verifications are done
+ * concurrently:  If signatures are verified locally, they are distributed
+ * to a persistent pool of worker threads (unless there are only a few).
+ * Otherwise, all (uncached) signatures are sent to Xaya Core as a single
+ * JSON-RPC batch request, so that the whole batch takes roughly the latency
+ * of one RPC call.
+ */
+std::vector<std::string> VerifyMessages (
+    XayaRpcClient& rpc, const std::vector<SignedMessage>& msgs);
+
+/**
+ * Recovers the signing address of a message signature in-process, without
+ * calling Xaya Core.  This implements the same algorithm as Core's
+ * "verifymessage" for a P2PKH address with the given version byte.
+ * Returns "invalid" if the signature is not valid at all.
+ */
+std::string VerifyMessageLocally (const std::string& msg,
+                                  const std::string& sgn,
+                                  unsigned char addressVersion);
+
+/**
+ * Enables or disables verifying signatures in-process in VerifyMessage and
+ * VerifyMessages.  This is disabled by default:  The local implementation
+ * has not yet been tested against fixtures recorded from Xaya Core's
+ * verifymessage, so it may still differ from Core for unusual signatures
+ * (e.g. in how the base64 encoding is decoded).  Until such fixtures exist,
+ * every signature is verified through RPC unless this is turned on
+ * explicitly.  Disabling it also forgets what was learnt from Xaya Core.
+ */
+void SetLocalMessageVerification (bool enable);
+
+/**
+ * Runs a task asynchronously on the pool of threads that VerifyMessages
+ * uses for verifying signatures locally.  This is meant for verifying
+ * signatures in the background while the caller does other work (e.g.
+ * applying the moves of a state proof).  The task must not block on other
+ * submitted tasks, and the caller must make sure that everything it uses
+ * stays alive until it has finished.  If there are no pool threads (on
+ * a single-core machine), the task is run right away before this returns.
+ */
+void SubmitVerificationTask (const std::function<void ()>& task);
+
+/**
+ * Returns true if VerifyMessage and VerifyMessages currently verify
+ * uncached signatures in-process, i.e. without calling Xaya Core at all.
+ * In that case, they can be used concurrently with other calls on the
+ * RPC client, even if that is not thread-safe itself.
+ */
+bool IsLocalVerificationEnabled ();
+
+/** Default maximum number of entries in the signature cache.  */
+constexpr size_t DEFAULT_SIGNATURE_CACHE_SIZE = 10000;
+
+/**
+ * Statistics about the cache of signature verifications.
+ */
+struct SignatureCacheStats
+{
+
+  /** Number of entries currently in the cache.  */
+  size_t entries;
+
+  /** Number of lookups answered from the cache.  */
+  uint64_t hits;
+
+  /** Number of lookups that had to verify the signature.  */
+  uint64_t misses;
+
+};
+
+/**
+ * Sets the maximum number of entries in the signature cache.  Zero disables
+ * the cache.  If there are more entries than the new size, the least
+ * recently used ones are evicted.
+ */
+void SetSignatureCacheSize (size_t maxEntries);
+
+/**
+ * Returns the current statistics of the signature cache.
+ */
+SignatureCacheStats GetSignatureCacheStats ();
+
+/**
+ * Resets the state learnt about whether and how VerifyMessage can verify
+ * signatures locally (and disables local verification again), and clears
+ * the signature cache (including its stats).  This is mainly useful for tests.
+ */
+void ResetMessageVerification ();
+
 } // namespace xaya
 
 #endif // XAYAGAME_SIGNATURES_HPP
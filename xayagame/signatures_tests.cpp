@@ -1,4 +1,4 @@
-// Copyright (C) 2019 The Xaya developers
+// Copyright (C) 2019-2020 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
@@ -6,9 +6,19 @@
 
 #include "testutils.hpp"
 
+#include <xayautil/base64.hpp>
+
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <glog/logging.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
 namespace xaya
 {
 namespace
@@ -16,6 +26,80 @@ namespace
 
 using testing::Return;
 
+/** Address version byte used by Xaya Core on regtest.  */
+constexpr unsigned char REGTEST_VERSION = 88;
+/** Address version byte used by Xaya Core on mainnet.  */
+constexpr unsigned char MAINNET_VERSION = 28;
+
+/**
+ * Test vector for message signatures, with the expected address on regtest.
+ * Note that these have not been recorded from Xaya Core's verifymessage,
+ * so they only check the local implementation for self-consistency.
+ * Fixtures recorded from Core (including edge cases of the signature
+ * encoding) are still needed before local verification can be enabled
+ * by default.
+ */
+struct SignatureVector
+{
+  std::string msg;
+  std::string sgn;
+  std::string addr;
+};
+
+/** Valid signatures and their signing addresses on regtest.  */
+const SignatureVector VALID_SIGNATURES[] = {
+  {
+    "",
+    "Hw6i+bHi8qETdlZ97J0KEwDA2DYzHDJ7DI/+QRiTX6FQT7LvqWwRIp5vnsFQCElTRpGjcag53GJv7o10EKBG8aY=",
+    "cbRMCi7xqwds7TTcNhRNVtNDWW7ZeuZzGL",
+  },
+  {
+    "",
+    "Gw6i+bHi8qETdlZ97J0KEwDA2DYzHDJ7DI/+QRiTX6FQT7LvqWwRIp5vnsFQCElTRpGjcag53GJv7o10EKBG8aY=",
+    "ce2TDedQnrp1tWWaUyTASG1H79CiYSNA8T",
+  },
+  {
+    "Hello world!",
+    "H1wsv3UNrfO98DaxRcgzL/PuUZIRl8m4KS0dxs1jeNaxC0dlFgGxSg2hnvayMzIFb4xlPNq3nawSOquPKAN+KxU=",
+    "cbRMCi7xqwds7TTcNhRNVtNDWW7ZeuZzGL",
+  },
+  {
+    u8"äöü",
+    "HztSF20JTahBdIp6/FLm3dNv5xvSg7GB7yUbsvUmWD0lH586zIRqqh9WbalM1Se/X4puPrJoo9H6ChBNi13S0Ic=",
+    "cbRMCi7xqwds7TTcNhRNVtNDWW7ZeuZzGL",
+  },
+  {
+    std::string (300, 'x'),
+    "H65qj7/6QTrDX2yunN0Ylm26vy/RwYPw1eCUmNljnuEdLmJ2dmyb4vrbJ6uYYwWm9RJfVEP4myP8J3a55YGM+UI=",
+    "cbRMCi7xqwds7TTcNhRNVtNDWW7ZeuZzGL",
+  },
+  {
+    "Hello world!",
+    "H5D9kkCFe1g6LixlVw7yNMLcfsoOsRm+RGouxbXNLmfMOZfNsuffxh8uKeDEGbaP2vqOI2u4t0SuvuhOLhGFXaY=",
+    "cYEauBcsevLTAUqo1bxpPyjkQJ5tsLhVgL",
+  },
+  {
+    "Hello world!",
+    "G5D9kkCFe1g6LixlVw7yNMLcfsoOsRm+RGouxbXNLmfMOZfNsuffxh8uKeDEGbaP2vqOI2u4t0SuvuhOLhGFXaY=",
+    "cUGja3bzzbmBzC5ay2esKuAB8hT6zqLv4n",
+  },
+  {
+    std::string (300, 'x'),
+    "IGI9zV7vjNwEheqPqLbQro+QjdKX6qzwLxgy2HppHP+YMuQ/31rpmVTFEgtuaIfs+TCq6xexSTjov+aqdnpjSJw=",
+    "cYEauBcsevLTAUqo1bxpPyjkQJ5tsLhVgL",
+  },
+  {
+    "",
+    "IF6BF3Xe5z5Fr9kILxAf2/7HkDlqL1d7KRgQOKVahi1YcCDWh8grAxgXW5XrhnPtJrk+HkTYBgM4ulgz2EOBSYM=",
+    "cgbQrKim1gkQVievZZ9vYQoBMKNaegSPfF",
+  },
+  {
+    "Hello world!",
+    "GyRJUOx1RxhjKdtg6RWLKd7o5HBviMDb/qd0QaXE9aIeabb0SRo3GSeG74Hf4HW4d7Vjb9MzQUIwA5OL3mlYYIg=",
+    "ci8geA6XRt55YMgRVGtsBJm53YVDdqkXmC",
+  },
+};
+
 class SignaturesTests : public testing::Test
 {
 
@@ -23,6 +107,34 @@ protected:
 
   HttpRpcServer<MockXayaRpcServer> mockXayaServer;
 
+  SignaturesTests ()
+  {
+    SetLocalMessageVerification (true);
+  }
+
+  ~SignaturesTests ()
+  {
+    SetSignatureCacheSize (DEFAULT_SIGNATURE_CACHE_SIZE);
+    ResetMessageVerification ();
+  }
+
+  /**
+   * Expects a call to verifymessage for the given signature and returns
+   * the given address as valid from it.
+   */
+  void
+  ExpectRpcVerification (const std::string& msg, const std::string& sgn,
+                         const std::string& addr, const int times = 1)
+  {
+    Json::Value res(Json::objectValue);
+    res["valid"] = true;
+    res["address"] = addr;
+
+    EXPECT_CALL (*mockXayaServer, verifymessage ("", msg, sgn))
+        .Times (times)
+        .WillRepeatedly (Return (res));
+  }
+
 };
 
 TEST_F (SignaturesTests, InvalidSignature)
@@ -45,5 +157,413 @@ TEST_F (SignaturesTests, ValidSignature)
              "addr");
 }
 
+TEST_F (SignaturesTests, LocalVerification)
+{
+  for (const auto& v : VALID_SIGNATURES)
+    EXPECT_EQ (VerifyMessageLocally (v.msg, v.sgn, REGTEST_VERSION), v.addr);
+
+  EXPECT_EQ (VerifyMessageLocally (VALID_SIGNATURES[0].msg,
+                                   VALID_SIGNATURES[0].sgn, MAINNET_VERSION),
+             "CT9A8CEgF7qJ3T6QuXSFQN31kEexxxa2oX");
+  EXPECT_EQ (VerifyMessageLocally (VALID_SIGNATURES[1].msg,
+                                   VALID_SIGNATURES[1].sgn, MAINNET_VERSION),
+             "CVkG98k8C31SpW9P1oU3Ljg5Lsk7s84zJF");
+}
+
+TEST_F (SignaturesTests, LocalInvalidSignatures)
+{
+  const auto& v = VALID_SIGNATURES[2];
+
+  /* A different message recovers some other key.  */
+  const std::string other
+      = VerifyMessageLocally ("Hello world?", v.sgn, REGTEST_VERSION);
+  EXPECT_NE (other, v.addr);
+  EXPECT_NE (other, "invalid");
+
+  /* Changing the recovery ID yields a different key as well.  */
+  std::string sgn = v.sgn;
+  sgn[0] = 'I';
+  EXPECT_NE (VerifyMessageLocally (v.msg, sgn, REGTEST_VERSION), v.addr);
+
+  for (const auto& invalid : std::vector<std::string> {
+          "",
+          "invalid",
+          v.sgn.substr (4),
+          v.sgn + "AAAA",
+          "*" + v.sgn.substr (1),
+          /* r and s are zero.  */
+          "H" + std::string (86, 'A') + "=",
+          /* r and s are all-ones and thus larger than the group order.  */
+          "H" + std::string (85, '/') + "w=",
+        })
+    EXPECT_EQ (VerifyMessageLocally (v.msg, invalid, REGTEST_VERSION),
+               "invalid")
+        << invalid;
+}
+
+/**
+ * Returns the given signature (base64) with its header byte replaced.
+ */
+std::string
+WithHeader (const std::string& sgn, const unsigned char header)
+{
+  std::string bytes;
+  CHECK (DecodeBase64 (sgn, bytes));
+  bytes[0] = static_cast<char> (header);
+  return EncodeBase64 (bytes);
+}
+
+TEST_F (SignaturesTests, LocalHeaderByte)
+{
+  /* Xaya Core does not range-check the header byte, and only uses the
+     low three bits of (header - 27) as recovery ID and compression flag.
+     Thus headers that differ by a multiple of eight (including those that
+     wrap around) must be equivalent.  */
+  for (const auto& v : VALID_SIGNATURES)
+    {
+      std::string bytes;
+      ASSERT_TRUE (DecodeBase64 (v.sgn, bytes));
+      const unsigned char header = bytes[0];
+
+      for (const int offset : {8, 16, -8, -16, 224})
+        {
+          const unsigned char h = header + offset;
+          EXPECT_EQ (VerifyMessageLocally (v.msg, WithHeader (v.sgn, h),
+                                           REGTEST_VERSION),
+                     v.addr)
+              << static_cast<int> (h);
+        }
+    }
+
+  /* VALID_SIGNATURES[2] uses header 31 (recovery ID 0, compressed) with the
+     key of cbRMCi7xqwds7TTcNhRNVtNDWW7ZeuZzGL.  Header 35 means recovery
+     ID 0 and uncompressed, so yields the uncompressed address of the same
+     key (see VALID_SIGNATURES[1]).  Header 26 means recovery ID 3, for which
+     r + n is not a valid x coordinate, so the signature is invalid.
+     Header 255 wraps around to the same flags as 31.  */
+  const auto& v = VALID_SIGNATURES[2];
+  EXPECT_EQ (VerifyMessageLocally (v.msg, WithHeader (v.sgn, 35),
+                                   REGTEST_VERSION),
+             "ce2TDedQnrp1tWWaUyTASG1H79CiYSNA8T");
+  EXPECT_EQ (VerifyMessageLocally (v.msg, WithHeader (v.sgn, 26),
+                                   REGTEST_VERSION),
+             "invalid");
+  EXPECT_EQ (VerifyMessageLocally (v.msg, WithHeader (v.sgn, 255),
+                                   REGTEST_VERSION),
+             v.addr);
+}
+
+TEST_F (SignaturesTests, SwitchesToLocalVerification)
+{
+  const auto& first = VALID_SIGNATURES[0];
+  ExpectRpcVerification (first.msg, first.sgn, first.addr);
+  EXPECT_EQ (VerifyMessage (mockXayaServer.GetClient (), first.msg, first.sgn),
+             first.addr);
+
+  for (const auto& v : VALID_SIGNATURES)
+    EXPECT_EQ (VerifyMessage (mockXayaServer.GetClient (), v.msg, v.sgn),
+               v.addr);
+  EXPECT_EQ (VerifyMessage (mockXayaServer.GetClient (),
+                            "Hello world!", "invalid"),
+             "invalid");
+}
+
+TEST_F (SignaturesTests, LocalVerificationDisabledByDefault)
+{
+  ResetMessageVerification ();
+
+  for (const auto& v : VALID_SIGNATURES)
+    {
+      ExpectRpcVerification (v.msg, v.sgn, v.addr);
+      EXPECT_EQ (VerifyMessage (mockXayaServer.GetClient (), v.msg, v.sgn),
+                 v.addr);
+    }
+  EXPECT_FALSE (IsLocalVerificationEnabled ());
+}
+
+TEST_F (SignaturesTests, DisablingForgetsLearntVersion)
+{
+  const auto& first = VALID_SIGNATURES[0];
+  ExpectRpcVerification (first.msg, first.sgn, first.addr);
+  VerifyMessage (mockXayaServer.GetClient (), first.msg, first.sgn);
+  ASSERT_TRUE (IsLocalVerificationEnabled ());
+
+  SetLocalMessageVerification (false);
+  EXPECT_FALSE (IsLocalVerificationEnabled ());
+
+  const auto& v = VALID_SIGNATURES[1];
+  ExpectRpcVerification (v.msg, v.sgn, v.addr);
+  EXPECT_EQ (VerifyMessage (mockXayaServer.GetClient (), v.msg, v.sgn),
+             v.addr);
+  EXPECT_FALSE (IsLocalVerificationEnabled ());
+}
+
+TEST_F (SignaturesTests, InvalidSignatureDoesNotSwitch)
+{
+  const auto& invalid = VALID_SIGNATURES[0];
+  EXPECT_CALL (*mockXayaServer, verifymessage ("", invalid.msg, invalid.sgn))
+      .WillOnce (Return (ParseJson (R"({"valid": false})")));
+  EXPECT_EQ (VerifyMessage (mockXayaServer.GetClient (),
+                            invalid.msg, invalid.sgn),
+             "invalid");
+
+  const auto& v = VALID_SIGNATURES[1];
+  ExpectRpcVerification (v.msg, v.sgn, v.addr);
+  EXPECT_EQ (VerifyMessage (mockXayaServer.GetClient (), v.msg, v.sgn),
+             v.addr);
+
+  const auto& local = VALID_SIGNATURES[2];
+  EXPECT_EQ (VerifyMessage (mockXayaServer.GetClient (), local.msg, local.sgn),
+             local.addr);
+}
+
+TEST_F (SignaturesTests, MismatchKeepsRpc)
+{
+  for (const auto& v : VALID_SIGNATURES)
+    {
+      ExpectRpcVerification (v.msg, v.sgn, "other address");
+      EXPECT_EQ (VerifyMessage (mockXayaServer.GetClient (), v.msg, v.sgn),
+                 "other address");
+    }
+}
+
+TEST_F (SignaturesTests, MainnetVersionLearnt)
+{
+  const auto& first = VALID_SIGNATURES[0];
+  ExpectRpcVerification (first.msg, first.sgn,
+                         "CT9A8CEgF7qJ3T6QuXSFQN31kEexxxa2oX");
+  VerifyMessage (mockXayaServer.GetClient (), first.msg, first.sgn);
+
+  const auto& v = VALID_SIGNATURES[1];
+  EXPECT_EQ (VerifyMessage (mockXayaServer.GetClient (), v.msg, v.sgn),
+             "CVkG98k8C31SpW9P1oU3Ljg5Lsk7s84zJF");
+}
+
+TEST_F (SignaturesTests, CacheHits)
+{
+  ExpectRpcVerification ("my message", "my signature", "addr");
+  for (unsigned i = 0; i < 3; ++i)
+    EXPECT_EQ (VerifyMessage (mockXayaServer.GetClient (),
+                              "my message", "my signature"),
+               "addr");
+
+  const auto stats = GetSignatureCacheStats ();
+  EXPECT_EQ (stats.entries, 1);
+  EXPECT_EQ (stats.hits, 2);
+  EXPECT_EQ (stats.misses, 1);
+}
+
+TEST_F (SignaturesTests, CacheInvalidResults)
+{
+  EXPECT_CALL (*mockXayaServer, verifymessage ("", "my message", "bad"))
+      .WillOnce (Return (ParseJson (R"({"valid": false})")));
+  for (unsigned i = 0; i < 2; ++i)
+    EXPECT_EQ (VerifyMessage (mockXayaServer.GetClient (),
+                              "my message", "bad"),
+               "invalid");
+}
+
+TEST_F (SignaturesTests, CacheKeyIsUnambiguous)
+{
+  ExpectRpcVerification ("ab", "c", "addr 1");
+  ExpectRpcVerification ("a", "bc", "addr 2");
+  EXPECT_EQ (VerifyMessage (mockXayaServer.GetClient (), "ab", "c"), "addr 1");
+  EXPECT_EQ (VerifyMessage (mockXayaServer.GetClient (), "a", "bc"), "addr 2");
+}
+
+TEST_F (SignaturesTests, CacheEviction)
+{
+  SetSignatureCacheSize (2);
+
+  ExpectRpcVerification ("a", "sgn", "addr a", 2);
+  ExpectRpcVerification ("b", "sgn", "addr b", 2);
+  ExpectRpcVerification ("c", "sgn", "addr c");
+
+  auto& rpc = mockXayaServer.GetClient ();
+  EXPECT_EQ (VerifyMessage (rpc, "a", "sgn"), "addr a");
+  EXPECT_EQ (VerifyMessage (rpc, "b", "sgn"), "addr b");
+
+  /* Use a again, so that b is least recently used and evicted by c.  */
+  EXPECT_EQ (VerifyMessage (rpc, "a", "sgn"), "addr a");
+  EXPECT_EQ (VerifyMessage (rpc, "c", "sgn"), "addr c");
+  EXPECT_EQ (GetSignatureCacheStats ().entries, 2);
+
+  EXPECT_EQ (VerifyMessage (rpc, "a", "sgn"), "addr a");
+  EXPECT_EQ (VerifyMessage (rpc, "c", "sgn"), "addr c");
+  EXPECT_EQ (VerifyMessage (rpc, "b", "sgn"), "addr b");
+
+  /* Shrinking the cache evicts entries right away.  */
+  SetSignatureCacheSize (1);
+  EXPECT_EQ (GetSignatureCacheStats ().entries, 1);
+  EXPECT_EQ (VerifyMessage (rpc, "b", "sgn"), "addr b");
+  EXPECT_EQ (VerifyMessage (rpc, "a", "sgn"), "addr a");
+}
+
+TEST_F (SignaturesTests, CacheDisabled)
+{
+  SetSignatureCacheSize (0);
+
+  ExpectRpcVerification ("my message", "my signature", "addr", 2);
+  for (unsigned i = 0; i < 2; ++i)
+    EXPECT_EQ (VerifyMessage (mockXayaServer.GetClient (),
+                              "my message", "my signature"),
+               "addr");
+  EXPECT_EQ (GetSignatureCacheStats ().entries, 0);
+}
+
+TEST_F (SignaturesTests, BatchEmpty)
+{
+  EXPECT_EQ (VerifyMessages (mockXayaServer.GetClient (), {}),
+             std::vector<std::string> ());
+}
+
+TEST_F (SignaturesTests, BatchThroughRpc)
+{
+  ExpectRpcVerification ("cached", "sgn", "addr 0");
+  ExpectRpcVerification ("a", "sgn", "addr 1");
+  ExpectRpcVerification ("b", "sgn", "addr 2");
+  EXPECT_CALL (*mockXayaServer, verifymessage ("", "c", "sgn"))
+      .WillOnce (Return (ParseJson (R"({"valid": false})")));
+
+  auto& rpc = mockXayaServer.GetClient ();
+  EXPECT_EQ (VerifyMessage (rpc, "cached", "sgn"), "addr 0");
+
+  const std::vector<SignedMessage> msgs = {
+    {"a", "sgn"},
+    {"cached", "sgn"},
+    {"b", "sgn"},
+    {"c", "sgn"},
+  };
+  EXPECT_EQ (VerifyMessages (rpc, msgs),
+             std::vector<std::string> ({"addr 1", "addr 0", "addr 2",
+                                        "invalid"}));
+
+  /* Now all are cached.  */
+  EXPECT_EQ (VerifyMessages (rpc, msgs),
+             std::vector<std::string> ({"addr 1", "addr 0", "addr 2",
+                                        "invalid"}));
+}
+
+TEST_F (SignaturesTests, BatchSwitchesToLocal)
+{
+  std::vector<SignedMessage> msgs;
+  std::vector<std::string> expected;
+  for (const auto& v : VALID_SIGNATURES)
+    {
+      ExpectRpcVerification (v.msg, v.sgn, v.addr);
+      msgs.push_back ({v.msg, v.sgn});
+      expected.push_back (v.addr);
+    }
+
+  auto& rpc = mockXayaServer.GetClient ();
+  EXPECT_EQ (VerifyMessages (rpc, msgs), expected);
+
+  const auto& v = VALID_SIGNATURES[2];
+  EXPECT_EQ (VerifyMessage (rpc, v.msg + " ", v.sgn),
+             VerifyMessageLocally (v.msg + " ", v.sgn, REGTEST_VERSION));
+}
+
+TEST_F (SignaturesTests, BatchLocalInParallel)
+{
+  const auto& first = VALID_SIGNATURES[0];
+  ExpectRpcVerification (first.msg, first.sgn, first.addr);
+  auto& rpc = mockXayaServer.GetClient ();
+  VerifyMessage (rpc, first.msg, first.sgn);
+
+  /* Make sure that all signatures are actually verified, also the
+     duplicates in the batch.  */
+  SetSignatureCacheSize (0);
+
+  std::vector<SignedMessage> msgs;
+  std::vector<std::string> expected;
+  for (unsigned i = 0; i < 5; ++i)
+    for (const auto& v : VALID_SIGNATURES)
+      {
+        msgs.push_back ({v.msg, v.sgn});
+        expected.push_back (v.addr);
+
+        msgs.push_back ({v.msg + "x", v.sgn});
+        expected.push_back (VerifyMessageLocally (v.msg + "x", v.sgn,
+                                                  REGTEST_VERSION));
+
+        msgs.push_back ({v.msg, "invalid"});
+        expected.push_back ("invalid");
+      }
+
+  EXPECT_EQ (VerifyMessages (rpc, msgs), expected);
+}
+
+TEST_F (SignaturesTests, BatchLocalConcurrentCallers)
+{
+  const auto& first = VALID_SIGNATURES[0];
+  ExpectRpcVerification (first.msg, first.sgn, first.addr);
+  auto& rpc = mockXayaServer.GetClient ();
+  VerifyMessage (rpc, first.msg, first.sgn);
+  ASSERT_TRUE (IsLocalVerificationEnabled ());
+
+  SetSignatureCacheSize (0);
+
+  std::vector<SignedMessage> msgs;
+  std::vector<std::string> expected;
+  for (unsigned i = 0; i < 3; ++i)
+    for (const auto& v : VALID_SIGNATURES)
+      {
+        msgs.push_back ({v.msg, v.sgn});
+        expected.push_back (v.addr);
+      }
+
+  /* Multiple batches submitted at the same time share the worker pool.  */
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < 4; ++i)
+    threads.emplace_back ([&] ()
+      {
+        for (unsigned j = 0; j < 5; ++j)
+          EXPECT_EQ (VerifyMessages (rpc, msgs), expected);
+      });
+  for (auto& t : threads)
+    t.join ();
+}
+
+TEST_F (SignaturesTests, SubmittedTasksVerifyBatches)
+{
+  const auto& first = VALID_SIGNATURES[0];
+  ExpectRpcVerification (first.msg, first.sgn, first.addr);
+  auto& rpc = mockXayaServer.GetClient ();
+  VerifyMessage (rpc, first.msg, first.sgn);
+  ASSERT_TRUE (IsLocalVerificationEnabled ());
+
+  SetSignatureCacheSize (0);
+
+  std::vector<SignedMessage> msgs;
+  std::vector<std::string> expected;
+  for (const auto& v : VALID_SIGNATURES)
+    {
+      msgs.push_back ({v.msg, v.sgn});
+      expected.push_back (v.addr);
+    }
+
+  /* Tasks on the pool may themselves verify batches on it.  */
+  constexpr unsigned numTasks = 16;
+  std::mutex mut;
+  std::condition_variable cv;
+  unsigned done = 0;
+  std::vector<std::vector<std::string>> results(numTasks);
+  for (unsigned i = 0; i < numTasks; ++i)
+    SubmitVerificationTask ([&, i] ()
+      {
+        auto res = VerifyMessages (rpc, msgs);
+
+        std::lock_guard<std::mutex> lock(mut);
+        results[i] = std::move (res);
+        ++done;
+        cv.notify_all ();
+      });
+
+  std::unique_lock<std::mutex> lock(mut);
+  cv.wait (lock, [&] () { return done == numTasks; });
+  for (const auto& res : results)
+    EXPECT_EQ (res, expected);
+}
+
 } // anonymous namespace
 } // namespace xaya
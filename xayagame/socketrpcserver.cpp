@@ -0,0 +1,629 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketrpcserver.hpp"
+
+#include "jsonwriter.hpp"
+#include "socketutils.hpp"
+
+#include <json/json.h>
+
+#include <glog/logging.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <sstream>
+#include <vector>
+
+namespace xaya
+{
+
+namespace
+{
+
+/**
+ * Maximum size of a single request line.  If a client sends more data
+ * without a newline, the connection is closed.
+ */
+constexpr size_t MAX_REQUEST_SIZE = 64 << 20;
+
+/**
+ * Maximum size of unsent responses for a connection.  While more is
+ * buffered, no further requests of that client are processed.
+ */
+constexpr size_t MAX_PENDING_OUTPUT = 16 << 20;
+
+/** Backlog for the listening sockets.  */
+constexpr int LISTEN_BACKLOG = 64;
+
+/** Default number of worker threads processing requests.  */
+constexpr unsigned DEFAULT_WORKERS = 4;
+
+/** Default maximum number of simultaneous connections.  */
+constexpr unsigned DEFAULT_MAX_CONNECTIONS = 256;
+
+/**
+ * Brings a JSON-RPC response into the form of a single line (without
+ * the terminating newline).  jsonrpccpp may or may not add a trailing
+ * newline or format the response in a human-readable way.
+ */
+std::string
+NormaliseResponse (std::string response)
+{
+  while (!response.empty ()
+          && (response.back () == '\n' || response.back () == '\r'))
+    response.pop_back ();
+
+  if (response.find ('\n') == std::string::npos)
+    return response;
+
+  Json::Value val;
+  std::istringstream in(response);
+  in >> val;
+
+  return CompactJson (val);
+}
+
+/**
+ * Returns true if the response is in a binary encoding rather than JSON.
+ * JSON text always starts with an ASCII character, while e.g. a CBOR map
+ * never does.
+ */
+bool
+IsBinaryResponse (const std::string& response)
+{
+  return !response.empty ()
+            && (static_cast<unsigned char> (response[0]) & 0x80) != 0;
+}
+
+/**
+ * Frames a binary response by prefixing it with its length as four-byte
+ * big-endian number.
+ */
+std::string
+FrameBinaryResponse (const std::string& response)
+{
+  CHECK_LE (response.size (), 0xFFFFFFFF);
+  const uint32_t len = response.size ();
+
+  std::string res;
+  res.reserve (4 + response.size ());
+  for (int shift = 24; shift >= 0; shift -= 8)
+    res.push_back (static_cast<char> ((len >> shift) & 0xFF));
+  res.append (response);
+
+  return res;
+}
+
+/**
+ * Converts a response as returned by the request handler to the data that
+ * is sent on the connection.  For notifications, this is empty.
+ */
+std::string
+FormatResponse (std::string response)
+{
+  if (IsBinaryResponse (response))
+    return FrameBinaryResponse (response);
+
+  response = NormaliseResponse (std::move (response));
+  if (!response.empty ())
+    response.push_back ('\n');
+
+  return response;
+}
+
+} // anonymous namespace
+
+/**
+ * State shared between the I/O thread, the workers and completion callbacks.
+ */
+struct SocketRpcServer::IoState
+{
+
+  /**
+   * Lock for the state here as well as the fields of the connections
+   * that are shared with the workers.
+   */
+  std::mutex mut;
+
+  /** Condition variable notified when tasks are added or on stopping.  */
+  std::condition_variable cvTasks;
+
+  /** Pipe used to wake up the I/O thread.  */
+  int wakeFds[2];
+
+  /** Requests waiting to be processed by a worker.  */
+  std::deque<std::function<void ()>> tasks;
+
+  /** Set to true when the server is stopping.  */
+  bool stopping = false;
+
+  IoState ()
+  {
+    CHECK_EQ (pipe (wakeFds), 0)
+        << "Creating pipe failed: " << std::strerror (errno);
+    internal::SetNonBlocking (wakeFds[0]);
+    internal::SetNonBlocking (wakeFds[1]);
+  }
+
+  ~IoState ()
+  {
+    close (wakeFds[0]);
+    close (wakeFds[1]);
+  }
+
+  IoState (const IoState&) = delete;
+  void operator= (const IoState&) = delete;
+
+  /**
+   * Wakes up the I/O thread.  If the pipe is full, the thread will wake
+   * up anyway, so that is fine.
+   */
+  void
+  Wake ()
+  {
+    const char c = 0;
+    if (write (wakeFds[1], &c, 1) < 0 && errno != EAGAIN
+          && errno != EWOULDBLOCK)
+      LOG (WARNING)
+          << "Writing to wake-up pipe failed: " << std::strerror (errno);
+  }
+
+};
+
+/**
+ * Data for one active connection.
+ */
+struct SocketRpcServer::Connection
+{
+
+  /** The socket of this connection.  */
+  const int fd;
+
+  /* The following fields are only accessed by the I/O thread.  */
+
+  /** Received data that does not yet form a complete line.  */
+  std::string inBuf;
+
+  /** Complete request lines that have not yet been processed.  */
+  std::deque<std::string> requests;
+
+  /** Set when the client has closed its end of the connection.  */
+  bool eof = false;
+
+  /** Set when the connection failed and should be closed.  */
+  bool failed = false;
+
+  /* The following fields are protected by the lock of the IoState.  */
+
+  /** Whether a request of this connection is being processed.  */
+  bool busy = false;
+
+  /** Response data that has not yet been sent.  */
+  std::string outBuf;
+
+  explicit Connection (const int f)
+    : fd(f)
+  {}
+
+};
+
+SocketRpcServer::SocketRpcServer ()
+  : numWorkers(DEFAULT_WORKERS), maxConnections(DEFAULT_MAX_CONNECTIONS)
+{}
+
+SocketRpcServer::~SocketRpcServer ()
+{
+  CHECK (ioThread == nullptr)
+      << "Socket RPC server destructed while still listening";
+}
+
+void
+SocketRpcServer::SetWorkerThreads (const unsigned n)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (ioThread == nullptr)
+      << "Worker threads must be configured before starting to listen";
+  CHECK_GT (n, 0);
+  numWorkers = n;
+}
+
+void
+SocketRpcServer::SetMaxConnections (const unsigned n)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (ioThread == nullptr)
+      << "Connection limit must be configured before starting to listen";
+  CHECK_GT (n, 0);
+  maxConnections = n;
+}
+
+bool
+SocketRpcServer::StartListening ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  if (ioThread != nullptr)
+    return false;
+
+  listenFd = CreateListeningSocket ();
+  if (listenFd < 0)
+    return false;
+
+  if (listen (listenFd, LISTEN_BACKLOG) != 0)
+    {
+      LOG (WARNING) << "listen failed: " << std::strerror (errno);
+      close (listenFd);
+      listenFd = -1;
+      CleanupListeningSocket ();
+      return false;
+    }
+  internal::SetNonBlocking (listenFd);
+
+  io = std::make_shared<IoState> ();
+  ioThread = std::make_unique<std::thread> ([this] ()
+    {
+      RunIoLoop ();
+    });
+  for (unsigned i = 0; i < numWorkers; ++i)
+    workers.emplace_back ([this] ()
+      {
+        RunWorker ();
+      });
+
+  return true;
+}
+
+bool
+SocketRpcServer::StopListening ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  if (ioThread == nullptr)
+    return false;
+
+  {
+    std::lock_guard<std::mutex> ioLock(io->mut);
+    io->stopping = true;
+    io->cvTasks.notify_all ();
+    io->Wake ();
+  }
+
+  /* The I/O thread closes all connections when it exits.  Requests that
+     are currently being processed by a worker are finished first, but
+     their responses are no longer sent.  */
+  ioThread->join ();
+  ioThread.reset ();
+  for (auto& w : workers)
+    w.join ();
+  workers.clear ();
+
+  close (listenFd);
+  listenFd = -1;
+  CleanupListeningSocket ();
+
+  /* The queued tasks reference the IoState through their completion
+     callbacks, so they have to be cleared explicitly.  Callbacks of
+     asynchronous calls that are still pending keep it alive until
+     they are invoked.  */
+  {
+    std::lock_guard<std::mutex> ioLock(io->mut);
+    io->tasks.clear ();
+  }
+  io.reset ();
+
+  return true;
+}
+
+void
+SocketRpcServer::RunWorker ()
+{
+  while (true)
+    {
+      std::function<void ()> task;
+      {
+        std::unique_lock<std::mutex> lock(io->mut);
+        while (!io->stopping && io->tasks.empty ())
+          io->cvTasks.wait (lock);
+        if (io->stopping)
+          return;
+
+        task = std::move (io->tasks.front ());
+        io->tasks.pop_front ();
+      }
+
+      task ();
+    }
+}
+
+void
+SocketRpcServer::RunIoLoop ()
+{
+  std::list<std::shared_ptr<Connection>> connections;
+  std::vector<char> chunk(1 << 16);
+  bool atLimit = false;
+
+  while (true)
+    {
+      const bool accepting = connections.size () < maxConnections;
+      if (!accepting && !atLimit)
+        LOG (WARNING)
+            << "Reached the limit of " << maxConnections
+            << " RPC connections, not accepting new ones for now";
+      atLimit = !accepting;
+
+      /* The first two entries are always the wake-up pipe and the listening
+         socket (which is ignored by poll while at the connection limit).
+         They are followed by one entry for each connection.  */
+      std::vector<pollfd> fds;
+      fds.push_back ({io->wakeFds[0], POLLIN, 0});
+      fds.push_back ({accepting ? listenFd : -1, POLLIN, 0});
+      {
+        std::lock_guard<std::mutex> lock(io->mut);
+        if (io->stopping)
+          break;
+
+        for (const auto& c : connections)
+          {
+            /* We only read more data once all complete requests have been
+               processed, so that the data buffered for a client stays
+               bounded.  */
+            short events = 0;
+            if (!c->eof && c->requests.empty ())
+              events |= POLLIN;
+            if (!c->outBuf.empty ())
+              events |= POLLOUT;
+            fds.push_back ({c->fd, events, 0});
+          }
+      }
+
+      if (poll (fds.data (), fds.size (), -1) < 0)
+        {
+          CHECK_EQ (errno, EINTR) << "poll failed: " << std::strerror (errno);
+          continue;
+        }
+
+      if (fds[0].revents != 0)
+        {
+          char buf[256];
+          while (read (io->wakeFds[0], buf, sizeof (buf)) > 0)
+            continue;
+        }
+
+      auto it = connections.begin ();
+      for (size_t i = 2; i < fds.size (); ++i, ++it)
+        {
+          Connection& c = **it;
+          if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+            continue;
+
+          /* If we are not reading from the connection (e.g. while a request
+             is waiting for a change), a hangup means that the client is
+             gone and will not read the response anyway.  */
+          if ((fds[i].events & POLLIN) == 0)
+            {
+              c.failed = true;
+              continue;
+            }
+
+          const ssize_t n = recv (c.fd, chunk.data (), chunk.size (), 0);
+          if (n == 0)
+            {
+              c.eof = true;
+              continue;
+            }
+          if (n < 0)
+            {
+              if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+                c.failed = true;
+              continue;
+            }
+
+          const size_t oldSize = c.inBuf.size ();
+          c.inBuf.append (chunk.data (), n);
+
+          /* Extract all complete lines we have now.  We only need to look
+             for newlines in the newly received data.  */
+          size_t start = 0;
+          size_t pos = c.inBuf.find ('\n', oldSize);
+          while (pos != std::string::npos)
+            {
+              std::string request = c.inBuf.substr (start, pos - start);
+              start = pos + 1;
+              pos = c.inBuf.find ('\n', start);
+
+              if (!request.empty () && request.back () == '\r')
+                request.pop_back ();
+              if (!request.empty ())
+                c.requests.push_back (std::move (request));
+            }
+          c.inBuf.erase (0, start);
+
+          if (c.inBuf.size () > MAX_REQUEST_SIZE)
+            {
+              LOG (WARNING) << "RPC request too large, closing connection";
+              c.failed = true;
+            }
+        }
+
+      if (fds[1].revents != 0)
+        {
+          const int fd = accept (listenFd, nullptr, nullptr);
+          if (fd >= 0)
+            {
+              internal::SetNonBlocking (fd);
+              SetupConnection (fd);
+              VLOG (1) << "Accepted new RPC connection";
+              connections.push_back (std::make_shared<Connection> (fd));
+            }
+          else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+            LOG (WARNING)
+                << "Accepting RPC connection failed: " << std::strerror (errno);
+        }
+
+      /* Send out pending responses, hand the next requests to the workers
+         and close connections that are done.  */
+      std::lock_guard<std::mutex> lock(io->mut);
+      for (it = connections.begin (); it != connections.end (); )
+        {
+          const auto c = *it;
+
+          if (!c->failed && !c->outBuf.empty ())
+            {
+              const ssize_t n = send (c->fd, c->outBuf.data (),
+                                      c->outBuf.size (), MSG_NOSIGNAL);
+              if (n > 0)
+                c->outBuf.erase (0, n);
+              else if (n < 0 && errno != EINTR && errno != EAGAIN
+                         && errno != EWOULDBLOCK)
+                {
+                  VLOG (1)
+                      << "Sending RPC response failed, closing connection";
+                  c->failed = true;
+                }
+            }
+
+          if (!c->failed && !c->busy && !c->requests.empty ()
+                && c->outBuf.size () <= MAX_PENDING_OUTPUT)
+            {
+              c->busy = true;
+              std::string request = std::move (c->requests.front ());
+              c->requests.pop_front ();
+
+              auto state = io;
+              const ResponseCallback done
+                  = [state, c] (const std::string& response)
+                {
+                  const std::string data = FormatResponse (response);
+
+                  std::lock_guard<std::mutex> lock(state->mut);
+                  c->outBuf.append (data);
+                  c->busy = false;
+                  state->Wake ();
+                };
+
+              io->tasks.push_back ([this, request, done] ()
+                {
+                  ProcessLine (request, done);
+                });
+              io->cvTasks.notify_one ();
+            }
+
+          const bool finished = c->eof && !c->busy && c->requests.empty ()
+                                  && c->outBuf.empty ();
+          if (c->failed || finished)
+            {
+              VLOG (1) << "RPC connection closed";
+              close (c->fd);
+              it = connections.erase (it);
+            }
+          else
+            ++it;
+        }
+    }
+
+  for (const auto& c : connections)
+    close (c->fd);
+}
+
+void
+SocketRpcServer::ProcessLine (const std::string& request,
+                              const ResponseCallback& done)
+{
+  if (StartAsyncRequest (request, done))
+    return;
+
+  std::string response;
+  ProcessRequest (request, response);
+  done (response);
+}
+
+int
+UnixSocketRpcServer::CreateListeningSocket ()
+{
+  sockaddr_un addr;
+  std::memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size () >= sizeof (addr.sun_path))
+    {
+      LOG (WARNING) << "Socket path is too long: " << path;
+      return -1;
+    }
+  std::strcpy (addr.sun_path, path.c_str ());
+
+  const int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      LOG (WARNING) << "Creating socket failed: " << std::strerror (errno);
+      return -1;
+    }
+
+  internal::RemoveStaleSocket (path);
+
+  if (bind (fd, reinterpret_cast<const sockaddr*> (&addr), sizeof (addr)) != 0)
+    {
+      LOG (WARNING)
+          << "Binding to " << path << " failed: " << std::strerror (errno);
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+void
+UnixSocketRpcServer::CleanupListeningSocket ()
+{
+  unlink (path.c_str ());
+}
+
+int
+TcpSocketRpcServer::CreateListeningSocket ()
+{
+  const int fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      LOG (WARNING) << "Creating socket failed: " << std::strerror (errno);
+      return -1;
+    }
+
+  const int one = 1;
+  setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+  sockaddr_in addr;
+  std::memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (port);
+  addr.sin_addr.s_addr = htonl (listenLocally ? INADDR_LOOPBACK : INADDR_ANY);
+
+  if (bind (fd, reinterpret_cast<const sockaddr*> (&addr), sizeof (addr)) != 0)
+    {
+      LOG (WARNING)
+          << "Binding to port " << port << " failed: " << std::strerror (errno);
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+void
+TcpSocketRpcServer::SetupConnection (const int fd)
+{
+  /* Requests and responses are typically small and latency-sensitive,
+     so we do not want them to be delayed by Nagle's algorithm.  */
+  const int one = 1;
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+}
+
+} // namespace xaya
@@ -0,0 +1,210 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAGAME_SOCKETRPCSERVER_HPP
+#define XAYAGAME_SOCKETRPCSERVER_HPP
+
+#include "asyncrpc.hpp"
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace xaya
+{
+
+/**
+ * JSON-RPC server connector that accepts persistent stream connections
+ * and exchanges newline-delimited JSON-RPC messages on them.  Each request
+ * must be sent as a single line (i.e. compact JSON), and each response
+ * is written back as a single line as well.  Notifications do not get
+ * a response.  Requests on the same connection are processed in order,
+ * while different connections are served concurrently.
+ *
+ * Responses in a binary encoding (see RpcEncodingHandler) are recognised
+ * by their first byte not being ASCII.  They are sent with a four-byte
+ * big-endian length prefix and no terminating newline instead.
+ *
+ * Compared to the HTTP connector, this avoids the overhead of HTTP header
+ * parsing and of setting up a new connection for each request, which
+ * matters for frequent small calls like waitforchange or getnullstate.
+ *
+ * All sockets are handled by a single I/O thread, and requests are processed
+ * by a fixed pool of worker threads.  Methods can also be registered as
+ * asynchronous (see AsyncRpcServerConnector).  Thus waiting clients occupy
+ * neither a thread of their own nor a worker.
+ * The number of simultaneous connections is limited as well; further
+ * clients are only accepted once others disconnect.
+ *
+ * This is the shared base class, which handles the connections.  Concrete
+ * subclasses just set up the listening socket.
+ */
+class SocketRpcServer : public AsyncRpcServerConnector
+{
+
+private:
+
+  struct Connection;
+  struct IoState;
+
+  /** Lock for starting and stopping as well as the configuration.  */
+  std::mutex mut;
+
+  /**
+   * State shared between the I/O thread, the workers and the completion
+   * callbacks of pending requests.  The latter may be invoked even after
+   * the server has been stopped, so they hold on to it by shared_ptr.
+   * This is null while not listening.
+   */
+  std::shared_ptr<IoState> io;
+
+  /** The listening socket (or -1 if not listening).  */
+  int listenFd = -1;
+
+  /** The thread handling all socket I/O.  */
+  std::unique_ptr<std::thread> ioThread;
+
+  /** The worker threads processing requests.  */
+  std::vector<std::thread> workers;
+
+  /** Number of worker threads to start.  */
+  unsigned numWorkers;
+
+  /** Maximum number of simultaneous connections.  */
+  unsigned maxConnections;
+
+  /**
+   * Main function of the I/O thread.  It accepts new connections, reads
+   * requests, hands them to the workers and sends back the responses.
+   */
+  void RunIoLoop ();
+
+  /**
+   * Main function of the worker threads.
+   */
+  void RunWorker ();
+
+  /**
+   * Processes a single request line and passes the response to the
+   * callback (possibly asynchronously).
+   */
+  void ProcessLine (const std::string& request, const ResponseCallback& done);
+
+protected:
+
+  SocketRpcServer ();
+
+  /**
+   * Creates, binds and sets up the listening socket.  Returns -1 on error.
+   */
+  virtual int CreateListeningSocket () = 0;
+
+  /**
+   * Sets up a freshly accepted connection socket (e.g. socket options).
+   */
+  virtual void
+  SetupConnection (const int fd)
+  {}
+
+  /**
+   * Cleans up after the listening socket has been closed.
+   */
+  virtual void
+  CleanupListeningSocket ()
+  {}
+
+public:
+
+  ~SocketRpcServer ();
+
+  SocketRpcServer (const SocketRpcServer&) = delete;
+  void operator= (const SocketRpcServer&) = delete;
+
+  /**
+   * Sets the number of worker threads processing requests.  Calls to
+   * asynchronous methods do not block a worker while they are waiting,
+   * but other long-running calls do.  This must be called before
+   * StartListening.
+   */
+  void SetWorkerThreads (unsigned n);
+
+  /**
+   * Sets the maximum number of simultaneous connections.  This must be
+   * called before StartListening.
+   */
+  void SetMaxConnections (unsigned n);
+
+  bool StartListening () override;
+  bool StopListening () override;
+
+};
+
+/**
+ * Socket JSON-RPC server listening on a UNIX domain socket.
+ */
+class UnixSocketRpcServer : public SocketRpcServer
+{
+
+private:
+
+  /** The path of the socket.  */
+  const std::string path;
+
+protected:
+
+  int CreateListeningSocket () override;
+  void CleanupListeningSocket () override;
+
+public:
+
+  explicit UnixSocketRpcServer (const std::string& p)
+    : path(p)
+  {}
+
+};
+
+/**
+ * Socket JSON-RPC server listening on a TCP port.
+ */
+class TcpSocketRpcServer : public SocketRpcServer
+{
+
+private:
+
+  /** The port to listen on.  */
+  const int port;
+
+  /** Whether to listen only on the loopback interface.  */
+  bool listenLocally = false;
+
+protected:
+
+  int CreateListeningSocket () override;
+  void SetupConnection (int fd) override;
+
+public:
+
+  explicit TcpSocketRpcServer (const int p)
+    : port(p)
+  {}
+
+  /**
+   * Restricts the server to listen only on localhost, similar to
+   * jsonrpc::HttpServer::BindLocalhost.
+   */
+  void
+  BindLocalhost ()
+  {
+    listenLocally = true;
+  }
+
+};
+
+} // namespace xaya
+
+#endif // XAYAGAME_SOCKETRPCSERVER_HPP
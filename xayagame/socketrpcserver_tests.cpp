@@ -0,0 +1,595 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketrpcserver.hpp"
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <json/json.h>
+#include <jsonrpccpp/common/exception.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace xaya
+{
+namespace
+{
+
+/** Port used for the TCP server in tests.  */
+constexpr int TCP_PORT = 32110;
+
+/** Binary (non-JSON) response returned by the test handler.  */
+const std::string BINARY_RESPONSE("\xA1\x01\n\x02\x00\x03", 6);
+
+/**
+ * Request handler for the tests.  It returns the method name as result,
+ * optionally after sleeping for the number of milliseconds given in the
+ * "params" (to test concurrency).  The response is formatted on multiple
+ * lines to check that it gets normalised.  For the method "binary", it
+ * returns BINARY_RESPONSE instead.
+ */
+class TestHandler : public jsonrpc::IClientConnectionHandler
+{
+
+public:
+
+  void
+  HandleRequest (const std::string& request, std::string& response) override
+  {
+    Json::Value req;
+    std::istringstream in(request);
+    in >> req;
+
+    if (req["params"].isInt ())
+      std::this_thread::sleep_for (
+          std::chrono::milliseconds (req["params"].asInt ()));
+
+    if (!req.isMember ("id"))
+      return;
+
+    if (req["method"] == "binary")
+      {
+        response = BINARY_RESPONSE;
+        return;
+      }
+
+    Json::Value res(Json::objectValue);
+    res["jsonrpc"] = "2.0";
+    res["id"] = req["id"];
+    res["result"] = req["method"];
+
+    std::ostringstream out;
+    out << res;
+    response = out.str ();
+  }
+
+};
+
+/**
+ * Client connection to the server for tests.
+ */
+class TestClient
+{
+
+private:
+
+  /** The connected socket.  */
+  int fd;
+
+  /** Received data not yet returned.  */
+  std::string buffer;
+
+public:
+
+  explicit TestClient (const int f)
+    : fd(f)
+  {
+    CHECK_GE (fd, 0);
+  }
+
+  ~TestClient ()
+  {
+    close (fd);
+  }
+
+  static std::unique_ptr<TestClient>
+  ConnectUnix (const std::string& path)
+  {
+    sockaddr_un addr;
+    std::memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    std::strcpy (addr.sun_path, path.c_str ());
+
+    const int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    CHECK_EQ (connect (fd, reinterpret_cast<const sockaddr*> (&addr),
+                       sizeof (addr)), 0);
+    return std::make_unique<TestClient> (fd);
+  }
+
+  static std::unique_ptr<TestClient>
+  ConnectTcp (const int port)
+  {
+    sockaddr_in addr;
+    std::memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons (port);
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+    const int fd = socket (AF_INET, SOCK_STREAM, 0);
+    CHECK_EQ (connect (fd, reinterpret_cast<const sockaddr*> (&addr),
+                       sizeof (addr)), 0);
+    return std::make_unique<TestClient> (fd);
+  }
+
+  void
+  Send (const std::string& data)
+  {
+    const ssize_t n = send (fd, data.data (), data.size (), MSG_NOSIGNAL);
+    CHECK_EQ (n, static_cast<ssize_t> (data.size ()));
+  }
+
+  /**
+   * Reads the next line.  Returns false if none was received within
+   * a timeout or the connection got closed.
+   */
+  bool
+  ReadLine (std::string& line, const int timeoutMs = 5000)
+  {
+    while (true)
+      {
+        const size_t pos = buffer.find ('\n');
+        if (pos != std::string::npos)
+          {
+            line = buffer.substr (0, pos);
+            buffer.erase (0, pos + 1);
+            return true;
+          }
+
+        pollfd pfd = {fd, POLLIN, 0};
+        if (poll (&pfd, 1, timeoutMs) <= 0)
+          return false;
+
+        char buf[1024];
+        const ssize_t n = recv (fd, buf, sizeof (buf), 0);
+        if (n <= 0)
+          return false;
+        buffer.append (buf, n);
+      }
+  }
+
+  /**
+   * Reads exactly the given number of bytes.  Returns false if they were
+   * not received within a timeout.
+   */
+  bool
+  ReadBytes (const size_t n, std::string& data, const int timeoutMs = 5000)
+  {
+    while (buffer.size () < n)
+      {
+        pollfd pfd = {fd, POLLIN, 0};
+        if (poll (&pfd, 1, timeoutMs) <= 0)
+          return false;
+
+        char buf[1024];
+        const ssize_t r = recv (fd, buf, sizeof (buf), 0);
+        if (r <= 0)
+          return false;
+        buffer.append (buf, r);
+      }
+
+    data = buffer.substr (0, n);
+    buffer.erase (0, n);
+    return true;
+  }
+
+  /**
+   * Reads a line and parses it as JSON-RPC response, returning the result.
+   */
+  Json::Value
+  ReadResult ()
+  {
+    std::string line;
+    CHECK (ReadLine (line));
+
+    Json::Value res;
+    std::istringstream in(line);
+    in >> res;
+    return res["result"];
+  }
+
+};
+
+/**
+ * Returns a JSON-RPC request as line.
+ */
+std::string
+Request (const std::string& method, const int id, const int sleepMs = 0)
+{
+  std::ostringstream out;
+  out << R"({"jsonrpc":"2.0","method":")" << method << R"(","id":)" << id;
+  if (sleepMs > 0)
+    out << R"(,"params":)" << sleepMs;
+  out << "}\n";
+  return out.str ();
+}
+
+class SocketRpcServerTests : public testing::Test
+{
+
+protected:
+
+  TestHandler handler;
+
+  /** The path used for the UNIX socket.  */
+  const std::string path;
+
+  SocketRpcServerTests ()
+    : path(testing::TempDir () + "socketrpcserver.sock")
+  {}
+
+};
+
+TEST_F (SocketRpcServerTests, PersistentConnection)
+{
+  UnixSocketRpcServer srv(path);
+  srv.SetHandler (&handler);
+  ASSERT_TRUE (srv.StartListening ());
+
+  auto client = TestClient::ConnectUnix (path);
+  for (int i = 0; i < 10; ++i)
+    {
+      client->Send (Request ("method" + std::to_string (i), i));
+      EXPECT_EQ (client->ReadResult (), "method" + std::to_string (i));
+    }
+
+  ASSERT_TRUE (srv.StopListening ());
+}
+
+TEST_F (SocketRpcServerTests, PipelinedRequests)
+{
+  UnixSocketRpcServer srv(path);
+  srv.SetHandler (&handler);
+  ASSERT_TRUE (srv.StartListening ());
+
+  auto client = TestClient::ConnectUnix (path);
+  client->Send (Request ("foo", 1) + Request ("bar", 2) + "\r\n\n"
+                  + Request ("baz", 3));
+  EXPECT_EQ (client->ReadResult (), "foo");
+  EXPECT_EQ (client->ReadResult (), "bar");
+  EXPECT_EQ (client->ReadResult (), "baz");
+
+  ASSERT_TRUE (srv.StopListening ());
+}
+
+TEST_F (SocketRpcServerTests, SplitRequest)
+{
+  UnixSocketRpcServer srv(path);
+  srv.SetHandler (&handler);
+  ASSERT_TRUE (srv.StartListening ());
+
+  auto client = TestClient::ConnectUnix (path);
+  const std::string req = Request ("foo", 1);
+  client->Send (req.substr (0, 10));
+  std::this_thread::sleep_for (std::chrono::milliseconds (10));
+  client->Send (req.substr (10));
+  EXPECT_EQ (client->ReadResult (), "foo");
+
+  ASSERT_TRUE (srv.StopListening ());
+}
+
+TEST_F (SocketRpcServerTests, Notification)
+{
+  UnixSocketRpcServer srv(path);
+  srv.SetHandler (&handler);
+  ASSERT_TRUE (srv.StartListening ());
+
+  auto client = TestClient::ConnectUnix (path);
+  client->Send (R"({"jsonrpc":"2.0","method":"notify"})" "\n");
+  client->Send (Request ("foo", 1));
+  EXPECT_EQ (client->ReadResult (), "foo");
+
+  ASSERT_TRUE (srv.StopListening ());
+}
+
+TEST_F (SocketRpcServerTests, BinaryResponse)
+{
+  UnixSocketRpcServer srv(path);
+  srv.SetHandler (&handler);
+  ASSERT_TRUE (srv.StartListening ());
+
+  auto client = TestClient::ConnectUnix (path);
+  client->Send (Request ("binary", 1) + Request ("foo", 2));
+
+  std::string data;
+  ASSERT_TRUE (client->ReadBytes (4, data));
+  EXPECT_EQ (data, std::string ("\0\0\0\x06", 4));
+  ASSERT_TRUE (client->ReadBytes (BINARY_RESPONSE.size (), data));
+  EXPECT_EQ (data, BINARY_RESPONSE);
+  EXPECT_EQ (client->ReadResult (), "foo");
+
+  ASSERT_TRUE (srv.StopListening ());
+}
+
+TEST_F (SocketRpcServerTests, AsyncMethod)
+{
+  UnixSocketRpcServer srv(path);
+  srv.SetHandler (&handler);
+
+  std::mutex mut;
+  std::vector<SocketRpcServer::ResultCallback> waiting;
+  srv.AddAsyncMethod ("async", [&] (const Json::Value& params,
+                                    const SocketRpcServer::ResultCallback& cb)
+    {
+      if (!params.isNull ())
+        throw jsonrpc::JsonRpcException (-1, "invalid");
+
+      std::lock_guard<std::mutex> lock(mut);
+      waiting.push_back (cb);
+    });
+  ASSERT_TRUE (srv.StartListening ());
+
+  auto client = TestClient::ConnectUnix (path);
+  client->Send (Request ("async", 1) + Request ("foo", 2));
+
+  std::thread completer([&] ()
+    {
+      std::this_thread::sleep_for (std::chrono::milliseconds (10));
+      std::lock_guard<std::mutex> lock(mut);
+      CHECK_EQ (waiting.size (), 1);
+      waiting.front () ("done");
+    });
+
+  EXPECT_EQ (client->ReadResult (), "done");
+  EXPECT_EQ (client->ReadResult (), "foo");
+  completer.join ();
+
+  client->Send (Request ("async", 3, 42));
+  std::string line;
+  ASSERT_TRUE (client->ReadLine (line));
+  Json::Value res;
+  std::istringstream in(line);
+  in >> res;
+  EXPECT_EQ (res["id"], 3);
+  EXPECT_EQ (res["error"]["code"], -1);
+
+  ASSERT_TRUE (srv.StopListening ());
+}
+
+TEST_F (SocketRpcServerTests, WaitingCallsDoNotBlockWorkers)
+{
+  UnixSocketRpcServer srv(path);
+  srv.SetHandler (&handler);
+  srv.SetWorkerThreads (1);
+
+  std::mutex mut;
+  std::vector<SocketRpcServer::ResultCallback> waiting;
+  srv.AddAsyncMethod ("wait", [&] (const Json::Value& params,
+                                   const SocketRpcServer::ResultCallback& cb)
+    {
+      std::lock_guard<std::mutex> lock(mut);
+      waiting.push_back (cb);
+    });
+  ASSERT_TRUE (srv.StartListening ());
+
+  std::vector<std::unique_ptr<TestClient>> waiters;
+  for (int i = 0; i < 10; ++i)
+    {
+      waiters.push_back (TestClient::ConnectUnix (path));
+      waiters.back ()->Send (Request ("wait", i));
+    }
+
+  auto client = TestClient::ConnectUnix (path);
+  client->Send (Request ("foo", 1));
+  EXPECT_EQ (client->ReadResult (), "foo");
+
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    ASSERT_EQ (waiting.size (), 10);
+    for (auto& cb : waiting)
+      cb ("done");
+  }
+  for (auto& w : waiters)
+    EXPECT_EQ (w->ReadResult (), "done");
+
+  ASSERT_TRUE (srv.StopListening ());
+}
+
+TEST_F (SocketRpcServerTests, AsyncCompletionAfterStop)
+{
+  SocketRpcServer::ResultCallback pending;
+  {
+    UnixSocketRpcServer srv(path);
+    srv.SetHandler (&handler);
+    srv.AddAsyncMethod ("wait", [&] (const Json::Value& params,
+                                     const SocketRpcServer::ResultCallback& cb)
+      {
+        pending = cb;
+      });
+    ASSERT_TRUE (srv.StartListening ());
+
+    auto client = TestClient::ConnectUnix (path);
+    client->Send (Request ("wait", 1));
+    client->Send (Request ("foo", 2));
+
+    /* Make sure the request has been started.  */
+    std::this_thread::sleep_for (std::chrono::milliseconds (100));
+
+    ASSERT_TRUE (srv.StopListening ());
+  }
+
+  ASSERT_TRUE (pending != nullptr);
+  pending ("done");
+}
+
+TEST_F (SocketRpcServerTests, ConnectionLimit)
+{
+  UnixSocketRpcServer srv(path);
+  srv.SetHandler (&handler);
+  srv.SetMaxConnections (1);
+  ASSERT_TRUE (srv.StartListening ());
+
+  auto first = TestClient::ConnectUnix (path);
+  first->Send (Request ("foo", 1));
+  EXPECT_EQ (first->ReadResult (), "foo");
+
+  /* The second client can connect (it is put into the listen backlog),
+     but is not served until the first one is gone.  */
+  auto second = TestClient::ConnectUnix (path);
+  second->Send (Request ("bar", 2));
+  std::string line;
+  EXPECT_FALSE (second->ReadLine (line, 100));
+
+  first.reset ();
+  EXPECT_EQ (second->ReadResult (), "bar");
+
+  ASSERT_TRUE (srv.StopListening ());
+}
+
+TEST_F (SocketRpcServerTests, ConcurrentConnections)
+{
+  UnixSocketRpcServer srv(path);
+  srv.SetHandler (&handler);
+  ASSERT_TRUE (srv.StartListening ());
+
+  auto slow = TestClient::ConnectUnix (path);
+  auto fast = TestClient::ConnectUnix (path);
+
+  slow->Send (Request ("slow", 1, 1000));
+  std::this_thread::sleep_for (std::chrono::milliseconds (10));
+
+  const auto start = std::chrono::steady_clock::now ();
+  fast->Send (Request ("fast", 2));
+  EXPECT_EQ (fast->ReadResult (), "fast");
+  EXPECT_LT (std::chrono::steady_clock::now () - start,
+             std::chrono::milliseconds (500));
+
+  EXPECT_EQ (slow->ReadResult (), "slow");
+
+  ASSERT_TRUE (srv.StopListening ());
+}
+
+TEST_F (SocketRpcServerTests, ClosedConnectionsAreCleanedUp)
+{
+  UnixSocketRpcServer srv(path);
+  srv.SetHandler (&handler);
+  ASSERT_TRUE (srv.StartListening ());
+
+  for (int i = 0; i < 100; ++i)
+    {
+      auto client = TestClient::ConnectUnix (path);
+      client->Send (Request ("foo", i));
+      EXPECT_EQ (client->ReadResult (), "foo");
+    }
+
+  ASSERT_TRUE (srv.StopListening ());
+}
+
+TEST_F (SocketRpcServerTests, StopClosesConnections)
+{
+  UnixSocketRpcServer srv(path);
+  srv.SetHandler (&handler);
+  ASSERT_TRUE (srv.StartListening ());
+  EXPECT_FALSE (srv.StartListening ());
+
+  auto client = TestClient::ConnectUnix (path);
+  client->Send (Request ("foo", 1));
+  EXPECT_EQ (client->ReadResult (), "foo");
+
+  ASSERT_TRUE (srv.StopListening ());
+  EXPECT_FALSE (srv.StopListening ());
+
+  std::string line;
+  EXPECT_FALSE (client->ReadLine (line));
+  EXPECT_NE (access (path.c_str (), F_OK), 0);
+}
+
+TEST_F (SocketRpcServerTests, Restart)
+{
+  UnixSocketRpcServer srv(path);
+  srv.SetHandler (&handler);
+
+  for (int i = 0; i < 2; ++i)
+    {
+      ASSERT_TRUE (srv.StartListening ());
+      auto client = TestClient::ConnectUnix (path);
+      client->Send (Request ("foo", i));
+      EXPECT_EQ (client->ReadResult (), "foo");
+      ASSERT_TRUE (srv.StopListening ());
+    }
+}
+
+TEST_F (SocketRpcServerTests, ReplacesStaleSocket)
+{
+  UnixSocketRpcServer srv(path);
+  srv.SetHandler (&handler);
+
+  /* Leave behind a socket file as from an unclean shutdown.  */
+  {
+    sockaddr_un addr;
+    std::memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    std::strcpy (addr.sun_path, path.c_str ());
+
+    const int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_EQ (bind (fd, reinterpret_cast<const sockaddr*> (&addr),
+                     sizeof (addr)), 0);
+    close (fd);
+  }
+
+  ASSERT_TRUE (srv.StartListening ());
+  auto client = TestClient::ConnectUnix (path);
+  client->Send (Request ("foo", 1));
+  EXPECT_EQ (client->ReadResult (), "foo");
+  ASSERT_TRUE (srv.StopListening ());
+}
+
+TEST_F (SocketRpcServerTests, KeepsNonSocketFile)
+{
+  {
+    std::ofstream out(path);
+    out << "foo";
+  }
+
+  UnixSocketRpcServer srv(path);
+  srv.SetHandler (&handler);
+  EXPECT_FALSE (srv.StartListening ());
+  EXPECT_EQ (access (path.c_str (), F_OK), 0);
+
+  unlink (path.c_str ());
+}
+
+TEST_F (SocketRpcServerTests, Tcp)
+{
+  TcpSocketRpcServer srv(TCP_PORT);
+  srv.BindLocalhost ();
+  srv.SetHandler (&handler);
+  ASSERT_TRUE (srv.StartListening ());
+
+  auto client = TestClient::ConnectTcp (TCP_PORT);
+  client->Send (Request ("foo", 1));
+  EXPECT_EQ (client->ReadResult (), "foo");
+  client->Send (Request ("bar", 2));
+  EXPECT_EQ (client->ReadResult (), "bar");
+
+  ASSERT_TRUE (srv.StopListening ());
+}
+
+} // anonymous namespace
+} // namespace xaya
@@ -0,0 +1,39 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketutils.hpp"
+
+#include <glog/logging.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace xaya
+{
+namespace internal
+{
+
+void
+SetNonBlocking (const int fd)
+{
+  const int flags = fcntl (fd, F_GETFL);
+  CHECK_GE (flags, 0) << "fcntl failed: " << std::strerror (errno);
+  CHECK_EQ (fcntl (fd, F_SETFL, flags | O_NONBLOCK), 0)
+      << "fcntl failed: " << std::strerror (errno);
+}
+
+void
+RemoveStaleSocket (const std::string& path)
+{
+  struct stat st;
+  if (lstat (path.c_str (), &st) == 0 && S_ISSOCK (st.st_mode))
+    unlink (path.c_str ());
+}
+
+} // namespace internal
+} // namespace xaya
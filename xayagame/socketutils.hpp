@@ -0,0 +1,30 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAGAME_SOCKETUTILS_HPP
+#define XAYAGAME_SOCKETUTILS_HPP
+
+#include <string>
+
+namespace xaya
+{
+namespace internal
+{
+
+/**
+ * Sets a file descriptor to non-blocking mode.
+ */
+void SetNonBlocking (int fd);
+
+/**
+ * Removes a stale socket file left over from a previous run at the given
+ * path.  Anything else that exists there (e.g. a regular file given by
+ * mistake) is left alone, so that binding fails instead of deleting it.
+ */
+void RemoveStaleSocket (const std::string& path);
+
+} // namespace internal
+} // namespace xaya
+
+#endif // XAYAGAME_SOCKETUTILS_HPP
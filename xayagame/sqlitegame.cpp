@@ -6,6 +6,7 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstring>
 
 namespace xaya
@@ -299,6 +300,21 @@ SQLiteGame::GetStorage ()
   return *database;
 }
 
+void
+SQLiteGame::SetTuning (const SQLiteTuning& catchUp,
+                       const SQLiteTuning& upToDate)
+{
+  CHECK (database != nullptr) << "SQLiteGame has not bee initialised";
+  database->SetTuning (catchUp, upToDate);
+}
+
+void
+SQLiteGame::SetSnapshotPoolSize (const unsigned n)
+{
+  CHECK (database != nullptr) << "SQLiteGame has not bee initialised";
+  database->SetSnapshotPoolSize (n);
+}
+
 GameStateData
 SQLiteGame::GetInitialStateInternal (unsigned& height, std::string& hashHex)
 {
@@ -462,8 +478,83 @@ public:
 
 };
 
+/**
+ * Utility class wrapping an sqlite3_changegroup, which is used to merge
+ * multiple changesets into one.
+ */
+class ChangesetGroup
+{
+
+private:
+
+  /** The underlying sqlite3_changegroup handle.  */
+  sqlite3_changegroup* group = nullptr;
+
+public:
+
+  ChangesetGroup ()
+  {
+    CHECK_EQ (sqlite3changegroup_new (&group), SQLITE_OK)
+        << "Failed to create SQLite changegroup";
+    CHECK (group != nullptr);
+  }
+
+  ~ChangesetGroup ()
+  {
+    sqlite3changegroup_delete (group);
+  }
+
+  ChangesetGroup (const ChangesetGroup&) = delete;
+  void operator= (const ChangesetGroup&) = delete;
+
+  /**
+   * Adds the changes from a given changeset to the group.  They are
+   * considered to be done after all previously added changes.
+   */
+  void
+  Add (const UndoData& changeset)
+  {
+    CHECK_EQ (sqlite3changegroup_add (group, changeset.size (),
+                                      const_cast<char*> (changeset.data ())),
+              SQLITE_OK)
+        << "Failed to add changeset to SQLite changegroup";
+  }
+
+  /**
+   * Returns the combined changeset of the group.
+   */
+  UndoData
+  Output ()
+  {
+    int size;
+    void* data;
+    CHECK_EQ (sqlite3changegroup_output (group, &size, &data), SQLITE_OK)
+        << "Failed to extract changeset of SQLite changegroup";
+
+    UndoData result(static_cast<const char*> (data), size);
+    sqlite3_free (data);
+
+    return result;
+  }
+
+};
+
 } // anonymous namespace
 
+bool
+SQLiteGame::MergeUndoData (const std::vector<UndoData>& undos,
+                           UndoData& merged)
+{
+  VLOG (1) << "Merging undo data of " << undos.size () << " blocks";
+
+  ChangesetGroup group;
+  for (const auto& u : undos)
+    group.Add (u);
+
+  merged = group.Output ();
+  return true;
+}
+
 GameStateData
 SQLiteGame::ProcessBackwardsInternal (const GameStateData& newState,
                                       const Json::Value& blockData,
@@ -499,6 +590,75 @@ SQLiteGame::GameStateToJson (const GameStateData& state)
   return GetStateAsJson (database->GetDatabase ());
 }
 
+void
+SQLiteGame::WriteGameStateJson (const GameStateData& state,
+                                JsonStreamWriter& out)
+{
+  EnsureCurrentState (state);
+  WriteStateAsJson (database->GetDatabase (), out);
+}
+
+void
+SQLiteGame::WriteStateAsJson (const SQLiteDatabase& db, JsonStreamWriter& out)
+{
+  out.Value (GetStateAsJson (db));
+}
+
+void
+SQLiteGame::WriteRowsAsJson (sqlite3_stmt* stmt, JsonStreamWriter& out)
+{
+  /* Write the keys in sorted order, so that the output matches what
+     the corresponding Json::Value would serialise to.  */
+  std::vector<std::pair<std::string, int>> columns;
+  const int numColumns = sqlite3_column_count (stmt);
+  for (int i = 0; i < numColumns; ++i)
+    columns.emplace_back (sqlite3_column_name (stmt, i), i);
+  std::sort (columns.begin (), columns.end ());
+
+  out.BeginArray ();
+  while (true)
+    {
+      const int rc = sqlite3_step (stmt);
+      if (rc == SQLITE_DONE)
+        break;
+      CHECK_EQ (rc, SQLITE_ROW)
+          << "Failed to step SQLite statement: " << sqlite3_errstr (rc);
+
+      out.BeginObject ();
+      for (const auto& col : columns)
+        {
+          const int ind = col.second;
+          out.Key (col.first);
+          switch (sqlite3_column_type (stmt, ind))
+            {
+            case SQLITE_NULL:
+              out.Null ();
+              break;
+            case SQLITE_INTEGER:
+              out.Int (sqlite3_column_int64 (stmt, ind));
+              break;
+            case SQLITE_FLOAT:
+              out.Double (sqlite3_column_double (stmt, ind));
+              break;
+            case SQLITE_TEXT:
+              {
+                const auto* str = reinterpret_cast<const char*> (
+                    sqlite3_column_text (stmt, ind));
+                out.String (std::string (str,
+                                         sqlite3_column_bytes (stmt, ind)));
+                break;
+              }
+            default:
+              LOG (FATAL)
+                  << "Unsupported type for column " << col.first
+                  << " in WriteRowsAsJson";
+            }
+        }
+      out.EndObject ();
+    }
+  out.EndArray ();
+}
+
 Json::Value
 SQLiteGame::GetCustomStateData (
     const Game& game, const std::string& jsonField,
@@ -629,8 +789,37 @@ SQLiteGame::AutoId::Sync (SQLiteGame& game, const std::string& key)
 const SQLiteDatabase&
 SQLiteGame::PendingMoves::AccessConfirmedState () const
 {
-  game.EnsureCurrentState (GetConfirmedState ());
-  return game.database->GetDatabase ();
+  if (!IsConcurrentCallback ())
+    {
+      game.EnsureCurrentState (GetConfirmedState ());
+      return game.database->GetDatabase ();
+    }
+
+  if (snapshot == nullptr)
+    {
+      snapshot = game.database->GetSnapshot ();
+      CHECK (snapshot != nullptr)
+          << "Failed to create snapshot for concurrent pending processing";
+      if (!game.database->CheckCurrentState (*snapshot, GetConfirmedState ()))
+        VLOG (1)
+            << "Database snapshot for pending move is already at a newer"
+               " confirmed state";
+    }
+
+  return *snapshot;
+}
+
+void
+SQLiteGame::PendingMoves::CallbackFinished ()
+{
+  snapshot.reset ();
+}
+
+bool
+SQLiteGame::PendingMoves::SupportsConcurrentProcessing () const
+{
+  CHECK (game.database != nullptr) << "SQLiteGame has not been initialised";
+  return game.database->SupportsSnapshots ();
 }
 
 /* ************************************************************************** */
@@ -18,6 +18,7 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace xaya
 {
@@ -152,6 +153,25 @@ protected:
    */
   virtual Json::Value GetStateAsJson (const SQLiteDatabase& db) = 0;
 
+  /**
+   * Writes the current state as JSON to a streaming writer, producing the
+   * same data as GetStateAsJson.  Games with big states can override this
+   * to avoid building up the full Json::Value in memory, e.g. using
+   * WriteRowsAsJson.  By default, this just writes the result of
+   * GetStateAsJson, since the layout of the database is up to the game.
+   */
+  virtual void WriteStateAsJson (const SQLiteDatabase& db,
+                                 JsonStreamWriter& out);
+
+  /**
+   * Steps through all result rows of the given statement and writes them
+   * directly to a streaming writer, without building them up as Json::Value.
+   * The result is an array with one object per row, mapping the column
+   * names to their values.  Integer, float, text and null columns are
+   * supported.
+   */
+  static void WriteRowsAsJson (sqlite3_stmt* stmt, JsonStreamWriter& out);
+
   /**
    * Returns a handle to an AutoId instance for a given named key.  That can
    * be used to generate a consistent sequence of integer IDs.
@@ -229,6 +249,20 @@ public:
    */
   StorageInterface& GetStorage ();
 
+  /**
+   * Sets the tuning settings for the underlying database, which are used
+   * while catching up and while up-to-date.  See SQLiteStorage::SetTuning
+   * for details.  This must be called after Initialise.
+   */
+  void SetTuning (const SQLiteTuning& catchUp, const SQLiteTuning& upToDate);
+
+  /**
+   * Sets the number of idle read-only connections that are kept around for
+   * reuse by snapshots (e.g. when extracting custom state data).  See
+   * SQLiteStorage::SetSnapshotPoolSize.  This must be called after Initialise.
+   */
+  void SetSnapshotPoolSize (unsigned n);
+
   /**
    * Sets a flag (off by default) that determines whether to set
    * 'PRAGMA reverse_unordered_selects' in SQLite (and potentially
@@ -241,6 +275,16 @@ public:
   void SetMessForDebug (bool val);
 
   Json::Value GameStateToJson (const GameStateData& state) override;
+  void WriteGameStateJson (const GameStateData& state,
+                           JsonStreamWriter& out) override;
+
+  /**
+   * Merges the undo data of a series of consecutive blocks into a single
+   * SQLite changeset.  The result is the same as if all changes had been
+   * done in a single block.
+   */
+  bool MergeUndoData (const std::vector<UndoData>& undos,
+                      UndoData& merged) override;
 
 };
 
@@ -331,6 +375,13 @@ private:
   /** The underlying SQLiteGame instance, which manages the database.  */
   SQLiteGame& game;
 
+  /**
+   * Database snapshot used by AccessConfirmedState for the currently running
+   * callback, if it is a concurrent one.  It is released once the callback
+   * is finished.
+   */
+  mutable SQLiteStorage::Snapshot snapshot;
+
 protected:
 
   explicit PendingMoves (SQLiteGame& g)
@@ -357,9 +408,26 @@ protected:
    * database.  So if the state is accessed through other means (e.g. using
    * SQLiteGame::PrepareStatement), then calling this function and discarding
    * the return value is a way to ensure consistency.
+   *
+   * If the callback is running concurrently to updates of the confirmed
+   * state (see PendingMoveProcessor::IsConcurrentCallback), then a read-only
+   * snapshot of the database is returned instead of the main connection.
+   * Its state may already be newer than the one returned by
+   * GetConfirmedState; that is fine, since the pending state will be rebuilt
+   * for the new confirmed state anyway in that case.
    */
   const SQLiteDatabase& AccessConfirmedState () const;
 
+  void CallbackFinished () override;
+
+public:
+
+  /**
+   * Concurrent processing requires database snapshots, which are only
+   * possible if the database uses WAL mode.
+   */
+  bool SupportsConcurrentProcessing () const override;
+
 };
 
 } // namespace xaya
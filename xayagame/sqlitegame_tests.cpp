@@ -133,6 +133,7 @@ public:
 
   using SQLiteGame::GetCustomStateData;
   using SQLiteGame::GetDatabaseForTesting;
+  using SQLiteGame::WriteRowsAsJson;
 
 };
 
@@ -522,6 +523,41 @@ TEST_F (GameStateStringTests, InvalidString)
 
 /* ************************************************************************** */
 
+using WriteRowsAsJsonTests = SQLiteGameTests<ChatGame>;
+
+TEST_F (WriteRowsAsJsonTests, Works)
+{
+  rules.ExpectState ("initial", {{"domob", "hello world"}, {"foo", "bar"}});
+
+  auto* stmt = rules.GetDatabaseForTesting ().PrepareRo (R"(
+    SELECT `user`, `msg`, NULL AS `none`, 42 AS `num`, 1.5 AS `frac`
+      FROM `chat`
+      ORDER BY `user`
+  )");
+
+  std::ostringstream out;
+  JsonStreamWriter w(out);
+  ChatGame::WriteRowsAsJson (stmt, w);
+  ASSERT_TRUE (w.IsComplete ());
+
+  Json::Value expected(Json::arrayValue);
+  for (const auto& entry : ChatGame::State ({{"domob", "hello world"},
+                                             {"foo", "bar"}}))
+    {
+      Json::Value row(Json::objectValue);
+      row["user"] = entry.first;
+      row["msg"] = entry.second;
+      row["none"] = Json::Value ();
+      row["num"] = 42;
+      row["frac"] = 1.5;
+      expected.append (row);
+    }
+
+  EXPECT_EQ (out.str (), CompactJson (expected));
+}
+
+/* ************************************************************************** */
+
 using MovingTests = SQLiteGameTests<ChatGame>;
 
 TEST_F (MovingTests, ForwardAndBackward)
@@ -710,6 +746,148 @@ TEST_F (UniqueConstraintTests, Undo)
 
 /* ************************************************************************** */
 
+/**
+ * Test fixture for detaching multiple blocks at once with merged undo data.
+ * The result is compared to the states we get from detaching block by block.
+ */
+template <typename G>
+  class MergedUndoTests : public SQLiteGameTests<G>
+{
+
+protected:
+
+  using SQLiteGameTests<G>::rules;
+
+  /**
+   * Detaches the given blocks (in the order they were attached) in a single
+   * step using merged undo data, bypassing the Game instance.  The current
+   * state in the storage is updated to the given parent block.
+   */
+  void
+  DetachMerged (const std::vector<uint256>& blocks, const uint256& parent)
+  {
+    auto& storage = rules.GetStorage ();
+
+    std::vector<UndoData> undos;
+    for (const auto& h : blocks)
+      {
+        UndoData undo;
+        ASSERT_TRUE (storage.GetUndoData (h, undo));
+        undos.push_back (undo);
+      }
+
+    Json::Value blockData(Json::objectValue);
+    blockData["block"]["parent"] = parent.ToHex ();
+    blockData["block"]["rngseed"] = blocks.front ().ToHex ();
+
+    UndoData merged;
+    ASSERT_TRUE (rules.MergeUndoData (undos, merged));
+
+    storage.BeginTransaction ();
+    const GameStateData newState
+        = rules.ProcessBackwards (storage.GetCurrentGameState (), blockData,
+                                  merged);
+    storage.SetCurrentGameState (parent, newState);
+    storage.CommitTransaction ();
+  }
+
+};
+
+using ChatMergedUndoTests = MergedUndoTests<ChatGame>;
+
+TEST_F (ChatMergedUndoTests, NoBlocks)
+{
+  UndoData merged;
+  ASSERT_TRUE (rules.MergeUndoData ({}, merged));
+  EXPECT_EQ (merged, "");
+}
+
+TEST_F (ChatMergedUndoTests, DetachAll)
+{
+  AttachBlock (game, BlockHash (11), ChatGame::Moves ({
+    {"domob", "new"},
+    {"a", "x"},
+  }));
+  AttachBlock (game, BlockHash (12), ChatGame::Moves ({}));
+  AttachBlock (game, BlockHash (13), ChatGame::Moves ({
+    {"a", "y"},
+    {"b", "z"},
+    {"domob", "newer"},
+  }));
+  ExpectState ({
+    {"a", "y"},
+    {"b", "z"},
+    {"domob", "newer"},
+    {"foo", "bar"},
+  });
+
+  DetachMerged ({BlockHash (11), BlockHash (12), BlockHash (13)},
+                GenesisHash ());
+  ExpectState ({{"domob", "hello world"}, {"foo", "bar"}});
+}
+
+TEST_F (ChatMergedUndoTests, EquivalentToSingleDetaches)
+{
+  AttachBlock (game, BlockHash (11), ChatGame::Moves ({{"a", "x"}}));
+  AttachBlock (game, BlockHash (12), ChatGame::Moves ({
+    {"a", "y"},
+    {"b", "y"},
+  }));
+  AttachBlock (game, BlockHash (13), ChatGame::Moves ({
+    {"a", "z"},
+    {"domob", "z"},
+  }));
+
+  DetachBlock (game);
+  DetachBlock (game);
+  const ChatGame::State expected({
+    {"a", "x"},
+    {"domob", "hello world"},
+    {"foo", "bar"},
+  });
+  ExpectState (expected);
+
+  AttachBlock (game, BlockHash (12), ChatGame::Moves ({
+    {"a", "y"},
+    {"b", "y"},
+  }));
+  AttachBlock (game, BlockHash (13), ChatGame::Moves ({
+    {"a", "z"},
+    {"domob", "z"},
+  }));
+
+  DetachMerged ({BlockHash (12), BlockHash (13)}, BlockHash (11));
+  ExpectState (expected);
+}
+
+using UniqueMergedUndoTests = MergedUndoTests<UniqueMessageChat>;
+
+TEST_F (UniqueMergedUndoTests, DeleteAndReinsert)
+{
+  AttachBlock (game, BlockHash (11), ChatGame::Moves ({
+    {"andy", "hello world"},
+    {"baz", "bar"},
+  }));
+  AttachBlock (game, BlockHash (12), ChatGame::Moves ({
+    {"domob", "hello world"},
+    {"foo", "bar"},
+    {"baz", "baz"},
+  }));
+  ExpectState ({
+    {"baz", "baz"},
+    {"domob", "hello world"},
+    {"foo", "bar"},
+  });
+
+  DetachMerged ({BlockHash (11), BlockHash (12)}, GenesisHash ());
+  ExpectState ({
+    {"domob", "hello world"},
+    {"foo", "bar"},
+  });
+}
+
+/* ************************************************************************** */
+
 class PersistenceTests : public GameTestWithBlockchain
 {
 
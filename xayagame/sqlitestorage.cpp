@@ -7,6 +7,7 @@
 #include <glog/logging.h>
 
 #include <cstdio>
+#include <sstream>
 
 namespace xaya
 {
@@ -65,8 +66,36 @@ GetStringBlob (sqlite3_stmt* stmt, const int ind)
   return std::string (static_cast<const char*> (blob), blobSize);
 }
 
+/**
+ * Executes a PRAGMA statement (given as full SQL) on the database.  Some
+ * PRAGMA's return the new value as a row, which is just ignored.
+ */
+void
+ExecutePragma (sqlite3* db, const std::string& sql)
+{
+  const int rc = sqlite3_exec (db, sql.c_str (), nullptr, nullptr, nullptr);
+  if (rc != SQLITE_OK)
+    LOG (FATAL) << "Failed to execute '" << sql << "': " << rc;
+}
+
 } // anonymous namespace
 
+SQLiteTuning
+SQLiteTuning::ForCatchingUp ()
+{
+  SQLiteTuning res;
+  res.CacheSize = -64 * 1024;
+  res.MmapSize = 256 << 20;
+  res.Synchronous = "NORMAL";
+  res.TempStore = "MEMORY";
+  res.WalAutocheckpoint = 0;
+  res.CheckpointOnCommit = true;
+
+  return res;
+}
+
+/* ************************************************************************** */
+
 bool SQLiteDatabase::loggerInitialised = false;
 
 SQLiteDatabase::SQLiteDatabase (const std::string& file, const int flags)
@@ -115,11 +144,7 @@ SQLiteDatabase::SQLiteDatabase (const std::string& file, const int flags)
 
 SQLiteDatabase::~SQLiteDatabase ()
 {
-  if (parent != nullptr)
-    {
-      LOG (INFO) << "Ending snapshot read transaction";
-      CHECK_EQ (sqlite3_step (PrepareRo ("ROLLBACK")), SQLITE_DONE);
-    }
+  CHECK (parent == nullptr) << "Snapshot has not been ended";
 
   for (const auto& stmt : preparedStatements)
     {
@@ -133,9 +158,6 @@ SQLiteDatabase::~SQLiteDatabase ()
   const int rc = sqlite3_close (db);
   if (rc != SQLITE_OK)
     LOG (ERROR) << "Failed to close SQLite database";
-
-  if (parent != nullptr)
-    parent->UnrefSnapshot ();
 }
 
 void
@@ -143,7 +165,7 @@ SQLiteDatabase::SetReadonlySnapshot (const SQLiteStorage& p)
 {
   CHECK (parent == nullptr);
   parent = &p;
-  LOG (INFO) << "Starting read transaction for snapshot";
+  VLOG (1) << "Starting read transaction for snapshot";
 
   /* There is no way to do an "immediate" read transaction.  Thus we have
      to start a default deferred one, and then issue some SELECT query
@@ -157,6 +179,63 @@ SQLiteDatabase::SetReadonlySnapshot (const SQLiteStorage& p)
   CHECK_EQ (sqlite3_step (stmt), SQLITE_DONE);
 }
 
+void
+SQLiteDatabase::EndReadonlySnapshot ()
+{
+  CHECK (parent != nullptr);
+  VLOG (1) << "Ending snapshot read transaction";
+  CHECK_EQ (sqlite3_step (PrepareRo ("ROLLBACK")), SQLITE_DONE);
+  parent = nullptr;
+}
+
+void
+SQLiteDatabase::ApplyTuning (const SQLiteTuning& tuning)
+{
+  CHECK (db != nullptr);
+  CHECK (sqlite3_get_autocommit (db))
+      << "Tuning cannot be applied while a transaction is in progress";
+
+  std::ostringstream sql;
+  sql << "PRAGMA `cache_size` = " << tuning.CacheSize << ";"
+      << "PRAGMA `mmap_size` = " << tuning.MmapSize << ";"
+      << "PRAGMA `synchronous` = " << tuning.Synchronous << ";"
+      << "PRAGMA `temp_store` = " << tuning.TempStore << ";"
+      << "PRAGMA `wal_autocheckpoint` = " << tuning.WalAutocheckpoint << ";";
+  ExecutePragma (db, sql.str ());
+
+  VLOG (1) << "Applied SQLite tuning: " << sql.str ();
+}
+
+void
+SQLiteDatabase::Checkpoint ()
+{
+  CHECK (db != nullptr);
+  if (!walMode)
+    return;
+
+  if (!sqlite3_get_autocommit (db))
+    {
+      VLOG (1) << "Not checkpointing inside a transaction";
+      return;
+    }
+
+  int walFrames, checkpointed;
+  const int rc = sqlite3_wal_checkpoint_v2 (db, nullptr,
+                                            SQLITE_CHECKPOINT_TRUNCATE,
+                                            &walFrames, &checkpointed);
+
+  /* If there are readers (e.g. snapshots) that still need some of the
+     WAL frames, we get SQLITE_BUSY.  Everything possible has been
+     checkpointed anyway in that case, and the rest will be done with
+     some later checkpoint.  */
+  if (rc == SQLITE_BUSY)
+    VLOG (1) << "WAL checkpoint is blocked by readers";
+  else if (rc != SQLITE_OK)
+    LOG (ERROR) << "WAL checkpoint failed: " << rc;
+  else
+    VLOG (1) << "Checkpointed " << checkpointed << " WAL frames";
+}
+
 sqlite3_stmt*
 SQLiteDatabase::Prepare (const std::string& sql)
 {
@@ -205,6 +284,8 @@ SQLiteStorage::OpenDatabase ()
   CHECK (db == nullptr);
   db = std::make_unique<SQLiteDatabase> (filename,
           SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+  db->ApplyTuning (GetActiveTuning ());
+  tuningPending = false;
 
   SetupSchema ();
 }
@@ -220,6 +301,7 @@ SQLiteStorage::CloseDatabase ()
   while (snapshots > 0)
     cvSnapshots.wait (lock);
 
+  snapshotPool.clear ();
   db.reset ();
 }
 
@@ -237,7 +319,7 @@ SQLiteStorage::GetDatabase () const
   return *db;
 }
 
-std::unique_ptr<SQLiteDatabase>
+SQLiteStorage::Snapshot
 SQLiteStorage::GetSnapshot () const
 {
   CHECK (db != nullptr);
@@ -247,19 +329,100 @@ SQLiteStorage::GetSnapshot () const
       return nullptr;
     }
 
+  std::unique_ptr<SQLiteDatabase> conn;
+  {
+    std::lock_guard<std::mutex> lock(mutSnapshots);
+    ++snapshots;
+
+    if (!snapshotPool.empty ())
+      {
+        conn = std::move (snapshotPool.back ());
+        snapshotPool.pop_back ();
+      }
+  }
+
+  /* Opening a fresh connection is done without holding the lock, so that
+     other threads can still check out pooled connections meanwhile.  */
+  if (conn == nullptr)
+    {
+      VLOG (1) << "Opening new database connection for snapshot";
+      conn = std::make_unique<SQLiteDatabase> (filename, SQLITE_OPEN_READONLY);
+    }
+
+  conn->SetReadonlySnapshot (*this);
+
+  return Snapshot (conn.release (), SnapshotReleaser (*this));
+}
+
+bool
+SQLiteStorage::SupportsSnapshots () const
+{
+  return db != nullptr && db->IsWalMode ();
+}
+
+void
+SQLiteStorage::SetSnapshotPoolSize (const unsigned n)
+{
   std::lock_guard<std::mutex> lock(mutSnapshots);
-  ++snapshots;
+  snapshotPoolSize = n;
+  if (snapshotPool.size () > snapshotPoolSize)
+    snapshotPool.resize (snapshotPoolSize);
+}
 
-  auto res = std::make_unique<SQLiteDatabase> (filename, SQLITE_OPEN_READONLY);
-  res->SetReadonlySnapshot (*this);
+void
+SQLiteStorage::UpdateTuning ()
+{
+  if (db == nullptr)
+    return;
 
-  return res;
+  /* Note that the underlying SQLite transaction may still be open even if
+     startedTransaction is false, namely after a rollback to our savepoint.  */
+  if (startedTransaction || !sqlite3_get_autocommit (db->ro ()))
+    {
+      VLOG (1) << "Delaying SQLite tuning update until transaction is done";
+      tuningPending = true;
+      return;
+    }
+
+  db->ApplyTuning (GetActiveTuning ());
+  tuningPending = false;
 }
 
 void
-SQLiteStorage::UnrefSnapshot () const
+SQLiteStorage::SetTuning (const SQLiteTuning& catchUp,
+                          const SQLiteTuning& upToDate)
 {
+  tuningCatchingUp = catchUp;
+  tuningUpToDate = upToDate;
+  UpdateTuning ();
+}
+
+void
+SQLiteStorage::SetCatchingUp (const bool val)
+{
+  if (catchingUp == val)
+    return;
+
+  LOG (INFO)
+      << "Switching SQLite tuning to "
+      << (val ? "catching-up" : "up-to-date") << " settings";
+  catchingUp = val;
+  UpdateTuning ();
+}
+
+void
+SQLiteStorage::ReleaseSnapshot (SQLiteDatabase* snapshot) const
+{
+  std::unique_ptr<SQLiteDatabase> conn(snapshot);
+  conn->EndReadonlySnapshot ();
+
   std::lock_guard<std::mutex> lock(mutSnapshots);
+
+  if (snapshotPool.size () < snapshotPoolSize)
+    snapshotPool.push_back (std::move (conn));
+  else
+    conn.reset ();
+
   CHECK_GT (snapshots, 0);
   --snapshots;
   cvSnapshots.notify_all ();
@@ -480,6 +643,11 @@ SQLiteStorage::CommitTransaction ()
   StepWithNoResult (db->Prepare ("RELEASE `xayagame-sqlitegame`"));
   CHECK (startedTransaction);
   startedTransaction = false;
+
+  if (tuningPending)
+    UpdateTuning ();
+  if (GetActiveTuning ().CheckpointOnCommit)
+    db->Checkpoint ();
 }
 
 void
@@ -488,6 +656,9 @@ SQLiteStorage::RollbackTransaction ()
   StepWithNoResult (db->Prepare ("ROLLBACK TO `xayagame-sqlitegame`"));
   CHECK (startedTransaction);
   startedTransaction = false;
+
+  if (tuningPending)
+    UpdateTuning ();
 }
 
 /* ************************************************************************** */
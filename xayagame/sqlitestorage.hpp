@@ -12,16 +12,69 @@
 #include <sqlite3.h>
 
 #include <condition_variable>
+#include <cstdint>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <vector>
 
 namespace xaya
 {
 
 class SQLiteStorage;
 
+/**
+ * Performance-related settings for an SQLite database connection.  They
+ * correspond (mostly) to PRAGMA's that are applied to the connection.
+ * SQLiteStorage uses two sets of them, one while the game is catching up
+ * and one while it is up-to-date and mainly serving requests.
+ *
+ * The default values correspond to SQLite's own defaults.
+ */
+struct SQLiteTuning
+{
+
+  /**
+   * Value for PRAGMA cache_size.  Positive values are a number of pages,
+   * negative values are the cache size in KiB.
+   */
+  int CacheSize = -2000;
+
+  /** Value for PRAGMA mmap_size, i.e. the number of bytes to mmap.  */
+  int64_t MmapSize = 0;
+
+  /** Value for PRAGMA synchronous, e.g. "OFF", "NORMAL" or "FULL".  */
+  std::string Synchronous = "FULL";
+
+  /** Value for PRAGMA temp_store, i.e. "DEFAULT", "FILE" or "MEMORY".  */
+  std::string TempStore = "DEFAULT";
+
+  /**
+   * Value for PRAGMA wal_autocheckpoint, in pages.  Zero disables automatic
+   * checkpoints by SQLite.
+   */
+  int WalAutocheckpoint = 1000;
+
+  /**
+   * If true, then we explicitly run a WAL checkpoint after every committed
+   * transaction on the storage.  This is useful together with disabled
+   * automatic checkpoints to control when checkpointing happens (e.g. only
+   * once per batch of blocks during catch-up), while still making sure that
+   * the WAL file does not grow without bound.
+   */
+  bool CheckpointOnCommit = false;
+
+  /**
+   * Returns the default settings we use while catching up.  They use a bigger
+   * page cache and mmap, relaxed syncing (which is safe against corruption
+   * in WAL mode, and the game will simply resync blocks lost in a crash)
+   * and explicit checkpoints once per committed batch.
+   */
+  static SQLiteTuning ForCatchingUp ();
+
+};
+
 /**
  * Wrapper around an SQLite database connection.  This object mostly holds
  * an sqlite3* handle (that is owned and managed by it), but it also
@@ -61,11 +114,29 @@ private:
   /**
    * Marks this is a read-only snapshot (with the given parent storage).  When
    * called, this starts a read transaction to ensure that the current view is
-   * preserved for all future queries.  It also registers this as outstanding
-   * snapshot with the parent.
+   * preserved for all future queries.
    */
   void SetReadonlySnapshot (const SQLiteStorage& p);
 
+  /**
+   * Ends the read transaction of a snapshot, so that the connection
+   * can be closed or reused for another snapshot later on.
+   */
+  void EndReadonlySnapshot ();
+
+  /**
+   * Applies the given tuning settings to the database connection.  This must
+   * not be called while a transaction is in progress, as that is not allowed
+   * for some of the settings (e.g. synchronous).
+   */
+  void ApplyTuning (const SQLiteTuning& tuning);
+
+  /**
+   * Runs a WAL checkpoint on the database, truncating the WAL file if
+   * that is possible (i.e. no readers are blocking it).
+   */
+  void Checkpoint ();
+
   /**
    * Returns whether or not the database is using WAL mode.
    */
@@ -162,13 +233,38 @@ private:
    */
   bool startedTransaction = false;
 
+  /** Tuning settings applied while the game is catching up.  */
+  SQLiteTuning tuningCatchingUp;
+  /** Tuning settings applied while the game is up-to-date.  */
+  SQLiteTuning tuningUpToDate;
+
+  /** Whether or not the game is currently catching up.  */
+  bool catchingUp = false;
+
+  /**
+   * Set to true if the active tuning changed while a transaction was in
+   * progress.  In that case, we apply it once the transaction is done.
+   */
+  bool tuningPending = false;
+
   /**
    * Number of outstanding snapshots.  This has to drop to zero before
    * we can close the database.
    */
   mutable unsigned snapshots = 0;
 
-  /** Mutex for the snapshot number.  */
+  /**
+   * Read-only database connections that are currently not used by any
+   * snapshot.  They are kept around (including their cache of prepared
+   * statements) so that new snapshots can be created without reopening
+   * the database.
+   */
+  mutable std::vector<std::unique_ptr<SQLiteDatabase>> snapshotPool;
+
+  /** Maximum number of idle connections to keep in snapshotPool.  */
+  unsigned snapshotPoolSize = 4;
+
+  /** Mutex for the snapshot number and the pool of connections.  */
   mutable std::mutex mutSnapshots;
   /** Condition variable for waiting for snapshot unrefs.  */
   mutable std::condition_variable cvSnapshots;
@@ -185,12 +281,65 @@ private:
   void CloseDatabase ();
 
   /**
-   * Decrements the count of outstanding snapshots.
+   * Returns a snapshot's connection to the pool (or closes it if the pool
+   * is full) and decrements the count of outstanding snapshots.
+   */
+  void ReleaseSnapshot (SQLiteDatabase* snapshot) const;
+
+  /**
+   * Returns the tuning settings that should be active at the moment.
    */
-  void UnrefSnapshot () const;
+  const SQLiteTuning&
+  GetActiveTuning () const
+  {
+    return catchingUp ? tuningCatchingUp : tuningUpToDate;
+  }
+
+  /**
+   * Applies the active tuning to the main database connection if that is
+   * possible right now (i.e. it is open and no transaction is in progress).
+   * Otherwise it is marked as pending, to be done later.
+   */
+  void UpdateTuning ();
 
   friend class SQLiteDatabase;
 
+public:
+
+  /**
+   * Deleter for snapshots, which hands them back to the storage they
+   * were created from.
+   */
+  class SnapshotReleaser
+  {
+
+  private:
+
+    /** The storage from which the snapshot was created.  */
+    const SQLiteStorage* storage = nullptr;
+
+  public:
+
+    SnapshotReleaser () = default;
+
+    explicit SnapshotReleaser (const SQLiteStorage& s)
+      : storage(&s)
+    {}
+
+    void
+    operator() (SQLiteDatabase* snapshot) const
+    {
+      storage->ReleaseSnapshot (snapshot);
+    }
+
+  };
+
+  /**
+   * Handle for a read-only snapshot.  When it is destructed, the snapshot
+   * is ended and the underlying connection returned to the pool.
+   */
+  using Snapshot = std::unique_ptr<SQLiteDatabase, SnapshotReleaser>;
+
 protected:
 
   /**
@@ -219,8 +368,13 @@ protected:
    * Creates a read-only snapshot of the underlying database and returns
    * the corresponding SQLiteDatabase instance.  May return NULL if the
    * underlying database is not using WAL mode (e.g. in-memory).
+   *
+   * If possible, an idle connection from the pool is reused for the
+   * snapshot, which saves opening the database and preparing statements.
+   * Its read transaction is started freshly, so that it sees the latest
+   * committed state just like a new connection would.
    */
-  std::unique_ptr<SQLiteDatabase> GetSnapshot () const;
+  Snapshot GetSnapshot () const;
 
   /**
    * Steps a given statement and expects no results (i.e. for an update).
@@ -249,7 +403,29 @@ public:
   SQLiteStorage (const SQLiteStorage&) = delete;
   void operator= (const SQLiteStorage&) = delete;
 
+  /**
+   * Sets the tuning settings to use while the game is catching up and
+   * while it is up-to-date, respectively.  The ones matching the current
+   * state are applied right away if the database is open (or once it
+   * gets opened).
+   */
+  void SetTuning (const SQLiteTuning& catchUp, const SQLiteTuning& upToDate);
+
+  /**
+   * Sets the maximum number of idle read-only connections that are kept
+   * for reuse by snapshots.  Zero disables pooling, so that each snapshot
+   * opens (and closes) its own connection.
+   */
+  void SetSnapshotPoolSize (unsigned n);
+
+  /**
+   * Returns true if GetSnapshot is possible for the database, i.e. if it
+   * is open and using WAL mode.
+   */
+  bool SupportsSnapshots () const;
+
   void Initialise () override;
+  void SetCatchingUp (bool val) override;
 
   /**
    * Clears the storage.  This deletes and re-creates the full database,
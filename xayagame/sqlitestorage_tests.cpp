@@ -11,6 +11,7 @@
 
 #include <atomic>
 #include <cstdio>
+#include <fstream>
 #include <memory>
 #include <thread>
 
@@ -254,6 +255,193 @@ TEST_F (SQLiteStorageSnapshotTests, CloseWaitsForOutstandingSnapshots)
   ExpectDatabaseState (storage.GetDatabase (), "");
 }
 
+TEST_F (SQLiteStorageSnapshotTests, ConnectionsAreReused)
+{
+  Storage storage(filename);
+  storage.Initialise ();
+
+  storage.BeginTransaction ();
+  storage.SetCurrentGameState (hash, "first");
+  storage.CommitTransaction ();
+
+  auto snapshot = storage.GetSnapshot ();
+  const sqlite3* handle = snapshot->ro ();
+  ExpectDatabaseState (*snapshot, "first");
+  snapshot.reset ();
+
+  storage.BeginTransaction ();
+  storage.SetCurrentGameState (hash, "second");
+  storage.CommitTransaction ();
+
+  snapshot = storage.GetSnapshot ();
+  EXPECT_EQ (snapshot->ro (), handle);
+  ExpectDatabaseState (*snapshot, "second");
+}
+
+TEST_F (SQLiteStorageSnapshotTests, PoolSizeLimit)
+{
+  Storage storage(filename);
+  storage.Initialise ();
+  storage.SetSnapshotPoolSize (1);
+
+  auto s1 = storage.GetSnapshot ();
+  auto s2 = storage.GetSnapshot ();
+  const sqlite3* h1 = s1->ro ();
+  ASSERT_NE (h1, s2->ro ());
+  s1.reset ();
+  s2.reset ();
+
+  s1 = storage.GetSnapshot ();
+  s2 = storage.GetSnapshot ();
+  EXPECT_EQ (s1->ro (), h1);
+  ExpectDatabaseState (*s1, "");
+  ExpectDatabaseState (*s2, "");
+}
+
+/* ************************************************************************** */
+
+class SQLiteStorageTuningTests : public SQLiteStorageSnapshotTests
+{
+
+protected:
+
+  SQLiteTuning catchUp;
+  SQLiteTuning upToDate;
+
+  SQLiteStorageTuningTests ()
+  {
+    catchUp.CacheSize = -10000;
+    catchUp.Synchronous = "NORMAL";
+    catchUp.WalAutocheckpoint = 0;
+    catchUp.CheckpointOnCommit = false;
+
+    upToDate.CacheSize = 500;
+    upToDate.Synchronous = "FULL";
+  }
+
+  /**
+   * Queries the value of some integer-valued PRAGMA on the database.
+   */
+  static int
+  GetPragma (const SQLiteDatabase& db, const std::string& name)
+  {
+    auto* stmt = db.PrepareRo ("PRAGMA `" + name + "`");
+    CHECK_EQ (sqlite3_step (stmt), SQLITE_ROW);
+    const int res = sqlite3_column_int (stmt, 0);
+    CHECK_EQ (sqlite3_step (stmt), SQLITE_DONE);
+    return res;
+  }
+
+  /**
+   * Returns the size of the WAL file for our database.
+   */
+  std::streamoff
+  GetWalSize () const
+  {
+    std::ifstream in(filename + "-wal", std::ios::binary | std::ios::ate);
+    if (!in)
+      return 0;
+    return in.tellg ();
+  }
+
+  /**
+   * Writes some data in a transaction to the storage.
+   */
+  void
+  WriteSomeData (Storage& storage)
+  {
+    storage.BeginTransaction ();
+    for (unsigned i = 0; i < 100; ++i)
+      storage.AddUndoData (hash, i, std::string (1000, 'x'));
+    storage.SetCurrentGameState (hash, state);
+    storage.CommitTransaction ();
+  }
+
+  ~SQLiteStorageTuningTests ()
+  {
+    std::remove ((filename + "-wal").c_str ());
+    std::remove ((filename + "-shm").c_str ());
+  }
+
+};
+
+TEST_F (SQLiteStorageTuningTests, AppliedOnOpen)
+{
+  Storage storage(filename);
+  storage.SetTuning (catchUp, upToDate);
+  storage.Initialise ();
+
+  EXPECT_EQ (GetPragma (storage.GetDatabase (), "cache_size"), 500);
+  EXPECT_EQ (GetPragma (storage.GetDatabase (), "synchronous"), 2);
+  EXPECT_EQ (GetPragma (storage.GetDatabase (), "wal_autocheckpoint"), 1000);
+}
+
+TEST_F (SQLiteStorageTuningTests, SwitchesWithState)
+{
+  Storage storage(filename);
+  storage.Initialise ();
+  storage.SetTuning (catchUp, upToDate);
+  EXPECT_EQ (GetPragma (storage.GetDatabase (), "cache_size"), 500);
+
+  storage.SetCatchingUp (true);
+  EXPECT_EQ (GetPragma (storage.GetDatabase (), "cache_size"), -10000);
+  EXPECT_EQ (GetPragma (storage.GetDatabase (), "synchronous"), 1);
+  EXPECT_EQ (GetPragma (storage.GetDatabase (), "wal_autocheckpoint"), 0);
+
+  storage.SetCatchingUp (false);
+  EXPECT_EQ (GetPragma (storage.GetDatabase (), "cache_size"), 500);
+  EXPECT_EQ (GetPragma (storage.GetDatabase (), "synchronous"), 2);
+}
+
+TEST_F (SQLiteStorageTuningTests, DelayedDuringTransaction)
+{
+  Storage storage(filename);
+  storage.SetTuning (catchUp, upToDate);
+  storage.Initialise ();
+
+  storage.BeginTransaction ();
+  storage.SetCurrentGameState (hash, state);
+  storage.SetCatchingUp (true);
+  EXPECT_EQ (GetPragma (storage.GetDatabase (), "synchronous"), 2);
+  storage.CommitTransaction ();
+
+  EXPECT_EQ (GetPragma (storage.GetDatabase (), "synchronous"), 1);
+}
+
+TEST_F (SQLiteStorageTuningTests, CheckpointOnCommit)
+{
+  Storage storage(filename);
+  storage.SetTuning (catchUp, upToDate);
+  storage.Initialise ();
+  storage.SetCatchingUp (true);
+
+  WriteSomeData (storage);
+  EXPECT_GT (GetWalSize (), 0);
+
+  catchUp.CheckpointOnCommit = true;
+  storage.SetTuning (catchUp, upToDate);
+  WriteSomeData (storage);
+  EXPECT_EQ (GetWalSize (), 0);
+}
+
+TEST_F (SQLiteStorageTuningTests, CheckpointBlockedBySnapshot)
+{
+  Storage storage(filename);
+  catchUp.CheckpointOnCommit = true;
+  storage.SetTuning (catchUp, upToDate);
+  storage.Initialise ();
+  storage.SetCatchingUp (true);
+
+  WriteSomeData (storage);
+  auto snapshot = storage.GetSnapshot ();
+  WriteSomeData (storage);
+  EXPECT_GT (GetWalSize (), 0);
+
+  snapshot.reset ();
+  WriteSomeData (storage);
+  EXPECT_EQ (GetWalSize (), 0);
+}
+
 /* ************************************************************************** */
 
 } // anonymous namespace
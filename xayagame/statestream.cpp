@@ -0,0 +1,570 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "statestream.hpp"
+
+#include "jsonwriter.hpp"
+#include "socketutils.hpp"
+
+#include <glog/logging.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <vector>
+
+namespace xaya
+{
+
+namespace
+{
+
+/** Clock used for timing re-arming of wait requests.  */
+using Clock = std::chrono::steady_clock;
+
+/**
+ * Minimum time between parking wait requests on the Game if they completed
+ * without an actual change.  This avoids busy looping if the Game does not
+ * block at all (e.g. before the ZMQ subscriber is running).
+ */
+constexpr auto MIN_REARM_INTERVAL = std::chrono::seconds (1);
+
+/**
+ * Maximum size of unsent data for a client before we disconnect it.
+ */
+constexpr size_t MAX_CLIENT_BUFFER = 16 << 20;
+
+/** Backlog for the listening socket.  */
+constexpr int LISTEN_BACKLOG = 64;
+
+/**
+ * Serialises an event as a single line of compact JSON.
+ */
+std::string
+SerialiseEvent (const Json::Value& event)
+{
+  return CompactJson (event) + "\n";
+}
+
+/**
+ * Extracts the block hash from a state event, or null if there is none.
+ */
+uint256
+EventBlockHash (const Json::Value& event)
+{
+  uint256 res;
+  if (!event["blockhash"].isString ()
+        || !res.FromHex (event["blockhash"].asString ()))
+    res.SetNull ();
+  return res;
+}
+
+} // anonymous namespace
+
+/**
+ * The part of the server state that is accessed from the callbacks of wait
+ * requests on the Game.  They record what happened and wake up the worker
+ * thread through a pipe.
+ */
+class StateStreamServer::Notifier
+{
+
+public:
+
+  /**
+   * The events that may happen.
+   */
+  struct Events
+  {
+
+    /** Set if the worker should stop.  */
+    bool stop = false;
+
+    /** Set if a block wait request has completed.  */
+    bool block = false;
+
+    /** The new block of the completed block request.  */
+    uint256 newBlock;
+
+    /** Set if a pending wait request has completed.  */
+    bool pending = false;
+
+    /** The pending version of the completed pending request.  */
+    int newVersion = 0;
+
+  };
+
+private:
+
+  /** Lock for this instance.  */
+  std::mutex mut;
+
+  /** Read end of the wake-up pipe.  */
+  int wakeRead;
+
+  /** Write end of the wake-up pipe.  */
+  int wakeWrite;
+
+  /** Set to false when callbacks should be ignored.  */
+  bool active = true;
+
+  /** The events that happened since the last call to Take.  */
+  Events events;
+
+  /**
+   * Wakes up the worker thread.  mut must be held.
+   */
+  void
+  Wake ()
+  {
+    const char c = 0;
+    const ssize_t n = write (wakeWrite, &c, 1);
+    /* If the pipe is full, the worker will wake up anyway.  */
+    if (n < 0)
+      CHECK (errno == EAGAIN || errno == EWOULDBLOCK)
+          << "Writing to wake-up pipe failed: " << std::strerror (errno);
+  }
+
+public:
+
+  Notifier ()
+  {
+    int fds[2];
+    CHECK_EQ (pipe (fds), 0)
+        << "Creating pipe failed: " << std::strerror (errno);
+    wakeRead = fds[0];
+    wakeWrite = fds[1];
+    internal::SetNonBlocking (wakeRead);
+    internal::SetNonBlocking (wakeWrite);
+  }
+
+  ~Notifier ()
+  {
+    close (wakeRead);
+    close (wakeWrite);
+  }
+
+  Notifier (const Notifier&) = delete;
+  void operator= (const Notifier&) = delete;
+
+  int
+  GetWakeFd () const
+  {
+    return wakeRead;
+  }
+
+  /**
+   * Reads all pending data from the wake-up pipe.
+   */
+  void
+  Drain ()
+  {
+    char buf[64];
+    while (read (wakeRead, buf, sizeof (buf)) > 0)
+      continue;
+  }
+
+  void
+  BlockChanged (const uint256& newBlock)
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    if (!active)
+      return;
+    events.block = true;
+    events.newBlock = newBlock;
+    Wake ();
+  }
+
+  void
+  PendingChanged (const int version)
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    if (!active)
+      return;
+    events.pending = true;
+    events.newVersion = version;
+    Wake ();
+  }
+
+  /**
+   * Requests the worker to stop and deactivates the callbacks.
+   */
+  void
+  RequestStop ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    active = false;
+    events.stop = true;
+    Wake ();
+  }
+
+  /**
+   * Returns and resets the events that happened.
+   */
+  Events
+  Take ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    Events res = events;
+    events = Events ();
+    events.stop = res.stop;
+    return res;
+  }
+
+};
+
+/**
+ * Data about a connected client.
+ */
+struct StateStreamServer::Client
+{
+
+  /** Data that still needs to be sent.  */
+  std::string buffer;
+
+  /** Set to true if the client should be disconnected.  */
+  bool broken = false;
+
+  /**
+   * Tries to send as much of the buffer as possible without blocking.
+   */
+  void
+  Flush (const int fd)
+  {
+    while (!broken && !buffer.empty ())
+      {
+        const ssize_t n = send (fd, buffer.data (), buffer.size (),
+                                MSG_NOSIGNAL);
+        if (n < 0)
+          {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+              return;
+            if (errno == EINTR)
+              continue;
+            VLOG (1) << "Sending to stream client failed, disconnecting";
+            broken = true;
+            return;
+          }
+        buffer.erase (0, n);
+      }
+  }
+
+};
+
+StateStreamServer::StateStreamServer (const Game& g, const std::string& path,
+                                      const EventDataCallback& cb)
+  : game(g), socketPath(path),
+    eventData(cb != nullptr ? cb : [&g] () { return g.GetNullJsonState (); }),
+    lastPendingVersion(Game::WAITFORCHANGE_ALWAYS_BLOCK)
+{
+  lastBlock.SetNull ();
+}
+
+StateStreamServer::~StateStreamServer ()
+{
+  if (worker != nullptr)
+    Stop ();
+}
+
+void
+StateStreamServer::Start ()
+{
+  CHECK (worker == nullptr) << "State stream server is already running";
+
+  sockaddr_un addr;
+  std::memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  CHECK_LT (socketPath.size (), sizeof (addr.sun_path))
+      << "Socket path is too long: " << socketPath;
+  std::strcpy (addr.sun_path, socketPath.c_str ());
+
+  listenFd = socket (AF_UNIX, SOCK_STREAM, 0);
+  CHECK_GE (listenFd, 0) << "Creating socket failed: " << std::strerror (errno);
+  internal::RemoveStaleSocket (socketPath);
+  CHECK_EQ (bind (listenFd, reinterpret_cast<const sockaddr*> (&addr),
+                  sizeof (addr)), 0)
+      << "Binding to " << socketPath << " failed: " << std::strerror (errno);
+  CHECK_EQ (listen (listenFd, LISTEN_BACKLOG), 0)
+      << "Listening on " << socketPath << " failed: " << std::strerror (errno);
+  internal::SetNonBlocking (listenFd);
+
+  Json::Value event = eventData ();
+  event["type"] = "state";
+  lastStateEvent = SerialiseEvent (event);
+  lastBlock = EventBlockHash (event);
+
+  notifier = std::make_shared<Notifier> ();
+  LOG (INFO) << "Streaming state changes on socket " << socketPath;
+
+  worker = std::make_unique<std::thread> ([this] ()
+    {
+      RunWorker ();
+    });
+}
+
+void
+StateStreamServer::Stop ()
+{
+  CHECK (worker != nullptr) << "State stream server is not running";
+
+  notifier->RequestStop ();
+  worker->join ();
+  worker.reset ();
+
+  /* The notifier may still be referenced by parked requests on the Game,
+     but it has been deactivated so that those do nothing anymore.  */
+  notifier.reset ();
+
+  while (!clients.empty ())
+    CloseClient (clients.begin ()->first);
+
+  close (listenFd);
+  listenFd = -1;
+  unlink (socketPath.c_str ());
+
+  LOG (INFO) << "Stopped state stream on socket " << socketPath;
+}
+
+void
+StateStreamServer::WaitForBlock ()
+{
+  std::shared_ptr<Notifier> n = notifier;
+  game.AsyncWaitForChange (lastBlock, [n] (const uint256& newBlock)
+    {
+      n->BlockChanged (newBlock);
+    });
+}
+
+bool
+StateStreamServer::WaitForPending ()
+{
+  std::shared_ptr<Notifier> n = notifier;
+  try
+    {
+      game.AsyncWaitForPendingVersionChange (lastPendingVersion,
+        [n] (const int version)
+        {
+          n->PendingChanged (version);
+        });
+    }
+  catch (const std::exception& exc)
+    {
+      LOG (INFO)
+          << "Not streaming pending state changes: " << exc.what ();
+      return false;
+    }
+
+  return true;
+}
+
+void
+StateStreamServer::QueueForClient (Client& c, const std::string& data)
+{
+  if (c.buffer.size () + data.size () > MAX_CLIENT_BUFFER)
+    {
+      LOG (WARNING) << "Stream client is too slow, disconnecting";
+      c.broken = true;
+      return;
+    }
+
+  c.buffer += data;
+}
+
+void
+StateStreamServer::Broadcast (const Json::Value& event)
+{
+  const std::string line = SerialiseEvent (event);
+  VLOG (1)
+      << "Sending " << event["type"].asString () << " event to "
+      << clients.size () << " stream clients";
+
+  for (auto& entry : clients)
+    {
+      QueueForClient (*entry.second, line);
+      entry.second->Flush (entry.first);
+    }
+}
+
+void
+StateStreamServer::AcceptClient ()
+{
+  while (true)
+    {
+      const int fd = accept (listenFd, nullptr, nullptr);
+      if (fd < 0)
+        {
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            LOG (WARNING)
+                << "Accepting stream client failed: " << std::strerror (errno);
+          return;
+        }
+
+      internal::SetNonBlocking (fd);
+      auto c = std::make_unique<Client> ();
+      VLOG (1) << "New stream client connected";
+
+      QueueForClient (*c, lastStateEvent);
+      c->Flush (fd);
+      clients.emplace (fd, std::move (c));
+    }
+}
+
+void
+StateStreamServer::CloseClient (const int fd)
+{
+  VLOG (1) << "Closing connection to stream client";
+  close (fd);
+  clients.erase (fd);
+}
+
+void
+StateStreamServer::RunWorker ()
+{
+  bool blockArmed = false;
+  Clock::time_point blockArmTime;
+  Clock::time_point nextBlockArm = Clock::now ();
+
+  bool pendingArmed = false;
+  Clock::time_point pendingArmTime;
+  Clock::time_point nextPendingArm = Clock::now ();
+
+  while (true)
+    {
+      auto now = Clock::now ();
+      if (!blockArmed && now >= nextBlockArm)
+        {
+          blockArmed = true;
+          blockArmTime = now;
+          WaitForBlock ();
+        }
+      if (trackPending && !pendingArmed && now >= nextPendingArm)
+        {
+          pendingArmed = true;
+          pendingArmTime = now;
+          if (!WaitForPending ())
+            {
+              trackPending = false;
+              pendingArmed = false;
+            }
+        }
+
+      /* Determine how long we can sleep until we need to re-arm one of
+         the wait requests.  */
+      int timeout = -1;
+      const auto updateTimeout = [&] (const Clock::time_point next)
+        {
+          using std::chrono::milliseconds;
+          const int ms
+              = std::chrono::duration_cast<milliseconds> (next - now).count ()
+                  + 1;
+          if (timeout < 0 || ms < timeout)
+            timeout = ms;
+        };
+      if (!blockArmed)
+        updateTimeout (nextBlockArm);
+      if (trackPending && !pendingArmed)
+        updateTimeout (nextPendingArm);
+
+      std::vector<pollfd> fds;
+      fds.push_back ({notifier->GetWakeFd (), POLLIN, 0});
+      fds.push_back ({listenFd, POLLIN, 0});
+      for (const auto& entry : clients)
+        {
+          short ev = POLLIN;
+          if (!entry.second->buffer.empty ())
+            ev |= POLLOUT;
+          fds.push_back ({entry.first, ev, 0});
+        }
+
+      if (poll (fds.data (), fds.size (), timeout) < 0)
+        {
+          CHECK_EQ (errno, EINTR) << "poll failed: " << std::strerror (errno);
+          continue;
+        }
+      now = Clock::now ();
+
+      if (fds[0].revents & POLLIN)
+        notifier->Drain ();
+      const Notifier::Events events = notifier->Take ();
+      if (events.stop)
+        return;
+
+      if (events.block)
+        {
+          blockArmed = false;
+          nextBlockArm = now;
+
+          if (events.newBlock != lastBlock)
+            {
+              Json::Value event = eventData ();
+              event["type"] = "state";
+              lastStateEvent = SerialiseEvent (event);
+              lastBlock = EventBlockHash (event);
+              Broadcast (event);
+            }
+          else
+            nextBlockArm = blockArmTime + MIN_REARM_INTERVAL;
+        }
+
+      if (events.pending)
+        {
+          pendingArmed = false;
+          nextPendingArm = now;
+
+          if (events.newVersion != lastPendingVersion)
+            {
+              lastPendingVersion = events.newVersion;
+              Json::Value event(Json::objectValue);
+              event["type"] = "pending";
+              event["version"] = lastPendingVersion;
+              Broadcast (event);
+            }
+          else
+            nextPendingArm = pendingArmTime + MIN_REARM_INTERVAL;
+        }
+
+      if (fds[1].revents & POLLIN)
+        AcceptClient ();
+
+      for (size_t i = 2; i < fds.size (); ++i)
+        {
+          const int fd = fds[i].fd;
+          auto mit = clients.find (fd);
+          if (mit == clients.end ())
+            continue;
+          Client& c = *mit->second;
+
+          if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+              /* Clients are not supposed to send anything, so we just discard
+                 the data and only use this to detect closed connections.  */
+              char buf[256];
+              const ssize_t n = recv (fd, buf, sizeof (buf), 0);
+              if (n == 0
+                    || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+                          && errno != EINTR))
+                c.broken = true;
+            }
+
+          if (fds[i].revents & POLLOUT)
+            c.Flush (fd);
+        }
+
+      std::vector<int> toClose;
+      for (const auto& entry : clients)
+        if (entry.second->broken)
+          toClose.push_back (entry.first);
+      for (const int fd : toClose)
+        CloseClient (fd);
+    }
+}
+
+} // namespace xaya
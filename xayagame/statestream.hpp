@@ -0,0 +1,157 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAGAME_STATESTREAM_HPP
+#define XAYAGAME_STATESTREAM_HPP
+
+#include "defaultmain.hpp"
+#include "game.hpp"
+
+#include <xayautil/uint256.hpp>
+
+#include <json/json.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace xaya
+{
+
+/**
+ * Game component that pushes notifications about state changes to clients
+ * connected through a UNIX domain socket.  This allows frontends to get
+ * updates without polling waitforchange and then requesting the new state
+ * in a second call (which may already be outdated by then).
+ *
+ * The stream consists of JSON objects, each serialised on a single line.
+ * For each new best block, an object with "type" set to "state" is sent,
+ * which contains the data returned by the event-data callback (by default,
+ * Game::GetNullJsonState, i.e. the block hash, height and syncing state).
+ * Games can pass their own callback to include custom data, e.g. using
+ * Game::GetCustomStateData so that it is consistent with the block hash.
+ * If pending moves are tracked, objects with "type" set to "pending" and
+ * the new "version" are sent whenever the pending state changes.
+ *
+ * Each event is serialised only once and then sent to all connected
+ * clients.  When a client connects, it immediately receives the latest
+ * state event.  Clients that do not read their data and fall too far
+ * behind are disconnected.
+ *
+ * Instances can be constructed and returned from
+ * CustomisedInstanceFactory::BuildGameComponents.
+ */
+class StateStreamServer : public GameComponent
+{
+
+public:
+
+  /** Callback that returns the data for a state event.  */
+  using EventDataCallback = std::function<Json::Value ()>;
+
+private:
+
+  class Notifier;
+  struct Client;
+
+  /** The Game instance whose changes we stream.  */
+  const Game& game;
+
+  /** The path of the socket to listen on.  */
+  const std::string socketPath;
+
+  /** Callback to get the data for state events.  */
+  const EventDataCallback eventData;
+
+  /**
+   * State shared with the callbacks of parked wait requests on the Game.
+   * It is reference counted so that callbacks that are invoked after this
+   * instance has been stopped (or destructed) are harmless.
+   */
+  std::shared_ptr<Notifier> notifier;
+
+  /** The listening socket (or -1 if not listening).  */
+  int listenFd = -1;
+
+  /** The connected clients by their socket.  */
+  std::map<int, std::unique_ptr<Client>> clients;
+
+  /** The serialised latest state event (sent to new clients).  */
+  std::string lastStateEvent;
+
+  /** The block hash of the last state event sent.  */
+  uint256 lastBlock;
+
+  /** The pending version of the last pending event sent.  */
+  int lastPendingVersion;
+
+  /** Whether we are tracking the pending state.  */
+  bool trackPending = true;
+
+  /** The thread handling the sockets and sending events.  */
+  std::unique_ptr<std::thread> worker;
+
+  /**
+   * Main function of the worker thread.
+   */
+  void RunWorker ();
+
+  /**
+   * Parks a wait request for a block change on the Game.  The callback
+   * records the result in the notifier and wakes up the worker.
+   */
+  void WaitForBlock ();
+
+  /**
+   * Parks a wait request for a pending change on the Game.  Returns false if
+   * pending moves are not tracked by the Game.
+   */
+  bool WaitForPending ();
+
+  /**
+   * Sends the given event as JSON line to all connected clients.
+   */
+  void Broadcast (const Json::Value& event);
+
+  /**
+   * Queues the given data to be sent to a client.
+   */
+  void QueueForClient (Client& c, const std::string& data);
+
+  /**
+   * Accepts a new client connection on the listening socket.
+   */
+  void AcceptClient ();
+
+  /**
+   * Closes the connection to the client with the given socket.
+   */
+  void CloseClient (int fd);
+
+public:
+
+  /**
+   * Constructs the server for the given game and socket path.  If no
+   * event-data callback is given, the state events contain the result
+   * of Game::GetNullJsonState.
+   */
+  explicit StateStreamServer (const Game& g, const std::string& path,
+                              const EventDataCallback& cb = nullptr);
+
+  ~StateStreamServer ();
+
+  StateStreamServer () = delete;
+  StateStreamServer (const StateStreamServer&) = delete;
+  void operator= (const StateStreamServer&) = delete;
+
+  void Start () override;
+  void Stop () override;
+
+};
+
+} // namespace xaya
+
+#endif // XAYAGAME_STATESTREAM_HPP
@@ -0,0 +1,296 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "statestream.hpp"
+
+#include "game.hpp"
+#include "storage.hpp"
+#include "testutils.hpp"
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace xaya
+{
+namespace
+{
+
+/**
+ * Simple client connection to the stream socket, which reads lines
+ * of JSON with a timeout.
+ */
+class StreamClient
+{
+
+private:
+
+  /** The socket connected to the server.  */
+  int fd;
+
+  /** Data received but not yet returned as line.  */
+  std::string buffer;
+
+public:
+
+  explicit StreamClient (const std::string& path)
+  {
+    sockaddr_un addr;
+    std::memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    std::strcpy (addr.sun_path, path.c_str ());
+
+    fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    CHECK_GE (fd, 0);
+    CHECK_EQ (connect (fd, reinterpret_cast<const sockaddr*> (&addr),
+                       sizeof (addr)), 0);
+  }
+
+  ~StreamClient ()
+  {
+    close (fd);
+  }
+
+  /**
+   * Tries to read the next line within the given timeout.  Returns false
+   * if none was received (or the connection was closed).
+   */
+  bool
+  ReadLine (Json::Value& res, const int timeoutMs)
+  {
+    while (true)
+      {
+        const size_t pos = buffer.find ('\n');
+        if (pos != std::string::npos)
+          {
+            std::istringstream in(buffer.substr (0, pos));
+            buffer.erase (0, pos + 1);
+            in >> res;
+            return true;
+          }
+
+        pollfd pfd = {fd, POLLIN, 0};
+        if (poll (&pfd, 1, timeoutMs) <= 0)
+          return false;
+
+        char buf[1024];
+        const ssize_t n = recv (fd, buf, sizeof (buf), 0);
+        if (n <= 0)
+          return false;
+        buffer.append (buf, n);
+      }
+  }
+
+  /**
+   * Returns true if the server has closed the connection.
+   */
+  bool
+  IsClosed ()
+  {
+    pollfd pfd = {fd, POLLIN, 0};
+    if (poll (&pfd, 1, 1000) <= 0)
+      return false;
+
+    char buf[1024];
+    return recv (fd, buf, sizeof (buf), 0) == 0;
+  }
+
+};
+
+class StateStreamTests : public testing::Test
+{
+
+protected:
+
+  /** Timeout (in ms) used for reading events that we expect.  */
+  static constexpr int EVENT_TIMEOUT = 5000;
+
+  Game game;
+  MemoryStorage storage;
+
+  /** The path of the socket for the test.  */
+  const std::string path;
+
+  /** Custom data added to the events.  */
+  std::string customData;
+
+  StateStreamTests ()
+    : game("game"), path(testing::TempDir () + "statestream.sock")
+  {
+    game.SetStorage (storage);
+  }
+
+  /**
+   * Constructs the server with a callback that does not need the RPC
+   * connection to look up block heights.
+   */
+  std::unique_ptr<StateStreamServer>
+  CreateServer ()
+  {
+    return std::make_unique<StateStreamServer> (game, path, [this] ()
+      {
+        Json::Value res(Json::objectValue);
+        uint256 hash;
+        if (storage.GetCurrentBlockHash (hash))
+          res["blockhash"] = hash.ToHex ();
+        res["data"] = customData;
+        return res;
+      });
+  }
+
+  /**
+   * Updates the current state in the storage.
+   */
+  void
+  SetState (const uint256& hash)
+  {
+    storage.BeginTransaction ();
+    storage.SetCurrentGameState (hash, "state");
+    storage.CommitTransaction ();
+  }
+
+};
+
+TEST_F (StateStreamTests, InitialEvent)
+{
+  SetState (BlockHash (10));
+  customData = "foo";
+
+  auto server = CreateServer ();
+  server->Start ();
+
+  StreamClient client(path);
+  Json::Value event;
+  ASSERT_TRUE (client.ReadLine (event, EVENT_TIMEOUT));
+  EXPECT_EQ (event["type"], "state");
+  EXPECT_EQ (event["blockhash"], BlockHash (10).ToHex ());
+  EXPECT_EQ (event["data"], "foo");
+
+  server->Stop ();
+}
+
+TEST_F (StateStreamTests, PushesChanges)
+{
+  SetState (BlockHash (10));
+  auto server = CreateServer ();
+  server->Start ();
+
+  StreamClient client1(path);
+  StreamClient client2(path);
+  Json::Value event;
+  ASSERT_TRUE (client1.ReadLine (event, EVENT_TIMEOUT));
+  ASSERT_TRUE (client2.ReadLine (event, EVENT_TIMEOUT));
+
+  customData = "bar";
+  SetState (BlockHash (11));
+
+  for (auto* c : {&client1, &client2})
+    {
+      ASSERT_TRUE (c->ReadLine (event, EVENT_TIMEOUT));
+      EXPECT_EQ (event["type"], "state");
+      EXPECT_EQ (event["blockhash"], BlockHash (11).ToHex ());
+      EXPECT_EQ (event["data"], "bar");
+    }
+
+  /* Nothing is sent if the block does not change.  */
+  EXPECT_FALSE (client1.ReadLine (event, 2500));
+
+  /* New clients get the latest event.  */
+  StreamClient client3(path);
+  ASSERT_TRUE (client3.ReadLine (event, EVENT_TIMEOUT));
+  EXPECT_EQ (event["blockhash"], BlockHash (11).ToHex ());
+
+  server->Stop ();
+}
+
+TEST_F (StateStreamTests, StopClosesConnections)
+{
+  auto server = CreateServer ();
+  server->Start ();
+
+  StreamClient client(path);
+  Json::Value event;
+  ASSERT_TRUE (client.ReadLine (event, EVENT_TIMEOUT));
+  EXPECT_FALSE (event.isMember ("blockhash"));
+
+  server->Stop ();
+  EXPECT_TRUE (client.IsClosed ());
+}
+
+TEST_F (StateStreamTests, ClientDisconnects)
+{
+  auto server = CreateServer ();
+  server->Start ();
+
+  {
+    StreamClient client(path);
+    Json::Value event;
+    ASSERT_TRUE (client.ReadLine (event, EVENT_TIMEOUT));
+  }
+
+  /* The server should handle the closed connection gracefully and still
+     send events to other clients.  */
+  StreamClient client(path);
+  Json::Value event;
+  ASSERT_TRUE (client.ReadLine (event, EVENT_TIMEOUT));
+
+  SetState (BlockHash (42));
+  ASSERT_TRUE (client.ReadLine (event, EVENT_TIMEOUT));
+  EXPECT_EQ (event["blockhash"], BlockHash (42).ToHex ());
+
+  server->Stop ();
+}
+
+TEST_F (StateStreamTests, ReplacesStaleSocket)
+{
+  for (int i = 0; i < 2; ++i)
+    {
+      /* Simulate an unclean shutdown by not removing the socket file
+         through Stop.  */
+      auto server = CreateServer ();
+      server->Start ();
+      StreamClient client(path);
+      Json::Value event;
+      ASSERT_TRUE (client.ReadLine (event, EVENT_TIMEOUT));
+      server->Stop ();
+
+      const int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+      sockaddr_un addr;
+      std::memset (&addr, 0, sizeof (addr));
+      addr.sun_family = AF_UNIX;
+      std::strcpy (addr.sun_path, path.c_str ());
+      ASSERT_EQ (bind (fd, reinterpret_cast<const sockaddr*> (&addr),
+                       sizeof (addr)), 0);
+      close (fd);
+    }
+
+  unlink (path.c_str ());
+}
+
+TEST_F (StateStreamTests, KeepsNonSocketFile)
+{
+  {
+    std::ofstream out(path);
+    out << "foo";
+  }
+
+  auto server = CreateServer ();
+  EXPECT_DEATH (server->Start (), "Binding");
+  EXPECT_EQ (access (path.c_str (), F_OK), 0);
+
+  unlink (path.c_str ());
+}
+
+} // anonymous namespace
+} // namespace xaya
@@ -1,20 +1,82 @@
-// Copyright (C) 2018 The Xaya developers
+// Copyright (C) 2018-2020 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "storage.hpp"
 
+#include "undolog.hpp"
+
 #include <glog/logging.h>
 
+#include <experimental/filesystem>
+
+#include <cstdlib>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
 namespace xaya
 {
 
+namespace fs = std::experimental::filesystem;
+
+namespace
+{
+
+/** Prefix for the names of temporary directories with spilled undo data.  */
+constexpr const char* SPILL_DIR_PREFIX = "xayagame-undo-";
+
+/** Name of the lock file inside a spill directory.  */
+constexpr const char* SPILL_LOCK_FILE = "lock";
+
+/**
+ * Removes spill directories inside the given base directory that have been
+ * left behind by processes that crashed.  Directories that are still in use
+ * have their lock file locked.
+ */
+void
+RemoveStaleSpillDirs (const fs::path& base)
+{
+  const std::string prefix(SPILL_DIR_PREFIX);
+
+  std::error_code ec;
+  for (const auto& entry : fs::directory_iterator (base, ec))
+    {
+      const std::string name = entry.path ().filename ().string ();
+      if (name.compare (0, prefix.size (), prefix) != 0)
+        continue;
+
+      const fs::path lockFile = entry.path () / fs::path (SPILL_LOCK_FILE);
+      const int fd = open (lockFile.c_str (), O_RDWR | O_CLOEXEC);
+      if (fd < 0)
+        continue;
+
+      if (flock (fd, LOCK_EX | LOCK_NB) == 0)
+        {
+          LOG (INFO) << "Removing stale spilled undo data in " << entry.path ();
+          fs::remove_all (entry.path (), ec);
+        }
+      close (fd);
+    }
+}
+
+} // anonymous namespace
+
 void
 StorageInterface::Initialise ()
 {
   /* Nothing is done here, but can be overridden by subclasses.  */
 }
 
+bool
+StorageInterface::GetUndoStats (UndoStats& stats) const
+{
+  return false;
+}
+
 void
 StorageInterface::BeginTransaction ()
 {
@@ -33,6 +95,100 @@ StorageInterface::RollbackTransaction ()
   /* Nothing is done in the default implementation.  */
 }
 
+MemoryStorage::MemoryStorage () = default;
+
+MemoryStorage::~MemoryStorage ()
+{
+  if (spilled == nullptr)
+    return;
+
+  spilled.reset ();
+  LOG (INFO) << "Removing spilled undo data in " << spillDir;
+  fs::remove_all (spillDir);
+  close (spillLockFd);
+}
+
+void
+MemoryStorage::SetUndoMemoryBudget (const uint64_t bytes,
+                                    const std::string& dir)
+{
+  CHECK (undoData.empty ()) << "Undo budget must be set before adding data";
+  CHECK (spilled == nullptr) << "Undo budget has already been set";
+  CHECK_GT (bytes, 0);
+
+  undoBudget = bytes;
+
+  const fs::path base
+      = dir.empty () ? fs::temp_directory_path () : fs::path (dir);
+  RemoveStaleSpillDirs (base);
+
+  std::string tmpl = (base / (SPILL_DIR_PREFIX + std::string ("XXXXXX")))
+                        .string ();
+  std::vector<char> buf(tmpl.begin (), tmpl.end ());
+  buf.push_back ('\0');
+  PCHECK (mkdtemp (buf.data ()) != nullptr)
+      << "Failed to create temporary directory in " << base;
+  spillDir = buf.data ();
+
+  const fs::path lockFile = fs::path (spillDir) / fs::path (SPILL_LOCK_FILE);
+  spillLockFd = open (lockFile.c_str (), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  PCHECK (spillLockFd >= 0) << "Failed to create " << lockFile;
+  PCHECK (flock (spillLockFd, LOCK_EX | LOCK_NB) == 0)
+      << "Failed to lock " << lockFile;
+
+  LOG (INFO)
+      << "Keeping at most " << bytes << " bytes of undo data in memory,"
+      << " spilling to " << spillDir;
+  spilled = std::make_unique<UndoLog> (spillDir);
+}
+
+bool
+MemoryStorage::GetUndoStats (UndoStats& stats) const
+{
+  if (spilled == nullptr)
+    return false;
+
+  stats.memoryEntries = undoData.size ();
+  stats.memoryBytes = undoBytes;
+  stats.diskEntries = spilled->GetNumEntries ();
+  stats.diskBytes = spilled->GetLiveBytes ();
+
+  return true;
+}
+
+MemoryStorage::UndoMap::iterator
+MemoryStorage::EraseUndo (const UndoMap::const_iterator it)
+{
+  undoByHeight.erase (std::make_pair (it->second.height, it->first));
+  undoBytes -= it->second.data.size ();
+  return undoData.erase (it);
+}
+
+void
+MemoryStorage::SpillUndoData ()
+{
+  if (undoBudget == 0 || undoBytes <= undoBudget)
+    return;
+
+  unsigned num = 0;
+  while (undoBytes > undoBudget)
+    {
+      CHECK (!undoByHeight.empty ());
+      const auto mit = undoData.find (undoByHeight.begin ()->second);
+      CHECK (mit != undoData.end ());
+
+      spilled->Push (mit->first, mit->second.height, mit->second.data);
+      EraseUndo (mit);
+      ++num;
+    }
+
+  VLOG (1)
+      << "Spilled " << num << " undo entries to disk, now "
+      << undoData.size () << " in memory (" << undoBytes << " bytes) and "
+      << spilled->GetNumEntries () << " on disk ("
+      << spilled->GetLiveBytes () << " bytes)";
+}
+
 void
 MemoryStorage::Clear ()
 {
@@ -40,6 +196,11 @@ MemoryStorage::Clear ()
 
   hasState = false;
   undoData.clear ();
+  undoByHeight.clear ();
+  undoBytes = 0;
+
+  if (spilled != nullptr)
+    spilled->Clear ();
 }
 
 bool
@@ -74,11 +235,16 @@ bool
 MemoryStorage::GetUndoData (const uint256& hash, UndoData& data) const
 {
   const auto mit = undoData.find (hash);
-  if (mit == undoData.end ())
-    return false;
+  if (mit != undoData.end ())
+    {
+      data = mit->second.data;
+      return true;
+    }
 
-  data = mit->second.data;
-  return true;
+  if (spilled != nullptr)
+    return spilled->Get (hash, data);
+
+  return false;
 }
 
 void
@@ -87,15 +253,28 @@ MemoryStorage::AddUndoData (const uint256& hash,
 {
   CHECK (startedTxn);
 
+  if (undoData.count (hash) > 0
+        || (spilled != nullptr && spilled->Has (hash)))
+    return;
+
   HeightAndUndoData heightAndData = {height, data};
   undoData.emplace (hash, std::move (heightAndData));
+  undoByHeight.emplace (height, hash);
+  undoBytes += data.size ();
+
+  SpillUndoData ();
 }
 
 void
 MemoryStorage::ReleaseUndoData (const uint256& hash)
 {
   CHECK (startedTxn);
-  undoData.erase (hash);
+
+  const auto mit = undoData.find (hash);
+  if (mit != undoData.end ())
+    EraseUndo (mit);
+  else if (spilled != nullptr)
+    spilled->Release (hash);
 }
 
 void
@@ -105,9 +284,12 @@ MemoryStorage::PruneUndoData (const unsigned height)
 
   for (auto it = undoData.cbegin (); it != undoData.cend (); )
     if (it->second.height <= height)
-      it = undoData.erase (it);
+      it = EraseUndo (it);
     else
       ++it;
+
+  if (spilled != nullptr)
+    spilled->Prune (height);
 }
 
 void
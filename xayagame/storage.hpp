@@ -1,4 +1,4 @@
-// Copyright (C) 2018-2019 The Xaya developers
+// Copyright (C) 2018-2020 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
@@ -7,9 +7,14 @@
 
 #include <xayautil/uint256.hpp>
 
+#include <cstddef>
+#include <cstdint>
 #include <map>
+#include <memory>
+#include <set>
 #include <stdexcept>
 #include <string>
+#include <utility>
 
 namespace xaya
 {
@@ -118,6 +123,45 @@ public:
        future (because the blocks involved have many confirmations).  */
   }
 
+  /**
+   * Statistics about the undo data held by a storage.
+   */
+  struct UndoStats
+  {
+
+    /** Number of undo entries held in memory.  */
+    size_t memoryEntries = 0;
+
+    /** Total size of undo data held in memory.  */
+    uint64_t memoryBytes = 0;
+
+    /** Number of undo entries kept on disk.  */
+    size_t diskEntries = 0;
+
+    /** Total size of undo data kept on disk.  */
+    uint64_t diskBytes = 0;
+
+  };
+
+  /**
+   * Retrieves statistics about the undo data held by the storage, for
+   * implementations that keep track of them.  Returns false if there are
+   * no statistics, which is what the default implementation does.
+   */
+  virtual bool GetUndoStats (UndoStats& stats) const;
+
+  /**
+   * Informs the storage whether the game is currently catching up
+   * (i.e. processing lots of blocks in batched transactions) or is
+   * up-to-date with the tip of the chain.  Implementations can use this
+   * hint to tune themselves accordingly.
+   */
+  virtual void
+  SetCatchingUp (const bool val)
+  {
+    /* Do nothing by default.  */
+  }
+
   /**
    * Tells the storage that a change to the state is about to be made
    * (because a new block is being attached or detached).
@@ -175,6 +219,8 @@ public:
 
 };
 
+class UndoLog;
+
 /**
  * An implementation of the StorageInterface that holds all data just in
  * memory.  This means that it has to resync on every restart, but may be
@@ -182,6 +228,13 @@ public:
  *
  * Besides needing to sync from scratch on every restart, this is actually
  * a fully functional implementation.
+ *
+ * Optionally, a memory budget for undo data can be set.  In that case, the
+ * undo data of the oldest blocks is spilled to a temporary UndoLog on disk
+ * (read through memory maps) whenever the in-memory undo data exceeds the
+ * budget.  This keeps the undo data of recent blocks (which is the one
+ * likely needed for reorgs) in memory, while bounding memory usage for
+ * long-running processes without pruning.
  */
 class MemoryStorage : public StorageInterface
 {
@@ -211,6 +264,43 @@ private:
   /** Undo data associated to block hashes we know about.  */
   UndoMap undoData;
 
+  /**
+   * Heights and hashes of the undo entries in memory, ordered so that
+   * the oldest blocks (which are spilled first) come first.
+   */
+  std::set<std::pair<unsigned, uint256>> undoByHeight;
+
+  /** Total size of all undo data held in memory.  */
+  uint64_t undoBytes = 0;
+
+  /** Maximum size of undo data held in memory, or zero for no limit.  */
+  uint64_t undoBudget = 0;
+
+  /** Temporary directory for spilled undo data (if a budget is set).  */
+  std::string spillDir;
+
+  /**
+   * File descriptor of the lock file in spillDir.  It is locked for as long
+   * as the directory is in use, so that stale directories of crashed
+   * processes can be told apart from those of running ones.
+   */
+  int spillLockFd = -1;
+
+  /** Undo log holding spilled undo data.  */
+  std::unique_ptr<UndoLog> spilled;
+
+  /**
+   * Removes the in-memory undo data pointed to by the iterator, updating
+   * all related bookkeeping.
+   */
+  UndoMap::iterator EraseUndo (UndoMap::const_iterator it);
+
+  /**
+   * Spills the oldest undo entries to disk until memory usage is within
+   * the budget again.
+   */
+  void SpillUndoData ();
+
   /**
    * Whether or not a transaction has currently been started.  The storage
    * itself does not support transaction rollbacks, but it keeps track of
@@ -222,11 +312,40 @@ private:
 
 public:
 
-  MemoryStorage () = default;
+  MemoryStorage ();
   MemoryStorage (const MemoryStorage&) = delete;
 
   void operator= (const MemoryStorage&) = delete;
 
+  ~MemoryStorage ();
+
+  /**
+   * Limits the size of undo data kept in memory to the given number
+   * of bytes.  Older undo data is spilled to a temporary directory created
+   * inside the given base directory (or the system's temporary directory
+   * if it is empty), which is removed again when the storage is destructed.
+   * Temporary directories left behind in the base directory by processes
+   * that crashed are removed here as well.
+   *
+   * This must be called before any undo data is added.
+   */
+  void SetUndoMemoryBudget (uint64_t bytes, const std::string& dir = "");
+
+  /**
+   * Returns true if a memory budget for undo data has been set.
+   */
+  bool
+  HasUndoMemoryBudget () const
+  {
+    return undoBudget > 0;
+  }
+
+  /**
+   * Returns statistics about the undo data held in memory and spilled
+   * to disk, if a memory budget has been set.
+   */
+  bool GetUndoStats (UndoStats& stats) const override;
+
   void Clear () override;
 
   bool GetCurrentBlockHash (uint256& hash) const override;
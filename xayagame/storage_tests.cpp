@@ -1,16 +1,204 @@
-// Copyright (C) 2018 The Xaya developers
+// Copyright (C) 2018-2020 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "storage_tests.hpp"
 
+#include <xayautil/uint256.hpp>
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <experimental/filesystem>
+
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
 namespace xaya
 {
 namespace
 {
 
+namespace fs = std::experimental::filesystem;
+
 INSTANTIATE_TYPED_TEST_CASE_P (Memory, BasicStorageTests, MemoryStorage);
 INSTANTIATE_TYPED_TEST_CASE_P (Memory, PruningStorageTests, MemoryStorage);
 
+/**
+ * MemoryStorage with a tiny undo budget, so that basically all undo data
+ * gets spilled to disk.
+ */
+class SpillingMemoryStorage : public MemoryStorage
+{
+
+public:
+
+  SpillingMemoryStorage ()
+  {
+    SetUndoMemoryBudget (1);
+  }
+
+};
+
+INSTANTIATE_TYPED_TEST_CASE_P (SpillingMemory, BasicStorageTests,
+                               SpillingMemoryStorage);
+INSTANTIATE_TYPED_TEST_CASE_P (SpillingMemory, PruningStorageTests,
+                               SpillingMemoryStorage);
+
+class MemoryStorageSpillTests : public testing::Test
+{
+
+protected:
+
+  MemoryStorage storage;
+
+  /** Block hashes for use in the tests.  */
+  uint256 hash[4];
+
+  MemoryStorageSpillTests ()
+  {
+    for (unsigned i = 0; i < 4; ++i)
+      CHECK (hash[i].FromHex ("0" + std::to_string (i + 1)
+                                + std::string (62, '0')));
+
+    storage.SetUndoMemoryBudget (10);
+  }
+
+  /**
+   * Expects the given undo stats.
+   */
+  void
+  ExpectStats (const size_t memEntries, const uint64_t memBytes,
+               const size_t spilledEntries, const uint64_t spilledBytes)
+  {
+    StorageInterface::UndoStats stats;
+    ASSERT_TRUE (storage.GetUndoStats (stats));
+    EXPECT_EQ (stats.memoryEntries, memEntries);
+    EXPECT_EQ (stats.memoryBytes, memBytes);
+    EXPECT_EQ (stats.diskEntries, spilledEntries);
+    EXPECT_EQ (stats.diskBytes, spilledBytes);
+  }
+
+};
+
+TEST_F (MemoryStorageSpillTests, KeepsTipInMemory)
+{
+  storage.BeginTransaction ();
+  storage.AddUndoData (hash[0], 10, "aaaa");
+  storage.AddUndoData (hash[1], 11, "bbbb");
+  ExpectStats (2, 8, 0, 0);
+
+  storage.AddUndoData (hash[2], 12, "cccc");
+  ExpectStats (2, 8, 1, 4);
+
+  storage.AddUndoData (hash[3], 13, "dddd");
+  ExpectStats (2, 8, 2, 8);
+  storage.CommitTransaction ();
+
+  UndoData undo;
+  ASSERT_TRUE (storage.GetUndoData (hash[0], undo));
+  EXPECT_EQ (undo, "aaaa");
+  ASSERT_TRUE (storage.GetUndoData (hash[3], undo));
+  EXPECT_EQ (undo, "dddd");
+}
+
+TEST_F (MemoryStorageSpillTests, ReleaseAndPrune)
+{
+  storage.BeginTransaction ();
+  storage.AddUndoData (hash[0], 10, "aaaa");
+  storage.AddUndoData (hash[1], 11, "bbbb");
+  storage.AddUndoData (hash[2], 12, "cccc");
+  storage.AddUndoData (hash[3], 13, "dddd");
+
+  storage.ReleaseUndoData (hash[3]);
+  storage.ReleaseUndoData (hash[0]);
+  ExpectStats (1, 4, 1, 4);
+
+  storage.PruneUndoData (12);
+  ExpectStats (0, 0, 0, 0);
+  storage.CommitTransaction ();
+
+  UndoData undo;
+  for (const auto& h : hash)
+    EXPECT_FALSE (storage.GetUndoData (h, undo));
+}
+
+TEST_F (MemoryStorageSpillTests, DuplicateOfSpilledEntry)
+{
+  storage.BeginTransaction ();
+  storage.AddUndoData (hash[0], 10, "aaaa");
+  storage.AddUndoData (hash[1], 11, "bbbb");
+  storage.AddUndoData (hash[2], 12, "cccc");
+  storage.AddUndoData (hash[0], 10, "aaaa");
+  ExpectStats (2, 8, 1, 4);
+
+  storage.ReleaseUndoData (hash[0]);
+  storage.CommitTransaction ();
+
+  UndoData undo;
+  EXPECT_FALSE (storage.GetUndoData (hash[0], undo));
+}
+
+TEST_F (MemoryStorageSpillTests, Clear)
+{
+  storage.BeginTransaction ();
+  storage.AddUndoData (hash[0], 10, "aaaa");
+  storage.AddUndoData (hash[1], 11, "bbbb");
+  storage.AddUndoData (hash[2], 12, "cccc");
+  storage.CommitTransaction ();
+
+  storage.Clear ();
+  ExpectStats (0, 0, 0, 0);
+
+  UndoData undo;
+  EXPECT_FALSE (storage.GetUndoData (hash[0], undo));
+}
+
+TEST_F (MemoryStorageSpillTests, NoStatsWithoutBudget)
+{
+  MemoryStorage other;
+  StorageInterface::UndoStats stats;
+  EXPECT_FALSE (other.GetUndoStats (stats));
+}
+
+TEST (MemoryStorageSpillDirTests, RemovesStaleDirectories)
+{
+  std::string tmpl = (fs::temp_directory_path () / "spilltest-XXXXXX")
+                        .string ();
+  std::vector<char> buf(tmpl.begin (), tmpl.end ());
+  buf.push_back ('\0');
+  ASSERT_NE (mkdtemp (buf.data ()), nullptr);
+  const fs::path base(buf.data ());
+
+  /* A directory left behind by a crashed process has an unlocked lock file.
+     Unrelated directories without lock file are kept.  */
+  const fs::path stale = base / "xayagame-undo-stale";
+  ASSERT_TRUE (fs::create_directories (stale));
+  std::ofstream (stale / "lock").close ();
+  const fs::path other = base / "xayagame-undo-other";
+  ASSERT_TRUE (fs::create_directories (other));
+
+  {
+    MemoryStorage running;
+    running.SetUndoMemoryBudget (10, base.string ());
+    EXPECT_FALSE (fs::exists (stale));
+    EXPECT_TRUE (fs::exists (other));
+
+    /* The directory of the running instance is locked and kept.  */
+    MemoryStorage second;
+    second.SetUndoMemoryBudget (10, base.string ());
+    EXPECT_EQ (std::distance (fs::directory_iterator (base),
+                              fs::directory_iterator ()), 3);
+  }
+
+  EXPECT_EQ (std::distance (fs::directory_iterator (base),
+                            fs::directory_iterator ()), 1);
+  fs::remove_all (base);
+}
+
 } // anonymous namespace
 } // namespace xaya
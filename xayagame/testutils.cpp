@@ -4,6 +4,8 @@
 
 #include "testutils.hpp"
 
+#include "signatures.hpp"
+
 #include <glog/logging.h>
 
 #include <chrono>
@@ -59,6 +61,10 @@ MockXayaRpcServer::MockXayaRpcServer (jsonrpc::AbstractServerConnector& conn)
   EXPECT_CALL (*this, verifymessage (_, _, _)).Times (0);
   EXPECT_CALL (*this, getrawmempool ()).Times (0);
   EXPECT_CALL (*this, name_pending ()).Times (0);
+
+  /* Cached signature verifications (and what was learnt about verifying
+     them locally) from earlier mock servers must not leak into this one.  */
+  ResetMessageVerification ();
 }
 
 MockXayaWalletRpcServer::MockXayaWalletRpcServer (
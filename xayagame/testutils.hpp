@@ -72,7 +72,9 @@ public:
    * listening yet.
    *
    * This also sets the mock expectations to no calls at all, so that
-   * tests can explicitly specify the calls they want.
+   * tests can explicitly specify the calls they want.  It also resets
+   * the process-wide state of VerifyMessage, so that no cached results
+   * from a previous test are used.
    */
   explicit MockXayaRpcServer (jsonrpc::AbstractServerConnector& conn);
 
@@ -0,0 +1,909 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "undolog.hpp"
+
+#include <glog/logging.h>
+
+#include <experimental/filesystem>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace xaya
+{
+
+namespace fs = std::experimental::filesystem;
+
+namespace
+{
+
+/** Prefix of segment file names.  */
+constexpr const char* SEGMENT_PREFIX = "undo-";
+/** Suffix of segment file names.  */
+constexpr const char* SEGMENT_SUFFIX = ".log";
+/** File name of the prune mark.  */
+constexpr const char* PRUNE_MARK_FILE = "prune.mark";
+
+/**
+ * Size of the prune mark.  It consists of the height (four bytes), the
+ * segment number (eight bytes) and the size in that segment (eight bytes),
+ * all in little endian.
+ */
+constexpr size_t PRUNE_MARK_SIZE = 4 + 8 + 8;
+
+/**
+ * Size of the header of each record.  It consists of the data length
+ * and block height (each as four bytes in little endian) and the block hash.
+ */
+constexpr size_t HEADER_SIZE = 4 + 4 + uint256::NUM_BYTES;
+
+/**
+ * Value of the length field that marks a release tombstone.  Those records
+ * have no data, and refer to the hash in their header.
+ */
+constexpr uint32_t RELEASE_MARKER = 0xFFFFFFFF;
+
+/**
+ * Value of the length field that marks a prune tombstone.  Those records
+ * have no data, and refer to the height in their header.
+ */
+constexpr uint32_t PRUNE_MARKER = 0xFFFFFFFE;
+
+/**
+ * Encodes a 32-bit number as little-endian bytes into the buffer.
+ */
+void
+EncodeUint32 (const uint32_t val, unsigned char* out)
+{
+  for (unsigned i = 0; i < 4; ++i)
+    out[i] = (val >> (8 * i)) & 0xFF;
+}
+
+/**
+ * Decodes a little-endian 32-bit number from the buffer.
+ */
+uint32_t
+DecodeUint32 (const unsigned char* in)
+{
+  uint32_t res = 0;
+  for (unsigned i = 0; i < 4; ++i)
+    res |= static_cast<uint32_t> (in[i]) << (8 * i);
+  return res;
+}
+
+/**
+ * Encodes a 64-bit number as little-endian bytes into the buffer.
+ */
+void
+EncodeUint64 (const uint64_t val, unsigned char* out)
+{
+  EncodeUint32 (val & 0xFFFFFFFF, out);
+  EncodeUint32 (val >> 32, out + 4);
+}
+
+/**
+ * Decodes a little-endian 64-bit number from the buffer.
+ */
+uint64_t
+DecodeUint64 (const unsigned char* in)
+{
+  return DecodeUint32 (in)
+            | (static_cast<uint64_t> (DecodeUint32 (in + 4)) << 32);
+}
+
+/**
+ * Calls fsync on the given directory, so that file creations and removals
+ * inside of it are durable.
+ */
+void
+SyncDirectory (const std::string& dir)
+{
+  const int fd = open (dir.c_str (), O_RDONLY | O_DIRECTORY);
+  PCHECK (fd >= 0) << "Failed to open directory " << dir;
+  PCHECK (fsync (fd) == 0) << "Failed to sync directory " << dir;
+  close (fd);
+}
+
+} // anonymous namespace
+
+/* ************************************************************************** */
+
+/**
+ * A single segment file of the undo log.  The file is written through the
+ * file descriptor, and read through a read-only memory map that is extended
+ * as needed when the file grows.
+ */
+class UndoLog::Segment
+{
+
+private:
+
+  /** The file name.  */
+  const std::string file;
+
+  /** The file descriptor.  */
+  int fd;
+
+  /** The currently mapped region, if any.  */
+  void* map = nullptr;
+
+  /** Size of the mapped region.  */
+  size_t mapSize = 0;
+
+  /**
+   * Removes the memory map, if there is one.
+   */
+  void
+  Unmap ()
+  {
+    if (map == nullptr)
+      return;
+
+    PCHECK (munmap (map, mapSize) == 0) << "Failed to unmap " << file;
+    map = nullptr;
+    mapSize = 0;
+  }
+
+public:
+
+  /** The number of this segment.  */
+  const uint64_t num;
+
+  /** Current size of the file.  */
+  size_t size;
+
+  /** The entries in this segment, ordered from oldest to newest.  */
+  std::vector<Entry> entries;
+
+  /** Number of entries that are still live.  */
+  size_t numLive = 0;
+
+  explicit Segment (const std::string& f, const uint64_t n)
+    : file(f), num(n)
+  {
+    fd = open (file.c_str (), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    PCHECK (fd >= 0) << "Failed to open undo-log segment " << file;
+
+    struct stat st;
+    PCHECK (fstat (fd, &st) == 0) << "Failed to stat " << file;
+    size = st.st_size;
+  }
+
+  ~Segment ()
+  {
+    Unmap ();
+    if (fd >= 0)
+      close (fd);
+  }
+
+  Segment () = delete;
+  Segment (const Segment&) = delete;
+  void operator= (const Segment&) = delete;
+
+  const std::string&
+  GetFile () const
+  {
+    return file;
+  }
+
+  /**
+   * Returns a pointer to the given range of the file's data, which must
+   * be within the current size.  The pointer remains valid until the
+   * next call to Truncate.
+   */
+  const unsigned char*
+  Read (const size_t offset, const size_t len)
+  {
+    CHECK_LE (offset + len, size);
+    if (len == 0)
+      return nullptr;
+
+    if (offset + len > mapSize)
+      {
+        Unmap ();
+        map = mmap (nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        PCHECK (map != MAP_FAILED) << "Failed to mmap " << file;
+        mapSize = size;
+      }
+
+    return static_cast<const unsigned char*> (map) + offset;
+  }
+
+  /**
+   * Appends the given bytes to the file.
+   */
+  void
+  Append (const unsigned char* data, const size_t len)
+  {
+    size_t written = 0;
+    while (written < len)
+      {
+        const ssize_t n = pwrite (fd, data + written, len - written,
+                                  size + written);
+        PCHECK (n > 0) << "Failed to write to " << file;
+        written += n;
+      }
+    size += len;
+  }
+
+  /**
+   * Truncates the file to the given size.
+   */
+  void
+  Truncate (const size_t newSize)
+  {
+    CHECK_LE (newSize, size);
+
+    /* Accessing mapped pages beyond the end of the file results in SIGBUS,
+       so make sure to drop the mapping if it extends too far.  */
+    if (mapSize > newSize)
+      Unmap ();
+
+    PCHECK (ftruncate (fd, newSize) == 0) << "Failed to truncate " << file;
+    size = newSize;
+  }
+
+  /**
+   * Syncs the file data to disk.
+   */
+  void
+  Sync ()
+  {
+    PCHECK (fdatasync (fd) == 0) << "Failed to sync " << file;
+  }
+
+};
+
+/* ************************************************************************** */
+
+UndoLog::UndoLog (const std::string& dir, const size_t segSize)
+  : directory(dir), maxSegmentSize(segSize)
+{
+  CHECK (fs::is_directory (directory))
+      << "Undo-log directory does not exist: " << directory;
+
+  const std::string prefix(SEGMENT_PREFIX);
+  const std::string suffix(SEGMENT_SUFFIX);
+
+  std::vector<uint64_t> nums;
+  for (const auto& f : fs::directory_iterator (directory))
+    {
+      const std::string name = f.path ().filename ().string ();
+      if (name.size () <= prefix.size () + suffix.size ()
+            || name.compare (0, prefix.size (), prefix) != 0
+            || name.compare (name.size () - suffix.size (), suffix.size (),
+                             suffix) != 0)
+        continue;
+
+      const std::string numStr
+          = name.substr (prefix.size (),
+                         name.size () - prefix.size () - suffix.size ());
+      nums.push_back (std::stoull (numStr));
+    }
+  std::sort (nums.begin (), nums.end ());
+
+  if (nums.empty ())
+    nums.push_back (0);
+
+  for (const auto n : nums)
+    {
+      Segment& seg = OpenSegment (n);
+
+      size_t offset = 0;
+      while (offset + HEADER_SIZE <= seg.size)
+        {
+          const unsigned char* header = seg.Read (offset, HEADER_SIZE);
+          const uint32_t lenField = DecodeUint32 (header);
+
+          Entry e;
+          e.height = DecodeUint32 (header + 4);
+          e.hash.FromBlob (header + 8);
+          e.offset = offset;
+          e.size = 0;
+          e.live = false;
+          switch (lenField)
+            {
+            case RELEASE_MARKER:
+              e.type = Entry::Type::RELEASE;
+              break;
+            case PRUNE_MARKER:
+              e.type = Entry::Type::PRUNE;
+              break;
+            default:
+              e.type = Entry::Type::DATA;
+              e.size = lenField;
+              break;
+            }
+
+          if (offset + HEADER_SIZE + e.size > seg.size)
+            break;
+
+          switch (e.type)
+            {
+            case Entry::Type::DATA:
+              {
+                /* A later record for the same hash supersedes earlier ones,
+                   as it can only have been written after those got
+                   released.  */
+                const auto mit = index.find (e.hash);
+                if (mit != index.end ())
+                  Kill (mit);
+
+                e.live = true;
+                index.emplace (e.hash, Location {&seg, seg.entries.size ()});
+                byHeight.emplace (e.height, e.hash);
+                ++seg.numLive;
+                liveBytes += e.size;
+                break;
+              }
+
+            case Entry::Type::RELEASE:
+              {
+                const auto mit = index.find (e.hash);
+                if (mit != index.end ())
+                  Kill (mit);
+                break;
+              }
+
+            case Entry::Type::PRUNE:
+              KillUpTo (e.height);
+              break;
+            }
+          seg.entries.push_back (e);
+
+          offset += HEADER_SIZE + e.size;
+        }
+
+      if (offset < seg.size)
+        {
+          LOG (WARNING)
+              << "Truncating incomplete record at the end of " << seg.GetFile ();
+          seg.Truncate (offset);
+        }
+    }
+
+  const std::string markFile
+      = (fs::path (directory) / fs::path (PRUNE_MARK_FILE)).string ();
+  pruneMarkFd = open (markFile.c_str (), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  PCHECK (pruneMarkFd >= 0) << "Failed to open " << markFile;
+
+  unsigned char mark[PRUNE_MARK_SIZE];
+  if (pread (pruneMarkFd, mark, PRUNE_MARK_SIZE, 0) == PRUNE_MARK_SIZE)
+    {
+      hasPruneMark = true;
+      pruneMarkHeight = DecodeUint32 (mark);
+      pruneMarkPos.segment = DecodeUint64 (mark + 4);
+      pruneMarkPos.size = DecodeUint64 (mark + 12);
+      KillUpToBefore (pruneMarkHeight, pruneMarkPos);
+      ClampPruneMark ();
+    }
+
+  LOG (INFO)
+      << "Opened undo log in " << directory
+      << " with " << segments.size () << " segments and "
+      << index.size () << " entries";
+}
+
+UndoLog::~UndoLog ()
+{
+  close (pruneMarkFd);
+}
+
+std::string
+UndoLog::GetSegmentFile (const uint64_t num) const
+{
+  char numStr[32];
+  std::snprintf (numStr, sizeof (numStr), "%010llu",
+                 static_cast<unsigned long long> (num));
+
+  const fs::path file = fs::path (directory)
+      / fs::path (SEGMENT_PREFIX + std::string (numStr) + SEGMENT_SUFFIX);
+  return file.string ();
+}
+
+UndoLog::Segment&
+UndoLog::OpenSegment (const uint64_t num)
+{
+  CHECK (segments.empty () || segments.back ()->num < num);
+  segments.push_back (std::make_unique<Segment> (GetSegmentFile (num), num));
+  return *segments.back ();
+}
+
+void
+UndoLog::RemoveTipSegment ()
+{
+  CHECK (!segments.empty ());
+  Segment& tip = *segments.back ();
+
+  for (const auto& e : tip.entries)
+    if (e.live)
+      {
+        index.erase (e.hash);
+        byHeight.erase (std::make_pair (e.height, e.hash));
+        liveBytes -= e.size;
+      }
+
+  const std::string file = tip.GetFile ();
+  segments.pop_back ();
+  PCHECK (std::remove (file.c_str ()) == 0) << "Failed to remove " << file;
+
+  if (!segments.empty ())
+    ClampPruneMark ();
+}
+
+void
+UndoLog::PopEntry ()
+{
+  CHECK (!segments.empty ());
+  Segment& tip = *segments.back ();
+  CHECK (!tip.entries.empty ());
+
+  const Entry& e = tip.entries.back ();
+  if (e.live)
+    {
+      index.erase (e.hash);
+      byHeight.erase (std::make_pair (e.height, e.hash));
+      --tip.numLive;
+      liveBytes -= e.size;
+    }
+
+  tip.Truncate (e.offset);
+  tip.entries.pop_back ();
+
+  ClampPruneMark ();
+}
+
+void
+UndoLog::AppendRecord (const Entry::Type type, const uint256& hash,
+                       const unsigned height, const UndoData& data)
+{
+  CHECK (!segments.empty ());
+  if (segments.back ()->size >= maxSegmentSize)
+    {
+      OpenSegment (segments.back ()->num + 1);
+      SyncDirectory (directory);
+    }
+  Segment& tip = *segments.back ();
+
+  CHECK_LT (data.size (), PRUNE_MARKER) << "Undo data too large";
+  uint32_t lenField = data.size ();
+  switch (type)
+    {
+    case Entry::Type::DATA:
+      break;
+    case Entry::Type::RELEASE:
+      CHECK (data.empty ());
+      lenField = RELEASE_MARKER;
+      break;
+    case Entry::Type::PRUNE:
+      CHECK (data.empty ());
+      lenField = PRUNE_MARKER;
+      break;
+    }
+
+  Entry e;
+  e.type = type;
+  e.hash = hash;
+  e.height = height;
+  e.offset = tip.size;
+  e.size = data.size ();
+  e.live = (type == Entry::Type::DATA);
+
+  std::vector<unsigned char> record(HEADER_SIZE + data.size ());
+  EncodeUint32 (lenField, record.data ());
+  EncodeUint32 (height, record.data () + 4);
+  std::copy (hash.GetBlob (), hash.GetBlob () + uint256::NUM_BYTES,
+             record.data () + 8);
+  std::copy (data.begin (), data.end (), record.data () + HEADER_SIZE);
+  tip.Append (record.data (), record.size ());
+
+  if (e.live)
+    {
+      index.emplace (hash, Location {&tip, tip.entries.size ()});
+      byHeight.emplace (height, hash);
+      ++tip.numLive;
+      liveBytes += e.size;
+    }
+  tip.entries.push_back (e);
+}
+
+void
+UndoLog::Kill (const std::map<uint256, Location>::iterator mit)
+{
+  Segment& seg = *mit->second.segment;
+  Entry& e = seg.entries[mit->second.index];
+  CHECK (e.live);
+
+  e.live = false;
+  --seg.numLive;
+  liveBytes -= e.size;
+  byHeight.erase (std::make_pair (e.height, e.hash));
+  index.erase (mit);
+}
+
+bool
+UndoLog::KillUpTo (const unsigned height)
+{
+  bool found = false;
+  while (!byHeight.empty () && byHeight.begin ()->first <= height)
+    {
+      Kill (index.find (byHeight.begin ()->second));
+      found = true;
+    }
+
+  return found;
+}
+
+void
+UndoLog::KillUpToBefore (const unsigned height, const Position& pos)
+{
+  std::vector<uint256> toKill;
+  for (auto it = byHeight.begin ();
+       it != byHeight.end () && it->first <= height; ++it)
+    {
+      const Location& loc = index.at (it->second);
+      const Entry& e = loc.segment->entries[loc.index];
+      if (loc.segment->num < pos.segment
+            || (loc.segment->num == pos.segment && e.offset < pos.size))
+        toKill.push_back (it->second);
+    }
+
+  for (const auto& h : toKill)
+    Kill (index.find (h));
+}
+
+void
+UndoLog::WritePruneMark ()
+{
+  if (!hasPruneMark)
+    {
+      PCHECK (ftruncate (pruneMarkFd, 0) == 0)
+          << "Failed to clear the prune mark";
+      return;
+    }
+
+  unsigned char mark[PRUNE_MARK_SIZE];
+  EncodeUint32 (pruneMarkHeight, mark);
+  EncodeUint64 (pruneMarkPos.segment, mark + 4);
+  EncodeUint64 (pruneMarkPos.size, mark + 12);
+  PCHECK (pwrite (pruneMarkFd, mark, PRUNE_MARK_SIZE, 0) == PRUNE_MARK_SIZE)
+      << "Failed to write the prune mark";
+}
+
+void
+UndoLog::ClampPruneMark ()
+{
+  if (!hasPruneMark)
+    return;
+
+  /* Entries appended later at positions before the mark must not be
+     affected by it, so move it back to the current end of the log.  All
+     entries before the new end were also before the old mark.  */
+  const Position end = GetPosition ();
+  if (pruneMarkPos.segment < end.segment
+        || (pruneMarkPos.segment == end.segment
+              && pruneMarkPos.size <= end.size))
+    return;
+
+  pruneMarkPos = end;
+  WritePruneMark ();
+}
+
+void
+UndoLog::Push (const uint256& hash, const unsigned height,
+               const UndoData& data)
+{
+  if (index.count (hash) > 0)
+    return;
+
+  AppendRecord (Entry::Type::DATA, hash, height, data);
+}
+
+bool
+UndoLog::Get (const uint256& hash, UndoData& data) const
+{
+  const auto mit = index.find (hash);
+  if (mit == index.end ())
+    return false;
+
+  Segment& seg = *mit->second.segment;
+  const Entry& e = seg.entries[mit->second.index];
+
+  const size_t len = DecodeUint32 (seg.Read (e.offset, HEADER_SIZE));
+  if (len == 0)
+    data.clear ();
+  else
+    {
+      const unsigned char* ptr = seg.Read (e.offset + HEADER_SIZE, len);
+      data.assign (reinterpret_cast<const char*> (ptr), len);
+    }
+
+  return true;
+}
+
+void
+UndoLog::PopDeadEntries (std::set<uint256> releases)
+{
+  bool hasPrune = false;
+  unsigned pruneHeight;
+
+  /* Pop all non-live entries from the tip.  If the tip segment becomes
+     empty, remove it as well (unless it is the only one).  Tombstones
+     are popped as well, but we keep track of them so that those which
+     still refer to data on disk can be written again afterwards.  */
+  while (true)
+    {
+      Segment& tip = *segments.back ();
+      if (tip.entries.empty ())
+        {
+          if (segments.size () == 1)
+            break;
+          RemoveTipSegment ();
+          continue;
+        }
+
+      const Entry& e = tip.entries.back ();
+      if (e.live)
+        break;
+
+      switch (e.type)
+        {
+        case Entry::Type::DATA:
+          releases.erase (e.hash);
+          break;
+        case Entry::Type::RELEASE:
+          releases.insert (e.hash);
+          break;
+        case Entry::Type::PRUNE:
+          if (!hasPrune || e.height > pruneHeight)
+            pruneHeight = e.height;
+          hasPrune = true;
+          break;
+        }
+
+      PopEntry ();
+    }
+
+  /* All data before the new end was also before the popped prune
+     tombstones, so the highest of them applies to all of it.  */
+  if (hasPrune)
+    {
+      uint256 nullHash;
+      nullHash.SetNull ();
+      AppendRecord (Entry::Type::PRUNE, nullHash, pruneHeight, "");
+    }
+
+  for (const auto& h : releases)
+    AppendRecord (Entry::Type::RELEASE, h, 0, "");
+}
+
+void
+UndoLog::Release (const uint256& hash)
+{
+  const auto mit = index.find (hash);
+  if (mit == index.end ())
+    return;
+  Kill (mit);
+
+  /* The released entry itself is treated as if it had a tombstone, which
+     is dropped again if it gets popped.  */
+  PopDeadEntries ({hash});
+}
+
+void
+UndoLog::Prune (const unsigned height)
+{
+  if (!KillUpTo (height))
+    return;
+
+  /* The tip segment is always kept, even if it is empty.  */
+  bool removed = false;
+  while (segments.size () > 1 && segments.front ()->numLive == 0)
+    {
+      const std::string file = segments.front ()->GetFile ();
+      segments.pop_front ();
+      PCHECK (std::remove (file.c_str ()) == 0) << "Failed to remove " << file;
+      removed = true;
+    }
+
+  if (removed)
+    SyncDirectory (directory);
+
+  PopDeadEntries ({});
+
+  /* Normally, the prune mark is just moved forward.  Only if it is already
+     at a higher height, we append a tombstone instead.  */
+  if (hasPruneMark && height < pruneMarkHeight)
+    {
+      uint256 nullHash;
+      nullHash.SetNull ();
+      AppendRecord (Entry::Type::PRUNE, nullHash, height, "");
+      return;
+    }
+
+  hasPruneMark = true;
+  pruneMarkHeight = height;
+  pruneMarkPos = GetPosition ();
+  WritePruneMark ();
+}
+
+void
+UndoLog::Clear ()
+{
+  CHECK (!segments.empty ());
+  const uint64_t next = segments.back ()->num + 1;
+
+  while (!segments.empty ())
+    RemoveTipSegment ();
+  CHECK (index.empty ());
+  CHECK (byHeight.empty ());
+  CHECK_EQ (liveBytes, 0);
+
+  hasPruneMark = false;
+  WritePruneMark ();
+
+  OpenSegment (next);
+  SyncDirectory (directory);
+}
+
+UndoLog::Position
+UndoLog::GetPosition () const
+{
+  CHECK (!segments.empty ());
+
+  Position res;
+  res.segment = segments.back ()->num;
+  res.size = segments.back ()->size;
+
+  return res;
+}
+
+void
+UndoLog::TruncateTo (const Position& pos)
+{
+  while (segments.back ()->num > pos.segment)
+    {
+      CHECK_GT (segments.size (), 1);
+      RemoveTipSegment ();
+    }
+
+  Segment& tip = *segments.back ();
+  CHECK_EQ (tip.num, pos.segment);
+  CHECK_LE (pos.size, tip.size);
+
+  while (!tip.entries.empty () && tip.entries.back ().offset >= pos.size)
+    PopEntry ();
+  CHECK_EQ (tip.size, pos.size);
+}
+
+void
+UndoLog::Sync ()
+{
+  PCHECK (fdatasync (pruneMarkFd) == 0) << "Failed to sync the prune mark";
+  for (auto& seg : segments)
+    seg->Sync ();
+}
+
+/* ************************************************************************** */
+
+StorageWithUndoLog::StorageWithUndoLog (StorageInterface& s,
+                                        const std::string& dir,
+                                        const size_t segSize)
+  : storage(s), log(dir, segSize)
+{}
+
+void
+StorageWithUndoLog::Clear ()
+{
+  CHECK (!startedTxn);
+
+  storage.Clear ();
+  log.Clear ();
+}
+
+bool
+StorageWithUndoLog::GetUndoData (const uint256& hash, UndoData& data) const
+{
+  return log.Get (hash, data);
+}
+
+void
+StorageWithUndoLog::AddUndoData (const uint256& hash, const unsigned height,
+                                 const UndoData& data)
+{
+  CHECK (startedTxn);
+
+  /* If the block is attached again after being detached in the same
+     transaction, its undo data must not be released at commit time.  */
+  pendingReleases.erase (std::remove (pendingReleases.begin (),
+                                      pendingReleases.end (), hash),
+                         pendingReleases.end ());
+
+  log.Push (hash, height, data);
+}
+
+void
+StorageWithUndoLog::ReleaseUndoData (const uint256& hash)
+{
+  CHECK (startedTxn);
+  pendingReleases.push_back (hash);
+}
+
+void
+StorageWithUndoLog::PruneUndoData (const unsigned height)
+{
+  CHECK (startedTxn);
+
+  if (!hasPendingPrune || height > pendingPruneHeight)
+    pendingPruneHeight = height;
+  hasPendingPrune = true;
+}
+
+bool
+StorageWithUndoLog::GetUndoStats (UndoStats& stats) const
+{
+  stats.memoryEntries = 0;
+  stats.memoryBytes = 0;
+  stats.diskEntries = log.GetNumEntries ();
+  stats.diskBytes = log.GetLiveBytes ();
+  return true;
+}
+
+void
+StorageWithUndoLog::BeginTransaction ()
+{
+  CHECK (!startedTxn);
+
+  storage.BeginTransaction ();
+
+  startedTxn = true;
+  txnStart = log.GetPosition ();
+  pendingReleases.clear ();
+  hasPendingPrune = false;
+}
+
+void
+StorageWithUndoLog::CommitTransaction ()
+{
+  CHECK (startedTxn);
+
+  /* The undo data must be durable before the state referencing it is
+     committed.  If we crash after this but before the commit below,
+     the log just contains some extra entries at the tip.  */
+  log.Sync ();
+  storage.CommitTransaction ();
+  startedTxn = false;
+
+  /* Releasing in reverse order makes sure that undo data of blocks
+     detached in this transaction is popped from the tip where possible.  */
+  for (auto it = pendingReleases.rbegin (); it != pendingReleases.rend (); ++it)
+    log.Release (*it);
+  pendingReleases.clear ();
+
+  if (hasPendingPrune)
+    log.Prune (pendingPruneHeight);
+  hasPendingPrune = false;
+}
+
+void
+StorageWithUndoLog::RollbackTransaction ()
+{
+  CHECK (startedTxn);
+
+  storage.RollbackTransaction ();
+  startedTxn = false;
+
+  log.TruncateTo (txnStart);
+  pendingReleases.clear ();
+  hasPendingPrune = false;
+}
+
+} // namespace xaya
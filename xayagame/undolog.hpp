@@ -0,0 +1,428 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAGAME_UNDOLOG_HPP
+#define XAYAGAME_UNDOLOG_HPP
+
+#include "storage.hpp"
+
+#include <xayautil/uint256.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace xaya
+{
+
+/**
+ * Append-only log of undo data on disk.  The access pattern for undo data is
+ * that of a stack:  New blocks push their undo data at the tip, detached
+ * blocks pop it again from the tip, and pruning drops old entries from the
+ * bottom.  This class stores the entries in a sequence of segment files,
+ * where new data is always appended to the last segment.  Pushing and popping
+ * are thus O(1) appends and truncations of a file, and pruning deletes entire
+ * segment files at once.  Reads are done through read-only memory maps of
+ * the segments.
+ *
+ * An in-memory index from block hashes to the location of their undo data
+ * is built by scanning all segments when the log is opened.  Entries that
+ * are released while not at the tip are removed from that index and a small
+ * tombstone record is appended, so that the scan drops them again on
+ * reopening.  Pruning instead records the pruned height together with the
+ * current end of the log in a separate, fixed-size "prune mark" file that is
+ * overwritten in place.  The space of dead entries is reclaimed once the
+ * whole segment gets pruned.  If there are multiple records for the same
+ * hash (e.g. because a block was attached again after being released),
+ * the newest one wins.
+ *
+ * This class is not thread-safe.
+ */
+class UndoLog
+{
+
+public:
+
+  /**
+   * A position in the log, i.e. the end of the log at some point in time.
+   * This can be used to truncate the log back to that point later on.
+   */
+  struct Position
+  {
+
+    /** The number of the segment at the tip.  */
+    uint64_t segment;
+
+    /** The size of the tip segment.  */
+    size_t size;
+
+  };
+
+  /** Default maximum size of segment files (64 MiB).  */
+  static constexpr size_t DEFAULT_SEGMENT_SIZE = 64 << 20;
+
+private:
+
+  class Segment;
+
+  /**
+   * Data about a single entry in the log.
+   */
+  struct Entry
+  {
+
+    /** Types of entries (records) in the log.  */
+    enum class Type
+    {
+      /** Actual undo data for a block.  */
+      DATA,
+      /** Tombstone marking the latest data for the hash as released.  */
+      RELEASE,
+      /**
+       * Tombstone marking all data up to the height as pruned.  Those are
+       * only written if the prune mark cannot be used, i.e. if a prune
+       * height is lower than the one of the mark.
+       */
+      PRUNE,
+    };
+
+    /** The type of this entry.  */
+    Type type;
+
+    /** The block hash of the entry.  */
+    uint256 hash;
+
+    /** The block height of the entry.  */
+    unsigned height;
+
+    /** Offset of the entry's record within its segment file.  */
+    size_t offset;
+
+    /** Size of the undo data itself.  */
+    size_t size;
+
+    /**
+     * Whether or not the entry is still "live" (i.e. in the index).
+     * Tombstones are never live.
+     */
+    bool live;
+
+  };
+
+  /** Location of an entry, as stored in the index.  */
+  struct Location
+  {
+    Segment* segment;
+    size_t index;
+  };
+
+  /** The directory holding the segment files.  */
+  const std::string directory;
+
+  /**
+   * Segment size after which a new segment is started.  Single entries may
+   * exceed that size, though.
+   */
+  const size_t maxSegmentSize;
+
+  /**
+   * All segments that are currently on disk, ordered from the oldest (bottom
+   * of the stack) to the newest one (tip).
+   */
+  std::deque<std::unique_ptr<Segment>> segments;
+
+  /** Index of all live entries by hash.  */
+  std::map<uint256, Location> index;
+
+  /**
+   * All live entries ordered by height, so that pruning only needs to look
+   * at the entries it actually removes.
+   */
+  std::set<std::pair<unsigned, uint256>> byHeight;
+
+  /** File descriptor of the prune-mark file.  */
+  int pruneMarkFd;
+
+  /** Whether or not there is a prune mark.  */
+  bool hasPruneMark = false;
+
+  /** Height of the prune mark (if any).  */
+  unsigned pruneMarkHeight;
+
+  /**
+   * Position of the prune mark.  All entries before it with heights up to
+   * (including) pruneMarkHeight have been pruned.
+   */
+  Position pruneMarkPos;
+
+  /** Total size of the undo data of all live entries.  */
+  uint64_t liveBytes = 0;
+
+  /**
+   * Returns the file name for the segment with the given number.
+   */
+  std::string GetSegmentFile (uint64_t num) const;
+
+  /**
+   * Opens the segment with the given number and appends it to our list
+   * of segments.  If the file does not exist yet, it is created.
+   */
+  Segment& OpenSegment (uint64_t num);
+
+  /**
+   * Removes the tip segment completely (including its file).
+   */
+  void RemoveTipSegment ();
+
+  /**
+   * Removes the tip entry from the tip segment, truncating its file.
+   */
+  void PopEntry ();
+
+  /**
+   * Appends a record of the given type to the tip of the log, starting
+   * a new segment if necessary.
+   */
+  void AppendRecord (Entry::Type type, const uint256& hash,
+                     unsigned height, const UndoData& data);
+
+  /**
+   * Marks the live entry referenced by the given index iterator as no
+   * longer live and removes it from the index.
+   */
+  void Kill (std::map<uint256, Location>::iterator mit);
+
+  /**
+   * Pops all non-live entries from the tip of the log.  Afterwards, tombstones
+   * are appended for the given released hashes (and those of popped release
+   * tombstones) as well as for popped prune tombstones.
+   */
+  void PopDeadEntries (std::set<uint256> releases);
+
+  /**
+   * Kills all live entries with heights up to (including) the given value.
+   * Returns true if any of them was found.
+   */
+  bool KillUpTo (unsigned height);
+
+  /**
+   * Kills all live entries with heights up to (including) the given value
+   * that are located before the given position.
+   */
+  void KillUpToBefore (unsigned height, const Position& pos);
+
+  /**
+   * Writes the current prune mark to its file (or empties the file if there
+   * is no mark).
+   */
+  void WritePruneMark ();
+
+  /**
+   * Moves the prune mark back to the end of the log if the log has been
+   * truncated before it.
+   */
+  void ClampPruneMark ();
+
+public:
+
+  /**
+   * Opens the undo log in the given directory (which must exist).  Existing
+   * segment files are scanned to rebuild the index, and incomplete records
+   * at the end (e.g. from a crash while writing) are truncated.
+   */
+  explicit UndoLog (const std::string& dir,
+                    size_t segSize = DEFAULT_SEGMENT_SIZE);
+
+  ~UndoLog ();
+
+  UndoLog () = delete;
+  UndoLog (const UndoLog&) = delete;
+  void operator= (const UndoLog&) = delete;
+
+  /**
+   * Pushes a new entry onto the tip of the log.  If there is already a live
+   * entry for the given hash, this does nothing.
+   */
+  void Push (const uint256& hash, unsigned height, const UndoData& data);
+
+  /**
+   * Looks up the undo data for a given hash.  Returns false if there is
+   * no live entry for it.
+   */
+  bool Get (const uint256& hash, UndoData& data) const;
+
+  /**
+   * Returns true if there is a live entry for the given hash.
+   */
+  bool
+  Has (const uint256& hash) const
+  {
+    return index.count (hash) > 0;
+  }
+
+  /**
+   * Releases the entry for the given hash.  All released entries that are
+   * at the tip of the log afterwards are popped from the files.  If the
+   * entry itself is not popped, a tombstone for it is appended instead.
+   */
+  void Release (const uint256& hash);
+
+  /**
+   * Releases all entries with heights up to (including) the given value.
+   * Segments at the bottom that no longer contain any live entries
+   * are deleted.  This only needs to look at the entries that are
+   * actually pruned.
+   */
+  void Prune (unsigned height);
+
+  /**
+   * Removes all segments and entries.
+   */
+  void Clear ();
+
+  /**
+   * Returns the number of live entries.
+   */
+  size_t
+  GetNumEntries () const
+  {
+    return index.size ();
+  }
+
+  /**
+   * Returns the total size of undo data in all live entries.
+   */
+  uint64_t
+  GetLiveBytes () const
+  {
+    return liveBytes;
+  }
+
+  /**
+   * Returns the current end of the log.
+   */
+  Position GetPosition () const;
+
+  /**
+   * Truncates the log back to the given position.  All entries pushed
+   * since then are removed.
+   */
+  void TruncateTo (const Position& pos);
+
+  /**
+   * Makes sure all data written is durable on disk.
+   */
+  void Sync ();
+
+};
+
+/**
+ * Wrapper around a StorageInterface that keeps the game state in the
+ * wrapped instance, but delegates all undo data to an UndoLog.
+ *
+ * Transactions of the wrapped storage are kept in sync with the log:  The log
+ * is synced to disk before the wrapped storage commits, so that undo data
+ * for a committed state is always available.  Releasing and pruning of undo
+ * data is deferred until the wrapped transaction has been committed, and
+ * rolling back truncates the log to where it was when the transaction
+ * started.
+ */
+class StorageWithUndoLog : public StorageInterface
+{
+
+private:
+
+  /** The wrapped storage, used for the current game state.  */
+  StorageInterface& storage;
+
+  /** The undo log.  */
+  UndoLog log;
+
+  /** Whether a transaction is currently started.  */
+  bool startedTxn = false;
+
+  /** The log position at the start of the current transaction.  */
+  UndoLog::Position txnStart;
+
+  /** Undo entries released in the current transaction.  */
+  std::vector<uint256> pendingReleases;
+
+  /** Whether there is a pending prune operation.  */
+  bool hasPendingPrune = false;
+
+  /** Height of the pending prune (if any).  */
+  unsigned pendingPruneHeight;
+
+public:
+
+  /**
+   * Constructs the wrapper based on an existing storage (which must outlive
+   * the wrapper) and with the log in the given directory.
+   */
+  explicit StorageWithUndoLog (StorageInterface& s, const std::string& dir,
+                               size_t segSize = UndoLog::DEFAULT_SEGMENT_SIZE);
+
+  StorageWithUndoLog () = delete;
+  StorageWithUndoLog (const StorageWithUndoLog&) = delete;
+  void operator= (const StorageWithUndoLog&) = delete;
+
+  void
+  Initialise () override
+  {
+    storage.Initialise ();
+  }
+
+  void Clear () override;
+
+  bool
+  GetCurrentBlockHash (uint256& hash) const override
+  {
+    return storage.GetCurrentBlockHash (hash);
+  }
+
+  GameStateData
+  GetCurrentGameState () const override
+  {
+    return storage.GetCurrentGameState ();
+  }
+
+  void
+  SetCurrentGameState (const uint256& hash, const GameStateData& data) override
+  {
+    storage.SetCurrentGameState (hash, data);
+  }
+
+  bool GetUndoData (const uint256& hash, UndoData& data) const override;
+  void AddUndoData (const uint256& hash,
+                    unsigned height, const UndoData& data) override;
+  void ReleaseUndoData (const uint256& hash) override;
+  void PruneUndoData (unsigned height) override;
+
+  /**
+   * Returns the statistics of the undo log, which holds all undo data
+   * on disk.
+   */
+  bool GetUndoStats (UndoStats& stats) const override;
+
+  void
+  SetCatchingUp (const bool val) override
+  {
+    storage.SetCatchingUp (val);
+  }
+
+  void BeginTransaction () override;
+  void CommitTransaction () override;
+  void RollbackTransaction () override;
+
+};
+
+} // namespace xaya
+
+#endif // XAYAGAME_UNDOLOG_HPP
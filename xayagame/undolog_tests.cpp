@@ -0,0 +1,537 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "undolog.hpp"
+
+#include "storage_tests.hpp"
+
+#include "storage.hpp"
+
+#include <xayautil/uint256.hpp>
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <experimental/filesystem>
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+namespace xaya
+{
+namespace
+{
+
+namespace fs = std::experimental::filesystem;
+
+/**
+ * Creates a temporary directory and removes it again in the destructor.
+ */
+class TemporaryDirectory
+{
+
+private:
+
+  /** Path of the created directory.  */
+  fs::path dir;
+
+public:
+
+  TemporaryDirectory ()
+  {
+    dir = std::tmpnam (nullptr);
+    LOG (INFO) << "Temporary directory for undo log: " << dir;
+    CHECK (fs::create_directories (dir));
+  }
+
+  ~TemporaryDirectory ()
+  {
+    LOG (INFO) << "Cleaning up temporary directory: " << dir;
+    fs::remove_all (dir);
+  }
+
+  const std::string
+  GetPath () const
+  {
+    return dir.string ();
+  }
+
+  /**
+   * Returns the number of segment files in the directory.
+   */
+  unsigned
+  CountFiles () const
+  {
+    unsigned res = 0;
+    for (const auto& f : fs::directory_iterator (dir))
+      if (f.path ().extension () == ".log")
+        ++res;
+    return res;
+  }
+
+};
+
+/**
+ * StorageWithUndoLog based on a MemoryStorage and an undo log in a temporary
+ * directory, for use with the generic storage tests.  The segment size is
+ * chosen small, so that multiple segments are used even in those tests.
+ */
+class TempUndoLogStorage : public StorageInterface
+{
+
+private:
+
+  TemporaryDirectory tempDir;
+  MemoryStorage base;
+  StorageWithUndoLog storage;
+
+public:
+
+  TempUndoLogStorage ()
+    : tempDir(), storage(base, tempDir.GetPath (), 10)
+  {}
+
+  void
+  Initialise () override
+  {
+    storage.Initialise ();
+  }
+
+  void
+  Clear () override
+  {
+    storage.Clear ();
+  }
+
+  bool
+  GetCurrentBlockHash (uint256& hash) const override
+  {
+    return storage.GetCurrentBlockHash (hash);
+  }
+
+  GameStateData
+  GetCurrentGameState () const override
+  {
+    return storage.GetCurrentGameState ();
+  }
+
+  void
+  SetCurrentGameState (const uint256& hash, const GameStateData& data) override
+  {
+    storage.SetCurrentGameState (hash, data);
+  }
+
+  bool
+  GetUndoData (const uint256& hash, UndoData& data) const override
+  {
+    return storage.GetUndoData (hash, data);
+  }
+
+  void
+  AddUndoData (const uint256& hash,
+               const unsigned height, const UndoData& data) override
+  {
+    storage.AddUndoData (hash, height, data);
+  }
+
+  void
+  ReleaseUndoData (const uint256& hash) override
+  {
+    storage.ReleaseUndoData (hash);
+  }
+
+  void
+  PruneUndoData (const unsigned height) override
+  {
+    storage.PruneUndoData (height);
+  }
+
+  void
+  BeginTransaction () override
+  {
+    storage.BeginTransaction ();
+  }
+
+  void
+  CommitTransaction () override
+  {
+    storage.CommitTransaction ();
+  }
+
+  void
+  RollbackTransaction () override
+  {
+    storage.RollbackTransaction ();
+  }
+
+};
+
+INSTANTIATE_TYPED_TEST_CASE_P (UndoLog, BasicStorageTests,
+                               TempUndoLogStorage);
+INSTANTIATE_TYPED_TEST_CASE_P (UndoLog, PruningStorageTests,
+                               TempUndoLogStorage);
+
+/**
+ * Tests for the UndoLog class itself.  The fixture manages a temporary
+ * directory and provides some block hashes.
+ */
+class UndoLogTests : public testing::Test
+{
+
+protected:
+
+  TemporaryDirectory dir;
+
+  /** Block hashes for use in tests.  */
+  uint256 hash[4];
+
+  UndoLogTests ()
+  {
+    for (unsigned i = 0; i < 4; ++i)
+      CHECK (hash[i].FromHex ("0" + std::to_string (i + 1)
+                                + std::string (62, '0')));
+  }
+
+  /**
+   * Expects that the given log has undo data for the given hash
+   * with the expected value.
+   */
+  static void
+  ExpectUndo (const UndoLog& log, const uint256& h, const UndoData& expected)
+  {
+    UndoData undo;
+    ASSERT_TRUE (log.Get (h, undo));
+    EXPECT_EQ (undo, expected);
+  }
+
+  /**
+   * Expects that the given log has no undo data for the given hash.
+   */
+  static void
+  ExpectNoUndo (const UndoLog& log, const uint256& h)
+  {
+    UndoData undo;
+    EXPECT_FALSE (log.Get (h, undo));
+  }
+
+};
+
+TEST_F (UndoLogTests, PushAndPop)
+{
+  UndoLog log(dir.GetPath ());
+
+  log.Push (hash[0], 1, "foo");
+  log.Push (hash[1], 2, "");
+  log.Push (hash[2], 3, std::string ("b\0r", 3));
+  ExpectUndo (log, hash[0], "foo");
+  ExpectUndo (log, hash[1], "");
+  ExpectUndo (log, hash[2], std::string ("b\0r", 3));
+
+  const auto pos = log.GetPosition ();
+  log.Release (hash[2]);
+  ExpectNoUndo (log, hash[2]);
+  EXPECT_LT (log.GetPosition ().size, pos.size);
+
+  /* Releasing an entry not at the tip keeps the file size until the
+     tip is released as well.  */
+  log.Release (hash[0]);
+  ExpectNoUndo (log, hash[0]);
+  ExpectUndo (log, hash[1], "");
+  EXPECT_GT (log.GetPosition ().size, 0);
+
+  log.Release (hash[1]);
+  EXPECT_EQ (log.GetPosition ().size, 0);
+}
+
+TEST_F (UndoLogTests, PersistsData)
+{
+  {
+    UndoLog log(dir.GetPath (), 10);
+    log.Push (hash[0], 1, "first");
+    log.Push (hash[1], 2, "second");
+    log.Push (hash[2], 3, "third");
+    log.Release (hash[2]);
+    log.Sync ();
+  }
+
+  UndoLog log(dir.GetPath (), 10);
+  ExpectUndo (log, hash[0], "first");
+  ExpectUndo (log, hash[1], "second");
+  ExpectNoUndo (log, hash[2]);
+
+  log.Push (hash[3], 4, "fourth");
+  ExpectUndo (log, hash[3], "fourth");
+}
+
+TEST_F (UndoLogTests, PersistsReleases)
+{
+  {
+    UndoLog log(dir.GetPath (), 10);
+    log.Push (hash[0], 1, "first");
+    log.Push (hash[1], 2, "second");
+    log.Push (hash[2], 3, "third");
+    log.Release (hash[0]);
+    log.Release (hash[1]);
+    log.Sync ();
+  }
+
+  {
+    UndoLog log(dir.GetPath (), 10);
+    ExpectNoUndo (log, hash[0]);
+    ExpectNoUndo (log, hash[1]);
+    ExpectUndo (log, hash[2], "third");
+    EXPECT_EQ (log.GetNumEntries (), 1);
+
+    /* Releasing the tip now pops the data and all tombstones.  */
+    log.Release (hash[2]);
+    EXPECT_EQ (log.GetNumEntries (), 0);
+    EXPECT_EQ (dir.CountFiles (), 1);
+    EXPECT_EQ (log.GetPosition ().size, 0);
+    log.Sync ();
+  }
+
+  UndoLog log(dir.GetPath (), 10);
+  EXPECT_EQ (log.GetNumEntries (), 0);
+}
+
+TEST_F (UndoLogTests, PersistsPrunes)
+{
+  {
+    UndoLog log(dir.GetPath ());
+    for (unsigned i = 0; i < 4; ++i)
+      log.Push (hash[i], 10 + i, "data " + std::to_string (i));
+    log.Prune (11);
+    log.Sync ();
+  }
+
+  UndoLog log(dir.GetPath ());
+  ExpectNoUndo (log, hash[0]);
+  ExpectNoUndo (log, hash[1]);
+  ExpectUndo (log, hash[2], "data 2");
+  ExpectUndo (log, hash[3], "data 3");
+  EXPECT_EQ (log.GetLiveBytes (), 12);
+}
+
+TEST_F (UndoLogTests, NewestRecordWins)
+{
+  {
+    UndoLog log(dir.GetPath ());
+    log.Push (hash[0], 1, "old");
+    log.Push (hash[1], 2, "other");
+    log.Release (hash[0]);
+    log.Push (hash[0], 1, "new");
+    log.Sync ();
+
+    ExpectUndo (log, hash[0], "new");
+  }
+
+  {
+    UndoLog log(dir.GetPath ());
+    ExpectUndo (log, hash[0], "new");
+    ExpectUndo (log, hash[1], "other");
+    EXPECT_EQ (log.GetNumEntries (), 2);
+
+    /* A prune pushed after some entry does not affect newer data
+       for the same height.  */
+    log.Prune (1);
+    log.Push (hash[0], 1, "newest");
+    log.Sync ();
+  }
+
+  UndoLog log(dir.GetPath ());
+  ExpectUndo (log, hash[0], "newest");
+  ExpectUndo (log, hash[1], "other");
+}
+
+TEST_F (UndoLogTests, PruneMark)
+{
+  {
+    UndoLog log(dir.GetPath ());
+    for (unsigned i = 0; i < 3; ++i)
+      log.Push (hash[i], 10 + i, "data " + std::to_string (i));
+
+    /* Consecutive prunes just move the mark and do not grow the log.  */
+    const auto pos = log.GetPosition ();
+    log.Prune (10);
+    log.Prune (11);
+    EXPECT_EQ (log.GetPosition ().size, pos.size);
+
+    /* Data pushed after the prune is not affected by the mark.  */
+    log.Push (hash[3], 11, "data 3");
+    log.Sync ();
+  }
+
+  {
+    UndoLog log(dir.GetPath ());
+    ExpectNoUndo (log, hash[0]);
+    ExpectNoUndo (log, hash[1]);
+    ExpectUndo (log, hash[2], "data 2");
+    ExpectUndo (log, hash[3], "data 3");
+
+    /* Pruning a lower height than the mark uses a tombstone instead.  */
+    log.Release (hash[3]);
+    log.Push (hash[3], 10, "data 3");
+    log.Push (hash[0], 13, "new 0");
+    log.Prune (10);
+    ExpectNoUndo (log, hash[3]);
+    log.Sync ();
+  }
+
+  UndoLog log(dir.GetPath ());
+  ExpectNoUndo (log, hash[3]);
+  ExpectUndo (log, hash[0], "new 0");
+  ExpectUndo (log, hash[2], "data 2");
+  EXPECT_EQ (log.GetNumEntries (), 2);
+}
+
+TEST_F (UndoLogTests, PruneMarkAfterTruncation)
+{
+  {
+    UndoLog log(dir.GetPath ());
+    log.Push (hash[0], 10, "zero");
+    const auto pos = log.GetPosition ();
+    log.Push (hash[1], 11, "one");
+    log.Prune (10);
+
+    /* Entries written after truncating the log back before the mark
+       are not affected by it on reopening.  */
+    log.TruncateTo (pos);
+    log.Push (hash[2], 10, "two");
+    log.Sync ();
+  }
+
+  UndoLog log(dir.GetPath ());
+  ExpectNoUndo (log, hash[0]);
+  ExpectNoUndo (log, hash[1]);
+  ExpectUndo (log, hash[2], "two");
+}
+
+TEST_F (UndoLogTests, PruningRemovesSegments)
+{
+  UndoLog log(dir.GetPath (), 10);
+  for (unsigned i = 0; i < 4; ++i)
+    log.Push (hash[i], 10 + i, "some undo data");
+  EXPECT_EQ (dir.CountFiles (), 4);
+
+  log.Prune (11);
+  ExpectNoUndo (log, hash[0]);
+  ExpectNoUndo (log, hash[1]);
+  ExpectUndo (log, hash[2], "some undo data");
+  EXPECT_EQ (dir.CountFiles (), 2);
+
+  /* The tip segment is kept even if everything is pruned.  */
+  log.Prune (100);
+  ExpectNoUndo (log, hash[3]);
+  EXPECT_EQ (dir.CountFiles (), 1);
+}
+
+TEST_F (UndoLogTests, TruncateTo)
+{
+  UndoLog log(dir.GetPath (), 10);
+  log.Push (hash[0], 1, "zero");
+  const auto pos = log.GetPosition ();
+
+  log.Push (hash[1], 2, "one");
+  log.Push (hash[2], 3, "two");
+  EXPECT_EQ (dir.CountFiles (), 3);
+
+  log.TruncateTo (pos);
+  ExpectUndo (log, hash[0], "zero");
+  ExpectNoUndo (log, hash[1]);
+  ExpectNoUndo (log, hash[2]);
+  EXPECT_EQ (dir.CountFiles (), 1);
+  EXPECT_EQ (log.GetPosition ().segment, pos.segment);
+  EXPECT_EQ (log.GetPosition ().size, pos.size);
+}
+
+TEST_F (UndoLogTests, IncompleteRecord)
+{
+  std::string file;
+  {
+    UndoLog log(dir.GetPath ());
+    log.Push (hash[0], 1, "complete");
+    log.Sync ();
+
+    for (const auto& f : fs::directory_iterator (dir.GetPath ()))
+      if (f.path ().extension () == ".log")
+        file = f.path ().string ();
+  }
+
+  {
+    std::ofstream out(file, std::ios::binary | std::ios::app);
+    out << "partial";
+  }
+
+  UndoLog log(dir.GetPath ());
+  ExpectUndo (log, hash[0], "complete");
+  log.Push (hash[1], 2, "next");
+  ExpectUndo (log, hash[1], "next");
+}
+
+TEST_F (UndoLogTests, Clear)
+{
+  UndoLog log(dir.GetPath (), 10);
+  log.Push (hash[0], 1, "zero");
+  log.Push (hash[1], 2, "one");
+
+  log.Clear ();
+  ExpectNoUndo (log, hash[0]);
+  ExpectNoUndo (log, hash[1]);
+  EXPECT_EQ (dir.CountFiles (), 1);
+
+  log.Push (hash[0], 1, "new");
+  ExpectUndo (log, hash[0], "new");
+}
+
+/**
+ * Tests for the transaction handling of StorageWithUndoLog.
+ */
+class StorageWithUndoLogTests : public UndoLogTests
+{
+
+protected:
+
+  MemoryStorage base;
+  StorageWithUndoLog storage;
+
+  StorageWithUndoLogTests ()
+    : storage(base, dir.GetPath ())
+  {}
+
+};
+
+TEST_F (StorageWithUndoLogTests, RollbackRemovesUndo)
+{
+  storage.BeginTransaction ();
+  storage.AddUndoData (hash[0], 1, "zero");
+  storage.CommitTransaction ();
+
+  storage.BeginTransaction ();
+  storage.AddUndoData (hash[1], 2, "one");
+  storage.ReleaseUndoData (hash[0]);
+  storage.RollbackTransaction ();
+
+  UndoData undo;
+  ASSERT_TRUE (storage.GetUndoData (hash[0], undo));
+  EXPECT_EQ (undo, "zero");
+  EXPECT_FALSE (storage.GetUndoData (hash[1], undo));
+}
+
+TEST_F (StorageWithUndoLogTests, ReattachInSameTransaction)
+{
+  storage.BeginTransaction ();
+  storage.AddUndoData (hash[0], 1, "zero");
+  storage.ReleaseUndoData (hash[0]);
+  storage.AddUndoData (hash[0], 1, "zero");
+  storage.CommitTransaction ();
+
+  UndoData undo;
+  ASSERT_TRUE (storage.GetUndoData (hash[0], undo));
+  EXPECT_EQ (undo, "zero");
+}
+
+} // anonymous namespace
+} // namespace xaya
@@ -0,0 +1,489 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "writebehindstorage.hpp"
+
+#include <glog/logging.h>
+
+#include <exception>
+
+namespace xaya
+{
+
+/**
+ * The changes made in a single transaction.  They are recorded as a sequence
+ * of operations on undo data (to be replayed on the wrapped storage) and
+ * the final game state, together with a lookup table for reads.
+ */
+class WriteBehindStorage::Batch
+{
+
+private:
+
+  /** Types of undo-data operations.  */
+  enum class OpType
+  {
+    ADD,
+    RELEASE,
+    PRUNE,
+  };
+
+  /** A single undo-data operation.  */
+  struct Op
+  {
+    OpType type;
+    uint256 hash;
+    unsigned height;
+    UndoData data;
+  };
+
+  /** All undo-data operations in order.  */
+  std::vector<Op> ops;
+
+  /**
+   * For each hash with ADD or RELEASE operations in this batch, the index
+   * of the last such operation.
+   */
+  std::map<uint256, size_t> lastUndoOp;
+
+  /** Indices of all PRUNE operations.  */
+  std::vector<size_t> pruneOps;
+
+public:
+
+  /** Whether or not the game state was set.  */
+  bool hasState = false;
+
+  /** The block hash of the game state set, if any.  */
+  uint256 hash;
+
+  /** The game state set, if any.  */
+  GameStateData state;
+
+  Batch () = default;
+  Batch (const Batch&) = delete;
+  void operator= (const Batch&) = delete;
+
+  void
+  AddUndo (const uint256& h, const unsigned height, const UndoData& data)
+  {
+    lastUndoOp[h] = ops.size ();
+    ops.push_back ({OpType::ADD, h, height, data});
+  }
+
+  void
+  ReleaseUndo (const uint256& h)
+  {
+    lastUndoOp[h] = ops.size ();
+    ops.push_back ({OpType::RELEASE, h, 0, ""});
+  }
+
+  void
+  PruneUndo (const unsigned height)
+  {
+    pruneOps.push_back (ops.size ());
+    ops.push_back ({OpType::PRUNE, uint256 (), height, ""});
+  }
+
+  /**
+   * Returns true if this batch contains any PRUNE operations.
+   */
+  bool
+  HasPrune () const
+  {
+    return !pruneOps.empty ();
+  }
+
+  /**
+   * Returns true if the batch prunes undo data at the given height
+   * after the operation with the given index.
+   */
+  bool
+  IsPrunedAfter (const unsigned height, const size_t index) const
+  {
+    for (const auto p : pruneOps)
+      if (p >= index && height <= ops[p].height)
+        return true;
+    return false;
+  }
+
+  /**
+   * Checks whether this batch determines the undo data for the given hash.
+   * If it does, found is set to true and the return value is whether or
+   * not there is undo data (which is filled into data).  If there is
+   * undo data, its height is returned in height.
+   */
+  bool
+  LookupUndo (const uint256& h, bool& found, UndoData& data,
+              unsigned& height) const
+  {
+    found = false;
+
+    const auto mit = lastUndoOp.find (h);
+    if (mit == lastUndoOp.end ())
+      return false;
+
+    found = true;
+    const Op& op = ops[mit->second];
+    if (op.type != OpType::ADD || IsPrunedAfter (op.height, mit->second))
+      return false;
+
+    data = op.data;
+    height = op.height;
+    return true;
+  }
+
+  /**
+   * Applies all changes to the given storage.  The caller must take care
+   * of beginning and committing the transaction.
+   */
+  void
+  Apply (StorageInterface& s) const
+  {
+    for (const auto& op : ops)
+      switch (op.type)
+        {
+        case OpType::ADD:
+          s.AddUndoData (op.hash, op.height, op.data);
+          break;
+        case OpType::RELEASE:
+          s.ReleaseUndoData (op.hash);
+          break;
+        case OpType::PRUNE:
+          s.PruneUndoData (op.height);
+          break;
+        }
+
+    if (hasState)
+      s.SetCurrentGameState (hash, state);
+  }
+
+};
+
+/* ************************************************************************** */
+
+WriteBehindStorage::WriteBehindStorage (StorageInterface& s,
+                                        const unsigned maxQueued)
+  : storage(s), maxInFlight(maxQueued)
+{
+  CHECK_GT (maxInFlight, 0);
+  LOG (INFO)
+      << "Using write-behind storage with up to " << maxInFlight
+      << " transactions in flight";
+
+  worker = std::thread ([this] ()
+    {
+      RunWorker ();
+    });
+}
+
+WriteBehindStorage::~WriteBehindStorage ()
+{
+  CHECK (current == nullptr);
+
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    WaitForQueue (lock);
+    shouldStop = true;
+    cvQueued.notify_all ();
+  }
+
+  worker.join ();
+
+  if (failed)
+    LOG (WARNING)
+        << "Unreported write-behind failure on shutdown: " << failure;
+}
+
+void
+WriteBehindStorage::RunWorker ()
+{
+  while (true)
+    {
+      const Batch* batch;
+      {
+        std::unique_lock<std::mutex> lock(mut);
+        cvQueued.wait (lock, [this] ()
+          {
+            return shouldStop || !queue.empty ();
+          });
+
+        if (queue.empty ())
+          {
+            CHECK (shouldStop);
+            return;
+          }
+
+        batch = queue.front ().get ();
+      }
+
+      /* The front batch stays in the queue (and is not modified) while we
+         write it, so that reads still see its changes.  */
+      bool ok = true;
+      std::string error;
+      {
+        std::lock_guard<std::mutex> lockStorage(mutStorage);
+        bool started = false;
+        try
+          {
+            storage.BeginTransaction ();
+            started = true;
+            batch->Apply (storage);
+            storage.CommitTransaction ();
+          }
+        catch (const std::exception& exc)
+          {
+            ok = false;
+            error = exc.what ();
+            if (started)
+              storage.RollbackTransaction ();
+          }
+      }
+
+      std::lock_guard<std::mutex> lock(mut);
+      if (ok)
+        queue.pop_front ();
+      else
+        {
+          LOG (ERROR)
+              << "Write-behind commit failed, discarding " << queue.size ()
+              << " queued transactions: " << error;
+          queue.clear ();
+          failed = true;
+          failure = error;
+        }
+      cvWritten.notify_all ();
+    }
+}
+
+template <typename Fcn>
+  const WriteBehindStorage::Batch*
+  WriteBehindStorage::FindInOverlay (const Fcn& pred) const
+{
+  if (current != nullptr && pred (*current))
+    return current.get ();
+
+  for (auto it = queue.rbegin (); it != queue.rend (); ++it)
+    if (pred (**it))
+      return it->get ();
+
+  return nullptr;
+}
+
+void
+WriteBehindStorage::WaitForQueue (std::unique_lock<std::mutex>& lock) const
+{
+  cvWritten.wait (lock, [this] ()
+    {
+      return queue.empty ();
+    });
+}
+
+void
+WriteBehindStorage::Flush ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  WaitForQueue (lock);
+}
+
+void
+WriteBehindStorage::Initialise ()
+{
+  std::lock_guard<std::mutex> lock(mutStorage);
+  storage.Initialise ();
+}
+
+void
+WriteBehindStorage::Clear ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  CHECK (current == nullptr);
+  WaitForQueue (lock);
+
+  /* A full reset also resolves any pending failure.  */
+  failed = false;
+
+  std::lock_guard<std::mutex> lockStorage(mutStorage);
+  storage.Clear ();
+}
+
+bool
+WriteBehindStorage::GetCurrentBlockHash (uint256& hash) const
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    const Batch* b = FindInOverlay ([] (const Batch& batch)
+      {
+        return batch.hasState;
+      });
+    if (b != nullptr)
+      {
+        hash = b->hash;
+        return true;
+      }
+  }
+
+  std::lock_guard<std::mutex> lockStorage(mutStorage);
+  return storage.GetCurrentBlockHash (hash);
+}
+
+GameStateData
+WriteBehindStorage::GetCurrentGameState () const
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    const Batch* b = FindInOverlay ([] (const Batch& batch)
+      {
+        return batch.hasState;
+      });
+    if (b != nullptr)
+      return b->state;
+  }
+
+  std::lock_guard<std::mutex> lockStorage(mutStorage);
+  return storage.GetCurrentGameState ();
+}
+
+void
+WriteBehindStorage::SetCurrentGameState (const uint256& hash,
+                                         const GameStateData& data)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (current != nullptr);
+
+  current->hasState = true;
+  current->hash = hash;
+  current->state = data;
+}
+
+bool
+WriteBehindStorage::GetUndoData (const uint256& hash, UndoData& data) const
+{
+  {
+    std::unique_lock<std::mutex> lock(mut);
+
+    /* Look through the batches from newest to oldest, keeping track of
+       the ones we passed that prune undo data.  */
+    std::vector<const Batch*> newer;
+    bool res = false;
+    unsigned height;
+    const Batch* b = FindInOverlay ([&] (const Batch& batch)
+      {
+        bool found;
+        res = batch.LookupUndo (hash, found, data, height);
+        if (!found)
+          newer.push_back (&batch);
+        return found;
+      });
+
+    if (b != nullptr)
+      {
+        if (!res)
+          return false;
+        for (const auto* n : newer)
+          if (n->IsPrunedAfter (height, 0))
+            return false;
+        return true;
+      }
+
+    /* If the data comes from the underlying storage, we do not know its
+       height.  Thus if there are pending prunes, wait for them to be
+       written first.  This only happens when pruning is enabled, and then
+       undo data is only read rarely (for detaching blocks).  */
+    bool hasPrune = false;
+    for (const auto* n : newer)
+      if (n != current.get () && n->HasPrune ())
+        hasPrune = true;
+    if (hasPrune)
+      WaitForQueue (lock);
+    if (current != nullptr && current->HasPrune ())
+      LOG (WARNING)
+          << "Reading undo data after pruning in the same transaction,"
+             " the result may not take the pruning into account";
+  }
+
+  std::lock_guard<std::mutex> lockStorage(mutStorage);
+  return storage.GetUndoData (hash, data);
+}
+
+void
+WriteBehindStorage::AddUndoData (const uint256& hash, const unsigned height,
+                                 const UndoData& data)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (current != nullptr);
+  current->AddUndo (hash, height, data);
+}
+
+void
+WriteBehindStorage::ReleaseUndoData (const uint256& hash)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (current != nullptr);
+  current->ReleaseUndo (hash);
+}
+
+void
+WriteBehindStorage::PruneUndoData (const unsigned height)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (current != nullptr);
+  current->PruneUndo (height);
+}
+
+bool
+WriteBehindStorage::GetUndoStats (UndoStats& stats) const
+{
+  std::lock_guard<std::mutex> lockStorage(mutStorage);
+  return storage.GetUndoStats (stats);
+}
+
+void
+WriteBehindStorage::SetCatchingUp (const bool val)
+{
+  std::lock_guard<std::mutex> lockStorage(mutStorage);
+  storage.SetCatchingUp (val);
+}
+
+void
+WriteBehindStorage::BeginTransaction ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (current == nullptr);
+  current = std::make_unique<Batch> ();
+}
+
+void
+WriteBehindStorage::CommitTransaction ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  CHECK (current != nullptr);
+
+  cvWritten.wait (lock, [this] ()
+    {
+      return failed || queue.size () < maxInFlight;
+    });
+
+  if (failed)
+    {
+      /* The failure is reported now, and Game will reinitialise itself
+         based on the state that is actually stored.  */
+      failed = false;
+      throw RetryWithNewTransaction ("write-behind commit failed: " + failure);
+    }
+
+  queue.push_back (std::move (current));
+  current.reset ();
+  cvQueued.notify_all ();
+}
+
+void
+WriteBehindStorage::RollbackTransaction ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (current != nullptr);
+  current.reset ();
+}
+
+} // namespace xaya
@@ -0,0 +1,171 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAGAME_WRITEBEHINDSTORAGE_HPP
+#define XAYAGAME_WRITEBEHINDSTORAGE_HPP
+
+#include "storage.hpp"
+
+#include <xayautil/uint256.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace xaya
+{
+
+/**
+ * Wrapper around a StorageInterface that commits transactions asynchronously
+ * ("write behind").  All changes made in a transaction are buffered in memory,
+ * and when the transaction is committed, they are handed to a dedicated
+ * I/O thread that applies and commits them on the wrapped storage.  Reads
+ * see the buffered changes immediately, so that the game can continue
+ * processing blocks without waiting for the (potentially slow, e.g. due to
+ * fsync) commit of the underlying storage.
+ *
+ * The number of committed transactions that have not yet been written
+ * is bounded; if the limit is reached, CommitTransaction blocks until the
+ * I/O thread has caught up.
+ *
+ * If committing a transaction on the wrapped storage fails, then that
+ * transaction and all later ones that are still queued are discarded.
+ * The next CommitTransaction call then throws RetryWithNewTransaction,
+ * which makes Game reinitialise its state from what has actually been
+ * stored (and sync up again from there).  Until that happens, reads may
+ * return the older, durably stored state.
+ *
+ * This only works for storages where all changes are done through the
+ * StorageInterface methods; in particular, it must not be used with
+ * SQLiteGame, which modifies its database directly.
+ */
+class WriteBehindStorage : public StorageInterface
+{
+
+private:
+
+  class Batch;
+
+  /** The wrapped storage.  */
+  StorageInterface& storage;
+
+  /** Maximum number of committed but not yet written transactions.  */
+  const unsigned maxInFlight;
+
+  /**
+   * Lock for accessing the wrapped storage.  It is held by the I/O thread
+   * while a batch is written, and by other threads when reading data
+   * from the underlying storage.
+   */
+  mutable std::mutex mutStorage;
+
+  /** Lock for the queue and related state.  */
+  mutable std::mutex mut;
+
+  /** Condition variable signalled when a new batch is queued.  */
+  std::condition_variable cvQueued;
+
+  /** Condition variable signalled when a batch has been written.  */
+  mutable std::condition_variable cvWritten;
+
+  /**
+   * Queue of committed transactions, oldest first.  A batch stays in the
+   * queue while it is being written, so that reads still see it.
+   */
+  std::deque<std::unique_ptr<Batch>> queue;
+
+  /** The changes of the currently open transaction (null if none).  */
+  std::unique_ptr<Batch> current;
+
+  /** Set if writing a batch failed and this has not yet been reported.  */
+  bool failed = false;
+
+  /** Error message of the failure (if any).  */
+  std::string failure;
+
+  /** Set to true when the I/O thread should stop.  */
+  bool shouldStop = false;
+
+  /** The I/O thread.  */
+  std::thread worker;
+
+  /**
+   * Main function of the I/O thread.
+   */
+  void RunWorker ();
+
+  /**
+   * Looks through the open transaction and the queued batches (newest first)
+   * for the given predicate.  Returns the batch with the first match or null.
+   * mut must be held.
+   */
+  template <typename Fcn>
+    const Batch* FindInOverlay (const Fcn& pred) const;
+
+  /**
+   * Waits until all queued batches have been written.  mut must be held
+   * through the given lock.
+   */
+  void WaitForQueue (std::unique_lock<std::mutex>& lock) const;
+
+public:
+
+  /**
+   * Constructs the wrapper for the given storage (which must outlive this
+   * instance) with the given bound on in-flight transactions.  The I/O
+   * thread is started right away.
+   */
+  explicit WriteBehindStorage (StorageInterface& s, unsigned maxQueued);
+
+  /**
+   * Writes all queued transactions and stops the I/O thread.
+   */
+  ~WriteBehindStorage ();
+
+  WriteBehindStorage () = delete;
+  WriteBehindStorage (const WriteBehindStorage&) = delete;
+  void operator= (const WriteBehindStorage&) = delete;
+
+  /**
+   * Blocks until all committed transactions have been written to the
+   * wrapped storage (or discarded due to a failure).
+   */
+  void Flush ();
+
+  void Initialise () override;
+  void Clear () override;
+
+  bool GetCurrentBlockHash (uint256& hash) const override;
+  GameStateData GetCurrentGameState () const override;
+  void SetCurrentGameState (const uint256& hash,
+                            const GameStateData& data) override;
+
+  bool GetUndoData (const uint256& hash, UndoData& data) const override;
+  void AddUndoData (const uint256& hash,
+                    unsigned height, const UndoData& data) override;
+  void ReleaseUndoData (const uint256& hash) override;
+  void PruneUndoData (unsigned height) override;
+
+  /**
+   * Returns the statistics of the wrapped storage.  They do not yet
+   * include batches that have not been written.
+   */
+  bool GetUndoStats (UndoStats& stats) const override;
+
+  void SetCatchingUp (bool val) override;
+
+  void BeginTransaction () override;
+  void CommitTransaction () override;
+  void RollbackTransaction () override;
+
+};
+
+} // namespace xaya
+
+#endif // XAYAGAME_WRITEBEHINDSTORAGE_HPP
@@ -0,0 +1,280 @@
+// Copyright (C) 2020 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "writebehindstorage.hpp"
+
+#include "storage_tests.hpp"
+
+#include "storage.hpp"
+
+#include <xayautil/uint256.hpp>
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace xaya
+{
+namespace
+{
+
+/**
+ * MemoryStorage whose commits can be blocked (to simulate slow writes)
+ * and whose updates can be made to fail.  Since MemoryStorage does not support
+ * rollbacks, the failure is triggered when adding undo data (which is done
+ * before any other changes by WriteBehindStorage).
+ */
+class ControlledMemoryStorage : public MemoryStorage
+{
+
+private:
+
+  std::mutex mut;
+  std::condition_variable cv;
+
+  /** Whether commits are currently blocked.  */
+  bool blocked = false;
+
+  /** Whether the next update should fail.  */
+  bool shouldFail = false;
+
+public:
+
+  /** Number of commits done.  */
+  unsigned commits = 0;
+
+  void
+  Block ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    blocked = true;
+  }
+
+  void
+  Unblock ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    blocked = false;
+    cv.notify_all ();
+  }
+
+  void
+  FailNextUpdate ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    shouldFail = true;
+  }
+
+  void
+  AddUndoData (const uint256& hash, const unsigned height,
+               const UndoData& data) override
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    cv.wait (lock, [this] ()
+      {
+        return !blocked;
+      });
+
+    if (shouldFail)
+      {
+        shouldFail = false;
+        throw RetryWithNewTransaction ("failing update");
+      }
+
+    MemoryStorage::AddUndoData (hash, height, data);
+  }
+
+  void
+  CommitTransaction () override
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    cv.wait (lock, [this] ()
+      {
+        return !blocked;
+      });
+
+    ++commits;
+    MemoryStorage::CommitTransaction ();
+  }
+
+};
+
+/**
+ * Holder for the base storage of TestWriteBehindStorage.  It is used as the
+ * first base class there, so that it is constructed before and destructed
+ * after the WriteBehindStorage.
+ */
+struct BaseStorageHolder
+{
+  MemoryStorage base;
+};
+
+/**
+ * WriteBehindStorage with its own MemoryStorage base, for the generic
+ * storage tests.
+ */
+class TestWriteBehindStorage : private BaseStorageHolder,
+                               public WriteBehindStorage
+{
+
+public:
+
+  TestWriteBehindStorage ()
+    : WriteBehindStorage(base, 3)
+  {}
+
+};
+
+INSTANTIATE_TYPED_TEST_CASE_P (WriteBehind, BasicStorageTests,
+                               TestWriteBehindStorage);
+INSTANTIATE_TYPED_TEST_CASE_P (WriteBehind, PruningStorageTests,
+                               TestWriteBehindStorage);
+INSTANTIATE_TYPED_TEST_CASE_P (WriteBehind, TransactingStorageTests,
+                               TestWriteBehindStorage);
+
+class WriteBehindStorageTests : public testing::Test
+{
+
+protected:
+
+  ControlledMemoryStorage base;
+
+  uint256 hash1, hash2, hash3;
+
+  WriteBehindStorageTests ()
+  {
+    CHECK (hash1.FromHex ("01" + std::string (62, '0')));
+    CHECK (hash2.FromHex ("02" + std::string (62, '0')));
+    CHECK (hash3.FromHex ("03" + std::string (62, '0')));
+  }
+
+  /**
+   * Commits a transaction that sets the state to the given value and
+   * adds undo data for the hash.
+   */
+  static void
+  Attach (StorageInterface& s, const uint256& hash, const std::string& state)
+  {
+    s.BeginTransaction ();
+    s.AddUndoData (hash, 1, "undo " + state);
+    s.SetCurrentGameState (hash, state);
+    s.CommitTransaction ();
+  }
+
+};
+
+TEST_F (WriteBehindStorageTests, ReadsSeeQueuedChanges)
+{
+  WriteBehindStorage storage(base, 10);
+
+  base.Block ();
+  Attach (storage, hash1, "state 1");
+  Attach (storage, hash2, "state 2");
+
+  uint256 hash;
+  ASSERT_TRUE (storage.GetCurrentBlockHash (hash));
+  EXPECT_EQ (hash, hash2);
+  EXPECT_EQ (storage.GetCurrentGameState (), "state 2");
+
+  UndoData undo;
+  ASSERT_TRUE (storage.GetUndoData (hash1, undo));
+  EXPECT_EQ (undo, "undo state 1");
+
+  storage.BeginTransaction ();
+  storage.ReleaseUndoData (hash1);
+  EXPECT_FALSE (storage.GetUndoData (hash1, undo));
+  storage.RollbackTransaction ();
+  EXPECT_TRUE (storage.GetUndoData (hash1, undo));
+
+  base.Unblock ();
+  storage.Flush ();
+
+  EXPECT_EQ (base.commits, 2);
+  ASSERT_TRUE (base.GetCurrentBlockHash (hash));
+  EXPECT_EQ (hash, hash2);
+  EXPECT_EQ (base.GetCurrentGameState (), "state 2");
+}
+
+TEST_F (WriteBehindStorageTests, BoundedInFlight)
+{
+  WriteBehindStorage storage(base, 1);
+
+  base.Block ();
+  Attach (storage, hash1, "state 1");
+
+  /* The next commit has to wait until the first one is written, which
+     we allow only from a separate thread after a short while.  */
+  std::thread unblocker([this] ()
+    {
+      std::this_thread::sleep_for (std::chrono::milliseconds (10));
+      base.Unblock ();
+    });
+  Attach (storage, hash2, "state 2");
+  unblocker.join ();
+
+  storage.Flush ();
+  EXPECT_EQ (base.commits, 2);
+}
+
+TEST_F (WriteBehindStorageTests, ForwardsUndoStats)
+{
+  StorageInterface::UndoStats stats;
+
+  {
+    WriteBehindStorage storage(base, 10);
+    EXPECT_FALSE (storage.GetUndoStats (stats));
+  }
+
+  MemoryStorage spilling;
+  spilling.SetUndoMemoryBudget (1);
+  WriteBehindStorage storage(spilling, 10);
+  Attach (storage, hash1, "state 1");
+  Attach (storage, hash2, "state 2");
+  storage.Flush ();
+
+  ASSERT_TRUE (storage.GetUndoStats (stats));
+  EXPECT_EQ (stats.memoryEntries, 0);
+  EXPECT_EQ (stats.diskEntries, 2);
+  EXPECT_GT (stats.diskBytes, 0);
+}
+
+TEST_F (WriteBehindStorageTests, FailureIsReported)
+{
+  WriteBehindStorage storage(base, 10);
+
+  Attach (storage, hash1, "state 1");
+  storage.Flush ();
+
+  base.Block ();
+  base.FailNextUpdate ();
+  Attach (storage, hash2, "state 2");
+  Attach (storage, hash3, "state 3");
+  base.Unblock ();
+  storage.Flush ();
+
+  /* Both queued transactions have been discarded, and reads see the stored
+     state again.  */
+  EXPECT_EQ (storage.GetCurrentGameState (), "state 1");
+  UndoData undo;
+  EXPECT_FALSE (storage.GetUndoData (hash2, undo));
+
+  storage.BeginTransaction ();
+  storage.SetCurrentGameState (hash2, "state 2");
+  EXPECT_THROW (storage.CommitTransaction (),
+                StorageInterface::RetryWithNewTransaction);
+  storage.RollbackTransaction ();
+
+  /* After the failure has been reported, things work normally again.  */
+  Attach (storage, hash2, "state 2");
+  storage.Flush ();
+  EXPECT_EQ (base.GetCurrentGameState (), "state 2");
+}
+
+} // anonymous namespace
+} // namespace xaya
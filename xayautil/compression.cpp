@@ -16,6 +16,12 @@ constexpr int WINDOW_BITS = 15;
 /** Compression level we use.  */
 constexpr int LEVEL = 9;
 
+/** Compression level used for data transfer (not consensus).  */
+constexpr int TRANSFER_LEVEL = Z_DEFAULT_COMPRESSION;
+
+/** Offset to add to the window bits for producing gzip format.  */
+constexpr int GZIP_WINDOW_OFFSET = 16;
+
 /**
  * Utility class wrapping a z_stream instance used for inflating data.
  */
@@ -95,4 +101,18 @@ UncompressData (const std::string& input, const size_t maxOutputSize,
   return uncompressor.Uncompress (input, maxOutputSize, output);
 }
 
+std::string
+CompressGzip (const std::string& data)
+{
+  DeflateStream compressor(WINDOW_BITS + GZIP_WINDOW_OFFSET, TRANSFER_LEVEL);
+  return compressor.Compress (data);
+}
+
+std::string
+CompressZlib (const std::string& data)
+{
+  DeflateStream compressor(WINDOW_BITS, TRANSFER_LEVEL);
+  return compressor.Compress (data);
+}
+
 } // namespace xaya
@@ -45,6 +45,21 @@ std::string CompressData (const std::string& data);
 bool UncompressData (const std::string& input, size_t maxOutputSize,
                      std::string& output);
 
+/**
+ * Compresses the given data in gzip format (RFC 1952), e.g. for the
+ * "gzip" HTTP content coding.  This is meant for transferring data
+ * (like large RPC responses) and not relevant for consensus.  It uses the
+ * default compression level, to trade off size against speed.
+ */
+std::string CompressGzip (const std::string& data);
+
+/**
+ * Compresses the given data in zlib format (RFC 1950), which is what the
+ * "deflate" HTTP content coding uses.  Like CompressGzip, this is not
+ * relevant for consensus.
+ */
+std::string CompressZlib (const std::string& data);
+
 } // namespace xaya
 
 #endif // XAYAUTIL_COMPRESSION_HPP
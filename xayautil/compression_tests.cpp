@@ -31,6 +31,37 @@ protected:
     EXPECT_EQ (actual, expected);
   }
 
+  /**
+   * Inflates zlib or gzip data (depending on the window bits) with
+   * zlib directly and expects it to match the given original input.
+   */
+  static void
+  ExpectWrappedInflate (const std::string& compressed, const int windowBits,
+                        const std::string& expected)
+  {
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    stream.next_in = Z_NULL;
+    stream.avail_in = 0;
+    ASSERT_EQ (inflateInit2 (&stream, windowBits), Z_OK);
+
+    std::string output(expected.size () + 1, '\0');
+    stream.next_in = reinterpret_cast<Bytef*> (
+        const_cast<char*> (compressed.data ()));
+    stream.avail_in = compressed.size ();
+    stream.next_out = reinterpret_cast<Bytef*> (&output[0]);
+    stream.avail_out = output.size ();
+
+    EXPECT_EQ (inflate (&stream, Z_FINISH), Z_STREAM_END);
+    EXPECT_EQ (stream.avail_in, 0);
+    output.resize (stream.total_out);
+    EXPECT_EQ (output, expected);
+
+    inflateEnd (&stream);
+  }
+
   /**
    * Tries to uncompress with the given data and expects it to fail.
    */
@@ -64,6 +95,30 @@ TEST_F (CompressionTests, RoundTrip)
     }
 }
 
+TEST_F (CompressionTests, TransferFormats)
+{
+  std::string longString;
+  for (unsigned i = 0; i < 100'000; ++i)
+    longString.append (R"({"foo":42,"bar":"baz"},)");
+
+  const std::vector<std::string> tests =
+    {
+      "", "123", std::string ("foo\0bar", 7), longString,
+    };
+
+  for (const auto& str : tests)
+    {
+      const std::string gzip = CompressGzip (str);
+      ASSERT_GE (gzip.size (), 2);
+      EXPECT_EQ (gzip.substr (0, 2), "\x1f\x8b");
+      ExpectWrappedInflate (gzip, 15 + 16, str);
+
+      ExpectWrappedInflate (CompressZlib (str), 15, str);
+    }
+
+  EXPECT_LT (CompressGzip (longString).size (), longString.size () / 10);
+}
+
 TEST_F (CompressionTests, MaxOutputSize)
 {
   const std::string input = "foobar";